@@ -31,7 +31,9 @@
 #include "udipe/future.h"
 #include "udipe/log.h"
 #include "udipe/nodiscard.h"
+#include "udipe/operation.h"
 #include "udipe/pointer.h"
 #include "udipe/result.h"
 // Not including udipe/unit_tests.h as it isn't meant for end user consumption
 #include "udipe/visibility.h"
+#include "udipe/worker.h"
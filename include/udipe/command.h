@@ -36,17 +36,29 @@
 #include "context.h"
 #include "future.h"
 #include "nodiscard.h"
+#include "operation.h"
 #include "pointer.h"
 #include "result.h"
 #include "visibility.h"
 
 #include <assert.h>
+#include <stddef.h>
 
 
-// TODO: document and implement
+/// Start establishing a UDP connection
+///
+/// This is the asynchronous version of udipe_connect(). Once the connection
+/// has been established, or connection setup has failed, the returned future
+/// will produce a result of type \ref UDIPE_CONNECT whose payload is a \ref
+/// udipe_connect_result_t.
+///
+/// The `options` struct is copied by this function, but if
+/// `options.local_interface` is set, the string it points to must remain valid
+/// until the returned future has been awaited with udipe_finish().
+///
+/// See \ref udipe_connect_options_t for more information about connection
+/// parameters.
 //
-// TODO: Explain somewhere that a udipe connection is mostly like a POSIX socket
-//       but may be implemented using multiple sockets under the hood.
 // TODO: Explain somewhere that it is important to arrange for sockets to be
 //       closed in the event where the process is stopped via a signal like
 //       Ctrl+C, otherwise...
@@ -63,14 +75,25 @@ UDIPE_PUBLIC
 udipe_future_t* udipe_start_connect(udipe_context_t* context,
                                     udipe_connect_options_t options);
 
-// TODO: document and implement
+/// Establish a UDP connection
+///
+/// This is the synchronous version of udipe_start_connect(), which waits for
+/// the connection to be established (or connection setup to fail) and returns
+/// the associated \ref udipe_connect_result_t.
 UDIPE_NODISCARD
 UDIPE_NON_NULL_ARGS
 UDIPE_PUBLIC
 udipe_connect_result_t udipe_connect(udipe_context_t* context,
                                      udipe_connect_options_t options);
 
-// TODO: document and implement
+/// Start closing a UDP connection
+///
+/// This is the asynchronous version of udipe_disconnect(). Once the connection
+/// has been closed, the returned future will produce a result of type \ref
+/// UDIPE_DISCONNECT whose payload is a \ref udipe_disconnect_result_t.
+///
+/// From the moment where this function is called, `options.connection` must
+/// not be used by any other command.
 UDIPE_NODISCARD
 UDIPE_NON_NULL_ARGS
 UDIPE_NON_NULL_RESULT
@@ -78,19 +101,38 @@ UDIPE_PUBLIC
 udipe_future_t* udipe_start_disconnect(udipe_context_t* context,
                                        udipe_disconnect_options_t options);
 
-// TODO: document and implement
+/// Close a UDP connection
+///
+/// This is the synchronous version of udipe_start_disconnect(), which waits
+/// for the connection to be closed and returns the associated \ref
+/// udipe_disconnect_result_t.
 UDIPE_NODISCARD
 UDIPE_NON_NULL_ARGS
 UDIPE_PUBLIC
 udipe_disconnect_result_t udipe_disconnect(udipe_context_t* context,
                                            udipe_disconnect_options_t options);
 
-// TODO: Add and implement
-/* // TODO: document and implement
-//
-// TODO: Should have GSO-like semantics, i.e. if you give a large enough buffer
-//       then multiple datagrams may be sent. If GSO is disabled, then it just
-//       sends a single datagram. Do not attempt to send more than 64 datagrams.
+/// Start sending a UDP datagram
+///
+/// This is the asynchronous version of udipe_send(). Once the datagram has
+/// been handed over to the operating system, or emission has failed, the
+/// returned future will produce a result of type \ref UDIPE_SEND whose payload
+/// is a \ref udipe_send_result_t.
+///
+/// If GSO is enabled on the target connection, a single send command can send
+/// many datagrams at once, see \ref udipe_connect_options_t::gso_segment_size.
+///
+/// See \ref udipe_send_options_t for more information about emission
+/// parameters, including buffer lifetime requirements.
+///
+/// \internal
+///
+/// Worker threads do not send datagrams one by one. Instead, the payload of
+/// each send command is copied into a buffer from the worker's \ref
+/// buffer_allocator_t, and all datagrams that have been queued for a given
+/// connection are handed over to the operating system using a single
+/// `sendmmsg()` system call once the worker is done processing incoming
+/// commands.
 UDIPE_NODISCARD
 UDIPE_NON_NULL_ARGS
 UDIPE_NON_NULL_RESULT
@@ -98,14 +140,35 @@ UDIPE_PUBLIC
 udipe_future_t* udipe_start_send(udipe_context_t* context,
                                  udipe_send_options_t options);
 
-// TODO: document and implement
+/// Send a UDP datagram
+///
+/// This is the synchronous version of udipe_start_send(), which waits for the
+/// datagram to be sent (or emission to fail) and returns the associated \ref
+/// udipe_send_result_t.
 UDIPE_NODISCARD
 UDIPE_NON_NULL_ARGS
 UDIPE_PUBLIC
 udipe_send_result_t udipe_send(udipe_context_t* context,
                                udipe_send_options_t options);
 
-// TODO: document and implement
+/// Start receiving a UDP datagram
+///
+/// This is the asynchronous version of udipe_recv(). Once a datagram has been
+/// received, or reception has failed, the returned future will produce a
+/// result of type \ref UDIPE_RECV whose payload is a \ref
+/// udipe_recv_result_t.
+///
+/// See \ref udipe_recv_options_t for more information about reception
+/// parameters, including buffer lifetime requirements.
+///
+/// \internal
+///
+/// Worker threads do not receive datagrams one by one. Instead, whenever a
+/// connection has pending receive commands, its socket is drained with
+/// `recvmmsg()` into as many buffers from the worker's \ref buffer_allocator_t
+/// as are available, and any datagram that is not immediately claimed by a
+/// receive command is kept around to serve the next ones without performing
+/// any extra system call.
 UDIPE_NODISCARD
 UDIPE_NON_NULL_ARGS
 UDIPE_NON_NULL_RESULT
@@ -113,14 +176,170 @@ UDIPE_PUBLIC
 udipe_future_t* udipe_start_recv(udipe_context_t* context,
                                  udipe_recv_options_t options);
 
-// TODO: document and implement
-//
-// TODO: Should have GRO-like semantics, i.e. if you give a large enough buffer
-//       then multiple datagrams may be received, and there will be anciliary
-//       data telling you how large the inner segments are. If GRO is disabled,
-//       then it just receives a single datagram.
+/// Receive a UDP datagram
+///
+/// This is the synchronous version of udipe_start_recv(), which waits for a
+/// datagram to be received (or reception to fail) and returns the associated
+/// \ref udipe_recv_result_t.
+///
+/// If GRO is enabled on the target connection, a single receive command may
+/// receive several datagrams at once, which you can then iterate over using
+/// udipe_recv_segments().
 UDIPE_NODISCARD
 UDIPE_NON_NULL_ARGS
 UDIPE_PUBLIC
 udipe_recv_result_t udipe_recv(udipe_context_t* context,
-                               udipe_recv_options_t options); */
+                               udipe_recv_options_t options);
+
+/// Start receiving a stream of UDP datagrams
+///
+/// This is the asynchronous version of udipe_recv_stream(). The worker thread
+/// that manages the target connection will pass every incoming datagram to
+/// `options.callback` until either the callback returns `false`, the returned
+/// future is canceled with udipe_cancel(), or the connection is closed with
+/// udipe_disconnect(). At this point, the returned future will produce a
+/// result of type \ref UDIPE_RECV_STREAM whose payload is a \ref
+/// udipe_recv_stream_result_t.
+///
+/// See \ref udipe_recv_stream_options_t for more information about stream
+/// parameters, and \ref udipe_recv_callback_t for more information about the
+/// constraints that the callback must honor.
+///
+/// \internal
+///
+/// Datagrams are received with `recvmmsg()` into worker buffers, exactly like
+/// in the case of udipe_start_recv(), but the callback is then invoked directly
+/// on each of these buffers, without any copy. Unlike udipe_start_recv(), one
+/// single command can therefore process an unbounded amount of datagrams
+/// without any per-datagram inter-thread communication.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+UDIPE_PUBLIC
+udipe_future_t* udipe_start_recv_stream(udipe_context_t* context,
+                                        udipe_recv_stream_options_t options);
+
+/// Receive a stream of UDP datagrams
+///
+/// This is the synchronous version of udipe_start_recv_stream(), which waits
+/// for the reception stream to end and returns the associated \ref
+/// udipe_recv_stream_result_t.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_PUBLIC
+udipe_recv_stream_result_t
+udipe_recv_stream(udipe_context_t* context,
+                  udipe_recv_stream_options_t options);
+
+/// Start sending a stream of UDP datagrams
+///
+/// This is the asynchronous version of udipe_send_stream(). The worker thread
+/// that manages the target connection will repeatedly call `options.callback`
+/// to produce datagrams and send them, until either the callback returns
+/// `false`, the returned future is canceled with udipe_cancel(), an emission
+/// error occurs, or the connection is closed with udipe_disconnect(). At this
+/// point, the returned future will produce a result of type \ref
+/// UDIPE_SEND_STREAM whose payload is a \ref udipe_send_stream_result_t.
+///
+/// See \ref udipe_send_stream_options_t for more information about stream
+/// parameters, and \ref udipe_send_callback_t for more information about the
+/// constraints that the callback must honor.
+///
+/// \internal
+///
+/// The callback directly fills buffers from the worker's \ref
+/// buffer_allocator_t, which are then queued and sent in batches with
+/// `sendmmsg()` exactly like the datagrams from udipe_start_send(). Unlike
+/// udipe_start_send(), one single command can therefore send an unbounded
+/// amount of datagrams without any per-datagram inter-thread communication or
+/// payload copy.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+UDIPE_PUBLIC
+udipe_future_t* udipe_start_send_stream(udipe_context_t* context,
+                                        udipe_send_stream_options_t options);
+
+/// Send a stream of UDP datagrams
+///
+/// This is the synchronous version of udipe_start_send_stream(), which waits
+/// for the emission stream to end and returns the associated \ref
+/// udipe_send_stream_result_t.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_PUBLIC
+udipe_send_stream_result_t
+udipe_send_stream(udipe_context_t* context,
+                  udipe_send_stream_options_t options);
+
+/// Command from a batch submitted with udipe_start_batch()
+///
+/// This is a tagged union of the options of all commands that can be
+/// submitted using an asynchronous `udipe_start_xyz()` entry point.
+typedef struct udipe_command_s {
+    /// Command that should be started
+    ///
+    /// This must be one of the network result types, i.e. \ref UDIPE_CONNECT,
+    /// \ref UDIPE_DISCONNECT, \ref UDIPE_SEND, \ref UDIPE_RECV, \ref
+    /// UDIPE_RECV_STREAM or \ref UDIPE_SEND_STREAM. It indicates which variant
+    /// of `options` is valid, and what type of result the associated future
+    /// will produce.
+    udipe_result_type_t type;
+
+    /// Options of this command
+    ///
+    /// These have the same meaning and lifetime requirements as the `options`
+    /// parameter of the `udipe_start_xyz()` entry point that corresponds to
+    /// `type`.
+    union {
+        /// Options of a \ref UDIPE_CONNECT command
+        udipe_connect_options_t connect;
+
+        /// Options of a \ref UDIPE_DISCONNECT command
+        udipe_disconnect_options_t disconnect;
+
+        /// Options of a \ref UDIPE_SEND command
+        udipe_send_options_t send;
+
+        /// Options of a \ref UDIPE_RECV command
+        udipe_recv_options_t recv;
+
+        /// Options of a \ref UDIPE_RECV_STREAM command
+        udipe_recv_stream_options_t recv_stream;
+
+        /// Options of a \ref UDIPE_SEND_STREAM command
+        udipe_send_stream_options_t send_stream;
+    } options;
+} udipe_command_t;
+
+/// Start a batch of commands
+///
+/// This has the same effect as calling the asynchronous `udipe_start_xyz()`
+/// entry point that matches each entry of `commands` in order, and storing the
+/// resulting future at the same position of `futures`. Commands that target
+/// the same connection are therefore processed in order, and the futures
+/// must be awaited or canceled individually.
+///
+/// But each individual command submission involves some inter-thread
+/// communication, which has a significant CPU overhead when done in quick
+/// succession (e.g. when opening many connections or sending many datagrams
+/// at application startup). This function amortizes that overhead by handing
+/// over all commands that target the same worker thread at once.
+///
+/// \param context must be a valid udipe context.
+/// \param commands is an array of `num_commands` commands to be started.
+/// \param num_commands is the number of commands within `commands`.
+/// \param futures must point to an array of `num_commands` future pointers,
+///                which will be set to the futures of `commands`.
+///
+/// \internal
+///
+/// Commands are grouped by target worker thread, and each group is handed
+/// over using a single command queue lock acquisition and worker thread
+/// wakeup, unless it does not fit in the worker's command queue.
+UDIPE_NON_NULL_ARGS
+UDIPE_PUBLIC
+void udipe_start_batch(udipe_context_t* context,
+                       const udipe_command_t commands[],
+                       size_t num_commands,
+                       udipe_future_t* futures[]);
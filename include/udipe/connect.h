@@ -9,8 +9,12 @@
 //! header the interest of code clarity.
 
 #include "duration.h"
+#include "nodiscard.h"
+#include "pointer.h"
+#include "visibility.h"
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __unix__
@@ -22,6 +26,20 @@
 #endif
 
 
+/// UDP connection
+///
+/// A pointer to this opaque data structure is produced by a successful
+/// udipe_connect() command and can subsequently be passed to other network
+/// commands like udipe_recv() in order to exchange datagrams with the remote
+/// peer. Once you are done with it, you must pass it to udipe_disconnect() in
+/// order to release the associated system resources.
+///
+/// A udipe connection is mostly like a POSIX socket, but it is owned by a
+/// `libudipe` worker thread and can only be interacted with by sending commands
+/// to this worker thread. Its content is an opaque implementation detail of
+/// `libudipe` that you should not attempt to read or modify.
+typedef struct udipe_connection_s udipe_connection_t;
+
 /// Communication direction(s)
 ///
 /// When you create a \ref udipe_connection_t, you can specify whether you
@@ -79,8 +97,12 @@ typedef struct udipe_connect_options_s {
     ///
     /// The default is to wait indefinitely for datagrams to be sent. See \ref
     /// udipe_duration_ns_t for more info on timeout semantics.
-    //
-    // TODO: Maps to SO_SNDTIMEO if set
+    ///
+    /// \internal
+    ///
+    /// This is not mapped into `SO_SNDTIMEO` because worker threads never
+    /// block on an individual socket. Instead, the worker thread tracks the
+    /// timeout of each pending send command on its side.
     udipe_duration_ns_t send_timeout;
 
     /// Default receive timeout in nanoseconds or 0 = no timeout / wait forever
@@ -89,8 +111,12 @@ typedef struct udipe_connect_options_s {
     ///
     /// The default is to wait indefinitely for datagrams to be received. See
     /// \ref udipe_duration_ns_t for more info on timeout semantics.
-    //
-    // TODO: Maps to SO_RCVTIMEO if set
+    ///
+    /// \internal
+    ///
+    /// This is not mapped into `SO_RCVTIMEO` because worker threads never
+    /// block on an individual socket. Instead, the worker thread tracks the
+    /// timeout of each pending receive command on its side.
     udipe_duration_ns_t recv_timeout;
 
     // TODO: Add `udipe_future_t* after` option to chain this after other ops.
@@ -112,8 +138,10 @@ typedef struct udipe_connect_options_s {
     /// udipe_start_connect() had been awaited via udipe_finish().
     ///
     /// By default, the connection is not bound to any network interface.
-    //
-    // TODO: Maps to SO_BINDTODEVICE
+    ///
+    /// \internal
+    ///
+    /// This is implemented using the `SO_BINDTODEVICE` socket option.
     const char* local_interface;
 
     /// Local address
@@ -126,18 +154,14 @@ typedef struct udipe_connect_options_s {
     ///
     /// The default configuration sets this to IPv4 address 0.0.0.0 with port 0
     /// aka a randomly assigned port, unless `remote_address` is an IPv6 address
-    /// in which case the default is IPv6 address `::` with port 0.
-    //
-    // TODO: Provide a way to get that auto-assigned port after connection, this
-    //       is done via getsockname().
+    /// in which case the default is IPv6 address `::` with port 0. The address
+    /// and port that were eventually assigned by the operating system are
+    /// reported in \ref udipe_connect_result_t::local_address.
     ///
     /// This is appropriate if you want to send traffic and do not care which
     /// network interface and UDP port it goes through, or if you want to
     /// receive traffic and are ready to communicate the port number to your
     /// peer (as is common for e.g. local server testing).
-    //
-    // TODO: Maps to bind() if set + check type consistency with
-    //       remote_address
     ip_address_t local_address;
 
     /// Remote address
@@ -155,9 +179,12 @@ typedef struct udipe_connect_options_s {
     /// This is always incorrect for sending traffic and must be changed to the
     /// address of the intended peer. When receiving traffic, it simply means
     /// that you are accepting traffic from any source address and port.
-    //
-    // TODO: Maps to connect() if set + check type consistency with
-    //       local_address
+    ///
+    /// \internal
+    ///
+    /// A non-default remote address is mapped into a `connect()` call on the
+    /// underlying socket, which lets the kernel filter out inbound traffic
+    /// from other peers for us.
     ip_address_t remote_address;
 
     /// Reserved for future use, leave at `false` for now
@@ -176,12 +203,19 @@ typedef struct udipe_connect_options_s {
     /// on Linux is itself configured through pseudo-file
     /// `/proc/sys/net/core/wmem_default` or the equivalent sysctl.
     ///
+    /// Privileged processes are allowed to go above `wmem_max`. Otherwise, the
+    /// send buffer is clamped to this limit and a warning is logged. In any
+    /// case, the size that the operating system eventually granted is reported
+    /// in \ref udipe_connect_result_t::send_buffer.
+    ///
     /// \internal
     ///
     /// Bitfields are ab(used) there to ensure that attempting to set this to a
     /// value higher than `INT_MAX` is a compiler error.
-    //
-    // TODO: Implement by trying SO_SNDBUF then SO_SNDBUFFORCE
+    ///
+    /// This is mapped into the `SO_SNDBUF` socket option, and if the kernel
+    /// clamped the requested size, into the `SO_SNDBUFFORCE` socket option,
+    /// which requires `CAP_NET_ADMIN` privileges.
     unsigned send_buffer : 31;
 
     /// Enable Generic Receive Offload (GRO)
@@ -192,8 +226,21 @@ typedef struct udipe_connect_options_s {
     /// `recvmsg()`, eventually return and tell how big the input segments were
     /// in case the user needs to re-split the result into the original datagram
     /// payloads.
-    //
-    // TODO: Sets UDP_GRO
+    ///
+    /// When this is enabled, a single udipe_recv() may receive several
+    /// datagrams at once, see \ref udipe_recv_result_t::segment_size and
+    /// udipe_recv_segments().
+    ///
+    /// This parameter must not be set if `direction` is \ref UDIPE_OUT. For
+    /// best results, worker buffers should be at least 64 KiB large, see \ref
+    /// udipe_buffer_config_t::buffer_size, as the operating system may
+    /// otherwise need to drop some of the coalesced datagrams.
+    ///
+    /// \internal
+    ///
+    /// This is mapped into the `UDP_GRO` socket option, and the matching
+    /// `UDP_GRO` control message tells the receive engine about the segment
+    /// size of each coalesced batch.
     bool enable_gro : 1;
 
     /// Receive buffer size
@@ -206,16 +253,51 @@ typedef struct udipe_connect_options_s {
     ///
     /// By default, the receive buffer is configured at the OS' default size,
     /// which on Linux is itself configured through pseudo-file
-    /// `/proc/sys/net/core/rmem_default` or the equivalent sysctl.
+    /// `/proc/sys/net/core/rmem_default` or the equivalent sysctl, unless
+    /// `recv_rate` is set.
+    ///
+    /// Privileged processes are allowed to go above `rmem_max`. Otherwise, the
+    /// receive buffer is clamped to this limit and a warning is logged. In any
+    /// case, the size that the operating system eventually granted is reported
+    /// in \ref udipe_connect_result_t::recv_buffer.
     ///
     /// \internal
     ///
     /// Bitfields are ab(used) there to ensure that attempting to set this to a
     /// value higher than `INT_MAX` is a compiler error.
-    //
-    // TODO: Implement by trying SO_RCVBUF then SO_RCVBUFFORCE
+    ///
+    /// This is mapped into the `SO_RCVBUF` socket option, and if the kernel
+    /// clamped the requested size, into the `SO_RCVBUFFORCE` socket option,
+    /// which requires `CAP_NET_ADMIN` privileges.
     unsigned recv_buffer : 31;
 
+    /// Expected incoming data rate in bytes per second (nonzero to enable
+    /// automatic receive buffer sizing)
+    ///
+    /// Datagrams that come in while the worker thread is busy doing something
+    /// else, or waiting for the operating system to schedule it, must be held
+    /// by the socket's receive buffer. If this buffer is too small, bursts of
+    /// datagrams get dropped, see \ref udipe_connection_stats_t::recv_dropped.
+    ///
+    /// Setting this to a nonzero value lets udipe size the receive buffer for
+    /// you, such that it can hold the datagrams that come in at this rate
+    /// during the longest interruption of the worker thread that was observed
+    /// so far, with a safety margin. The receive buffer is never shrunk below
+    /// the OS' default size, and the same privilege rules as `recv_buffer`
+    /// apply when enlarging it.
+    ///
+    /// This parameter must not be set if `direction` is \ref UDIPE_OUT, or if
+    /// `recv_buffer` is set.
+    ///
+    /// \internal
+    ///
+    /// The longest interruption of the worker thread is tracked by
+    /// worker_poll() as \ref worker_t::max_latency. Until it has been observed
+    /// to exceed \ref AUTO_RECV_BUFFER_MIN_LATENCY, that duration is used
+    /// instead, so that connections that are established early on are not
+    /// given a tiny buffer.
+    uint64_t recv_rate;
+
     /// Communication direction(s)
     ///
     /// You can use this field to specify that you only intend to send or
@@ -224,9 +306,10 @@ typedef struct udipe_connect_options_s {
     /// By default, the connection is configured to receive traffic only, as
     /// sending traffic requires a remote address and there is no good default
     /// for a remote address.
-    //
-    // TODO: Used to enforce usage validation by detecting invalid parameters
-    //       and commands.
+    ///
+    /// Commands that do not match the configured direction, like calling
+    /// udipe_recv() on a connection configured as \ref UDIPE_OUT, will fail
+    /// with error `EOPNOTSUPP`.
     udipe_direction_t direction;
 
     /// GSO segment size (nonzero to enable)
@@ -250,10 +333,233 @@ typedef struct udipe_connect_options_s {
     /// Setting this to 0 disables GSO, falling back to the standard Unix send
     /// semantics where the kernel tries to send the whole payload as a single
     /// datagram (and fails if it ends up being larger than the MTU).
-    //
-    // TODO: Sets UDP_SEGMENT
+    ///
+    /// This parameter must not be set if `direction` is \ref UDIPE_IN.
+    ///
+    /// \internal
+    ///
+    /// This is mapped into the `UDP_SEGMENT` socket option. udipe_send()
+    /// payloads that are larger than 64 segments, or than the 64 KiB size
+    /// limit of an IP packet, are transparently split into several GSO sends
+    /// that are handed over to the kernel with a single `sendmmsg()` call.
     uint16_t gso_segment_size;
 
+    /// Maximal emission rate in payload bytes per second (nonzero to enable)
+    ///
+    /// Setting this to a nonzero value makes the operating system spread
+    /// outgoing datagrams over time so that their payload throughput does not
+    /// exceed this rate. This protects receivers that cannot absorb bursts of
+    /// datagrams, without requiring any sleeping on the sender side:
+    /// udipe_send() commands are still handed over to the kernel in batches,
+    /// along with the time at which each datagram should depart.
+    ///
+    /// When GSO is enabled, the datagrams of a single GSO send depart back to
+    /// back, and pacing is applied between GSO sends. Use a smaller \ref
+    /// udipe_send_options_t::size if this is too bursty for your receiver.
+    ///
+    /// Pacing relies on the network interface's queuing discipline, which
+    /// must support departure times. On Linux, this means that the `fq`
+    /// qdisc must be configured on the outgoing interface (e.g. with `tc
+    /// qdisc replace dev eth0 root fq`), otherwise datagrams are sent as soon
+    /// as possible. `fq` drops datagrams whose departure time is too far
+    /// ahead in the future (10s by default), but in practice the socket's
+    /// send buffer fills up long before that, which makes send commands wait.
+    ///
+    /// This parameter must not be set if `direction` is \ref UDIPE_IN.
+    ///
+    /// \internal
+    ///
+    /// This is mapped into the `SO_TXTIME` socket option, and the emission
+    /// engine attaches a `SCM_TXTIME` control message to each `sendmmsg()`
+    /// message, which carries the departure time of a datagram or GSO send
+    /// on the `CLOCK_MONOTONIC` clock.
+    uint64_t pacing_rate;
+
+    /// Number of sockets that share the local port (0 or 1 to disable)
+    ///
+    /// Setting this to a value above 1 creates a sharded connection, where
+    /// `num_shards` sockets are bound to the same local address and port and
+    /// the operating system spreads incoming traffic across them based on a
+    /// hash of the source address and port. These sockets are spread across
+    /// worker threads, which lets the processing of incoming traffic on a
+    /// single port scale beyond one CPU core. There is therefore little point
+    /// in using more shards than there are worker threads in the connection's
+    /// `worker_class`, see \ref udipe_worker_config_t.
+    ///
+    /// The connection returned by udipe_connect() is the first shard, and
+    /// other shards can be queried using udipe_connection_shard(). Each shard
+    /// otherwise behaves as an independent connection, which must be
+    /// disconnected separately. Because the datagrams from a given peer may
+    /// land on any shard, you will typically want to start a
+    /// udipe_recv_stream() on every shard.
+    ///
+    /// This parameter can only be set if `direction` is \ref UDIPE_IN and
+    /// `remote_address` is left at its default value, as the operating system
+    /// does not spread traffic across connected sockets.
+    ///
+    /// \internal
+    ///
+    /// This is implemented using the `SO_REUSEPORT` socket option. The shards
+    /// are assigned to the worker threads of `worker_class` in a round-robin
+    /// fashion, starting with the worker thread that processed the
+    /// udipe_connect() command.
+    uint16_t num_shards;
+
+    /// Worker class that this connection belongs to
+    ///
+    /// A connection is owned by one of the worker threads of its worker class,
+    /// which processes all of the commands that target this connection. By
+    /// assigning connections with different requirements to different worker
+    /// classes, you can make sure that e.g. latency-sensitive slow control
+    /// traffic is never processed by the same worker thread as bulk data
+    /// acquisition traffic. See \ref udipe_worker_class_config_t for more
+    /// information.
+    ///
+    /// This must designate a worker class that was configured at
+    /// udipe_initialize() time. By default, connections belong to worker class
+    /// 0, which is the worker class configured by \ref
+    /// udipe_config_t::workers.
+    uint8_t worker_class;
+
+    /// Steer incoming datagrams to the shard of the CPU core that received them
+    ///
+    /// When a datagram is received, the operating system first processes it
+    /// on a CPU core that is selected by the network interface (via interrupts
+    /// and Receive Side Scaling) or by the kernel's configuration (via Receive
+    /// Packet Steering). By default, the shard that the datagram is then
+    /// handed over to is selected based on its source address and port, so it
+    /// will usually be processed by a worker thread on another CPU core and
+    /// need to travel between CPU caches.
+    ///
+    /// Setting this to `true` makes each datagram go to a shard whose worker
+    /// thread runs on the CPU core that received it, if there is one, so that
+    /// the datagram is still in this core's cache when the worker thread reads
+    /// it. Datagrams that are received by other CPU cores keep being spread
+    /// across shards based on their source.
+    ///
+    /// This is only beneficial if incoming traffic is spread across the CPU
+    /// cores of worker threads by the network interface, e.g. by using a
+    /// multi-queue network interface with RSS whose interrupts are directed to
+    /// these CPU cores. Otherwise, all traffic may end up on a single shard.
+    ///
+    /// This parameter can only be set if `num_shards` is greater than 1.
+    ///
+    /// \internal
+    ///
+    /// This is implemented by attaching a classic BPF program to the shards
+    /// with `SO_ATTACH_REUSEPORT_CBPF`, which maps the `SKF_AD_CPU` of each
+    /// datagram to the index of a shard. The kernel reorders the sockets of a
+    /// `SO_REUSEPORT` group when one of them is closed, so this mapping becomes
+    /// approximate once a shard has been disconnected.
+    bool steer_by_cpu : 1;
+
+    /// Send datagrams without copying them into kernel memory
+    ///
+    /// Setting this to `true` lets the operating system send datagrams
+    /// straight from the worker buffers that they have been copied or produced
+    /// into, instead of copying them again into kernel memory. This saves CPU
+    /// time when sending large datagrams or GSO batches, but a worker buffer
+    /// then remains busy until the kernel reports that it is done with it, so
+    /// sustaining a given throughput may require more worker buffers, see \ref
+    /// udipe_buffer_config_t::buffer_count.
+    ///
+    /// Zero-copy emission usually only pays off for payloads of 10 KB or more.
+    /// Payloads that are sent straight from the client's buffer, because they
+    /// do not fit in a worker buffer or because the worker ran out of buffers,
+    /// are still copied. If the kernel reports that it had to copy zero-copy
+    /// datagrams anyway, as it does for loopback traffic, zero-copy emission is
+    /// turned off for the rest of the connection's lifetime.
+    ///
+    /// This parameter must not be set if `direction` is \ref UDIPE_IN.
+    ///
+    /// \internal
+    ///
+    /// This is implemented using the `SO_ZEROCOPY` socket option and the
+    /// `MSG_ZEROCOPY` send flag. Completion notifications are collected from
+    /// the socket's error queue in batches, and each worker buffer is
+    /// liberated once all of the sends that it was used for have completed.
+    bool enable_zerocopy : 1;
+
+    /// Record the time at which incoming datagrams were received
+    ///
+    /// Setting this to `true` makes the operating system timestamp each
+    /// incoming datagram as it is received. These timestamps are reported in
+    /// \ref udipe_recv_result_t::software_timestamp and \ref
+    /// udipe_recv_result_t::hardware_timestamp, alongside the datagram, at no
+    /// extra system call cost.
+    ///
+    /// Software timestamps are taken by the operating system's network stack
+    /// as soon as the datagram comes in, which excludes the time spent waiting
+    /// for the worker thread. Hardware timestamps are taken by the network
+    /// interface itself, and are only available if the network interface
+    /// supports it and was configured to do so by the system administrator
+    /// (e.g. via `hwstamp_ctl` on Linux).
+    ///
+    /// This parameter must not be set if `direction` is \ref UDIPE_OUT.
+    ///
+    /// \internal
+    ///
+    /// This is mapped into the `SO_TIMESTAMPING` socket option with the
+    /// software and raw hardware reception flags, and the matching
+    /// `SCM_TIMESTAMPING` control message is parsed by the receive engine.
+    bool enable_timestamps : 1;
+
+    /// Busy-poll for incoming datagrams instead of waiting for them
+    ///
+    /// Setting this to `true` makes the worker thread that owns this connection
+    /// spin on the connection's socket whenever the connection has pending
+    /// receive commands or an active reception stream, instead of going to
+    /// sleep until the operating system signals that datagrams came in. The
+    /// operating system is also asked to poll the network interface directly
+    /// when the socket is read, instead of waiting for an interrupt.
+    ///
+    /// This removes the interrupt-to-wakeup latency from the reception path,
+    /// at the expense of keeping the worker's CPU core 100% busy while the
+    /// connection awaits datagrams. It is therefore only recommended for
+    /// latency-critical connections with a dedicated worker thread.
+    ///
+    /// On Linux, having the operating system poll the network interface
+    /// requires `CAP_NET_ADMIN` privileges, or a nonzero
+    /// `/proc/sys/net/core/busy_read` setting. Without them, a warning is
+    /// logged and the worker thread still spins on the socket.
+    ///
+    /// This parameter must not be set if `direction` is \ref UDIPE_OUT.
+    ///
+    /// \internal
+    ///
+    /// This is mapped into the `SO_BUSY_POLL`, `SO_PREFER_BUSY_POLL` and
+    /// `SO_BUSY_POLL_BUDGET` socket options. The socket of a busy-polled
+    /// connection is never attached to the worker's \ref inpoll_t or armed via
+    /// io_uring, instead recv_busy_poll() reads from it on every iteration of
+    /// the worker loop.
+    bool enable_busy_poll : 1;
+
+    /// Let idle worker threads help with send commands
+    ///
+    /// All commands targeting a connection are normally processed by the
+    /// worker thread that owns it. When a client submits send commands faster
+    /// than this worker thread can process them, its command queue fills up
+    /// and the client blocks, even if other worker threads are idle.
+    ///
+    /// Setting this to `true` lets idle worker threads from the same worker
+    /// class, whose CPU cores share a cache with the owner's, take pending
+    /// send commands out of the owner's command queue and process them
+    /// themselves. The price to pay is that datagrams from send commands
+    /// targeting this connection may then be sent in a different order than
+    /// the commands were submitted.
+    ///
+    /// This parameter must not be set if `direction` is \ref UDIPE_IN, and
+    /// cannot be combined with `enable_zerocopy` or `pacing_rate`, whose
+    /// bookkeeping must be performed by a single worker thread.
+    ///
+    /// \internal
+    ///
+    /// Send commands targeting this connection are marked as \ref
+    /// command_t::stealable. Worker threads that run out of work steal them
+    /// from sibling workers whose command queue is backed up, see
+    /// command_queue_try_steal().
+    bool enable_send_stealing : 1;
+
     /// Desired traffic priority
     ///
     /// Setting a priority higher than zero indicates that the operating system
@@ -269,32 +575,221 @@ typedef struct udipe_connect_options_s {
     /// udipe code repo and describe your use case!
     ///
     /// By default, the priority is 0 i.e. lowest priority.
-    //
-    // TODO: Implement by setting SO_PRIORITY
+    ///
+    /// This priority is only known to the local operating system. Use `dscp`
+    /// if you want network switches and routers to prioritize traffic too.
+    ///
+    /// \internal
+    ///
+    /// This is mapped into the `SO_PRIORITY` socket option, which selects the
+    /// band of priority-aware queuing disciplines like `pfifo_fast` or
+    /// `prio`. It is applied after `dscp` because on Linux, setting the TOS
+    /// field of a socket overwrites its priority. If `priority` is 0, the
+    /// socket priority that Linux derived from `dscp` is kept.
     unsigned priority : 3;
 
-    // TODO: Activer aussi IP_RECVERR, et logger voire gérer les erreurs, cf man
-    //       7 ip pour plus d'infos. A utiliser en combinaison avec
-    //       getsockopt(SO_ERROR).
-
-    // TODO: Activer périodiquement SO_RXQ_OVFL pour check l'overflow côté
-    //       socket, puis le désactiver après réception du cmsg suivant + cf
-    //       ioctls udp et
-    //       <https://www.kernel.org/doc/html/latest/networking/statistics.html>.
+    /// Differentiated Services Code Point (DSCP) of outgoing datagrams
+    ///
+    /// This 6-bit value is written in the IP header of each outgoing datagram
+    /// and tells network switches and routers how this traffic should be
+    /// prioritized when links saturate, e.g. 46 (Expedited Forwarding) for
+    /// latency-sensitive control traffic or 8 (CS1) for bulk traffic that
+    /// should yield to everything else. The operating system's queuing
+    /// disciplines may also take it into account.
+    ///
+    /// Whether this value is honored, rewritten or cleared depends on the
+    /// configuration of the network, so check with your network administrator.
+    ///
+    /// This parameter must not be set if `direction` is \ref UDIPE_IN. By
+    /// default, the DSCP is 0 i.e. best effort.
+    ///
+    /// \internal
+    ///
+    /// This is mapped into the `IP_TOS` socket option for IPv4 sockets and the
+    /// `IPV6_TCLASS` socket option for IPv6 sockets. The DSCP occupies the 6
+    /// high-order bits of these fields, the remaining ECN bits are left at 0.
+    unsigned dscp : 6;
 
     // TODO: Dans udipe-config, creuser man 7 netdevice et man 7 rtnetlink pour
     //       la configuration device + check pseudofichiers mentionnés à la fin
     //       de man 7 socket, man 7 ip et man 7 udp pour la config kernel.
-
-    // TODO: Quand j'aurai implémenté le multithreading des workers, utiliser
-    //       SO_INCOMING_CPU pour associer le socket de chaque worker à son CPU.
 } udipe_connect_options_t;
 
-// TODO: Flesh out definitions, add docs
-//
-// TODO: Add max-size warnings in \internal, beware that they will not be the
-//       same for options and results as for options we need to fit in the
-//       internal command_t type.
-typedef int udipe_connect_result_t;
-typedef int udipe_disconnect_options_t;
-typedef int udipe_disconnect_result_t;
+/// udipe_connect() result
+///
+/// \internal
+///
+/// The size of this struct should be kept such that \ref udipe_future_t fits in
+/// one single cache line on all CPU platforms of interest. A static_assert()
+/// will fail the build if you blow this byte budget.
+typedef struct udipe_connect_result_s {
+    /// Newly established connection
+    ///
+    /// This is set to `NULL` if and only if `error` is nonzero. Otherwise it
+    /// must eventually be passed to udipe_disconnect().
+    udipe_connection_t* connection;
+
+    /// Local address and port that the connection is bound to
+    ///
+    /// This is where you will find out which port was automatically assigned
+    /// by the operating system if you left the port of \ref
+    /// udipe_connect_options_t::local_address at its default value of 0.
+    ip_address_t local_address;
+
+    /// Error code
+    ///
+    /// This is zero if the connection was successfully established, otherwise
+    /// it is an `errno` code that explains why connection setup failed. For
+    /// example, `EINVAL` indicates that the \ref udipe_connect_options_t were
+    /// incorrect, and `EADDRINUSE` indicates that the requested local port is
+    /// already used by another socket.
+    int error;
+
+    /// Send buffer size that the operating system granted, in bytes
+    ///
+    /// This is the outcome of \ref udipe_connect_options_t::send_buffer, or
+    /// the OS' default size if it was not set. On Linux, it is twice the size
+    /// that was requested, because the kernel reserves half of the buffer for
+    /// its own bookkeeping.
+    ///
+    /// This is zero if `error` is nonzero.
+    uint32_t send_buffer;
+
+    /// Receive buffer size that the operating system granted, in bytes
+    ///
+    /// This is the outcome of \ref udipe_connect_options_t::recv_buffer or
+    /// \ref udipe_connect_options_t::recv_rate, with the same caveats as
+    /// `send_buffer`.
+    uint32_t recv_buffer;
+} udipe_connect_result_t;
+
+/// Query a shard of a sharded connection
+///
+/// Connections that were established with \ref
+/// udipe_connect_options_t::num_shards set to a value above 1 are made of
+/// several shards, each of which behaves as an independent connection. This
+/// function lets you query these shards.
+///
+/// It is a simple accessor that does not involve any inter-thread
+/// communication, and can therefore be called from any thread.
+///
+/// \param connection must be a shard of a connection that was established by
+///                   udipe_connect(), which has not been disconnected yet.
+/// \param index is the index of the shard of interest. Shard 0 is the
+///              connection that was returned by udipe_connect(). Connections
+///              that are not sharded only have this shard.
+///
+/// \returns the shard at position `index`, or `NULL` if `index` is greater
+///          than or equal to the number of shards. The resulting shard must
+///          not be used once it has been disconnected.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_PUBLIC
+udipe_connection_t* udipe_connection_shard(udipe_connection_t* connection,
+                                           size_t index);
+
+/// Connection statistics
+///
+/// These are queried using udipe_connection_stats(). All counters start at
+/// zero when the connection is established and never go down. The shards of a
+/// sharded connection each have their own statistics.
+typedef struct udipe_connection_stats_s {
+    /// Number of incoming datagrams that were dropped by the operating system
+    ///
+    /// This usually happens when datagrams come in faster than the worker
+    /// thread receives them, so that the socket's receive buffer fills up.
+    /// Receiving datagrams more eagerly (e.g. with udipe_recv_stream()),
+    /// enlarging the receive buffer (see \ref
+    /// udipe_connect_options_t::recv_buffer) or spreading incoming traffic
+    /// across more shards (see \ref udipe_connect_options_t::num_shards) can
+    /// help.
+    ///
+    /// The operating system only reports drops alongside datagrams that
+    /// arrive after them, so drops that occured after the last datagram
+    /// arrived are not accounted for yet.
+    ///
+    /// \internal
+    ///
+    /// This comes from the `SO_RXQ_OVFL` control message, which carries the
+    /// socket's cumulative drop counter. The kernel only attaches it to
+    /// datagrams once a drop has occured, so it can be left enabled at all
+    /// times instead of being toggled periodically.
+    uint64_t recv_dropped;
+
+    /// Number of errors that remote hosts or routers reported via ICMP
+    ///
+    /// These are typically caused by datagrams that were sent to a port where
+    /// nobody is listening anymore (`ECONNREFUSED`), or to a host or network
+    /// that cannot be reached (`EHOSTUNREACH`, `ENETUNREACH`).
+    ///
+    /// On connections that can send datagrams, such errors are collected in
+    /// batches by the worker thread, so that an ICMP error storm fails at
+    /// most one send or receive command per batch instead of one command per
+    /// error. Errors are otherwise only logged in a rate-limited fashion, and
+    /// accounted for here.
+    ///
+    /// \internal
+    ///
+    /// This is implemented by enabling `IP_RECVERR` (or `IPV6_RECVERR`) on the
+    /// socket and reading its error queue whenever an operation fails.
+    uint64_t icmp_errors;
+
+    /// Number of errors that the local network stack reported alongside
+    /// `icmp_errors`
+    ///
+    /// This notably happens when datagrams exceed the known path MTU.
+    uint64_t local_errors;
+} udipe_connection_stats_t;
+
+/// Query the statistics of a connection
+///
+/// Like udipe_connection_shard(), this is a simple accessor that does not
+/// involve any inter-thread communication, and can therefore be called from
+/// any thread as often as needed. But it may lag slightly behind the worker
+/// thread that owns the connection.
+///
+/// \param connection must be a connection that was established by
+///                   udipe_connect(), or one of its shards, which has not been
+///                   disconnected yet.
+///
+/// \returns the current statistics of `connection`.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_PUBLIC
+udipe_connection_stats_t
+udipe_connection_stats(const udipe_connection_t* connection);
+
+/// udipe_disconnect() parameters
+///
+/// \internal
+///
+/// This struct must fit inside of the options union of the internal `command_t`
+/// type, whose size budget is half a cache line.
+typedef struct udipe_disconnect_options_s {
+    /// Connection to be closed
+    ///
+    /// This must be a connection that was previously established with
+    /// udipe_connect() and has not been closed since. It will be liberated by
+    /// the udipe_disconnect() command and must not be used afterwards.
+    ///
+    /// Any udipe_recv() command that is still pending on this connection when
+    /// the disconnection command is processed will fail with error
+    /// `ECONNABORTED`.
+    udipe_connection_t* connection;
+} udipe_disconnect_options_t;
+
+/// udipe_disconnect() result
+///
+/// \internal
+///
+/// The size of this struct should be kept such that \ref udipe_future_t fits in
+/// one single cache line on all CPU platforms of interest. A static_assert()
+/// will fail the build if you blow this byte budget.
+typedef struct udipe_disconnect_result_s {
+    /// Error code
+    ///
+    /// This is zero if the connection was closed cleanly, otherwise it is an
+    /// `errno` code that explains what went wrong. Connection resources are
+    /// liberated in any case.
+    int error;
+} udipe_disconnect_result_t;
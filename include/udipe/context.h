@@ -11,6 +11,8 @@
 //! - udipe_initialize(), the function that builds \ref udipe_context_t, which
 //!   you must call during the initialization stage of your application
 //! - \ref udipe_config_t, the configurable parameters of udipe_initialize()
+//! - \ref udipe_worker_class_config_t, the configuration of additional classes
+//!   of worker threads that connections can be dedicated to
 //! - udipe_finalize(), the function that destroys \ref udipe_context_t, which
 //!   you must call during the finalization stage of your application.
 
@@ -25,7 +27,36 @@
 #include "nodiscard.h"
 #include "pointer.h"
 #include "visibility.h"
+#include "worker.h"
 
+#include <stddef.h>
+
+
+/// Worker class configuration
+///
+/// Worker threads are grouped into classes, which are configured by \ref
+/// udipe_config_t. Each class has its own worker threads, and therefore its
+/// own command queues and buffer pools, so that connections from different
+/// classes never wait for each other within a worker thread. For example,
+/// latency-sensitive slow control connections can use a different worker
+/// class than bulk data acquisition connections, so that their round trips
+/// are not delayed by the processing of bulk traffic.
+///
+/// This struct is designed such that zero-initializing it results in a worker
+/// class with the same default configuration as \ref udipe_config_t.
+typedef struct udipe_worker_class_config_s {
+    /// Buffering configuration of this class' worker threads
+    ///
+    /// See \ref udipe_config_t::buffer.
+    udipe_buffer_configurator_t buffer;
+
+    /// Thread configuration of this class' worker threads
+    ///
+    /// See \ref udipe_config_t::workers. Worker classes select their CPUs
+    /// independently, so if you want the worker threads of different classes
+    /// not to compete for CPU time, you must give them disjoint `cpus`.
+    udipe_worker_config_t workers;
+} udipe_worker_class_config_t;
 
 /// Core `libudipe` configuration
 ///
@@ -49,6 +80,33 @@ typedef struct udipe_config_s {
     /// cache budget to each request and an L2-sized cache budget to the set of
     /// all concurrently handled requests.
     udipe_buffer_configurator_t buffer;
+
+    /// Worker thread configuration
+    ///
+    /// This member controls how many network worker threads `libudipe` spawns
+    /// and which CPU cores they are pinned to. By default, one worker thread is
+    /// spawned on each CPU core that the process is allowed to run on.
+    ///
+    /// Together with `buffer`, this configures worker class 0, which is the
+    /// worker class that connections use by default.
+    udipe_worker_config_t workers;
+
+    /// Additional worker classes
+    ///
+    /// Entry `i` of this array configures worker class `i + 1`, which
+    /// connections can opt into using \ref
+    /// udipe_connect_options_t::worker_class. See \ref
+    /// udipe_worker_class_config_t for more information.
+    ///
+    /// This array only needs to remain valid until udipe_initialize() returns.
+    /// It can be left at `NULL` if `num_worker_classes` is 0, which is the
+    /// default and results in worker class 0 being the only worker class.
+    const udipe_worker_class_config_t* worker_classes;
+
+    /// Number of entries within `worker_classes`
+    ///
+    /// This cannot be larger than \ref UDIPE_MAX_WORKER_CLASSES minus 1.
+    size_t num_worker_classes;
 } udipe_config_t;
 
 /// Core `libudipe` context
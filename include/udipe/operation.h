@@ -0,0 +1,488 @@
+#pragma once
+
+//! \file
+//! \brief Datagram operation definitions
+//!
+//! Like all other udipe commands, the udipe_send(), udipe_recv(),
+//! udipe_recv_stream() and udipe_send_stream() commands are defined in \ref
+//! command.h. But they come with a fair amount of related definitions, which
+//! have been extracted into this dedicated header in the interest of code
+//! clarity.
+
+#include "connect.h"
+#include "duration.h"
+#include "nodiscard.h"
+#include "pointer.h"
+#include "visibility.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/// udipe_send() parameters
+///
+/// This struct controls the parameters of a single datagram emission. Unlike
+/// most configuration structs, it cannot be zero-initialized, as you must at
+/// least specify a connection and the payload of the datagram to be sent.
+///
+/// \internal
+///
+/// This struct must fit inside of the options union of the internal `command_t`
+/// type, whose size budget is half a cache line.
+typedef struct udipe_send_options_s {
+    /// Connection through which a datagram should be sent
+    ///
+    /// This must be a connection that was previously established with
+    /// udipe_connect() with a \ref udipe_connect_options_t::direction of \ref
+    /// UDIPE_OUT or \ref UDIPE_INOUT, and that has not been closed with
+    /// udipe_disconnect() yet.
+    udipe_connection_t* connection;
+
+    /// Payload of the datagram
+    ///
+    /// If you use the udipe_start_send() asynchronous version of udipe_send(),
+    /// then this buffer must not be modified until the future associated with
+    /// udipe_start_send() has been awaited via udipe_finish().
+    const void* buffer;
+
+    /// Size of `buffer` in bytes
+    ///
+    /// Unless GSO is enabled, this must not be larger than the \ref
+    /// udipe_buffer_config_t::buffer_size of the worker buffers, otherwise the
+    /// emission will fail with error `EMSGSIZE`.
+    ///
+    /// If GSO is enabled via \ref udipe_connect_options_t::gso_segment_size,
+    /// the payload is sent as a sequence of datagrams of that size, followed by
+    /// a smaller datagram with the remaining bytes if needed. There is no
+    /// upper limit on the payload size in this case, but large payloads are
+    /// sent straight from `buffer` without being copied into worker buffers.
+    size_t size;
+
+    /// Timeout in nanoseconds, or 0 = use the connection's default
+    ///
+    /// If the datagram cannot be handed over to the operating system before
+    /// this timeout elapses, for example because the socket's send buffer is
+    /// full, the emission will fail with error `ETIMEDOUT`. By default, the
+    /// \ref udipe_connect_options_t::send_timeout of the connection is used.
+    udipe_duration_ns_t timeout;
+} udipe_send_options_t;
+
+/// udipe_send() result
+///
+/// \internal
+///
+/// The size of this struct should be kept such that \ref udipe_future_t fits in
+/// one single cache line on all CPU platforms of interest. A static_assert()
+/// will fail the build if you blow this byte budget.
+typedef struct udipe_send_result_s {
+    /// Number of payload bytes that were handed over to the operating system
+    ///
+    /// This is \ref udipe_send_options_t::size if the emission succeeded. On
+    /// failure, it is normally 0, but when GSO is enabled it may be nonzero if
+    /// some of the datagrams were sent before the error occured.
+    size_t size;
+
+    /// Error code
+    ///
+    /// This is zero if the datagram was sent successfully, otherwise it is an
+    /// `errno` code that explains what went wrong. The most notable errors
+    /// are...
+    ///
+    /// - `ETIMEDOUT` if the datagram could not be sent before the timeout
+    ///   elapsed.
+    /// - `EMSGSIZE` if the datagram is too large to be sent.
+    /// - `EOPNOTSUPP` if the connection was not configured for emission.
+    /// - `ECONNREFUSED` if an earlier datagram was rejected by the peer host.
+    /// - `ECONNABORTED` if the connection was closed by udipe_disconnect()
+    ///   before the datagram could be sent.
+    int error;
+} udipe_send_result_t;
+
+/// udipe_recv() parameters
+///
+/// This struct controls the parameters of a single datagram reception. Unlike
+/// most configuration structs, it cannot be zero-initialized, as you must at
+/// least specify a connection and a buffer into which the datagram should be
+/// received.
+///
+/// \internal
+///
+/// This struct must fit inside of the options union of the internal `command_t`
+/// type, whose size budget is half a cache line.
+typedef struct udipe_recv_options_s {
+    /// Connection from which a datagram should be received
+    ///
+    /// This must be a connection that was previously established with
+    /// udipe_connect() with a \ref udipe_connect_options_t::direction of \ref
+    /// UDIPE_IN or \ref UDIPE_INOUT, and that has not been closed with
+    /// udipe_disconnect() yet.
+    udipe_connection_t* connection;
+
+    /// Buffer into which the datagram payload should be written
+    ///
+    /// If you use the udipe_start_recv() asynchronous version of udipe_recv(),
+    /// then this buffer must not be accessed in any way until the future
+    /// associated with udipe_start_recv() has been awaited via udipe_finish().
+    void* buffer;
+
+    /// Size of `buffer` in bytes
+    ///
+    /// If the incoming datagram is larger than this, its payload will be
+    /// truncated and the reception will fail with error `EMSGSIZE`. To avoid
+    /// this, make sure that this buffer can hold the largest datagram that
+    /// your peer may send.
+    size_t buffer_size;
+
+    /// Timeout in nanoseconds, or 0 = use the connection's default
+    ///
+    /// If no datagram is received before this timeout elapses, the reception
+    /// will fail with error `ETIMEDOUT`. By default, the \ref
+    /// udipe_connect_options_t::recv_timeout of the connection is used.
+    udipe_duration_ns_t timeout;
+} udipe_recv_options_t;
+
+/// udipe_recv() result
+///
+/// \internal
+///
+/// The size of this struct should be kept such that \ref udipe_future_t fits in
+/// one single cache line on all CPU platforms of interest. A static_assert()
+/// will fail the build if you blow this byte budget.
+typedef struct udipe_recv_result_s {
+    /// Number of bytes that were written into \ref
+    /// udipe_recv_options_t::buffer
+    ///
+    /// This is the size of the received datagram, unless the datagram was
+    /// truncated (see below) in which case it is the size of the buffer.
+    ///
+    /// If GRO is enabled, this may also be the total size of several
+    /// datagrams, see `segment_size` below.
+    size_t size;
+
+    /// Size of the individual datagrams within \ref
+    /// udipe_recv_options_t::buffer, or 0 if it holds a single datagram
+    ///
+    /// When GRO is enabled via \ref udipe_connect_options_t::enable_gro,
+    /// consecutive datagrams of identical size from the same peer may be
+    /// coalesced by the operating system and received at once. In this case,
+    /// the buffer holds a sequence of datagrams of this size, the last of which
+    /// may be smaller. Use udipe_recv_segments() to iterate over them.
+    size_t segment_size;
+
+    /// Time at which the operating system received the datagram, in
+    /// nanoseconds since the Unix epoch, or 0 if unknown
+    ///
+    /// This is only measured if \ref udipe_connect_options_t::enable_timestamps
+    /// is set. When GRO is enabled, the operating system only timestamps the
+    /// first datagram of each coalesced batch, so all datagrams of a batch
+    /// share this timestamp.
+    uint64_t software_timestamp;
+
+    /// Time at which the network interface received the datagram, in
+    /// nanoseconds since the epoch of the interface's hardware clock, or 0 if
+    /// unknown
+    ///
+    /// This is like `software_timestamp`, but it is only available when the
+    /// network interface supports hardware timestamping and was configured
+    /// for it, see \ref udipe_connect_options_t::enable_timestamps.
+    uint64_t hardware_timestamp;
+
+    /// Error code
+    ///
+    /// This is zero if a datagram was received successfully, otherwise it is
+    /// an `errno` code that explains what went wrong. The most notable errors
+    /// are...
+    ///
+    /// - `ETIMEDOUT` if no datagram was received before the timeout elapsed.
+    /// - `EMSGSIZE` if a datagram was received, but it was too large for the
+    ///   provided buffer (or the internal buffers of `libudipe`) and its
+    ///   payload was therefore truncated to the first `size` bytes.
+    /// - `EOPNOTSUPP` if the connection was not configured for reception.
+    /// - `EBUSY` if the connection has an active udipe_recv_stream().
+    /// - `ECONNABORTED` if the connection was closed by udipe_disconnect()
+    ///   before any datagram was received.
+    int error;
+} udipe_recv_result_t;
+
+/// Datagram within a buffer that was filled by udipe_recv()
+///
+/// This is a view into the buffer, no data is copied.
+typedef struct udipe_segment_s {
+    /// Start of the datagram payload
+    ///
+    const void* payload;
+
+    /// Size of the datagram payload in bytes
+    ///
+    size_t size;
+} udipe_segment_t;
+
+/// Iterator over the datagrams within a buffer that was filled by udipe_recv()
+///
+/// This should be created with udipe_recv_segments() and advanced with
+/// udipe_next_segment(). It lets you handle GRO-coalesced datagrams one by one
+/// without copying them, while also working as expected when GRO is disabled
+/// or did not coalesce anything.
+///
+/// \internal
+///
+/// This iterator does not care about where the buffer comes from, so it can be
+/// used on internal worker buffers just as well as on client buffers.
+typedef struct udipe_segment_iterator_s {
+    /// Start of the next datagram
+    ///
+    const char* next;
+
+    /// Number of bytes left to be iterated over
+    ///
+    size_t remaining;
+
+    /// Size of the individual datagrams, or 0 for a single datagram
+    ///
+    size_t segment_size;
+
+    /// Truth that all datagrams have been iterated over
+    ///
+    /// This cannot be deduced from `remaining` alone, as an empty datagram is
+    /// a valid datagram.
+    bool done;
+} udipe_segment_iterator_t;
+
+/// Iterate over the datagrams that were received by udipe_recv()
+///
+/// \param buffer must be the \ref udipe_recv_options_t::buffer that was passed
+///               to udipe_recv() or udipe_start_recv().
+/// \param result must be the associated \ref udipe_recv_result_t.
+///
+/// \returns an iterator that can be passed to udipe_next_segment() in order to
+///          access each received datagram in turn.
+UDIPE_NODISCARD
+UDIPE_PUBLIC
+udipe_segment_iterator_t udipe_recv_segments(const void* buffer,
+                                             udipe_recv_result_t result);
+
+/// Get the next datagram from a \ref udipe_segment_iterator_t
+///
+/// \param iterator must be an iterator that was created by
+///                 udipe_recv_segments().
+/// \param segment will be set to a view of the next datagram if there is one.
+///
+/// \returns `true` if `segment` was set to the next datagram, `false` if
+///          there are no datagrams left.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_PUBLIC
+bool udipe_next_segment(udipe_segment_iterator_t* iterator,
+                        udipe_segment_t* segment);
+
+/// udipe_recv_stream() datagram callback
+///
+/// This callback is invoked by a `libudipe` worker thread for each datagram
+/// that is received by a udipe_recv_stream() command, in reception order. It
+/// takes the following arguments:
+///
+/// - User-defined \link #udipe_recv_stream_options_t::context context
+///   \endlink
+/// - Payload of the datagram, or `NULL` if `result.error` indicates that
+///   reception failed before any datagram could be received.
+/// - Result of the datagram reception, which uses the same conventions as the
+///   result of udipe_recv(). In particular, if GRO is enabled, several
+///   datagrams may be passed to a single callback invocation, and you can use
+///   udipe_recv_segments() to iterate over them.
+///
+/// The payload resides in an internal buffer of the worker thread, which will
+/// be reused for other datagrams once the callback returns. It must therefore
+/// not be accessed after the callback has returned, and any data that you need
+/// to keep around must be copied elsewhere.
+///
+/// The callback returns `true` to keep receiving datagrams, and `false` to
+/// stop the stream. In the latter case, the udipe_recv_stream() command
+/// completes successfully.
+///
+/// Because this callback runs on a worker thread, every moment spent inside of
+/// it is a moment where this worker thread does not process network traffic.
+/// For optimal performance, it should therefore do as little work as possible,
+/// and in particular it should not block. It must also not submit any
+/// `libudipe` command, as this could deadlock the worker thread.
+typedef bool (*udipe_recv_callback_t)(void* /* context */,
+                                      const void* /* payload */,
+                                      udipe_recv_result_t /* result */);
+
+/// udipe_recv_stream() parameters
+///
+/// This struct controls the parameters of a stream of datagram receptions.
+/// Unlike most configuration structs, it cannot be zero-initialized, as you
+/// must at least specify a connection and a callback that processes incoming
+/// datagrams.
+///
+/// \internal
+///
+/// This struct must fit inside of the options union of the internal `command_t`
+/// type, whose size budget is half a cache line.
+typedef struct udipe_recv_stream_options_s {
+    /// Connection from which datagrams should be received
+    ///
+    /// This must be a connection that was previously established with
+    /// udipe_connect() with a \ref udipe_connect_options_t::direction of \ref
+    /// UDIPE_IN or \ref UDIPE_INOUT, and that has not been closed with
+    /// udipe_disconnect() yet.
+    ///
+    /// A connection can only have one active reception stream at a time, and
+    /// udipe_recv() commands cannot be used on a connection while a reception
+    /// stream is active on it.
+    udipe_connection_t* connection;
+
+    /// Callback that processes incoming datagrams
+    ///
+    /// See \ref udipe_recv_callback_t for more information.
+    udipe_recv_callback_t callback;
+
+    /// Callback context
+    ///
+    /// This pointer is not used by the udipe implementation, but merely passed
+    /// down as the first argument to each call to `callback`. The data that it
+    /// points to, if any, must remain valid until the future associated with
+    /// udipe_start_recv_stream() has been awaited via udipe_finish().
+    void* context;
+} udipe_recv_stream_options_t;
+
+/// udipe_recv_stream() result
+///
+/// \internal
+///
+/// The size of this struct should be kept such that \ref udipe_future_t fits in
+/// one single cache line on all CPU platforms of interest. A static_assert()
+/// will fail the build if you blow this byte budget.
+typedef struct udipe_recv_stream_result_s {
+    /// Number of datagrams that were passed to the callback
+    ///
+    /// Datagrams that were coalesced by GRO are counted individually.
+    size_t num_datagrams;
+
+    /// Total payload size of the datagrams that were passed to the callback
+    ///
+    size_t num_bytes;
+
+    /// Error code
+    ///
+    /// This is zero if the stream was ended by the callback, otherwise it is
+    /// an `errno` code that explains what went wrong. The most notable errors
+    /// are...
+    ///
+    /// - `EOPNOTSUPP` if the connection was not configured for reception.
+    /// - `EBUSY` if the connection already has an active reception stream or
+    ///   pending udipe_recv() commands.
+    /// - `ECONNABORTED` if the connection was closed by udipe_disconnect()
+    ///   while the stream was active.
+    ///
+    /// Errors that affect individual datagram receptions are not reported
+    /// here, but passed down to the callback, which may decide to either
+    /// ignore them or end the stream.
+    int error;
+} udipe_recv_stream_result_t;
+
+/// udipe_send_stream() datagram producer callback
+///
+/// This callback is invoked by a `libudipe` worker thread whenever it is ready
+/// to send another datagram as part of a udipe_send_stream() command. It takes
+/// the following arguments:
+///
+/// - User-defined \link #udipe_send_stream_options_t::context context
+///   \endlink
+/// - Internal buffer of the worker thread, which the callback should fill with
+///   the payload of the next datagram.
+/// - Size of this buffer in bytes, which is the \ref
+///   udipe_buffer_config_t::buffer_size of the worker thread.
+/// - Pointer to the size of the datagram, which the callback should set to the
+///   number of bytes that it wrote into the buffer.
+///
+/// The callback returns `true` if it produced a datagram that should be sent,
+/// and `false` if the stream should end. In the latter case, the contents of
+/// the buffer are ignored, and the udipe_send_stream() command completes
+/// successfully once all previously produced datagrams have been sent.
+///
+/// If GSO is enabled via \ref udipe_connect_options_t::gso_segment_size, the
+/// callback may produce several datagrams at once by writing a sequence of
+/// datagrams of that size into the buffer, the last of which may be smaller.
+///
+/// Datagrams are produced ahead of emission so that they can be sent in
+/// batches, therefore the fact that this callback was called does not mean
+/// that the previously produced datagrams have already been sent.
+///
+/// Because this callback runs on a worker thread, every moment spent inside of
+/// it is a moment where this worker thread does not process network traffic.
+/// For optimal performance, it should therefore do as little work as possible,
+/// and in particular it should not block. It must also not submit any
+/// `libudipe` command, as this could deadlock the worker thread.
+typedef bool (*udipe_send_callback_t)(void* /* context */,
+                                      void* /* buffer */,
+                                      size_t /* buffer_size */,
+                                      size_t* /* size */);
+
+/// udipe_send_stream() parameters
+///
+/// This struct controls the parameters of a stream of datagram emissions.
+/// Unlike most configuration structs, it cannot be zero-initialized, as you
+/// must at least specify a connection and a callback that produces outgoing
+/// datagrams.
+///
+/// \internal
+///
+/// This struct must fit inside of the options union of the internal `command_t`
+/// type, whose size budget is half a cache line.
+typedef struct udipe_send_stream_options_s {
+    /// Connection through which datagrams should be sent
+    ///
+    /// This must be a connection that was previously established with
+    /// udipe_connect() with a \ref udipe_connect_options_t::direction of \ref
+    /// UDIPE_OUT or \ref UDIPE_INOUT, and that has not been closed with
+    /// udipe_disconnect() yet.
+    ///
+    /// A connection can only have one active emission stream at a time.
+    udipe_connection_t* connection;
+
+    /// Callback that produces outgoing datagrams
+    ///
+    /// See \ref udipe_send_callback_t for more information.
+    udipe_send_callback_t callback;
+
+    /// Callback context
+    ///
+    /// This pointer is not used by the udipe implementation, but merely passed
+    /// down as the first argument to each call to `callback`. The data that it
+    /// points to, if any, must remain valid until the future associated with
+    /// udipe_start_send_stream() has been awaited via udipe_finish().
+    void* context;
+} udipe_send_stream_options_t;
+
+/// udipe_send_stream() result
+///
+/// \internal
+///
+/// The size of this struct should be kept such that \ref udipe_future_t fits in
+/// one single cache line on all CPU platforms of interest. A static_assert()
+/// will fail the build if you blow this byte budget.
+typedef struct udipe_send_stream_result_s {
+    /// Number of datagrams that were handed over to the operating system
+    ///
+    /// When GSO is enabled, each GSO segment counts as one datagram.
+    size_t num_datagrams;
+
+    /// Total payload size of the datagrams that were handed over to the
+    /// operating system
+    ///
+    size_t num_bytes;
+
+    /// Error code
+    ///
+    /// This is zero if the stream was ended by the callback and all datagrams
+    /// that it produced were sent, otherwise it is an `errno` code that
+    /// explains what went wrong. Datagram emission errors end the stream, and
+    /// beyond those that are listed in \ref udipe_send_result_t, the most
+    /// notable errors are...
+    ///
+    /// - `EBUSY` if the connection already has an active emission stream.
+    /// - `ENOBUFS` if the worker thread has too many active streams.
+    int error;
+} udipe_send_stream_result_t;
@@ -8,16 +8,13 @@
 //! with related lower-level definitions.
 
 #include "connect.h"
+#include "operation.h"
 
 #include <limits.h>
 #include <stdalign.h>
 #include <stddef.h>
 
 
-// TODO: Extract to a dedicated operation.h header and fill in the blanks
-typedef int udipe_send_result_t;
-typedef int udipe_recv_result_t;
-
 /// Result payloads from network futures
 ///
 /// This result payload pairs with a \ref udipe_result_type_t that indicates
@@ -33,6 +30,8 @@ typedef union udipe_network_payload_u {
     udipe_disconnect_result_t disconnect;  ///< Result of udipe_disconnect()
     udipe_send_result_t send;  ///< Result of udipe_send()
     udipe_recv_result_t recv;  ///< Result of udipe_recv()
+    udipe_recv_stream_result_t recv_stream;  ///< Result of udipe_recv_stream()
+    udipe_send_stream_result_t send_stream;  ///< Result of udipe_send_stream()
 } udipe_network_payload_t;
 
 /// Result payload from custom futures created via udipe_start_custom()
@@ -49,12 +48,18 @@ typedef union udipe_network_payload_u {
 /// that we will not accidentally shrink it later as the implementation and API
 /// of network operations evolves. Indeed, the number of bytes available here is
 /// part of udipe's public API contract.
+///
+/// The largest variant is currently \ref udipe_connect_result_t, as it embeds
+/// an IP address that may be an IPv6 one, hence the 48 bytes. This is a fixed
+/// byte count rather than a multiple of `sizeof(void*)` because IP addresses
+/// do not get smaller on 32-bit CPUs. A static_assert() will fail the build if
+/// a network result outgrows this.
 typedef struct udipe_custom_payload_s {
     /// Word-aligned buffer that you can fill with any payload of your choosing
     ///
     /// The size of this buffer may increase in future releases of udipe, but it
     /// is guaranteed not to decrease.
-    alignas(void*) char bytes[2*sizeof(void*)];
+    alignas(void*) char bytes[48];
 } udipe_custom_payload_t;
 
 // Forward declaration of \ref udipe_future_t
@@ -128,6 +133,8 @@ typedef enum udipe_result_type_e {
     UDIPE_UNORDERED, ///< udipe_start_unordered()
     UDIPE_TIMER_ONCE, ///< udipe_start_timer_once()
     UDIPE_TIMER_REPEAT, ///< udipe_start_timer_repeat()
+    UDIPE_RECV_STREAM,  ///< Payload is in `payload.network.recv_stream`
+    UDIPE_SEND_STREAM,  ///< Payload is in `payload.network.send_stream`
 
     /// Invalid result type
     ///
@@ -0,0 +1,139 @@
+#pragma once
+
+//! \file
+//! \brief Worker thread configuration
+//!
+//! This header is the home of \ref udipe_worker_config_t, the data structure
+//! that controls how many network worker threads `libudipe` spawns and which
+//! CPU cores they run on, along with \ref udipe_io_backend_t, the choice of
+//! operating system interface that these threads use for network I/O.
+
+#include "duration.h"
+
+#include <stddef.h>
+
+
+/// Maximal number of worker classes, including worker class 0
+///
+/// See \ref udipe_worker_class_config_t for more information about worker
+/// classes.
+#define UDIPE_MAX_WORKER_CLASSES 256
+
+/// Operating system interface that worker threads use for network I/O
+///
+/// This is selected once and for all at udipe_initialize() time, via \ref
+/// udipe_worker_config_t::io_backend. All backends provide the same
+/// functionality, they only differ in performance characteristics, so this is
+/// mainly meant to let you compare them on your workload.
+typedef enum udipe_io_backend_e {
+    /// Let `libudipe` pick the backend
+    ///
+    /// This is currently \ref UDIPE_IO_EPOLL, which is the most widely
+    /// available backend, but this may change in future versions.
+    UDIPE_IO_DEFAULT = 0,
+
+    /// Readiness-based I/O
+    ///
+    /// Worker threads wait for socket readiness using `epoll`, then drain
+    /// readable sockets with one `recvmmsg()` call per socket and fill
+    /// writable sockets with one `sendmmsg()` call per socket.
+    UDIPE_IO_EPOLL,
+
+    /// Completion-based I/O
+    ///
+    /// Worker threads batch `IORING_OP_RECVMSG` and `IORING_OP_SENDMSG`
+    /// operations targeting any number of sockets into an `io_uring`, which
+    /// amortizes system call overhead across sockets and operations. Datagrams
+    /// are received into worker buffers that are handed over to the kernel via
+    /// a provided buffer ring, so that buffers are only consumed by sockets
+    /// that actually receive data.
+    ///
+    /// This requires Linux 5.19 or later. If `io_uring` is not available, for
+    /// example because it was disabled by the system administrator, then a
+    /// warning is logged and worker threads fall back to \ref UDIPE_IO_EPOLL.
+    UDIPE_IO_URING,
+
+    /// Completion-based I/O with persistent reception operations
+    ///
+    /// This is like \ref UDIPE_IO_URING, except that each connection that
+    /// needs datagrams gets a single multishot `IORING_OP_RECVMSG` operation,
+    /// which keeps producing one completion per incoming datagram until the
+    /// provided buffer ring runs dry. This saves one submission per received
+    /// datagram, which matters most when receiving many small datagrams.
+    ///
+    /// Each received datagram is preceded by a small header in its worker
+    /// buffer, so the largest datagram that can be received without
+    /// truncation is a bit smaller than \ref udipe_buffer_config_t::buffer_size.
+    ///
+    /// This requires Linux 6.0 or later. On older kernels, a warning is logged
+    /// and worker threads fall back to \ref UDIPE_IO_URING.
+    UDIPE_IO_URING_MULTISHOT,
+} udipe_io_backend_t;
+
+
+/// Worker thread configuration
+///
+/// `libudipe` spawns one network worker thread per selected CPU core, pins it
+/// to this core, and has it allocate all of its state in locked memory that is
+/// local to this core's NUMA node. Client commands are then spread across
+/// these worker threads on a per-connection basis: each connection is owned by
+/// the worker thread that processed the associated udipe_connect() command,
+/// which will then process all other commands targeting this connection.
+///
+/// This struct is designed such that zero-initializing it results in one
+/// worker thread being spawned on every CPU core that the process is allowed
+/// to run on.
+typedef struct udipe_worker_config_s {
+    /// CPUs that worker threads may run on
+    ///
+    /// This is a list of CPU ranges that uses the syntax of Linux' `cpulist`
+    /// files, e.g. `0-3,8,10-11`, where the CPU numbers are those reported by
+    /// the operating system (e.g. in `/proc/cpuinfo` on Linux). One worker
+    /// thread is spawned per CPU core that contains at least one selected CPU,
+    /// and this worker thread is pinned to the selected CPUs of this core.
+    ///
+    /// CPUs that the process is not allowed to run on are ignored. If no
+    /// allowed CPU is selected, udipe_initialize() will fail.
+    ///
+    /// If this is left at `NULL`, then all CPUs that the process is allowed to
+    /// run on are selected.
+    const char* cpus;
+
+    /// Maximal number of worker threads
+    ///
+    /// If more CPU cores are selected than this, only the first `max_workers`
+    /// selected cores in the order of CPU numbers will be used.
+    ///
+    /// If this is left at 0, then the number of worker threads is only limited
+    /// by the number of selected CPU cores.
+    size_t max_workers;
+
+    /// Network I/O backend
+    ///
+    /// See \ref udipe_io_backend_t for the available choices. If this is left
+    /// at \ref UDIPE_IO_DEFAULT, then `libudipe` picks the backend.
+    udipe_io_backend_t io_backend;
+
+    /// Maximal time that an idle worker thread spends spinning before it
+    /// blocks
+    ///
+    /// Waking up a worker thread that is blocked in the operating system's
+    /// scheduler takes tens of microseconds, which is a lot of latency for
+    /// bursty traffic. When this is set, worker threads that run out of work
+    /// first busy-wait for new commands or network activity for up to this
+    /// long, then yield their CPU core to other threads for up to this long,
+    /// and only then block.
+    ///
+    /// The actual spinning time is adjusted to the time that the worker thread
+    /// usually stays idle: if new work tends to come in within this limit,
+    /// worker threads spin for about twice as long as they usually wait,
+    /// otherwise they do not spin at all.
+    ///
+    /// This reduces latency at the expense of CPU time and power consumption,
+    /// so it is best used when worker threads have CPU cores to themselves.
+    /// It must not be longer than one second.
+    ///
+    /// If this is left at \ref UDIPE_DURATION_DEFAULT, then idle worker
+    /// threads block right away.
+    udipe_duration_ns_t idle_spin;
+} udipe_worker_config_t;
@@ -107,6 +107,27 @@ static_assert(FALSE_SHARING_GRANULARITY % CACHE_LINE_SIZE == 0,
 /// \}
 
 
+/// \name Busy waiting
+/// \{
+
+/// Tell the CPU that the calling thread is busy-waiting
+///
+/// This should be called on every iteration of a spin loop. It lets the CPU
+/// save power and give execution resources to the sibling hyperthread, and
+/// avoids a costly pipeline flush when the awaited condition comes true.
+static inline void spin_loop_hint() {
+    #if defined(_M_X64)
+        _mm_pause();
+    #elif defined(X86_64)
+        __builtin_ia32_pause();
+    #elif defined(__aarch64__)
+        __asm__ volatile("yield");
+    #endif
+}
+
+/// \}
+
+
 // x86-specific functionality
 #ifdef X86_64
     /// \name High-resolution timing
@@ -10,6 +10,7 @@
     #include "benchmark/distribution_log.h"
     #include "benchmark/distribution_pool.h"
     #include "benchmark/statistics.h"
+    #include "command.h"
     #include "error.h"
     #include "log.h"
     #include "memory.h"
@@ -1124,7 +1125,7 @@
     DEFINE_PUBLIC void udipe_micro_benchmarks(udipe_benchmark_t* benchmark) {
         // Microbenchmarks are ordered such that a piece of code is
         // benchmarked before other pieces of code that may depend on it
-        // TODO: UDIPE_BENCHMARK(benchmark, xyz_micro_benchmarks, NULL);
+        UDIPE_BENCHMARK(benchmark, command_micro_benchmarks, NULL);
     }
 
 #endif  // UDIPE_BUILD_BENCHMARKS
@@ -15,7 +15,9 @@
 #include "bit_array.h"
 #include "memory.h"
 
+#include <assert.h>
 #include <hwloc.h>
+#include <stddef.h>
 
 
 /// Buffer allocator
@@ -157,6 +159,47 @@ UDIPE_NON_NULL_ARGS
 void* buffer_allocate(buffer_allocator_t* allocator);
 
 
+/// Locate a buffer from its index within the memory pool of an allocator
+///
+/// This is used when buffers must be designated by a small integer, e.g. when
+/// they are handed over to the kernel via an io_uring provided buffer ring.
+///
+/// \param allocator points to an allocator that has previously been set up
+///                  using buffer_allocator_initialize() and hasn't been
+///                  destroyed with buffer_allocator_finalize() yet.
+/// \param index must be smaller than \link #udipe_buffer_config_t::buffer_count
+///              allocator->config.buffer_count\endlink.
+///
+/// \returns the buffer with index `index`.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+static inline void* buffer_at(const buffer_allocator_t* allocator,
+                              size_t index) {
+    assert(index < allocator->config.buffer_count);
+    return (char*)allocator->memory_pool + index * allocator->config.buffer_size;
+}
+
+/// Determine the index of a buffer within the memory pool of an allocator
+///
+/// This is the inverse of buffer_at().
+///
+/// \param allocator points to an allocator that has previously been set up
+///                  using buffer_allocator_initialize() and hasn't been
+///                  destroyed with buffer_allocator_finalize() yet.
+/// \param buffer must be a buffer from `allocator`.
+///
+/// \returns the index of `buffer`.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static inline size_t buffer_index(const buffer_allocator_t* allocator,
+                                  const void* buffer) {
+    const size_t offset =
+        (const char*)buffer - (const char*)allocator->memory_pool;
+    assert(offset % allocator->config.buffer_size == 0);
+    return offset / allocator->config.buffer_size;
+}
+
 #ifdef UDIPE_BUILD_TESTS
     /// Unit tests
     ///
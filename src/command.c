@@ -1,13 +1,336 @@
 #include "command.h"
 
 #include <udipe/nodiscard.h>
+#include <udipe/result.h>
 
+#include "connection.h"
+#include "context.h"
 #include "error.h"
+#include "future.h"
+#include "future/type.h"
 #include "log.h"
+#include "memory.h"
 #include "visibility.h"
+#include "worker.h"
+#include "worker_pool.h"
 
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <threads.h>
 
-/* DEFINE_PUBLIC
+#ifdef UDIPE_BUILD_BENCHMARKS
+    #include "benchmark.h"
+    #include "benchmark/distribution_pool.h"
+    #include "benchmark/statistics.h"
+#endif
+
+
+UDIPE_NON_NULL_ARGS
+void command_queue_initialize(command_queue_t* queue) {
+    LOGGED_FUNCTION_START("%p", queue)
+        debug("Setting up an empty ring buffer...");
+        atomic_init(&queue->worker_idx, 0);
+        atomic_init(&queue->client_idx, 0);
+        for (uint64_t pos = 0; pos < COMMAND_QUEUE_LEN; ++pos) {
+            atomic_init(&queue->commands[pos].sequence,
+                        pos << COMMAND_SLOT_FLAG_BITS);
+        }
+
+        debug("Setting up client synchronization...");
+        exit_on_thread_error(cnd_init(&queue->client_condition),
+                             "Failed to initialize the client condition");
+        atomic_init(&queue->num_waiting_clients, 0);
+        exit_on_thread_error(mtx_init(&queue->client_mutex, mtx_plain),
+                             "Failed to initialize the client mutex");
+    LOGGED_FUNCTION_END
+}
+
+// The worker thread must never miss a blocked client thread, otherwise said
+// client thread could wait forever. This is prevented by the following
+// store-load sequences, which must be sequentially consistent so that at least
+// one of the two threads observes the other's store:
+//
+// - A blocked client increments `num_waiting_clients`, then checks
+//   `worker_idx` again before waiting on `client_condition`.
+// - The worker updates `worker_idx`, then checks `num_waiting_clients` and
+//   signals `client_condition` with `client_mutex` locked if it is nonzero.
+//
+// Because the client holds `client_mutex` from its final `worker_idx` check
+// until cnd_wait() atomically releases it, the worker's signal cannot slip in
+// between these two steps and be lost.
+
+UDIPE_NON_NULL_ARGS
+void command_queue_push(command_queue_t* queue, const command_t* command) {
+    LOGGED_FUNCTION_START("%p, %p", queue, command)
+        const size_t num_pushed = command_queue_push_batch(queue, command, 1);
+        ensure_eq(num_pushed, (size_t)1);
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+size_t command_queue_push_batch(command_queue_t* queue,
+                                const command_t commands[],
+                                size_t num_commands) {
+    LOGGED_FUNCTION_START("%p, %p, %zu", queue, commands, num_commands)
+        ensure_gt(num_commands, (size_t)0);
+
+        debug("Taking control of the client side of the queue...");
+        exit_on_thread_error(mtx_lock(&queue->client_mutex),
+                             "Failed to lock the client mutex");
+
+        debug("Waiting for free queue slots...");
+        uint64_t client_idx;
+        size_t num_free;
+        bool waiting = false;
+        while (true) {
+            // Other clients may have pushed commands while we were waiting
+            client_idx = atomic_load_explicit(&queue->client_idx,
+                                              memory_order_relaxed);
+            const uint64_t worker_idx =
+                atomic_load_explicit(&queue->worker_idx, memory_order_seq_cst);
+            num_free = COMMAND_QUEUE_LEN - (size_t)(client_idx - worker_idx);
+            if (num_free > 0) break;
+            if (!waiting) {
+                debug("Queue is full, will wait for the worker to catch up...");
+                atomic_fetch_add_explicit(&queue->num_waiting_clients,
+                                          1,
+                                          memory_order_seq_cst);
+                waiting = true;
+                continue;
+            }
+            exit_on_thread_error(cnd_wait(&queue->client_condition,
+                                          &queue->client_mutex),
+                                 "Failed to wait for the worker");
+        }
+        if (waiting) {
+            atomic_fetch_sub_explicit(&queue->num_waiting_clients,
+                                      1,
+                                      memory_order_relaxed);
+        }
+
+        const size_t num_pushed =
+            (num_commands < num_free) ? num_commands : num_free;
+        debugf("Publishing %zu/%zu command(s)...", num_pushed, num_commands);
+        for (size_t i = 0; i < num_pushed; ++i) {
+            const uint64_t pos = client_idx + i;
+            command_slot_t* const slot =
+                &queue->commands[pos % COMMAND_QUEUE_LEN];
+            const uint64_t free_sequence = pos << COMMAND_SLOT_FLAG_BITS;
+            // A worker may have taken the previous command out of this slot
+            // but not finished copying it yet. This is short, so just wait.
+            while (atomic_load_explicit(&slot->sequence, memory_order_acquire)
+                   != free_sequence) {
+                thrd_yield();
+            }
+            slot->command = commands[i];
+            atomic_store_explicit(
+                &slot->sequence,
+                free_sequence
+                | COMMAND_SLOT_FULL
+                | (commands[i].stealable ? COMMAND_SLOT_STEALABLE : 0),
+                // Make the command visible to workers
+                memory_order_release
+            );
+        }
+        atomic_store_explicit(&queue->client_idx,
+                              client_idx + num_pushed,
+                              // Make the slot sequence numbers visible too
+                              memory_order_release);
+
+        debug("Releasing control of the client side of the queue...");
+        exit_on_thread_error(mtx_unlock(&queue->client_mutex),
+                             "Failed to unlock the client mutex");
+        return num_pushed;
+    LOGGED_FUNCTION_END
+}
+
+/// Try to take the oldest command out of a command queue
+///
+/// This is the common implementation of command_queue_try_pop() and
+/// command_queue_try_steal().
+///
+/// This function must be called within a logging scope.
+///
+/// \param queue must be a valid command queue.
+/// \param command must point to storage where the oldest command will be
+///                written, if it is taken out of the queue.
+/// \param steal indicates whether only \ref command_t::stealable commands
+///              should be taken out of the queue.
+///
+/// \returns `true` if a command was written to `command`.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static bool try_take(command_queue_t* queue, command_t* command, bool steal) {
+    LOGGED_FUNCTION_START("%p, %p, %d", queue, command, steal)
+        uint64_t worker_idx = atomic_load_explicit(&queue->worker_idx,
+                                                   memory_order_relaxed);
+        command_slot_t* slot;
+        while (true) {
+            debug("Checking for pending commands...");
+            slot = &queue->commands[worker_idx % COMMAND_QUEUE_LEN];
+            const uint64_t free_sequence = worker_idx << COMMAND_SLOT_FLAG_BITS;
+            const uint64_t sequence =
+                atomic_load_explicit(&slot->sequence, memory_order_acquire);
+            if (sequence == free_sequence) {
+                debug("Queue is empty.");
+                return false;
+            }
+            if ((sequence & ~COMMAND_SLOT_STEALABLE)
+                != (free_sequence | COMMAND_SLOT_FULL)) {
+                // Another worker took the command at position worker_idx, and
+                // the slot may even have been reused for a later command.
+                debug("Another worker took the command first, retrying...");
+                worker_idx = atomic_load_explicit(&queue->worker_idx,
+                                                  memory_order_relaxed);
+                continue;
+            }
+            if (steal && !(sequence & COMMAND_SLOT_STEALABLE)) {
+                debug("Oldest command cannot be stolen.");
+                return false;
+            }
+
+            debug("Taking ownership of the oldest command...");
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue->worker_idx,
+                    &worker_idx,
+                    worker_idx + 1,
+                    // Order this before num_waiting_clients check
+                    memory_order_seq_cst,
+                    memory_order_relaxed
+                )) {
+                break;
+            }
+            debug("Another worker took the command first, retrying...");
+        }
+
+        // Clients do not overwrite the slot until we release it below, and
+        // other workers cannot take this command as worker_idx moved past it.
+        debug("Fetching the command and freeing its queue slot...");
+        *command = slot->command;
+        atomic_store_explicit(
+            &slot->sequence,
+            (worker_idx + COMMAND_QUEUE_LEN) << COMMAND_SLOT_FLAG_BITS,
+            // Don't let clients overwrite the slot before we're done reading
+            memory_order_release
+        );
+
+        if (atomic_load_explicit(&queue->num_waiting_clients,
+                                 memory_order_seq_cst) > 0) {
+            debug("Waking up a client that waits for a free slot...");
+            exit_on_thread_error(mtx_lock(&queue->client_mutex),
+                                 "Failed to lock the client mutex");
+            exit_on_thread_error(cnd_signal(&queue->client_condition),
+                                 "Failed to signal the client condition");
+            exit_on_thread_error(mtx_unlock(&queue->client_mutex),
+                                 "Failed to unlock the client mutex");
+        }
+        return true;
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+bool command_queue_try_pop(command_queue_t* queue, command_t* command) {
+    LOGGED_FUNCTION_START("%p, %p", queue, command)
+        return try_take(queue, command, false);
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+bool command_queue_try_steal(command_queue_t* queue, command_t* command) {
+    LOGGED_FUNCTION_START("%p, %p", queue, command)
+        return try_take(queue, command, true);
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void command_queue_finalize(command_queue_t* queue) {
+    LOGGED_FUNCTION_START("%p", queue)
+        debug("Checking that no command is pending...");
+        ensure_eq(atomic_load_explicit(&queue->client_idx, memory_order_relaxed),
+                  atomic_load_explicit(&queue->worker_idx, memory_order_relaxed));
+
+        debug("Tearing down client synchronization...");
+        mtx_destroy(&queue->client_mutex);
+        cnd_destroy(&queue->client_condition);
+    LOGGED_FUNCTION_END
+}
+
+/// Submit a command to a worker
+///
+/// This function must be called within a logging scope.
+///
+/// \param context must be a valid udipe context.
+/// \param worker must be the worker that should process the command.
+/// \param type is the type of network command that is being submitted.
+/// \param command must be a command whose options have been set, but whose
+///                future has not been allocated yet. This function will
+///                allocate it.
+///
+/// \returns the future associated with the command.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+static udipe_future_t* submit_command(udipe_context_t* context,
+                                      worker_t* worker,
+                                      future_type_t type,
+                                      command_t* command) {
+    LOGGED_FUNCTION_START("%p, %p, %d, %p", context, worker, type, command)
+        debug("Allocating the result future...");
+        command->future = future_network_allocate(context, type);
+
+        debug("Handing over the command to the worker...");
+        worker_submit(worker, command);
+        return command->future;
+    LOGGED_FUNCTION_END
+}
+
+/// Find out which worker owns a connection
+///
+/// This function must be called within a logging scope.
+///
+/// \param connection must be a connection that was returned by
+///                   udipe_connect() and hasn't been disconnected yet.
+///
+/// \returns the worker that processes commands targeting `connection`.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_RESULT
+static worker_t* connection_worker(udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p", connection)
+        ensure(connection);
+        return connection->worker;
+    LOGGED_FUNCTION_END
+}
+
+DEFINE_PUBLIC
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+udipe_future_t* udipe_start_connect(udipe_context_t* context,
+                                    udipe_connect_options_t options) {
+    udipe_future_t* future = NULL;
+    LOGGER_START(&context->logger)
+        debug("Sharing the connection options with the worker...");
+        udipe_connect_options_t* const shared_options =
+            connect_options_allocate(&context->connect_options);
+        *shared_options = options;
+
+        debug("Submitting the connection command...");
+        command_t command = { .options.connect = shared_options };
+        future = submit_command(context,
+                                worker_pool_select(&context->workers,
+                                                   options.worker_class),
+                                TYPE_NETWORK_CONNECT,
+                                &command);
+    LOGGER_END
+    return future;
+}
+
+DEFINE_PUBLIC
 UDIPE_NODISCARD
 UDIPE_NON_NULL_ARGS
 udipe_connect_result_t udipe_connect(udipe_context_t* context,
@@ -21,6 +344,24 @@ udipe_connect_result_t udipe_connect(udipe_context_t* context,
     return result.payload.network.connect;
 }
 
+DEFINE_PUBLIC
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+udipe_future_t* udipe_start_disconnect(udipe_context_t* context,
+                                       udipe_disconnect_options_t options) {
+    udipe_future_t* future = NULL;
+    LOGGER_START(&context->logger)
+        debug("Submitting the disconnection command...");
+        command_t command = { .options.disconnect = options };
+        future = submit_command(context,
+                                connection_worker(options.connection),
+                                TYPE_NETWORK_DISCONNECT,
+                                &command);
+    LOGGER_END
+    return future;
+}
+
 DEFINE_PUBLIC
 UDIPE_NODISCARD
 UDIPE_NON_NULL_ARGS
@@ -32,7 +373,29 @@ udipe_disconnect_result_t udipe_disconnect(udipe_context_t* context,
     assert(future);
     udipe_result_t result = udipe_finish(future);
     assert(result.type == UDIPE_DISCONNECT);
-    return result.payload.network.connect;
+    return result.payload.network.disconnect;
+}
+
+DEFINE_PUBLIC
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+udipe_future_t* udipe_start_send(udipe_context_t* context,
+                                 udipe_send_options_t options) {
+    udipe_future_t* future = NULL;
+    LOGGER_START(&context->logger)
+        debug("Submitting the emission command...");
+        ensure(options.connection);
+        command_t command = {
+            .options.send = options,
+            .stealable = options.connection->steal_sends
+        };
+        future = submit_command(context,
+                                connection_worker(options.connection),
+                                TYPE_NETWORK_SEND,
+                                &command);
+    LOGGER_END
+    return future;
 }
 
 DEFINE_PUBLIC
@@ -49,6 +412,24 @@ udipe_send_result_t udipe_send(udipe_context_t* context,
     return result.payload.network.send;
 }
 
+DEFINE_PUBLIC
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+udipe_future_t* udipe_start_recv(udipe_context_t* context,
+                                 udipe_recv_options_t options) {
+    udipe_future_t* future = NULL;
+    LOGGER_START(&context->logger)
+        debug("Submitting the reception command...");
+        command_t command = { .options.recv = options };
+        future = submit_command(context,
+                                connection_worker(options.connection),
+                                TYPE_NETWORK_RECV,
+                                &command);
+    LOGGER_END
+    return future;
+}
+
 DEFINE_PUBLIC
 UDIPE_NODISCARD
 UDIPE_NON_NULL_ARGS
@@ -61,4 +442,852 @@ udipe_recv_result_t udipe_recv(udipe_context_t* context,
     udipe_result_t result = udipe_finish(future);
     assert(result.type == UDIPE_RECV);
     return result.payload.network.recv;
-} */
+}
+
+DEFINE_PUBLIC
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+udipe_future_t* udipe_start_recv_stream(udipe_context_t* context,
+                                        udipe_recv_stream_options_t options) {
+    udipe_future_t* future = NULL;
+    LOGGER_START(&context->logger)
+        debug("Submitting the stream reception command...");
+        command_t command = { .options.recv_stream = options };
+        future = submit_command(context,
+                                connection_worker(options.connection),
+                                TYPE_NETWORK_RECV_STREAM,
+                                &command);
+    LOGGER_END
+    return future;
+}
+
+DEFINE_PUBLIC
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+udipe_recv_stream_result_t
+udipe_recv_stream(udipe_context_t* context,
+                  udipe_recv_stream_options_t options) {
+    // FIXME: Do not force this synchronous implementation style, leave the
+    //        choice to the backend.
+    udipe_future_t* future = udipe_start_recv_stream(context, options);
+    assert(future);
+    udipe_result_t result = udipe_finish(future);
+    assert(result.type == UDIPE_RECV_STREAM);
+    return result.payload.network.recv_stream;
+}
+
+DEFINE_PUBLIC
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+udipe_future_t* udipe_start_send_stream(udipe_context_t* context,
+                                        udipe_send_stream_options_t options) {
+    udipe_future_t* future = NULL;
+    LOGGER_START(&context->logger)
+        debug("Submitting the stream emission command...");
+        command_t command = { .options.send_stream = options };
+        future = submit_command(context,
+                                connection_worker(options.connection),
+                                TYPE_NETWORK_SEND_STREAM,
+                                &command);
+    LOGGER_END
+    return future;
+}
+
+DEFINE_PUBLIC
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+udipe_send_stream_result_t
+udipe_send_stream(udipe_context_t* context,
+                  udipe_send_stream_options_t options) {
+    // FIXME: Do not force this synchronous implementation style, leave the
+    //        choice to the backend.
+    udipe_future_t* future = udipe_start_send_stream(context, options);
+    assert(future);
+    udipe_result_t result = udipe_finish(future);
+    assert(result.type == UDIPE_SEND_STREAM);
+    return result.payload.network.send_stream;
+}
+
+
+/// Maximal number of commands that udipe_start_batch() routes at once
+///
+/// There is little point in going above the capacity of a command queue, as
+/// the worker thread would need to be woken up in the middle of the batch
+/// anyway. And this keeps the stack footprint of udipe_start_batch() bounded.
+#define BATCH_CHUNK_LEN ((size_t)COMMAND_QUEUE_LEN)
+
+/// Find out which worker should process a command from a batch
+///
+/// This function must be called within a logging scope, in the same order as
+/// the commands are submitted, since connection commands are spread across
+/// workers in a round-robin fashion.
+///
+/// \param context must be a valid udipe context.
+/// \param command must be a command from a batch passed to
+///                udipe_start_batch().
+///
+/// \returns the worker that should process `command`.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+static worker_t* batch_command_worker(udipe_context_t* context,
+                                      const udipe_command_t* command) {
+    LOGGED_FUNCTION_START("%p, %p", context, command)
+        switch (command->type) {
+        case UDIPE_CONNECT:
+            return worker_pool_select(&context->workers,
+                                      command->options.connect.worker_class);
+        case UDIPE_DISCONNECT:
+            return connection_worker(command->options.disconnect.connection);
+        case UDIPE_SEND:
+            return connection_worker(command->options.send.connection);
+        case UDIPE_RECV:
+            return connection_worker(command->options.recv.connection);
+        case UDIPE_RECV_STREAM:
+            return connection_worker(command->options.recv_stream.connection);
+        case UDIPE_SEND_STREAM:
+            return connection_worker(command->options.send_stream.connection);
+        default:
+            exit_with_error("Batched commands must be network commands!");
+        }
+    LOGGED_FUNCTION_END
+}
+
+/// Translate a command from a batch into a worker command
+///
+/// This allocates the result future of the command, along with shared
+/// connection options if need be.
+///
+/// This function must be called within a logging scope.
+///
+/// \param context must be a valid udipe context.
+/// \param command must be a command from a batch passed to
+///                udipe_start_batch(), which has been checked by
+///                batch_command_worker().
+///
+/// \returns a worker command that is ready to be submitted.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static command_t prepare_batch_command(udipe_context_t* context,
+                                       const udipe_command_t* command) {
+    LOGGED_FUNCTION_START("%p, %p", context, command)
+        command_t result = { .stealable = false };
+        future_type_t type;
+        switch (command->type) {
+        case UDIPE_CONNECT:
+            debug("Sharing the connection options with the worker...");
+            result.options.connect =
+                connect_options_allocate(&context->connect_options);
+            *result.options.connect = command->options.connect;
+            type = TYPE_NETWORK_CONNECT;
+            break;
+        case UDIPE_DISCONNECT:
+            result.options.disconnect = command->options.disconnect;
+            type = TYPE_NETWORK_DISCONNECT;
+            break;
+        case UDIPE_SEND:
+            result.options.send = command->options.send;
+            result.stealable = command->options.send.connection->steal_sends;
+            type = TYPE_NETWORK_SEND;
+            break;
+        case UDIPE_RECV:
+            result.options.recv = command->options.recv;
+            type = TYPE_NETWORK_RECV;
+            break;
+        case UDIPE_RECV_STREAM:
+            result.options.recv_stream = command->options.recv_stream;
+            type = TYPE_NETWORK_RECV_STREAM;
+            break;
+        case UDIPE_SEND_STREAM:
+            result.options.send_stream = command->options.send_stream;
+            type = TYPE_NETWORK_SEND_STREAM;
+            break;
+        default:
+            exit_with_error("Batched commands must be network commands!");
+        }
+
+        debug("Allocating the result future...");
+        result.future = future_network_allocate(context, type);
+        return result;
+    LOGGED_FUNCTION_END
+}
+
+DEFINE_PUBLIC
+UDIPE_NON_NULL_ARGS
+void udipe_start_batch(udipe_context_t* context,
+                       const udipe_command_t commands[],
+                       size_t num_commands,
+                       udipe_future_t* futures[]) {
+    LOGGER_START(&context->logger)
+        worker_t* workers[BATCH_CHUNK_LEN];
+        command_t group[BATCH_CHUNK_LEN];
+        for (size_t chunk_start = 0;
+             chunk_start < num_commands;
+             chunk_start += BATCH_CHUNK_LEN) {
+            const size_t num_remaining = num_commands - chunk_start;
+            const size_t chunk_len = (num_remaining < BATCH_CHUNK_LEN)
+                                     ? num_remaining
+                                     : BATCH_CHUNK_LEN;
+
+            debugf("Routing commands #%zu to #%zu...",
+                   chunk_start, chunk_start + chunk_len - 1);
+            for (size_t i = 0; i < chunk_len; ++i) {
+                workers[i] = batch_command_worker(context,
+                                                  &commands[chunk_start + i]);
+            }
+
+            debug("Submitting commands to each target worker...");
+            for (size_t first = 0; first < chunk_len; ++first) {
+                worker_t* const worker = workers[first];
+                if (!worker) continue;
+                size_t group_len = 0;
+                for (size_t i = first; i < chunk_len; ++i) {
+                    if (workers[i] != worker) continue;
+                    const size_t idx = chunk_start + i;
+                    group[group_len] = prepare_batch_command(context,
+                                                             &commands[idx]);
+                    futures[idx] = group[group_len].future;
+                    ++group_len;
+                    workers[i] = NULL;
+                }
+                tracef("Submitting %zu command(s) to worker %p...",
+                       group_len, worker);
+                worker_submit_batch(worker, group, group_len);
+            }
+        }
+    LOGGER_END
+}
+
+
+#ifdef UDIPE_BUILD_TESTS
+
+    /// Build a recognizable fake command for command queue tests
+    ///
+    /// The command queue never looks into commands, so the future pointer does
+    /// not need to be valid. Fake commands are stealable, so that they may
+    /// also be used in command stealing tests.
+    static command_t fake_command(size_t producer, size_t seq) {
+        return (command_t){
+            .options.send = { .size = seq },
+            .future = (udipe_future_t*)(uintptr_t)(producer + 1),
+            .stealable = true
+        };
+    }
+
+    /// Check that the command queue works as a FIFO in single-threaded use
+    static void test_sequential(command_queue_t* queue) {
+        LOGGED_FUNCTION_START("%p", queue)
+            info("Running sequential command queue unit tests...");
+            command_t command;
+            ensure(!command_queue_try_pop(queue, &command));
+
+            debug("Filling up the queue then draining it, twice...");
+            const size_t capacity = COMMAND_QUEUE_LEN;
+            size_t seq = 0;
+            for (size_t round = 0; round < 2; ++round) {
+                for (size_t i = 0; i < capacity; ++i) {
+                    const command_t pushed = fake_command(0, seq + i);
+                    command_queue_push(queue, &pushed);
+                }
+                for (size_t i = 0; i < capacity; ++i) {
+                    ensure(command_queue_try_pop(queue, &command));
+                    ensure_eq(command.options.send.size, seq + i);
+                    ensure_eq((uintptr_t)command.future, (uintptr_t)1);
+                }
+                ensure(!command_queue_try_pop(queue, &command));
+                seq += capacity;
+            }
+
+            debug("Going around the ring buffer one command at a time...");
+            for (size_t i = 0; i < 3 * COMMAND_QUEUE_LEN; ++i) {
+                const command_t pushed = fake_command(0, i);
+                command_queue_push(queue, &pushed);
+                ensure(command_queue_try_pop(queue, &command));
+                ensure_eq(command.options.send.size, i);
+                ensure(!command_queue_try_pop(queue, &command));
+            }
+
+            debug("Submitting more commands than the queue can hold at once...");
+            command_t batch[COMMAND_QUEUE_LEN + 1];
+            for (size_t i = 0; i < COMMAND_QUEUE_LEN + 1; ++i) {
+                batch[i] = fake_command(0, i);
+            }
+            size_t num_pushed = command_queue_push_batch(queue,
+                                                         batch,
+                                                         COMMAND_QUEUE_LEN + 1);
+            ensure_eq(num_pushed, capacity);
+            for (size_t i = 0; i < 2; ++i) {
+                ensure(command_queue_try_pop(queue, &command));
+                ensure_eq(command.options.send.size, i);
+            }
+            num_pushed = command_queue_push_batch(queue,
+                                                  batch + capacity,
+                                                  COMMAND_QUEUE_LEN + 1
+                                                  - capacity);
+            ensure_eq(num_pushed, COMMAND_QUEUE_LEN + 1 - capacity);
+            for (size_t i = 2; i < COMMAND_QUEUE_LEN + 1; ++i) {
+                ensure(command_queue_try_pop(queue, &command));
+                ensure_eq(command.options.send.size, i);
+            }
+            ensure(!command_queue_try_pop(queue, &command));
+        LOGGED_FUNCTION_END
+    }
+
+    /// Check that command stealing respects queue order and stealability in
+    /// single-threaded use
+    static void test_sequential_steal(command_queue_t* queue) {
+        LOGGED_FUNCTION_START("%p", queue)
+            info("Running sequential command stealing unit tests...");
+            command_t command;
+            ensure(!command_queue_try_steal(queue, &command));
+            ensure(!command_queue_next_stealable(queue));
+
+            debug("Queuing a non-stealable command and two stealable ones...");
+            command_t pushed = fake_command(0, 0);
+            pushed.stealable = false;
+            command_queue_push(queue, &pushed);
+            for (size_t seq = 1; seq < 3; ++seq) {
+                pushed = fake_command(0, seq);
+                command_queue_push(queue, &pushed);
+            }
+            ensure_eq(command_queue_len(queue), (size_t)3);
+
+            debug("Checking that the non-stealable command blocks stealing...");
+            ensure(!command_queue_next_stealable(queue));
+            ensure(!command_queue_try_steal(queue, &command));
+            ensure_eq(command_queue_len(queue), (size_t)3);
+
+            debug("Popping it, then stealing the other commands in order...");
+            ensure(command_queue_try_pop(queue, &command));
+            ensure_eq(command.options.send.size, (size_t)0);
+            for (size_t seq = 1; seq < 3; ++seq) {
+                ensure(command_queue_next_stealable(queue));
+                ensure(command_queue_try_steal(queue, &command));
+                ensure_eq(command.options.send.size, seq);
+            }
+            ensure(!command_queue_try_steal(queue, &command));
+            ensure(!command_queue_try_pop(queue, &command));
+            ensure_eq(command_queue_len(queue), (size_t)0);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Number of client threads in concurrent command queue tests
+    #define NUM_PRODUCERS ((size_t)3)
+
+    /// Number of commands that each client thread pushes in concurrent command
+    /// queue tests
+    ///
+    /// This is much larger than the queue capacity, so that clients
+    /// frequently need to wait for the worker.
+    #define NUM_PUSHES_PER_PRODUCER ((size_t)(20 * COMMAND_QUEUE_LEN))
+
+    /// Number of commands that each client thread pushes in the command
+    /// stealing stress test
+    ///
+    /// This makes the ring buffer wrap around many times, so that a thief
+    /// which gets preempted in the middle of a steal often resumes after the
+    /// slot it was looking at has been reused.
+    #define NUM_STRESS_PUSHES_PER_PRODUCER ((size_t)(200 * COMMAND_QUEUE_LEN))
+
+    /// State of a client thread in concurrent command queue tests
+    typedef struct producer_state_s {
+        command_queue_t* queue;
+        logger_parent_state_t logger;
+        size_t id;
+        size_t num_pushes;
+        /// If not `NULL`, the future of each command points to its own
+        /// completion counter within this array, which has `num_pushes`
+        /// entries per client thread
+        atomic_uint* completions;
+    } producer_state_t;
+
+    /// Build the command that a client thread submits in concurrent command
+    /// queue tests
+    static command_t producer_command(const producer_state_t* state,
+                                      size_t seq) {
+        command_t command = fake_command(state->id, seq);
+        if (state->completions) {
+            command.future = (udipe_future_t*)
+                &state->completions[state->id * state->num_pushes + seq];
+        }
+        return command;
+    }
+
+    /// Client thread of concurrent command queue tests
+    ///
+    /// The first client thread submits commands one by one, while the other
+    /// ones submit them in batches of increasing size.
+    static int producer_func(void* context) {
+        producer_state_t* const state = (producer_state_t*)context;
+        logger_init_child(&state->logger);
+        LOGGED_FUNCTION_START("%p", context)
+            if (state->id == 0) {
+                for (size_t seq = 0; seq < state->num_pushes; ++seq) {
+                    const command_t command = producer_command(state, seq);
+                    command_queue_push(state->queue, &command);
+                }
+                return 0;
+            }
+
+            const size_t batch_len = state->id * COMMAND_QUEUE_LEN / 2;
+            command_t batch[NUM_PRODUCERS * COMMAND_QUEUE_LEN / 2];
+            assert(batch_len <= sizeof(batch) / sizeof(command_t));
+            size_t seq = 0;
+            while (seq < state->num_pushes) {
+                size_t num_commands = state->num_pushes - seq;
+                if (num_commands > batch_len) num_commands = batch_len;
+                for (size_t i = 0; i < num_commands; ++i) {
+                    batch[i] = producer_command(state, seq + i);
+                }
+                seq += command_queue_push_batch(state->queue,
+                                                batch,
+                                                num_commands);
+            }
+            return 0;
+        LOGGED_FUNCTION_END
+    }
+
+    /// Check that concurrent clients are subjected to backpressure and that
+    /// their commands come out in order
+    static void test_concurrent(command_queue_t* queue) {
+        LOGGED_FUNCTION_START("%p", queue)
+            info("Running concurrent command queue unit tests...");
+            producer_state_t states[NUM_PRODUCERS];
+            thrd_t producers[NUM_PRODUCERS];
+            for (size_t id = 0; id < NUM_PRODUCERS; ++id) {
+                states[id] = (producer_state_t){
+                    .queue = queue,
+                    .logger = logger_save_parent(),
+                    .id = id,
+                    .num_pushes = NUM_PUSHES_PER_PRODUCER
+                };
+                exit_on_thread_error(thrd_create(&producers[id],
+                                                 producer_func,
+                                                 &states[id]),
+                                     "Failed to spawn a producer thread");
+            }
+
+            debug("Draining commands as the worker would...");
+            size_t next_seq[NUM_PRODUCERS] = { 0 };
+            size_t num_popped = 0;
+            while (num_popped < NUM_PRODUCERS * NUM_PUSHES_PER_PRODUCER) {
+                command_t command;
+                if (!command_queue_try_pop(queue, &command)) {
+                    thrd_yield();
+                    continue;
+                }
+                const uintptr_t id = (uintptr_t)command.future - 1;
+                ensure_lt((size_t)id, NUM_PRODUCERS);
+                ensure_eq(command.options.send.size, next_seq[id]);
+                ++next_seq[id];
+                ++num_popped;
+            }
+
+            debug("Waiting for clients to exit...");
+            for (size_t id = 0; id < NUM_PRODUCERS; ++id) {
+                int result;
+                exit_on_thread_error(thrd_join(producers[id], &result),
+                                     "Failed to join a producer thread");
+                ensure_eq(result, 0);
+                ensure_eq(next_seq[id], NUM_PUSHES_PER_PRODUCER);
+            }
+            command_t command;
+            ensure(!command_queue_try_pop(queue, &command));
+            ensure_eq(atomic_load(&queue->num_waiting_clients), (size_t)0);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Consumer of concurrent command stealing tests
+    ///
+    /// The owner of the queue pops commands while a thief steals them. Each
+    /// records which commands it got, and checks that it gets the commands
+    /// from each client in order.
+    typedef struct steal_consumer_s {
+        command_queue_t* queue;
+        logger_parent_state_t logger;
+        atomic_size_t* num_consumed;
+        bool thief;
+        bool consumed[NUM_PRODUCERS][NUM_PUSHES_PER_PRODUCER];
+    } steal_consumer_t;
+
+    /// Consumer loop of concurrent command stealing tests
+    static void steal_consumer_run(steal_consumer_t* state) {
+        LOGGED_FUNCTION_START("%p", state)
+            size_t next_min_seq[NUM_PRODUCERS] = { 0 };
+            const size_t num_commands = NUM_PRODUCERS * NUM_PUSHES_PER_PRODUCER;
+            while (atomic_load_explicit(state->num_consumed,
+                                        memory_order_relaxed) < num_commands) {
+                command_t command;
+                const bool success =
+                    state->thief ? command_queue_try_steal(state->queue,
+                                                           &command)
+                                 : command_queue_try_pop(state->queue,
+                                                         &command);
+                if (!success) {
+                    thrd_yield();
+                    continue;
+                }
+                const uintptr_t id = (uintptr_t)command.future - 1;
+                ensure_lt((size_t)id, NUM_PRODUCERS);
+                const size_t seq = command.options.send.size;
+                ensure_lt(seq, NUM_PUSHES_PER_PRODUCER);
+                ensure_ge(seq, next_min_seq[id]);
+                next_min_seq[id] = seq + 1;
+                state->consumed[id][seq] = true;
+                atomic_fetch_add_explicit(state->num_consumed,
+                                          1,
+                                          memory_order_relaxed);
+            }
+        LOGGED_FUNCTION_END
+    }
+
+    /// Thread running steal_consumer_run() as a thief
+    static int thief_func(void* context) {
+        steal_consumer_t* const state = (steal_consumer_t*)context;
+        logger_init_child(&state->logger);
+        LOGGED_FUNCTION_START("%p", context)
+            steal_consumer_run(state);
+            return 0;
+        LOGGED_FUNCTION_END
+    }
+
+    /// Check that a worker and a thief that concurrently take commands out of
+    /// a queue get each command exactly once
+    static void test_concurrent_steal(command_queue_t* queue) {
+        LOGGED_FUNCTION_START("%p", queue)
+            info("Running concurrent command stealing unit tests...");
+            atomic_size_t num_consumed;
+            atomic_init(&num_consumed, 0);
+            steal_consumer_t* const consumers =
+                realtime_allocate(2 * sizeof(steal_consumer_t));
+            for (size_t i = 0; i < 2; ++i) {
+                consumers[i] = (steal_consumer_t){
+                    .queue = queue,
+                    .logger = logger_save_parent(),
+                    .num_consumed = &num_consumed,
+                    .thief = (i == 1)
+                };
+            }
+            thrd_t thief;
+            exit_on_thread_error(thrd_create(&thief, thief_func, &consumers[1]),
+                                 "Failed to spawn the thief thread");
+
+            producer_state_t states[NUM_PRODUCERS];
+            thrd_t producers[NUM_PRODUCERS];
+            for (size_t id = 0; id < NUM_PRODUCERS; ++id) {
+                states[id] = (producer_state_t){
+                    .queue = queue,
+                    .logger = logger_save_parent(),
+                    .id = id,
+                    .num_pushes = NUM_PUSHES_PER_PRODUCER
+                };
+                exit_on_thread_error(thrd_create(&producers[id],
+                                                 producer_func,
+                                                 &states[id]),
+                                     "Failed to spawn a producer thread");
+            }
+
+            debug("Competing with the thief for commands...");
+            steal_consumer_run(&consumers[0]);
+
+            debug("Waiting for other threads to exit...");
+            int result;
+            exit_on_thread_error(thrd_join(thief, &result),
+                                 "Failed to join the thief thread");
+            ensure_eq(result, 0);
+            for (size_t id = 0; id < NUM_PRODUCERS; ++id) {
+                exit_on_thread_error(thrd_join(producers[id], &result),
+                                     "Failed to join a producer thread");
+                ensure_eq(result, 0);
+            }
+
+            debug("Checking that each command was consumed exactly once...");
+            for (size_t id = 0; id < NUM_PRODUCERS; ++id) {
+                for (size_t seq = 0; seq < NUM_PUSHES_PER_PRODUCER; ++seq) {
+                    ensure_ne(consumers[0].consumed[id][seq],
+                              consumers[1].consumed[id][seq]);
+                }
+            }
+            command_t command;
+            ensure(!command_queue_try_pop(queue, &command));
+            ensure_eq(atomic_load(&queue->num_waiting_clients), (size_t)0);
+            realtime_liberate(consumers, 2 * sizeof(steal_consumer_t));
+        LOGGED_FUNCTION_END
+    }
+
+    /// Consumer of the command stealing stress test
+    ///
+    /// Every command that it gets is completed by incrementing the completion
+    /// counter that its future points to.
+    typedef struct stress_consumer_s {
+        command_queue_t* queue;
+        logger_parent_state_t logger;
+        atomic_size_t* num_consumed;
+        size_t num_commands;
+        bool thief;
+    } stress_consumer_t;
+
+    /// Consumer loop of the command stealing stress test
+    static void stress_consumer_run(stress_consumer_t* state) {
+        LOGGED_FUNCTION_START("%p", state)
+            while (atomic_load_explicit(state->num_consumed,
+                                        memory_order_relaxed)
+                   < state->num_commands) {
+                command_t command;
+                const bool success =
+                    state->thief ? command_queue_try_steal(state->queue,
+                                                           &command)
+                                 : command_queue_try_pop(state->queue,
+                                                         &command);
+                if (!success) {
+                    thrd_yield();
+                    continue;
+                }
+                atomic_fetch_add_explicit((atomic_uint*)command.future,
+                                          1,
+                                          memory_order_relaxed);
+                atomic_fetch_add_explicit(state->num_consumed,
+                                          1,
+                                          memory_order_relaxed);
+            }
+        LOGGED_FUNCTION_END
+    }
+
+    /// Thread running stress_consumer_run() as a thief
+    static int stress_thief_func(void* context) {
+        stress_consumer_t* const state = (stress_consumer_t*)context;
+        logger_init_child(&state->logger);
+        LOGGED_FUNCTION_START("%p", context)
+            stress_consumer_run(state);
+            return 0;
+        LOGGED_FUNCTION_END
+    }
+
+    /// Check that every command is completed exactly once when clients push
+    /// commands continuously while a worker pops them and a thief steals them
+    static void test_steal_stress(command_queue_t* queue) {
+        LOGGED_FUNCTION_START("%p", queue)
+            info("Running command stealing stress test...");
+            const size_t num_commands =
+                NUM_PRODUCERS * NUM_STRESS_PUSHES_PER_PRODUCER;
+            atomic_uint* const completions =
+                realtime_allocate(num_commands * sizeof(atomic_uint));
+            for (size_t i = 0; i < num_commands; ++i) {
+                atomic_init(&completions[i], 0);
+            }
+            atomic_size_t num_consumed;
+            atomic_init(&num_consumed, 0);
+            stress_consumer_t consumers[2];
+            for (size_t i = 0; i < 2; ++i) {
+                consumers[i] = (stress_consumer_t){
+                    .queue = queue,
+                    .logger = logger_save_parent(),
+                    .num_consumed = &num_consumed,
+                    .num_commands = num_commands,
+                    .thief = (i == 1)
+                };
+            }
+            thrd_t thief;
+            exit_on_thread_error(thrd_create(&thief,
+                                             stress_thief_func,
+                                             &consumers[1]),
+                                 "Failed to spawn the thief thread");
+
+            producer_state_t states[NUM_PRODUCERS];
+            thrd_t producers[NUM_PRODUCERS];
+            for (size_t id = 0; id < NUM_PRODUCERS; ++id) {
+                states[id] = (producer_state_t){
+                    .queue = queue,
+                    .logger = logger_save_parent(),
+                    .id = id,
+                    .num_pushes = NUM_STRESS_PUSHES_PER_PRODUCER,
+                    .completions = completions
+                };
+                exit_on_thread_error(thrd_create(&producers[id],
+                                                 producer_func,
+                                                 &states[id]),
+                                     "Failed to spawn a producer thread");
+            }
+
+            debug("Competing with the thief for commands...");
+            stress_consumer_run(&consumers[0]);
+
+            debug("Waiting for other threads to exit...");
+            int result;
+            exit_on_thread_error(thrd_join(thief, &result),
+                                 "Failed to join the thief thread");
+            ensure_eq(result, 0);
+            for (size_t id = 0; id < NUM_PRODUCERS; ++id) {
+                exit_on_thread_error(thrd_join(producers[id], &result),
+                                     "Failed to join a producer thread");
+                ensure_eq(result, 0);
+            }
+
+            debug("Checking that each command was completed exactly once...");
+            ensure_eq(atomic_load(&num_consumed), num_commands);
+            for (size_t i = 0; i < num_commands; ++i) {
+                ensure_eq(atomic_load(&completions[i]), 1u);
+            }
+            command_t command;
+            ensure(!command_queue_try_pop(queue, &command));
+            ensure_eq(atomic_load(&queue->num_waiting_clients), (size_t)0);
+            realtime_liberate(completions, num_commands * sizeof(atomic_uint));
+        LOGGED_FUNCTION_END
+    }
+
+    void command_unit_tests() {
+        LOGGED_FUNCTION_START_NO_PARAMS
+            info("Running command queue unit tests...");
+            command_queue_t* const queue =
+                realtime_allocate(sizeof(command_queue_t));
+            command_queue_initialize(queue);
+
+            test_sequential(queue);
+            test_concurrent(queue);
+            test_sequential_steal(queue);
+            test_concurrent_steal(queue);
+            test_steal_stress(queue);
+
+            command_queue_finalize(queue);
+            realtime_liberate(queue, sizeof(command_queue_t));
+        LOGGED_FUNCTION_END
+    }
+
+#endif  // UDIPE_BUILD_TESTS
+
+
+#ifdef UDIPE_BUILD_BENCHMARKS
+
+    /// Warmup duration of command queue microbenchmarks
+    //
+    // TODO: Tune on more systems
+    #define QUEUE_BENCH_WARMUP  (500*UDIPE_MILLISECOND)
+
+    /// Number of timed runs of command queue microbenchmarks
+    //
+    // TODO: Tune on more systems
+    #define QUEUE_BENCH_NRUNS  ((size_t)64*1024)
+
+    /// State shared by command queue microbenchmarks
+    typedef struct queue_bench_s {
+        /// Command queue under study
+        command_queue_t* queue;
+
+        /// Logger configuration propagated to the consumer thread
+        logger_parent_state_t logger;
+
+        /// Truth that the consumer thread should exit
+        atomic_bool stop;
+    } queue_bench_t;
+
+    /// Submit a command, then fetch it back from the same thread
+    ///
+    /// This measures the uncontended cost of the queue operations themselves.
+    static void push_pop_same_thread(void* context) {
+        queue_bench_t* const bench = (queue_bench_t*)context;
+        const command_t command = { .future = (udipe_future_t*)bench };
+        command_queue_push(bench->queue, &command);
+        command_t popped;
+        const bool success = command_queue_try_pop(bench->queue, &popped);
+        assert(success);
+        UDIPE_ASSUME_READ(popped.future);
+    }
+
+    /// Submit a command, then wait for a spinning consumer thread to fetch it
+    ///
+    /// This measures the client-to-worker handoff latency when the worker is
+    /// actively polling its queue, which is the best case for the worker.
+    static void push_cross_thread(void* context) {
+        queue_bench_t* const bench = (queue_bench_t*)context;
+        const command_t command = { .future = (udipe_future_t*)bench };
+        command_queue_push(bench->queue, &command);
+        const uint64_t client_idx =
+            atomic_load_explicit(&bench->queue->client_idx,
+                                 memory_order_relaxed);
+        while (atomic_load_explicit(&bench->queue->worker_idx,
+                                    memory_order_acquire) != client_idx) {
+            thrd_yield();
+        }
+    }
+
+    /// Consumer thread of push_cross_thread()
+    static int spinning_consumer(void* context) {
+        queue_bench_t* const bench = (queue_bench_t*)context;
+        logger_init_child(&bench->logger);
+        LOGGED_FUNCTION_START("%p", context)
+            while (!atomic_load_explicit(&bench->stop, memory_order_relaxed)) {
+                command_t command;
+                if (!command_queue_try_pop(bench->queue, &command)) {
+                    thrd_yield();
+                }
+            }
+            return 0;
+        LOGGED_FUNCTION_END
+    }
+
+    /// Measure a command queue workload and log the resulting statistics
+    UDIPE_NON_NULL_ARGS
+    static void measure_workload(udipe_benchmark_t* benchmark,
+                                 const char title[],
+                                 void (*workload)(void*),
+                                 queue_bench_t* bench) {
+        LOGGED_FUNCTION_START("%p, \"%s\", %p, %p",
+                              benchmark, title, workload, bench)
+            benchmark_clock_t* const bclock = &benchmark->bclock;
+            distribution_builder_t builder =
+                distribution_pool_request(&bclock->distribution_pool);
+            distribution_t durations = os_clock_measure(&bclock->os,
+                                                        workload,
+                                                        bench,
+                                                        QUEUE_BENCH_WARMUP,
+                                                        QUEUE_BENCH_NRUNS,
+                                                        &bclock->outlier_filter,
+                                                        &builder);
+            const statistics_t stats = analyzer_apply(&bclock->analyzer,
+                                                      &durations);
+            log_statistics(UDIPE_INFO, title, "  -", stats, "ns");
+            distribution_pool_recycle(&bclock->distribution_pool, &durations);
+        LOGGED_FUNCTION_END
+    }
+
+    UDIPE_NON_NULL_SPECIFIC_ARGS(2)
+    void command_micro_benchmarks(void* context, udipe_benchmark_t* benchmark) {
+        LOGGED_FUNCTION_START("%p, %p", context, benchmark)
+            debug("Setting up a command queue...");
+            queue_bench_t bench = {
+                .queue = realtime_allocate(sizeof(command_queue_t)),
+                .logger = logger_save_parent()
+            };
+            atomic_init(&bench.stop, false);
+            command_queue_initialize(bench.queue);
+
+            measure_workload(benchmark,
+                             "Command queue push + pop on the same thread",
+                             push_pop_same_thread,
+                             &bench);
+
+            debug("Spawning a consumer thread...");
+            thrd_t consumer;
+            exit_on_thread_error(thrd_create(&consumer,
+                                             spinning_consumer,
+                                             &bench),
+                                 "Failed to spawn the consumer thread");
+            measure_workload(benchmark,
+                             "Command queue handoff to a polling consumer",
+                             push_cross_thread,
+                             &bench);
+            atomic_store_explicit(&bench.stop, true, memory_order_relaxed);
+            int result;
+            exit_on_thread_error(thrd_join(consumer, &result),
+                                 "Failed to join the consumer thread");
+            ensure_eq(result, 0);
+
+            debug("Tearing down the command queue...");
+            command_queue_finalize(bench.queue);
+            realtime_liberate(bench.queue, sizeof(command_queue_t));
+        LOGGED_FUNCTION_END
+    }
+
+#endif  // UDIPE_BUILD_BENCHMARKS
@@ -11,6 +11,8 @@
 
 #include <udipe/command.h>
 #include <udipe/future.h>
+#include <udipe/nodiscard.h>
+#include <udipe/pointer.h>
 
 #include "arch.h"
 #include "connect.h"
@@ -18,7 +20,9 @@
 #include <assert.h>
 #include <stdalign.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <threads.h>
 
 
@@ -39,7 +43,7 @@
 ///   submitted by the same client thread in quick successions is not a goal.
 /// - Each command may be submitted by a different client thread and, by the
 ///   above observation, should therefore be written to its own false sharing
-///   granule.
+///   granule, see \ref command_slot_t.
 /// - To maximize worker thread performance, the control block that multiple
 ///   client threads use to decide which client will send the next command, for
 ///   which there may be arbitrarily high cache contention, should be distinct
@@ -52,9 +56,6 @@
 ///   capacity by half).
 #define COMMAND_QUEUE_LEN (EXPECTED_MIN_PAGE_SIZE/FALSE_SHARING_GRANULARITY - 2)
 
-// TODO: Also plan ahead a "shut down now" signal, but it should bypass
-//       normal FIFO queuing. Maybe cross-thread SIGTERM would be fine here?
-
 /// Worker thread command
 ///
 /// This is a complete worker thread command, which tells a worker thread about
@@ -63,38 +64,80 @@
 /// \internal
 ///
 /// This struct should strive to stay smaller than the cache line size of all
-/// supported CPU architectures. As of 2025, all high-performance CPU
-/// architectures have a cache line size of 64B or larger.
+/// supported CPU architectures, along with the sequence number of its \ref
+/// command_slot_t. As of 2025, all high-performance CPU architectures have a
+/// cache line size of 64B or larger.
 typedef struct command_s {
     /// Parameters that are appropriate for this command type
     ///
     /// The value of `id` indicates which of this union's variants is valid.
-    alignas(FALSE_SHARING_GRANULARITY) union {
+    union {
         udipe_connect_options_t* connect;
         udipe_disconnect_options_t disconnect;
-        // TODO: Add and implement
-        /*udipe_send_options_t send;
-        udipe_recv_options_t recv;*/
+        udipe_send_options_t send;
+        udipe_recv_options_t recv;
+        udipe_recv_stream_options_t recv_stream;
+        udipe_send_stream_options_t send_stream;
     } options;
 
     /// Result future, to be filled up and signaled upon command completion
     ///
     /// Also indicates what kind of command you are dealing with.
     ///
-    /// This pointer cannot be `NULL`.
+    /// This pointer is only `NULL` for commands whose cancelation was
+    /// acknowledged by the worker thread while they were queued, see
+    /// worker_cancel(). The worker thread then ignores them.
     udipe_future_t* future;
 
-    // TODO: Consider some kind of QoS infrastructure so that e.g. IPBus slow
-    //       control avoids using the same threads as acquisition. Can this just
-    //       be a connection option, or does it need to be more?
+    /// Truth that this command may be processed by a worker other than the one
+    /// it was submitted to, see command_queue_try_steal()
+    ///
+    /// This is only set for send commands targeting connections with \ref
+    /// udipe_connect_options_t::enable_send_stealing.
+    bool stealable;
 } command_t;
-static_assert(alignof(command_t) == FALSE_SHARING_GRANULARITY,
-              "Each command may originate from a different client thread and "
-              "should therefore be stored in its own false sharing granule");
-static_assert(sizeof(command_t) == FALSE_SHARING_GRANULARITY,
+
+/// \ref command_slot_t::sequence flag indicating that the slot holds a
+/// command which has not been taken out of the queue yet
+#define COMMAND_SLOT_FULL ((uint64_t)1 << 0)
+
+/// \ref command_slot_t::sequence flag indicating that the command held by
+/// the slot is \ref command_t::stealable
+#define COMMAND_SLOT_STEALABLE ((uint64_t)1 << 1)
+
+/// Number of low-order bits of \ref command_slot_t::sequence that are used
+/// by flags, the remaining bits being used by a queue position
+#define COMMAND_SLOT_FLAG_BITS 2
+
+/// Command queue slot
+///
+/// This is one entry of the ring buffer of a \ref command_queue_t, which holds
+/// a command along with a sequence number that lets threads tell which
+/// position of the queue the slot currently stands for.
+///
+/// \internal
+///
+/// The sequence number follows the design of Dmitry Vyukov's bounded MPMC
+/// queue: if the slot stands for queue position `pos`, its sequence number is
+/// `pos << COMMAND_SLOT_FLAG_BITS` while the slot is free for a client to write
+/// the command at position `pos`, and this plus \ref COMMAND_SLOT_FULL (and
+/// \ref COMMAND_SLOT_STEALABLE if applicable) once said command is published.
+/// After a worker has taken the command out of the queue and copied it, it
+/// releases the slot to clients by setting the sequence number to that of
+/// position `pos + COMMAND_QUEUE_LEN`. Because queue positions are 64-bit and
+/// never wrap around in practice, a worker cannot mistake a reused slot for
+/// the one it was looking for.
+typedef struct command_slot_s {
+    /// Sequence number, see above
+    alignas(FALSE_SHARING_GRANULARITY) _Atomic uint64_t sequence;
+
+    /// Command, which is only valid while \ref COMMAND_SLOT_FULL is set
+    command_t command;
+} command_slot_t;
+static_assert(sizeof(command_slot_t) == FALSE_SHARING_GRANULARITY,
               "Shouldn't need more than one false sharing granule per command");
 static_assert(
-    offsetof(command_t, future) + sizeof(udipe_future_t*) <= CACHE_LINE_SIZE,
+    offsetof(command_slot_t, command) + sizeof(command_t) <= CACHE_LINE_SIZE,
     "Should fit on a single cache line for optimal memory access performance "
     "on CPUs where the FALSE_SHARING_GRANULARITY upper bound is pessimistic"
 );
@@ -112,24 +155,25 @@ static_assert(
 /// This struct is designed such that it fills up one small memory page (4KiB on
 /// x86_64). The idea is that the command queue for each thread can be located
 /// within one mmap()-allocated and mlock()ed block allocated by this thread.
-//
-// TODO: Figure out how the address of the command queue is passed back to the
-//       main thread once this is done. Could just be a matter of filling up an
-//       array in the udipe_context_t, decrementing an atomic each time, and
-//       signaling a global futex once this is done.
 typedef struct command_queue_s {
     // === First control block for worker/client synchronization ===
 
-    /// Index within \link #command_queue_t::commands `commands`\endlink from
-    /// which the worker thread will read next
-    alignas(FALSE_SHARING_GRANULARITY) atomic_size_t worker_idx;
+    /// Position of the next command that a worker thread will take out of the
+    /// queue
+    ///
+    /// Positions increase monotonically and are only reduced modulo \ref
+    /// COMMAND_QUEUE_LEN when indexing \link #command_queue_t::commands
+    /// `commands`\endlink. This is normally only advanced by the worker
+    /// thread, but other worker threads may also advance it when they steal
+    /// commands, see command_queue_try_steal().
+    alignas(FALSE_SHARING_GRANULARITY) _Atomic uint64_t worker_idx;
 
-    /// Index within \link #command_queue_t::commands `commands`\endlink to
-    /// which client threads will write next
+    /// Position of the next command that a client thread will submit
     ///
     /// If this is equal to \link #command_queue_t::worker_idx
-    /// `worker_idx`\endlink, then the queue is empty.
-    atomic_size_t client_idx;
+    /// `worker_idx`\endlink, then the queue is empty. If it exceeds
+    /// `worker_idx` by \ref COMMAND_QUEUE_LEN, then the queue is full.
+    _Atomic uint64_t client_idx;
 
     /// Condition variable that client threads use to wait for the worker thread
     /// to process some commands
@@ -138,6 +182,15 @@ typedef struct command_queue_s {
     /// thundering herd effect.
     cnd_t client_condition;
 
+    /// Number of client threads that are waiting on \link
+    /// #command_queue_t::client_condition `client_condition`\endlink, or
+    /// about to do so
+    ///
+    /// This lets the worker thread skip signaling `client_condition`, which
+    /// requires locking `client_mutex`, in the common case where the queue is
+    /// not full and no client thread is waiting.
+    atomic_size_t num_waiting_clients;
+
     // === Second control block for client/client synchronization ===
 
     /// Mutex that a client thread must lock to submit commands
@@ -153,10 +206,10 @@ typedef struct command_queue_s {
 
     /// Ring buffer that holds commands destined for worker thread processing
     ///
-    /// The first control block indicates which entries from this array can be
-    /// read by the worker thread and which can safely be overwritten by client
-    /// threads then published through a `client_idx` increment.
-    command_t commands[COMMAND_QUEUE_LEN];
+    /// The first control block indicates how many commands are queued, while
+    /// the sequence number of each slot tells whether it can be read by a
+    /// worker thread or safely overwritten by a client thread.
+    command_slot_t commands[COMMAND_QUEUE_LEN];
 } command_queue_t;
 static_assert(alignof(command_queue_t) == FALSE_SHARING_GRANULARITY,
               "Should be a normal consequence of alignment directives, "
@@ -167,7 +220,240 @@ static_assert(sizeof(command_queue_t) > EXPECTED_MIN_PAGE_SIZE/2,
 static_assert(sizeof(command_queue_t) <= EXPECTED_MIN_PAGE_SIZE,
               "Should not use more than a page (otherwise size should shrink)");
 
-// TODO: Add queue operations
+/// Set up a command queue
+///
+/// The queue is initially empty. It must later be destroyed using
+/// command_queue_finalize().
+///
+/// This function must be called within a logging scope.
+///
+/// \param queue must point to uninitialized storage for a command queue.
+UDIPE_NON_NULL_ARGS
+void command_queue_initialize(command_queue_t* queue);
+
+/// Submit a command to a worker thread's command queue
+///
+/// If the queue is full, this function blocks until the worker thread has
+/// processed some commands, thusly enforcing backpressure. It is the
+/// responsibility of the caller to wake up the worker thread afterwards.
+///
+/// This function must be called within a logging scope.
+///
+/// \param queue must be a command queue that was set up with
+///              command_queue_initialize() and hasn't been destroyed with
+///              command_queue_finalize() yet.
+/// \param command is the command that should be submitted. Its future must
+///                have been allocated with future_network_allocate().
+UDIPE_NON_NULL_ARGS
+void command_queue_push(command_queue_t* queue, const command_t* command);
+
+/// Submit several commands to a worker thread's command queue
+///
+/// This is a batched version of command_queue_push(), which only needs to
+/// acquire the client side of the queue once per call and publishes commands
+/// to the worker thread in as few atomic operations as possible.
+///
+/// To avoid deadlocks, this function never blocks after publishing some
+/// commands: as soon as the queue is full, it returns, and the caller must
+/// wake up the worker thread before submitting the remaining commands with
+/// another call. It does, however, block until at least one queue slot is free
+/// if the queue is full on entry, thusly enforcing backpressure.
+///
+/// This function must be called within a logging scope.
+///
+/// \param queue must be a command queue that was set up with
+///              command_queue_initialize() and hasn't been destroyed with
+///              command_queue_finalize() yet.
+/// \param commands is an array of `num_commands` commands that should be
+///                 submitted in order. Their futures must have been allocated
+///                 with future_network_allocate().
+/// \param num_commands is the number of commands within `commands`. It must
+///                     not be zero.
+///
+/// \returns the number of commands from the start of `commands` that were
+///          submitted, which is between 1 and `num_commands`.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+size_t command_queue_push_batch(command_queue_t* queue,
+                                const command_t commands[],
+                                size_t num_commands);
+
+/// Fetch the oldest command from a worker thread's command queue, if any
+///
+/// This function must only be called by the worker thread that owns `queue`,
+/// within a logging scope. Other worker threads may concurrently call
+/// command_queue_try_steal().
+///
+/// \param queue must be a command queue that was set up with
+///              command_queue_initialize() and hasn't been destroyed with
+///              command_queue_finalize() yet.
+/// \param command must point to storage where the oldest command will be
+///                written, if there is one.
+///
+/// This function is lock-free, unless a client thread is blocked waiting for a
+/// free queue slot, in which case `client_mutex` must be briefly locked in
+/// order to wake it up.
+///
+/// \returns `true` if a command was written to `command`, `false` if the
+///          queue was empty.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+bool command_queue_try_pop(command_queue_t* queue, command_t* command);
+
+/// Truth that a worker thread's command queue is empty
+///
+/// This is cheaper than command_queue_try_pop(), and is used by worker threads
+/// to watch for new commands while they spin, see \ref
+/// udipe_worker_config_t::idle_spin.
+///
+/// This function must only be called by the worker thread that owns `queue`.
+///
+/// \param queue must be a command queue that was set up with
+///              command_queue_initialize() and hasn't been destroyed with
+///              command_queue_finalize() yet.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static inline bool command_queue_empty(command_queue_t* queue) {
+    const uint64_t worker_idx = atomic_load_explicit(&queue->worker_idx,
+                                                   memory_order_relaxed);
+    return atomic_load_explicit(&queue->client_idx, memory_order_acquire)
+           == worker_idx;
+}
+
+/// Approximate number of commands within a command queue
+///
+/// This is used to balance load across worker threads. The result may be
+/// outdated by the time it is returned, as clients and workers may
+/// concurrently push and pop commands.
+///
+/// This function may be called by any thread.
+///
+/// \param queue must be a command queue that was set up with
+///              command_queue_initialize() and hasn't been destroyed with
+///              command_queue_finalize() yet.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static inline size_t command_queue_len(command_queue_t* queue) {
+    // Workers may take a command out of the queue before the client_idx
+    // update that published it becomes visible, and either index may be
+    // outdated by the time the other is loaded, so the difference is clamped
+    // to the range of valid queue lengths.
+    const uint64_t worker_idx = atomic_load_explicit(&queue->worker_idx,
+                                                     memory_order_acquire);
+    const uint64_t client_idx = atomic_load_explicit(&queue->client_idx,
+                                                     memory_order_acquire);
+    if (client_idx <= worker_idx) return 0;
+    const uint64_t len = client_idx - worker_idx;
+    return (len > COMMAND_QUEUE_LEN) ? COMMAND_QUEUE_LEN : (size_t)len;
+}
 
+/// Access a command within a command queue without taking it out
+///
+/// This lets a worker thread find commands that were canceled while they were
+/// queued, see worker_cancel(). Commands may be modified in place, e.g. to turn
+/// them into no-ops, but only while other worker threads are kept from
+/// stealing them, see \ref worker_t::stealing. Modifying \ref
+/// command_t::stealable has no effect, as stealability is recorded in the
+/// \ref command_slot_t::sequence when the command is submitted.
+///
+/// This function must only be called by the worker thread that owns `queue`.
+///
+/// \param queue must be a command queue that was set up with
+///              command_queue_initialize() and hasn't been destroyed with
+///              command_queue_finalize() yet.
+/// \param pos is the position of the command within the queue, where 0
+///            designates the oldest command.
+///
+/// \returns the command at position `pos`, or `NULL` if there are not that
+///          many commands within the queue.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static inline command_t* command_queue_peek(command_queue_t* queue,
+                                            size_t pos) {
+    const uint64_t worker_idx = atomic_load_explicit(&queue->worker_idx,
+                                                     memory_order_relaxed);
+    const uint64_t client_idx = atomic_load_explicit(&queue->client_idx,
+                                                     memory_order_acquire);
+    if (pos >= client_idx - worker_idx) return NULL;
+    return &queue->commands[(worker_idx + pos) % COMMAND_QUEUE_LEN].command;
+}
 
-// TODO: Add unit tests
+/// Truth that the oldest command within a command queue is \ref
+/// command_t::stealable
+///
+/// This lets a loaded worker thread check if sibling workers could help it.
+///
+/// This function must only be called by the worker thread that owns `queue`.
+///
+/// \param queue must be a command queue that was set up with
+///              command_queue_initialize() and hasn't been destroyed with
+///              command_queue_finalize() yet.
+///
+/// \returns `false` if the queue is empty or its oldest command cannot be
+///          stolen, `true` otherwise.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static inline bool command_queue_next_stealable(command_queue_t* queue) {
+    const uint64_t worker_idx = atomic_load_explicit(&queue->worker_idx,
+                                                     memory_order_relaxed);
+    const uint64_t sequence = atomic_load_explicit(
+        &queue->commands[worker_idx % COMMAND_QUEUE_LEN].sequence,
+        memory_order_relaxed
+    );
+    return sequence == ((worker_idx << COMMAND_SLOT_FLAG_BITS)
+                        | COMMAND_SLOT_FULL
+                        | COMMAND_SLOT_STEALABLE);
+}
+
+/// Fetch the oldest command from another worker thread's command queue, if it
+/// is \ref command_t::stealable
+///
+/// This lets an idle worker thread take over work from a loaded one. Commands
+/// that are not stealable are left in the queue, and so are the commands that
+/// follow them, since commands must be taken out of the queue in order.
+///
+/// This function may be called by any worker thread, within a logging scope.
+///
+/// \param queue must be a command queue that was set up with
+///              command_queue_initialize() and hasn't been destroyed with
+///              command_queue_finalize() yet.
+/// \param command must point to storage where the oldest command will be
+///                written, if it can be stolen.
+///
+/// \returns `true` if a command was written to `command`, `false` if the
+///          queue was empty or its oldest command cannot be stolen.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+bool command_queue_try_steal(command_queue_t* queue, command_t* command);
+
+/// Destroy a command queue
+///
+/// This function must be called within a logging scope.
+///
+/// \param queue must be an empty command queue that was set up with
+///              command_queue_initialize() and hasn't been destroyed with
+///              command_queue_finalize() yet. It cannot be used after calling
+///              this function.
+UDIPE_NON_NULL_ARGS
+void command_queue_finalize(command_queue_t* queue);
+
+
+#ifdef UDIPE_BUILD_TESTS
+    /// Unit tests for the command queue
+    ///
+    /// This function runs the unit tests for the command queue. It must be
+    /// called within a logging scope.
+    void command_unit_tests();
+#endif
+
+#ifdef UDIPE_BUILD_BENCHMARKS
+    #include <udipe/benchmark.h>
+
+    /// Microbenchmarks for the command queue
+    ///
+    /// This measures the latency of command submission, which sets a lower
+    /// bound on the latency of every `libudipe` command. It must be called by
+    /// udipe_benchmark_run(), see \ref udipe_benchmark_runnable_t.
+    UDIPE_NON_NULL_SPECIFIC_ARGS(2)
+    void command_micro_benchmarks(void* context, udipe_benchmark_t* benchmark);
+#endif
@@ -0,0 +1,965 @@
+#include "connection.h"
+
+#include <udipe/nodiscard.h>
+
+#include "error.h"
+#include "log.h"
+#include "visibility.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+    #include <linux/filter.h>
+    #include <linux/net_tstamp.h>
+    #include <netinet/in.h>
+    #include <netinet/udp.h>
+    #include <sys/socket.h>
+    #include <unistd.h>
+#endif
+
+
+/// Duration for which the kernel may busy-poll the network interface when
+/// the socket of a busy-polled connection is read, in microseconds
+///
+/// Worker threads read these sockets without blocking, in which case the
+/// kernel polls the network interface once per read, so this mainly needs to
+/// be nonzero. The value matches the `net.core.busy_read` setting that the
+/// kernel documentation suggests.
+#define BUSY_POLL_USECS 50
+
+/// Maximal number of packets that the kernel processes per busy-poll of the
+/// network interface
+///
+/// This matches the default NAPI budget of Linux network drivers.
+#define BUSY_POLL_BUDGET 64
+
+/// Smallest send buffer size that can be requested, in bytes
+///
+#define MIN_SEND_BUFFER 1024
+
+/// Smallest receive buffer size that can be requested, in bytes
+///
+#define MIN_RECV_BUFFER 128
+
+/// Worker loop latency that automatic receive buffer sizing assumes at least
+///
+/// Worker threads that were just started have not been interrupted for long
+/// yet, but they will eventually be, e.g. by the operating system scheduler
+/// whose time slices are a few milliseconds long. See \ref
+/// udipe_connect_options_t::recv_rate.
+#define AUTO_RECV_BUFFER_MIN_LATENCY (10 * UDIPE_MILLISECOND)
+
+/// Safety factor that automatic receive buffer sizing applies
+///
+/// The longest worker loop latency observed so far is only a lower bound of
+/// the actual worst case, and traffic may be burstier than its average rate.
+#define AUTO_RECV_BUFFER_MARGIN 2
+
+/// Size of the `sockaddr` struct associated with an address family
+///
+/// \param family must be `AF_INET` or `AF_INET6`
+///
+/// \returns the size of the matching `sockaddr_in` or `sockaddr_in6`
+UDIPE_NODISCARD
+static inline socklen_t address_size(sa_family_t family) {
+    switch (family) {
+    case AF_INET:
+        return sizeof(struct sockaddr_in);
+    case AF_INET6:
+        return sizeof(struct sockaddr_in6);
+    default:
+        assert(("Only IPv4 and IPv6 addresses are supported", false));
+        return 0;
+    }
+}
+
+/// Check that a user-provided IP address is usable
+///
+/// \param address is the address to be checked
+///
+/// \returns true if the address is either a default address or a valid IPv4 or
+///          IPv6 address, false otherwise.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static inline bool address_family_ok(const ip_address_t* address) {
+    switch (address->any.sa_family) {
+    case 0:
+    case AF_INET:
+    case AF_INET6:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/// Check the consistency of connection options
+///
+/// This function must be called within a logging scope.
+///
+/// \param options must point to the connection options that were sent by the
+///                client thread.
+///
+/// \returns 0 if the options are valid, otherwise `EINVAL`.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static int check_options(const udipe_connect_options_t* options) {
+    LOGGED_FUNCTION_START("%p", options)
+        debug("Checking reserved fields...");
+        if (options->reserved) {
+            warn("Reserved connection options should not be set!");
+            return EINVAL;
+        }
+
+        debug("Checking direction-specific parameters...");
+        switch (options->direction) {
+        case UDIPE_IN:
+            if (options->send_timeout != UDIPE_DURATION_DEFAULT) {
+                warn("send_timeout should not be set on an input connection!");
+                return EINVAL;
+            }
+            if (options->send_buffer != 0) {
+                warn("send_buffer should not be set on an input connection!");
+                return EINVAL;
+            }
+            if (options->gso_segment_size != 0) {
+                warn("gso_segment_size should not be set on an input "
+                     "connection!");
+                return EINVAL;
+            }
+            if (options->enable_zerocopy) {
+                warn("enable_zerocopy should not be set on an input "
+                     "connection!");
+                return EINVAL;
+            }
+            if (options->pacing_rate != 0) {
+                warn("pacing_rate should not be set on an input connection!");
+                return EINVAL;
+            }
+            if (options->dscp != 0) {
+                warn("dscp should not be set on an input connection!");
+                return EINVAL;
+            }
+            if (options->enable_send_stealing) {
+                warn("enable_send_stealing should not be set on an input "
+                     "connection!");
+                return EINVAL;
+            }
+            break;
+        case UDIPE_OUT:
+            if (options->recv_timeout != UDIPE_DURATION_DEFAULT) {
+                warn("recv_timeout should not be set on an output connection!");
+                return EINVAL;
+            }
+            if (options->recv_buffer != 0) {
+                warn("recv_buffer should not be set on an output connection!");
+                return EINVAL;
+            }
+            if (options->recv_rate != 0) {
+                warn("recv_rate should not be set on an output connection!");
+                return EINVAL;
+            }
+            if (options->enable_gro) {
+                warn("enable_gro should not be set on an output connection!");
+                return EINVAL;
+            }
+            if (options->enable_timestamps) {
+                warn("enable_timestamps should not be set on an output "
+                     "connection!");
+                return EINVAL;
+            }
+            if (options->enable_busy_poll) {
+                warn("enable_busy_poll should not be set on an output "
+                     "connection!");
+                return EINVAL;
+            }
+            if (options->remote_address.any.sa_family == 0) {
+                warn("remote_address must be set on an output connection!");
+                return EINVAL;
+            }
+            break;
+        case UDIPE_INOUT:
+            if (options->remote_address.any.sa_family == 0) {
+                warn("remote_address must be set on an output connection!");
+                return EINVAL;
+            }
+            break;
+        default:
+            warnf("Invalid connection direction %d!", (int)options->direction);
+            return EINVAL;
+        }
+
+        debug("Checking socket buffer parameters...");
+        if (options->send_buffer != 0
+            && options->send_buffer < MIN_SEND_BUFFER) {
+            warnf("send_buffer should be at least %d bytes!", MIN_SEND_BUFFER);
+            return EINVAL;
+        }
+        if (options->recv_buffer != 0
+            && options->recv_buffer < MIN_RECV_BUFFER) {
+            warnf("recv_buffer should be at least %d bytes!", MIN_RECV_BUFFER);
+            return EINVAL;
+        }
+        if (options->recv_buffer != 0 && options->recv_rate != 0) {
+            warn("recv_buffer and recv_rate should not be set together!");
+            return EINVAL;
+        }
+
+        debug("Checking send stealing parameters...");
+        if (options->enable_send_stealing
+            && (options->enable_zerocopy || options->pacing_rate != 0)) {
+            warn("enable_send_stealing cannot be combined with enable_zerocopy "
+                 "or pacing_rate!");
+            return EINVAL;
+        }
+
+        debug("Checking sharding parameters...");
+        if (options->num_shards > 1) {
+            if (options->direction != UDIPE_IN) {
+                warn("num_shards should only be set on input connections!");
+                return EINVAL;
+            }
+            if (options->remote_address.any.sa_family) {
+                warn("num_shards cannot be combined with a remote_address!");
+                return EINVAL;
+            }
+        }
+
+        if (options->steer_by_cpu && options->num_shards <= 1) {
+            warn("steer_by_cpu should only be set on sharded connections!");
+            return EINVAL;
+        }
+
+        debug("Checking address families...");
+        if (!address_family_ok(&options->local_address)
+            || !address_family_ok(&options->remote_address)) {
+            warn("Only IPv4 and IPv6 addresses are supported!");
+            return EINVAL;
+        }
+        const sa_family_t local_family = options->local_address.any.sa_family;
+        const sa_family_t remote_family = options->remote_address.any.sa_family;
+        if (local_family && remote_family && local_family != remote_family) {
+            warn("local_address and remote_address should be of the same type!");
+            return EINVAL;
+        }
+        return 0;
+    LOGGED_FUNCTION_END
+}
+
+/// Translate `errno` after a failed socket setup operation
+///
+/// Socket setup errors that are caused by the user's configuration or system
+/// state are returned as an error code, while errors that can only be caused
+/// by a `libudipe` bug lead to program exit.
+///
+/// This function must be called within a logging scope.
+///
+/// \param operation is a human-readable name for the operation that failed
+///
+/// \returns the `errno` code that should be reported to the user
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static int socket_setup_error(const char* operation) {
+    LOGGED_FUNCTION_START("%s", operation)
+        const int error = errno;
+        switch (error) {
+        case EBADF:  // Not a valid file descriptor
+        case EFAULT:  // Invalid user memory
+        case ENOTSOCK:  // Not a socket
+            exit_after_c_error("This error is not expected to happen!");
+        default:
+            warnf("Failed to %s: %s.", operation, strerror(error));
+            errno = 0;
+            return error;
+        }
+    LOGGED_FUNCTION_END
+}
+
+/// Ask the kernel to busy-poll the network interface when a socket is read
+///
+/// This is best effort: if the kernel is too old or we lack the required
+/// privileges, a warning is logged and the worker thread will still spin on
+/// the socket, see \ref udipe_connect_options_t::enable_busy_poll.
+///
+/// This function must be called within a logging scope.
+///
+/// \param fd must be a valid UDP socket.
+///
+/// \returns 0 on success or if kernel busy polling is unavailable, otherwise
+///          an `errno` code from socket_setup_error().
+UDIPE_NODISCARD
+static int enable_kernel_busy_poll(fd_t fd) {
+    LOGGED_FUNCTION_START("%d", fd)
+        const struct {
+            int name;
+            int value;
+            const char* operation;
+        } options[] = {
+            { SO_BUSY_POLL, BUSY_POLL_USECS, "enable busy polling" },
+            { SO_PREFER_BUSY_POLL, 1, "prefer busy polling" },
+            { SO_BUSY_POLL_BUDGET, BUSY_POLL_BUDGET, "set busy poll budget" }
+        };
+        for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); ++i) {
+            if (setsockopt(fd,
+                           SOL_SOCKET,
+                           options[i].name,
+                           &options[i].value,
+                           sizeof(int)) == 0) {
+                continue;
+            }
+            switch (errno) {
+            case EPERM:  // Needs CAP_NET_ADMIN beyond net.core.busy_read
+            case ENOPROTOOPT:  // Kernel is too old
+                warnf("Failed to %s: %s. Will only spin on the socket.",
+                      options[i].operation, strerror(errno));
+                errno = 0;
+                return 0;
+            default:
+                return socket_setup_error(options[i].operation);
+            }
+        }
+        return 0;
+    LOGGED_FUNCTION_END
+}
+
+/// Query the size of a socket buffer
+///
+/// This function must be called within a logging scope.
+///
+/// \param fd must be a valid UDP socket.
+/// \param option must be `SO_SNDBUF` or `SO_RCVBUF`.
+///
+/// \returns the size of the buffer as reported by the operating system.
+UDIPE_NODISCARD
+static int query_buffer_size(fd_t fd, int option) {
+    LOGGED_FUNCTION_START("%d, %d", fd, option)
+        int size;
+        socklen_t size_len = sizeof(int);
+        exit_on_negative(getsockopt(fd, SOL_SOCKET, option, &size, &size_len),
+                         "Failed to query a socket buffer size!");
+        ensure_eq(size_len, (socklen_t)sizeof(int));
+        return size;
+    LOGGED_FUNCTION_END
+}
+
+/// Set the size of a socket buffer
+///
+/// The unprivileged `SO_SNDBUF`/`SO_RCVBUF` socket option is tried first. If
+/// the kernel clamped the requested size to its configured maximum, the
+/// privileged `SO_SNDBUFFORCE`/`SO_RCVBUFFORCE` socket option is tried next. If
+/// we lack the required privileges, a warning is logged and the clamped size is
+/// kept.
+///
+/// This function must be called within a logging scope.
+///
+/// \param fd must be a valid UDP socket.
+/// \param recv tells whether the receive buffer (`true`) or the send buffer
+///             (`false`) should be resized.
+/// \param size is the requested buffer size, which must be positive.
+///
+/// \returns 0 if the buffer was resized, possibly to a clamped size, otherwise
+///          an `errno` code from socket_setup_error().
+UDIPE_NODISCARD
+static int set_buffer_size(fd_t fd, bool recv, int size) {
+    LOGGED_FUNCTION_START("%d, %d, %d", fd, (int)recv, size)
+        assert(size > 0);
+        const int option = recv ? SO_RCVBUF : SO_SNDBUF;
+        const char* const name = recv ? "receive" : "send";
+        if (setsockopt(fd, SOL_SOCKET, option, &size, sizeof(int)) < 0) {
+            return socket_setup_error(recv ? "set the receive buffer size"
+                                           : "set the send buffer size");
+        }
+
+        // Linux doubles the requested size to account for its bookkeeping
+        // overhead, after clamping it to net.core.[rw]mem_max
+        const int granted = query_buffer_size(fd, option);
+        if (granted / 2 >= size) return 0;
+        debugf("The kernel clamped the %s buffer to %d bytes, "
+               "trying to force it to the requested size...",
+               name, granted);
+        if (setsockopt(fd,
+                       SOL_SOCKET,
+                       recv ? SO_RCVBUFFORCE : SO_SNDBUFFORCE,
+                       &size,
+                       sizeof(int)) == 0) {
+            return 0;
+        }
+        if (errno != EPERM) {
+            return socket_setup_error(recv ? "force the receive buffer size"
+                                           : "force the send buffer size");
+        }
+        warnf("Enlarging the %s buffer beyond net.core.%s requires "
+              "CAP_NET_ADMIN, it will only be %d bytes large.",
+              name, recv ? "rmem_max" : "wmem_max", granted);
+        errno = 0;
+        return 0;
+    LOGGED_FUNCTION_END
+}
+
+/// Compute the receive buffer size that is needed to absorb incoming traffic
+/// while the worker loop is not reacting to network activity
+///
+/// See \ref udipe_connect_options_t::recv_rate for more information.
+///
+/// This function must be called within a logging scope.
+///
+/// \param fd must be a valid UDP socket with its default receive buffer.
+/// \param recv_rate is the expected incoming data rate in bytes per second.
+/// \param max_latency is the longest worker loop latency observed so far.
+///
+/// \returns the receive buffer size that should be requested from the kernel,
+///          or 0 if the default receive buffer is large enough.
+UDIPE_NODISCARD
+static int auto_recv_buffer_size(fd_t fd,
+                                 uint64_t recv_rate,
+                                 udipe_duration_ns_t max_latency) {
+    LOGGED_FUNCTION_START("%d, %" PRIu64 ", %zu",
+                          fd, recv_rate, (size_t)max_latency)
+        udipe_duration_ns_t latency = max_latency;
+        if (latency < AUTO_RECV_BUFFER_MIN_LATENCY) {
+            latency = AUTO_RECV_BUFFER_MIN_LATENCY;
+        }
+        double size = (double)recv_rate
+                    * ((double)latency / UDIPE_SECOND)
+                    * AUTO_RECV_BUFFER_MARGIN;
+        // The kernel doubles requested sizes, which must fit in an int
+        if (size > INT_MAX / 2) {
+            warnf("Absorbing %" PRIu64 " bytes/s for %zu ns requires an "
+                  "oversized receive buffer, will clamp it to %d bytes.",
+                  recv_rate, (size_t)latency, INT_MAX / 2);
+            size = INT_MAX / 2;
+        }
+        if (size < MIN_RECV_BUFFER) size = MIN_RECV_BUFFER;
+
+        const int default_size = query_buffer_size(fd, SO_RCVBUF);
+        debugf("Need a %.0f-byte receive buffer to absorb %zu ns of latency, "
+               "the default receive buffer is %d bytes large.",
+               size, (size_t)latency, default_size);
+        if (default_size / 2 >= size) return 0;
+        return (int)size;
+    LOGGED_FUNCTION_END
+}
+
+/// Create, configure and bind a UDP socket
+///
+/// This function must be called within a logging scope.
+///
+/// \param options must point to connection options that have been checked by
+///                check_options().
+/// \param max_latency is the worker loop latency that automatic receive buffer
+///                    sizing should account for.
+/// \param family is the address family of the socket.
+/// \param local_address is the local address that the socket should be bound
+///                      to. It must not be a default address.
+/// \param fd must point to storage where the socket will be written on
+///           success.
+///
+/// \returns 0 if the socket was successfully set up, otherwise an `errno` code
+///          that explains what went wrong. The socket is closed on failure.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static int open_socket(const udipe_connect_options_t* options,
+                       udipe_duration_ns_t max_latency,
+                       sa_family_t family,
+                       const ip_address_t* local_address,
+                       fd_t* fd) {
+    LOGGED_FUNCTION_START("%p, %zu, %d, %p, %p",
+                          options, (size_t)max_latency, (int)family,
+                          local_address, fd)
+        int error;
+
+        debug("Creating the UDP socket...");
+        *fd = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+        if (*fd < 0) return socket_setup_error("create a UDP socket");
+
+        if (options->local_interface) {
+            debugf("Binding to network interface %s...",
+                   options->local_interface);
+            const socklen_t name_len = strlen(options->local_interface);
+            if (setsockopt(*fd,
+                           SOL_SOCKET,
+                           SO_BINDTODEVICE,
+                           options->local_interface,
+                           name_len) < 0) {
+                error = socket_setup_error("bind to network interface");
+                goto close_socket;
+            }
+        }
+
+        if (options->send_buffer) {
+            debugf("Setting the send buffer size to %u bytes...",
+                   (unsigned)options->send_buffer);
+            error = set_buffer_size(*fd, false, (int)options->send_buffer);
+            if (error) goto close_socket;
+        }
+
+        int recv_buffer = (int)options->recv_buffer;
+        if (options->recv_rate) {
+            debugf("Sizing the receive buffer for %" PRIu64 " bytes/s...",
+                   options->recv_rate);
+            recv_buffer = auto_recv_buffer_size(*fd,
+                                                options->recv_rate,
+                                                max_latency);
+        }
+        if (recv_buffer) {
+            debugf("Setting the receive buffer size to %d bytes...",
+                   recv_buffer);
+            error = set_buffer_size(*fd, true, recv_buffer);
+            if (error) goto close_socket;
+        }
+
+        if (options->gso_segment_size) {
+            debugf("Enabling GSO with %u-byte segments...",
+                   (unsigned)options->gso_segment_size);
+            const int segment_size = options->gso_segment_size;
+            if (setsockopt(*fd,
+                           SOL_UDP,
+                           UDP_SEGMENT,
+                           &segment_size,
+                           sizeof(int)) < 0) {
+                error = socket_setup_error("enable GSO");
+                goto close_socket;
+            }
+        }
+
+        if (options->pacing_rate) {
+            debugf("Enabling pacing at %" PRIu64 " bytes/s...",
+                   options->pacing_rate);
+            const struct sock_txtime txtime = {
+                .clockid = CLOCK_MONOTONIC,
+                .flags = 0
+            };
+            if (setsockopt(*fd,
+                           SOL_SOCKET,
+                           SO_TXTIME,
+                           &txtime,
+                           sizeof(struct sock_txtime)) < 0) {
+                error = socket_setup_error("enable pacing");
+                goto close_socket;
+            }
+        }
+
+        if (options->enable_zerocopy) {
+            debug("Enabling zero-copy emission...");
+            const int enable = 1;
+            if (setsockopt(*fd,
+                           SOL_SOCKET,
+                           SO_ZEROCOPY,
+                           &enable,
+                           sizeof(int)) < 0) {
+                error = socket_setup_error("enable zero-copy emission");
+                goto close_socket;
+            }
+        }
+
+        if (options->direction != UDIPE_OUT) {
+            debug("Enabling kernel drop reporting...");
+            const int enable = 1;
+            if (setsockopt(*fd,
+                           SOL_SOCKET,
+                           SO_RXQ_OVFL,
+                           &enable,
+                           sizeof(int)) < 0) {
+                error = socket_setup_error("enable kernel drop reporting");
+                goto close_socket;
+            }
+        }
+
+        if (options->direction != UDIPE_IN) {
+            debug("Enabling extended error reporting...");
+            const int enable = 1;
+            const bool ipv6 = (family == AF_INET6);
+            if (setsockopt(*fd,
+                           ipv6 ? SOL_IPV6 : SOL_IP,
+                           ipv6 ? IPV6_RECVERR : IP_RECVERR,
+                           &enable,
+                           sizeof(int)) < 0) {
+                error = socket_setup_error("enable extended error reporting");
+                goto close_socket;
+            }
+        }
+
+        if (options->enable_gro) {
+            debug("Enabling GRO...");
+            const int enable = 1;
+            if (setsockopt(*fd,
+                           SOL_UDP,
+                           UDP_GRO,
+                           &enable,
+                           sizeof(int)) < 0) {
+                error = socket_setup_error("enable GRO");
+                goto close_socket;
+            }
+        }
+
+        if (options->enable_timestamps) {
+            debug("Enabling reception timestamps...");
+            const int flags = SOF_TIMESTAMPING_RX_SOFTWARE
+                            | SOF_TIMESTAMPING_SOFTWARE
+                            | SOF_TIMESTAMPING_RX_HARDWARE
+                            | SOF_TIMESTAMPING_RAW_HARDWARE;
+            if (setsockopt(*fd,
+                           SOL_SOCKET,
+                           SO_TIMESTAMPING,
+                           &flags,
+                           sizeof(int)) < 0) {
+                error = socket_setup_error("enable reception timestamps");
+                goto close_socket;
+            }
+        }
+
+        if (options->enable_busy_poll) {
+            debug("Enabling busy polling...");
+            error = enable_kernel_busy_poll(*fd);
+            if (error) goto close_socket;
+        }
+
+        if (options->dscp) {
+            debugf("Marking outgoing datagrams with DSCP %u...",
+                   (unsigned)options->dscp);
+            const int tos = options->dscp << 2;
+            const bool ipv6 = (family == AF_INET6);
+            if (setsockopt(*fd,
+                           ipv6 ? SOL_IPV6 : SOL_IP,
+                           ipv6 ? IPV6_TCLASS : IP_TOS,
+                           &tos,
+                           sizeof(int)) < 0) {
+                error = socket_setup_error("set the DSCP");
+                goto close_socket;
+            }
+        }
+
+        // Must come after the DSCP, since Linux derives the socket priority
+        // from the TOS field whenever the latter is set
+        if (options->priority) {
+            debugf("Setting the socket priority to %u...",
+                   (unsigned)options->priority);
+            const int priority = options->priority;
+            if (setsockopt(*fd,
+                           SOL_SOCKET,
+                           SO_PRIORITY,
+                           &priority,
+                           sizeof(int)) < 0) {
+                error = socket_setup_error("set the socket priority");
+                goto close_socket;
+            }
+        }
+
+        if (options->num_shards > 1) {
+            debug("Allowing other shards to share the local port...");
+            const int enable = 1;
+            if (setsockopt(*fd,
+                           SOL_SOCKET,
+                           SO_REUSEPORT,
+                           &enable,
+                           sizeof(int)) < 0) {
+                error = socket_setup_error("enable port sharing");
+                goto close_socket;
+            }
+        }
+
+        debug("Binding to the local address...");
+        if (bind(*fd,
+                 &local_address->any,
+                 address_size(family)) < 0) {
+            error = socket_setup_error("bind to the local address");
+            goto close_socket;
+        }
+
+        if (options->remote_address.any.sa_family) {
+            debug("Connecting to the remote address...");
+            if (connect(*fd,
+                        &options->remote_address.any,
+                        address_size(family)) < 0) {
+                error = socket_setup_error("connect to the peer");
+                goto close_socket;
+            }
+        } else {
+            debug("No remote address, will accept traffic from any peer.");
+        }
+        return 0;
+
+    close_socket:
+        debug("Closing the socket after a setup failure...");
+        close_virtual_fd(fd);
+        return error;
+    LOGGED_FUNCTION_END
+}
+
+/// Allocate the state of a connection
+///
+/// This function must be called within a logging scope.
+///
+/// \param options must point to connection options that have been checked by
+///                check_options().
+/// \param fd must be a socket that was set up by open_socket(). It will be
+///           owned by the resulting connection.
+///
+/// \returns a connection that must eventually be destroyed with
+///          connection_close(), and whose `worker` must be set.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+static udipe_connection_t*
+allocate_connection(const udipe_connect_options_t* options, fd_t fd) {
+    LOGGED_FUNCTION_START("%p, %d", options, fd)
+        udipe_connection_t* connection = malloc(sizeof(udipe_connection_t));
+        exit_on_null(connection, "Failed to allocate connection state!");
+        *connection = (udipe_connection_t){
+            .socket = fd,
+            .direction = options->direction,
+            .send_timeout = options->send_timeout,
+            .recv_timeout = options->recv_timeout,
+            .gso_segment_size = options->gso_segment_size,
+            .zerocopy = options->enable_zerocopy,
+            .busy_poll = options->enable_busy_poll,
+            .steal_sends = options->enable_send_stealing,
+            .zerocopy_next = 0,
+            .pacing_rate = options->pacing_rate,
+            .next_departure = 0,
+            .recv = recv_state_initialize()
+        };
+        atomic_init(&connection->recv_dropped, 0);
+        atomic_init(&connection->icmp_errors, 0);
+        atomic_init(&connection->local_errors, 0);
+        atomic_init(&connection->num_refs, 1);
+        connection->disconnect_future = NULL;
+        if (connection->send_timeout == UDIPE_DURATION_DEFAULT) {
+            connection->send_timeout = UDIPE_DURATION_MAX;
+        }
+        if (connection->recv_timeout == UDIPE_DURATION_DEFAULT) {
+            connection->recv_timeout = UDIPE_DURATION_MAX;
+        }
+        debugf("Successfully set up connection %p with socket %d.",
+               connection, fd);
+        return connection;
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+udipe_connect_result_t connection_open(const udipe_connect_options_t* options,
+                                       udipe_duration_ns_t max_latency) {
+    LOGGED_FUNCTION_START("%p, %zu", options, (size_t)max_latency)
+        udipe_connect_result_t result = { 0 };
+
+        debug("Checking connection options...");
+        result.error = check_options(options);
+        if (result.error) return result;
+
+        debug("Determining the address family...");
+        sa_family_t family = options->local_address.any.sa_family;
+        if (!family) family = options->remote_address.any.sa_family;
+        if (!family) family = AF_INET;
+        debugf("Will use address family %d.", (int)family);
+
+        debug("Setting up the first socket...");
+        ip_address_t local_address = options->local_address;
+        if (local_address.any.sa_family == 0) {
+            local_address = (ip_address_t){ 0 };
+            local_address.any.sa_family = family;
+        }
+        fd_t fd;
+        result.error = open_socket(options,
+                                   max_latency,
+                                   family,
+                                   &local_address,
+                                   &fd);
+        if (result.error) return result;
+
+        debug("Querying the local address that we ended up bound to...");
+        socklen_t local_address_size = sizeof(ip_address_t);
+        exit_on_negative(getsockname(fd,
+                                     &result.local_address.any,
+                                     &local_address_size),
+                         "Failed to query the socket's local address!");
+        ensure_le(local_address_size, (socklen_t)sizeof(ip_address_t));
+
+        debug("Querying the socket buffer sizes that we ended up with...");
+        result.send_buffer = (uint32_t)query_buffer_size(fd, SO_SNDBUF);
+        result.recv_buffer = (uint32_t)query_buffer_size(fd, SO_RCVBUF);
+        debugf("Send buffer is %" PRIu32 " bytes large, "
+               "receive buffer is %" PRIu32 " bytes large.",
+               result.send_buffer, result.recv_buffer);
+        udipe_connection_t* const connection = allocate_connection(options,
+                                                                   fd);
+        if (options->num_shards <= 1) {
+            result.connection = connection;
+            return result;
+        }
+
+        debugf("Setting up %u other shard(s) on the same local address...",
+               (unsigned)options->num_shards - 1);
+        shard_group_t* const group =
+            malloc(sizeof(shard_group_t)
+                   + options->num_shards * sizeof(udipe_connection_t*));
+        exit_on_null(group, "Failed to allocate shard group!");
+        atomic_init(&group->num_open, 1);
+        group->num_shards = 1;
+        group->shards[0] = connection;
+        connection->shards = group;
+        for (size_t i = 1; i < options->num_shards; ++i) {
+            result.error = open_socket(options,
+                                       max_latency,
+                                       family,
+                                       &result.local_address,
+                                       &fd);
+            if (result.error) {
+                debug("Tearing down the shards that were already set up...");
+                const int close_error = connection_close_shards(connection);
+                if (close_error) warnf("Failed to close shards (errno %d).",
+                                       close_error);
+                result.local_address = (ip_address_t){ 0 };
+                result.send_buffer = 0;
+                result.recv_buffer = 0;
+                return result;
+            }
+            udipe_connection_t* const shard = allocate_connection(options, fd);
+            shard->shards = group;
+            group->shards[i] = shard;
+            ++(group->num_shards);
+            atomic_fetch_add_explicit(&group->num_open, 1, memory_order_relaxed);
+        }
+        result.connection = connection;
+        return result;
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+int connection_close(udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p", connection)
+        debug("Checking that the receive engine is done with it...");
+        recv_state_finalize(&connection->recv);
+
+        debugf("Closing socket %d...", connection->socket);
+        close_virtual_fd(&connection->socket);
+
+        debug("Liberating the connection state...");
+        shard_group_t* const group = connection->shards;
+        free(connection);
+        if (group
+            && atomic_fetch_sub_explicit(&group->num_open,
+                                         1,
+                                         // Synchronize with other shards'
+                                         // worker threads before liberation
+                                         memory_order_acq_rel) == 1) {
+            debug("This was the last shard, liberating the shard group...");
+            free(group);
+        }
+        return 0;
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+int connection_steer_by_cpu(udipe_connection_t* connection,
+                            const uint32_t cpu_shards[],
+                            size_t num_cpus) {
+    LOGGED_FUNCTION_START("%p, %p, %zu", connection, cpu_shards, num_cpus)
+        ensure((bool)connection->shards);
+        ensure(connection->shards->shards[0] == connection);
+
+        debug("Counting CPUs that have a shard...");
+        size_t num_mapped = 0;
+        for (size_t cpu = 0; cpu < num_cpus; ++cpu) {
+            if (cpu_shards[cpu] != UINT32_MAX) ++num_mapped;
+        }
+        // One load, two instructions per mapped CPU, and a fallback return
+        const size_t num_instructions = 2 * num_mapped + 2;
+        if (num_instructions > BPF_MAXINSNS) {
+            warnf("Too many CPUs (%zu) to steer datagrams by CPU!", num_mapped);
+            return E2BIG;
+        }
+
+        debugf("Generating a steering program for %zu CPU(s)...", num_mapped);
+        struct sock_filter* const code =
+            calloc(num_instructions, sizeof(struct sock_filter));
+        exit_on_null(code, "Failed to allocate steering program!");
+        size_t pc = 0;
+        code[pc++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                                  SKF_AD_OFF + SKF_AD_CPU);
+        for (size_t cpu = 0; cpu < num_cpus; ++cpu) {
+            const uint32_t shard = cpu_shards[cpu];
+            if (shard == UINT32_MAX) continue;
+            ensure_lt((size_t)shard, connection->shards->num_shards);
+            tracef("- Datagrams processed by CPU %zu will go to shard #%u.",
+                   cpu, (unsigned)shard);
+            code[pc++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                                      (uint32_t)cpu,
+                                                      0,
+                                                      1);
+            code[pc++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, shard);
+        }
+        // Out-of-range socket indices make the kernel fall back to hashing
+        code[pc++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, UINT32_MAX);
+        ensure_eq(pc, num_instructions);
+
+        debug("Attaching it to the shards...");
+        const struct sock_fprog program = {
+            .len = (unsigned short)num_instructions,
+            .filter = code
+        };
+        int error = 0;
+        if (setsockopt(connection->socket,
+                       SOL_SOCKET,
+                       SO_ATTACH_REUSEPORT_CBPF,
+                       &program,
+                       sizeof(program)) < 0) {
+            error = socket_setup_error("attach the steering program");
+        }
+        free(code);
+        return error;
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+int connection_close_shards(udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p", connection)
+        shard_group_t* const group = connection->shards;
+        if (!group) return connection_close(connection);
+
+        // Shards are closed in reverse order so that the shard group, which
+        // is liberated along with the last shard, remains valid until then.
+        debugf("Closing %zu shard(s)...", group->num_shards);
+        int error = 0;
+        for (size_t i = group->num_shards; i > 0; --i) {
+            const int shard_error = connection_close(group->shards[i - 1]);
+            if (!error) error = shard_error;
+        }
+        return error;
+    LOGGED_FUNCTION_END
+}
+
+DEFINE_PUBLIC
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+udipe_connection_t* udipe_connection_shard(udipe_connection_t* connection,
+                                           size_t index) {
+    const shard_group_t* const group = connection->shards;
+    if (!group) return (index == 0) ? connection : NULL;
+    return (index < group->num_shards) ? group->shards[index] : NULL;
+}
+
+DEFINE_PUBLIC
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+udipe_connection_stats_t
+udipe_connection_stats(const udipe_connection_t* connection) {
+    return (udipe_connection_stats_t){
+        .recv_dropped = atomic_load_explicit(&connection->recv_dropped,
+                                             memory_order_relaxed),
+        .icmp_errors = atomic_load_explicit(&connection->icmp_errors,
+                                            memory_order_relaxed),
+        .local_errors = atomic_load_explicit(&connection->local_errors,
+                                             memory_order_relaxed)
+    };
+}
@@ -0,0 +1,306 @@
+#pragma once
+
+//! \file
+//! \brief UDP connections
+//!
+//! This code module implements \ref udipe_connection_t, the worker-side state
+//! of an established UDP connection, along with the socket setup and teardown
+//! logic that backs the udipe_connect() and udipe_disconnect() commands.
+
+#include <udipe/connect.h>
+#include <udipe/duration.h>
+#include <udipe/future.h>
+#include <udipe/nodiscard.h>
+#include <udipe/pointer.h>
+
+#include "fd.h"
+#include "recv.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Forward declaration to break header dependency cycles
+typedef struct worker_s worker_t;
+
+/// Set of connections that share a local port
+///
+/// This is allocated alongside the shards of a sharded connection, see \ref
+/// udipe_connect_options_t::num_shards, and liberated once the last of them
+/// has been closed.
+typedef struct shard_group_s {
+    /// Number of shards that have not been closed yet
+    ///
+    /// Shards may be closed by different worker threads, so this must be
+    /// updated atomically.
+    atomic_size_t num_open;
+
+    /// Number of shards within `shards`
+    ///
+    size_t num_shards;
+
+    /// Shards, in the order of udipe_connection_shard() indices
+    ///
+    udipe_connection_t* shards[];
+} shard_group_t;
+
+/// \copydoc udipe_connection_t
+///
+/// \internal
+///
+/// Connections are allocated by the worker thread that processes the
+/// udipe_connect() command and are only accessed by this worker thread until
+/// they are liberated by udipe_disconnect(). Client threads only manipulate
+/// pointers to them, and read the immutable `worker` and `steal_sends` fields.
+///
+/// The only exception are connections with \ref
+/// udipe_connect_options_t::enable_send_stealing, whose send commands may be
+/// processed by other worker threads. These only use the socket and the
+/// atomic fields, and keep the connection alive via `num_refs`.
+struct udipe_connection_s {
+    /// Underlying UDP socket
+    ///
+    fd_t socket;
+
+    /// Communication direction(s) that were requested at connection time
+    ///
+    /// Used to reject commands that do not match the connection's purpose.
+    udipe_direction_t direction;
+
+    /// Default timeout of send commands
+    ///
+    /// This is \ref udipe_connect_options_t::send_timeout with \ref
+    /// UDIPE_DURATION_DEFAULT already translated into \ref UDIPE_DURATION_MAX.
+    udipe_duration_ns_t send_timeout;
+
+    /// Default timeout of receive commands
+    ///
+    /// This is \ref udipe_connect_options_t::recv_timeout with \ref
+    /// UDIPE_DURATION_DEFAULT already translated into \ref UDIPE_DURATION_MAX.
+    udipe_duration_ns_t recv_timeout;
+
+    /// GSO segment size, or 0 if GSO is disabled
+    ///
+    /// This is \ref udipe_connect_options_t::gso_segment_size, which has been
+    /// applied to the socket as its default `UDP_SEGMENT` size. The emission
+    /// engine uses it to decide how many bytes it can hand over to the kernel
+    /// per `sendmmsg()` message, see \ref send.h.
+    uint16_t gso_segment_size;
+
+    /// Truth that datagrams should be sent with `MSG_ZEROCOPY`
+    ///
+    /// This starts out as \ref udipe_connect_options_t::enable_zerocopy, and
+    /// is turned off by the emission engine if the kernel reports that it had
+    /// to copy zero-copy datagrams anyway.
+    bool zerocopy;
+
+    /// Truth that the worker busy-polls this connection's socket for incoming
+    /// datagrams
+    ///
+    /// This is \ref udipe_connect_options_t::enable_busy_poll.
+    bool busy_poll;
+
+    /// Truth that send commands targeting this connection may be processed by
+    /// other worker threads
+    ///
+    /// This is \ref udipe_connect_options_t::enable_send_stealing. Like
+    /// `worker`, it is read by client threads.
+    bool steal_sends;
+
+    /// Sequence number that the kernel will assign to the next successful
+    /// `MSG_ZEROCOPY` send on `socket`
+    ///
+    /// The kernel numbers these sends from 0 onwards, wrapping around on
+    /// overflow, and uses these numbers in its completion notifications.
+    uint32_t zerocopy_next;
+
+    /// Pacing rate in payload bytes per second, or 0 if pacing is disabled
+    ///
+    /// This is \ref udipe_connect_options_t::pacing_rate.
+    uint64_t pacing_rate;
+
+    /// Earliest `CLOCK_MONOTONIC` time in nanoseconds at which the next
+    /// datagram may depart if pacing is enabled
+    ///
+    /// The emission engine pushes this forward as it sends datagrams, see
+    /// \ref udipe_connect_options_t::pacing_rate.
+    uint64_t next_departure;
+
+    /// Receive engine state
+    ///
+    /// See \ref recv.h for more information.
+    recv_state_t recv;
+
+    /// Worker that owns this connection
+    ///
+    /// This is set by the worker that processed the udipe_connect() command
+    /// before the connection is handed over to the client, and never changes
+    /// afterwards. Unlike other fields, it is read by client threads, which use
+    /// it to submit commands targeting this connection to the right worker.
+    worker_t* worker;
+
+    /// Number of incoming datagrams that the kernel dropped
+    ///
+    /// This is \ref udipe_connection_stats_t::recv_dropped. It is updated by
+    /// the receive engine as `SO_RXQ_OVFL` control messages come in, and read
+    /// by client threads in udipe_connection_stats().
+    atomic_uint_least64_t recv_dropped;
+
+    /// Number of errors that remote nodes reported via ICMP
+    ///
+    /// This is \ref udipe_connection_stats_t::icmp_errors. Like
+    /// `recv_dropped`, it is updated by the owning worker, here as it reads
+    /// the socket's error queue, and read by client threads.
+    atomic_uint_least64_t icmp_errors;
+
+    /// Number of errors that the local network stack reported via the socket
+    /// error queue
+    ///
+    /// This is \ref udipe_connection_stats_t::local_errors, see `icmp_errors`.
+    atomic_uint_least64_t local_errors;
+
+    /// Shards of the sharded connection that this connection belongs to
+    ///
+    /// This is `NULL` for connections that are not sharded. Like `worker`, it
+    /// never changes after the connection has been handed over to the client,
+    /// and is read by client threads in udipe_connection_shard().
+    shard_group_t* shards;
+
+    /// Number of references that keep this connection open
+    ///
+    /// The owning worker holds one reference until it processes the
+    /// udipe_disconnect() command. Other workers hold one per stolen send
+    /// command that they have not completed yet, see `steal_sends`. Whoever
+    /// drops the last reference with connection_release() must close the
+    /// connection and notify `disconnect_future`.
+    atomic_size_t num_refs;
+
+    /// Future of the udipe_disconnect() command
+    ///
+    /// This is set by the owning worker before it drops its reference.
+    udipe_future_t* disconnect_future;
+};
+
+/// Take an extra reference to a connection
+///
+/// See \ref udipe_connection_t::num_refs.
+///
+/// \param connection must be a connection that is kept alive by another
+///                   reference until this function returns.
+UDIPE_NON_NULL_ARGS
+static inline void connection_acquire(udipe_connection_t* connection) {
+    atomic_fetch_add_explicit(&connection->num_refs, 1, memory_order_relaxed);
+}
+
+/// Drop a reference to a connection
+///
+/// See \ref udipe_connection_t::num_refs.
+///
+/// \param connection must be a connection that the caller holds a reference
+///                   to. It must not be used after calling this function,
+///                   unless the result is `true`.
+///
+/// \returns the truth that this was the last reference, in which case the
+///          caller must close the connection.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static inline bool connection_release(udipe_connection_t* connection) {
+    return atomic_fetch_sub_explicit(&connection->num_refs,
+                                     1,
+                                     // Synchronize with the other holders of
+                                     // references before closing
+                                     memory_order_acq_rel) == 1;
+}
+
+/// Set up a UDP connection
+///
+/// This creates a UDP socket, then configures and binds it according to the
+/// specified `options`. It is the worker-side backend of udipe_connect().
+///
+/// If a sharded connection is requested, then one socket is created and
+/// configured in this way per shard, and \ref udipe_connection_t::shards is
+/// set on each of the resulting connections. The `worker` of each shard must
+/// then be set by the caller.
+///
+/// This function must be called within a logging scope.
+///
+/// \param options must point to the connection options that were sent by the
+///                client thread.
+/// \param max_latency is the \ref worker_t::max_latency of the worker that
+///                    processes the udipe_connect() command, which is used to
+///                    size receive buffers if \ref
+///                    udipe_connect_options_t::recv_rate is set.
+///
+/// \returns the result of connection setup. If connection setup succeeded,
+///          the resulting connection must eventually be destroyed with
+///          connection_close(), as must all the other shards of a sharded
+///          connection.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+udipe_connect_result_t connection_open(const udipe_connect_options_t* options,
+                                       udipe_duration_ns_t max_latency);
+
+/// Tear down a UDP connection
+///
+/// This closes the underlying socket and liberates the connection. It is the
+/// worker-side backend of udipe_disconnect().
+///
+/// This function must be called within a logging scope.
+///
+/// \param connection must be a connection that was previously set up with
+///                   connection_open() and has not been closed since. The
+///                   receive engine must not hold any resource associated with
+///                   this connection anymore, see recv_abort(). It must not be
+///                   used after calling this function.
+///
+/// \returns 0 if the connection was cleanly closed, otherwise an `errno` code
+///          that explains what went wrong. The connection is liberated in any
+///          case.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+int connection_close(udipe_connection_t* connection);
+
+/// Steer incoming datagrams across shards based on the CPU that received them
+///
+/// This is the backend of \ref udipe_connect_options_t::steer_by_cpu.
+///
+/// This function must be called within a logging scope.
+///
+/// \param connection must be the first shard of a sharded connection that was
+///                   set up with connection_open().
+/// \param cpu_shards maps each operating system CPU index below `num_cpus` to
+///                   the index of the shard that should receive the datagrams
+///                   that this CPU processes, or to `UINT32_MAX` if these
+///                   datagrams should be spread across shards based on their
+///                   source address.
+/// \param num_cpus is the number of entries within `cpu_shards`.
+///
+/// \returns 0 if steering was successfully set up, otherwise an `errno` code
+///          that explains what went wrong. In the latter case, datagrams keep
+///          being spread across shards based on their source address.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+int connection_steer_by_cpu(udipe_connection_t* connection,
+                            const uint32_t cpu_shards[],
+                            size_t num_cpus);
+
+/// Tear down all shards of a connection that was not handed over to the client
+///
+/// This calls connection_close() on every shard of `connection`, or on
+/// `connection` itself if it is not sharded. It is used to clean up after
+/// udipe_connect() commands that were canceled.
+///
+/// This function must be called within a logging scope.
+///
+/// \param connection must be a connection that was set up with
+///                   connection_open(), none of whose shards have been closed
+///                   or used yet. It must not be used after calling this
+///                   function.
+///
+/// \returns 0 if all shards were cleanly closed, otherwise the `errno` code
+///          of the first shard that could not be closed cleanly.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+int connection_close_shards(udipe_connection_t* connection);
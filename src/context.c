@@ -10,18 +10,20 @@
 #include "log.h"
 #include "refcounted_tss.h"
 #include "visibility.h"
+#include "worker_pool.h"
 
 #include <hwloc.h>
 #include <stdalign.h>
 #include <stdlib.h>
 #include <string.h>
+#include <threads.h>
 
 
-/// future_thread_cache_finalize_from_context() wrapper that has the signature
+/// future_thread_cache_finalize_from_thread() wrapper that has the signature
 /// expected by `tss_dtor_t`.
 static void future_thread_cache_destructor(void* thread_cache) {
     future_thread_cache_t* cache = (future_thread_cache_t*)thread_cache;
-    if (cache) future_thread_cache_finalize_from_context(&cache);
+    if (cache) future_thread_cache_finalize_from_thread(&cache);
 }
 
 DEFINE_PUBLIC
@@ -51,6 +53,9 @@ udipe_context_t* udipe_initialize(udipe_config_t config) {
         debug("Initializing the connection options allocator...");
         context->connect_options = connect_options_allocator_initialize();
 
+        debug("Spawning the network worker threads...");
+        worker_pool_initialize(&context->workers, context, &config);
+
         debug("Initializing the context-global future allocator cache...");
         context->future_global_cache = future_context_cache_initialize();
 
@@ -66,6 +71,11 @@ DEFINE_PUBLIC
 UDIPE_NON_NULL_ARGS
 void udipe_finalize(udipe_context_t* context) {
     LOGGER_START(&context->logger)
+        // Worker threads may still access futures while they shut down, so
+        // they must be gone before future allocator caches are liberated.
+        debug("Stopping the network worker threads...");
+        worker_pool_finalize(&context->workers);
+
         debug("Liberating all the future allocator caches...");
         future_context_cache_finalize(&context->future_global_cache);
 
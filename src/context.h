@@ -15,6 +15,7 @@
 #include "connect.h"
 #include "log.h"
 #include "refcounted_tss.h"
+#include "worker_pool.h"
 
 #include <hwloc.h>
 
@@ -80,4 +81,9 @@ struct udipe_context_s {
     ///
     /// See \ref connect.h for more info on how this works and how to use it.
     connect_options_allocator_t connect_options;
+
+    /// Network worker threads
+    ///
+    /// See \ref worker_pool.h for more information.
+    worker_pool_t workers;
 };
@@ -23,11 +23,13 @@
 #include "log.h"
 #include "unit_tests.h"
 #include "visibility.h"
+#include "worker.h"
 
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <threads.h>
 #include <time.h>
 
 
@@ -163,6 +165,14 @@ bool udipe_cancel(udipe_future_t* future, bool finish) {
             }
         } while(true);
 
+        if (type >= TYPE_NETWORK_START && type < TYPE_NETWORK_END) {
+            // This is needed even if no one waits for the future, since the
+            // worker thread must acknowledge the cancelation.
+            debug("Telling the worker thread about the cancelation...");
+            ensure((bool)future->worker);
+            worker_cancel(future->worker);
+        }
+
         if (status.downstream_count == 0) {
             debug("No one could be waiting for a status change, "
                   "so there is no need for a change notification.");
@@ -182,10 +192,10 @@ bool udipe_cancel(udipe_future_t* future, bool finish) {
         case TYPE_NETWORK_DISCONNECT:
         case TYPE_NETWORK_SEND:
         case TYPE_NETWORK_RECV:
-            // TODO: Implement once we have a control block, most likely using
-            //       an event object in the control block which the network
-            //       thread includes in its wait-list.
-            exit_with_error("Not implemented yet!");
+        case TYPE_NETWORK_RECV_STREAM:
+        case TYPE_NETWORK_SEND_STREAM:
+            debug("No notification needed for polling-based NETWORK futures.");
+            break;
         case TYPE_CUSTOM:  // Aliases TYPE_NETWORK_END
             debug("No notification needed for polling-based CUSTOM futures.");
             break;
@@ -315,7 +325,7 @@ bool udipe_custom_canceled(udipe_future_t* custom) {
         );
 
         debug("Checking if it indicates that it is canceled...");
-        return future_custom_check_canceled(status);
+        return future_eager_check_canceled(status);
     LOGGER_END
 }
 
@@ -323,41 +333,8 @@ UDIPE_NON_NULL_ARGS
 UDIPE_PUBLIC
 void udipe_custom_acknowledge_cancel(udipe_future_t* custom) {
     LOGGER_START(&custom->context->logger)
-        debugf("Loading the initial status word of future %p...", custom);
-        future_status_t status = future_status_load(
-            custom,
-            // No need to synchronize with any state other than the status word
-            memory_order_relaxed
-        );
-        do {
-            debug("Checking the current future status...");
-            ensure(future_custom_check_canceled(status));
-
-            debug("Trying to mark the future as fully canceled...");
-            future_status_t desired = status;
-            desired.state = STATE_RESULT;
-            const bool success = future_status_compare_exchange_weak(
-                custom,
-                &status,
-                desired,
-                // Publish our changes with release ordering so that the thread
-                // that observes the canceled state also observes anything we
-                // did before acknowledging the cancelation.
-                memory_order_release,
-                // No need to synchronize with any state other than the status
-                memory_order_relaxed
-            );
-            if (success) {
-                debug("Success, will now notify other threads as needed!");
-                status = desired;
-                break;
-            } else {
-                debug("Raced with another thread or spurious failure occured, "
-                      "must try again...");
-                continue;
-            }
-        } while(true);
-        future_notify_eager_outcome(custom, status);
+        debug("Offloading the work to future_eager_acknowledge_cancel()...");
+        future_eager_acknowledge_cancel(custom);
     LOGGER_END
 }
 
@@ -378,8 +355,8 @@ bool udipe_custom_try_set_result(udipe_future_t* custom,
         bool payload_set = false;
         do {
             debug("Checking the current future status...");
-            if (future_custom_check_canceled(status)) {
-                udipe_custom_acknowledge_cancel(custom);
+            if (future_eager_check_canceled(status)) {
+                future_eager_acknowledge_cancel(custom);
                 return false;
             }
 
@@ -516,6 +493,14 @@ void future_finish(udipe_future_t* future,
                     result->type = UDIPE_RECV;
                     is_network = true;
                     break;
+                case TYPE_NETWORK_RECV_STREAM:
+                    result->type = UDIPE_RECV_STREAM;
+                    is_network = true;
+                    break;
+                case TYPE_NETWORK_SEND_STREAM:
+                    result->type = UDIPE_SEND_STREAM;
+                    is_network = true;
+                    break;
                 case TYPE_CUSTOM:
                     result->type = UDIPE_CUSTOM;
                     result->payload.custom = future->specific.custom_payload;
@@ -588,7 +573,12 @@ void future_notify_eager_outcome(udipe_future_t* future,
         status.reserved
     )
         assert(future_type_uses_worker_thread(status.type));
-        if (status.downstream_count) {
+        // udipe_finish() waits without incrementing the downstream count, but
+        // clears the `available` flag before doing so. This matters to every
+        // eager future type, including custom futures whose result is set
+        // while a thread is blocked in udipe_finish(), see
+        // custom_test_finish_then_set().
+        if (status.downstream_count || !status.available) {
             // Ensure these notifications are not sent before the new future
             // status word has been published.
             atomic_thread_fence(memory_order_acquire);
@@ -608,7 +598,7 @@ void future_notify_eager_outcome(udipe_future_t* future,
 }
 
 UDIPE_NODISCARD
-bool future_custom_check_canceled(future_status_t status) {
+bool future_eager_check_canceled(future_status_t status) {
     LOGGED_FUNCTION_START(
         "{ .dc = %u, .dco = %u, .a = %u, .s = %u, .o = %u, .t = %u, .na = %u, "
           ".ne/ll = %u, %u }",
@@ -624,8 +614,7 @@ bool future_custom_check_canceled(future_status_t status) {
     )
         debug("Checking the initial status...");
         future_status_debug_check(status, true);
-        ensure_eq((future_type_t)status.type,
-                  (future_type_t)TYPE_CUSTOM);
+        ensure(future_type_uses_worker_thread(status.type));
 
         #ifndef NDEBUG
             debug("Checking the outcome/state consistency...");
@@ -639,16 +628,18 @@ bool future_custom_check_canceled(future_status_t status) {
                           (future_state_t)STATE_CANCELING);
                 break;
             // These outcomes can only be set by try_set_result(), and the
-            // thread that implements the custom operation and performs this
+            // thread that implements the eager operation and performs this
             // check should stop using the future after calling this function.
             case OUTCOME_SUCCESS:
             case OUTCOME_FAILURE_INTERNAL:
-                exit_with_error("Used a custom future after freeing it!");
-            case OUTCOME_FAILURE_DEPENDENCY:  // Not valid for custom futures
+                exit_with_error("Used an eager future after freeing it!");
+            // TODO: Network futures may have this outcome once they can be
+            //       scheduled after other futures.
+            case OUTCOME_FAILURE_DEPENDENCY:  // Not valid for eager futures
             case NUM_OUTCOMES:  // Never valid
             default:
                 exit_with_error(
-                    "Encountered an invalid custom future outcome!"
+                    "Encountered an invalid eager future outcome!"
                 );
             }
         #endif
@@ -662,17 +653,184 @@ bool future_custom_check_canceled(future_status_t status) {
         // Set by try_set_result() or acknowledge_cancel() and future must
         // not be used again after calling those functions.
         case STATE_RESULT:
-            exit_with_error("Used a custom future after freeing it!");
+            exit_with_error("Used an eager future after freeing it!");
         case STATE_UNINITIALIZED:  // Not valid for any initialized future
-        case STATE_WAITING:  // Not valid for custom futures
+        case STATE_WAITING:  // Not valid for eager futures (for now)
         case NUM_STATES:  // Never valid
         default:
-            exit_with_error("Encountered an invalid custom future state!");
+            exit_with_error("Encountered an invalid eager future state!");
         }
     LOGGED_FUNCTION_END
 }
 
 
+UDIPE_NON_NULL_ARGS
+void future_eager_acknowledge_cancel(udipe_future_t* future) {
+    LOGGED_FUNCTION_START("%p", future)
+        debugf("Loading the initial status word of future %p...", future);
+        future_status_t status = future_status_load(
+            future,
+            // No need to synchronize with any state other than the status word
+            memory_order_relaxed
+        );
+        do {
+            debug("Checking the current future status...");
+            ensure(future_eager_check_canceled(status));
+
+            debug("Trying to mark the future as fully canceled...");
+            future_status_t desired = status;
+            desired.state = STATE_RESULT;
+            const bool success = future_status_compare_exchange_weak(
+                future,
+                &status,
+                desired,
+                // Publish our changes with release ordering so that the thread
+                // that observes the canceled state also observes anything we
+                // did before acknowledging the cancelation.
+                memory_order_release,
+                // No need to synchronize with any state other than the status
+                memory_order_relaxed
+            );
+            if (success) {
+                debug("Success, will now notify other threads as needed!");
+                status = desired;
+                break;
+            } else {
+                debug("Raced with another thread or spurious failure occured, "
+                      "must try again...");
+                continue;
+            }
+        } while(true);
+        future_notify_eager_outcome(future, status);
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+udipe_future_t* future_network_allocate(udipe_context_t* context,
+                                        future_type_t type) {
+    LOGGED_FUNCTION_START("%p, %d", context, type)
+        assert(type >= TYPE_NETWORK_START && type < TYPE_NETWORK_END);
+
+        debugf("Allocating a network future from context %p...", context);
+        udipe_future_t* const future = future_allocate(context, type);
+
+        debug("Checking its initial state in debug builds...");
+        assert(future->context == context);
+        assert((future_type_t)future_status_load(future,
+                                                 memory_order_relaxed).type
+               == type);
+        assert(future->status_sync.event != EVENT_INVALID);
+
+        debug("Clearing the worker, which is set upon submission...");
+        future->worker = NULL;
+
+        debug("Initializing the initial status word...");
+        const future_status_t status = (future_status_t){
+            .downstream_count = 0,
+            .downstream_count_overflow = false,
+            .available = true,
+            .state = STATE_PROCESSING,
+            .outcome = OUTCOME_UNKNOWN,
+            .type = type,
+            .notify_address = false,
+            .notify_event_or_lazy_lock = false,
+            .reserved = 0
+        };
+        future_status_debug_check(status, true);
+        future_status_store(
+            future,
+            status,
+            // Relaxed ordering is fine at this point because only one thread
+            // has access to this future and exposing the future to a worker
+            // thread will involve a release memory operation.
+            memory_order_relaxed
+        );
+        return future;
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+bool future_network_canceled(udipe_future_t* future) {
+    LOGGED_FUNCTION_START("%p", future)
+        debugf("Loading the current status word of future %p...", future);
+        const future_status_t status = future_status_load(
+            future,
+            // Can use relaxed ordering here because we're not reading from any
+            // other future field or using this load to synchronize later
+            // accesses to other future fields.
+            memory_order_relaxed
+        );
+        assert(status.type >= TYPE_NETWORK_START
+               && status.type < TYPE_NETWORK_END);
+
+        debug("Checking if it indicates that it is canceled...");
+        return future_eager_check_canceled(status);
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+bool future_network_try_set_result(udipe_future_t* future,
+                                   bool successful,
+                                   udipe_network_payload_t payload) {
+    LOGGED_FUNCTION_START("%p, %u, ...", future, successful)
+        debugf("Loading the initial status word of future %p...", future);
+        future_status_t status = future_status_load(
+            future,
+            // Can use relaxed ordering here because we're not reading from any
+            // other future field or using this load to synchronize later
+            // accesses to other future fields.
+            memory_order_relaxed
+        );
+        assert(status.type >= TYPE_NETWORK_START
+               && status.type < TYPE_NETWORK_END);
+        bool payload_set = false;
+        do {
+            debug("Checking the current future status...");
+            if (future_eager_check_canceled(status)) {
+                future_eager_acknowledge_cancel(future);
+                return false;
+            }
+
+            if (!payload_set) {
+                debug("Setting the result payload...");
+                future->specific.network = payload;
+                payload_set = true;
+            }
+
+            debug("Trying to mark the future as finished...");
+            future_status_t desired = status;
+            desired.state = STATE_RESULT;
+            desired.outcome = successful ? OUTCOME_SUCCESS
+                                         : OUTCOME_FAILURE_INTERNAL;
+            const bool success = future_status_compare_exchange_weak(
+                future,
+                &status,
+                desired,
+                // Publish our changes with release ordering so that the thread
+                // that observes the result payload also observes anything we
+                // did before publishing this payload.
+                memory_order_release,
+                // No need to synchronize with any state other than the status
+                memory_order_relaxed
+            );
+            if (success) {
+                debug("Success, will now notify other threads as needed!");
+                status = desired;
+                break;
+            } else {
+                debug("Raced with another thread or spurious failure occured, "
+                      "must try again...");
+                continue;
+            }
+        } while(true);
+        future_notify_eager_outcome(future, status);
+        return true;
+    LOGGED_FUNCTION_END
+}
+
 #ifdef UDIPE_BUILD_TESTS
 
     static udipe_custom_payload_t generate_custom_payload() {
@@ -833,6 +991,65 @@ bool future_custom_check_canceled(future_status_t status) {
         LOGGED_FUNCTION_END
     }
 
+    /// State of the thread that sets the result of a custom future in
+    /// custom_test_finish_then_set()
+    typedef struct custom_setter_s {
+        udipe_future_t* custom;
+        udipe_custom_payload_t payload;
+        logger_parent_state_t logger;
+    } custom_setter_t;
+
+    /// Thread that sets the result of a custom future after a delay
+    static int custom_setter_func(void* context) {
+        custom_setter_t* const setter = (custom_setter_t*)context;
+        logger_init_child(&setter->logger);
+        LOGGED_FUNCTION_START("%p", context)
+            debug("Giving the main thread time to block in udipe_finish()...");
+            const struct timespec delay = { .tv_nsec = 10 * 1000 * 1000 };
+            ensure_eq(thrd_sleep(&delay, NULL), 0);
+
+            debug("Marking the future as finished...");
+            ensure(udipe_custom_try_set_result(setter->custom,
+                                               true,
+                                               setter->payload));
+            return 0;
+        LOGGED_FUNCTION_END
+    }
+
+    static void custom_test_finish_then_set(udipe_context_t* context) {
+        LOGGED_FUNCTION_START("%p", context)
+            debug("Setting up a custom future...");
+            custom_setter_t setter = {
+                .custom = udipe_start_custom(context),
+                .payload = generate_custom_payload(),
+                .logger = logger_save_parent()
+            };
+
+            debug("Spawning a thread that will set its result later...");
+            thrd_t thread;
+            exit_on_thread_error(thrd_create(&thread,
+                                             custom_setter_func,
+                                             &setter),
+                                 "Failed to spawn the setter thread");
+
+            debug("Waiting for the result with udipe_finish()...");
+            const udipe_result_t result = udipe_finish(setter.custom);
+
+            debug("Checking output...");
+            ensure_eq(result.type, UDIPE_CUSTOM);
+            ensure_eq(memcmp(result.payload.custom.bytes,
+                             setter.payload.bytes,
+                             sizeof(setter.payload.bytes)),
+                      0);
+
+            debug("Joining the setter thread...");
+            int thread_result;
+            exit_on_thread_error(thrd_join(thread, &thread_result),
+                                 "Failed to join the setter thread");
+            ensure_eq(thread_result, 0);
+        LOGGED_FUNCTION_END
+    }
+
     /// Unit tests for custom futures
     ///
     void future_custom_unit_tests() {
@@ -850,7 +1067,8 @@ bool future_custom_check_canceled(future_status_t status) {
             custom_test_seq_canceled_failure(context);
             custom_test_seq_canceled_acknowledged(context);
 
-            // TODO: Multi-threaded test
+            debug("Running multi-threaded tests...");
+            custom_test_finish_then_set(context);
 
             debug("Tearing down the context...");
             udipe_finalize(context);
@@ -22,6 +22,7 @@
 #include "future/status.h"
 #include "future/status_sync.h"
 #include "future/timer_repeat_state.h"
+#include "future/type.h"
 #include "future/unordered_state.h"
 
 #include "arch.h"
@@ -31,6 +32,9 @@
 #include <stdint.h>
 
 
+// Forward declaration to break header dependency cycles
+typedef struct worker_s worker_t;
+
 /// \copydoc udipe_future_t
 struct udipe_future_s {
     /// State that is specific to a particular future type
@@ -51,10 +55,9 @@ struct udipe_future_s {
         ///
         /// The precise \ref future_type_t that you are dealing with will tell
         /// you which variant of this payload union has been set.
-        //
-        // FIXME: Need a way to access the associated control block in order to
-        //        detach from the upstream future on destruction and propagate
-        //        cancelation signals to the worker thread.
+        ///
+        /// Cancelation of network operations is propagated to the worker
+        /// thread that processes them via `worker`.
         udipe_network_payload_t network;
 
         /// Custom command result
@@ -118,6 +121,16 @@ struct udipe_future_s {
     /// `memory_order_release` and status word readouts must often be carried
     /// out with `memory_order_acquire`.
     _Atomic uint32_t status_word;
+
+    /// Worker that processes the command of a network future
+    ///
+    /// This is set by worker_submit() before the command becomes visible to
+    /// the worker thread, so that udipe_cancel() can tell it about the
+    /// cancelation with worker_cancel(). It is `NULL` for other future types.
+    ///
+    /// It lies after `status_word`, outside of the first cache line, because it
+    /// is only accessed on command submission and cancelation.
+    worker_t* worker;
 };
 static_assert(
     alignof(udipe_future_t) == FALSE_SHARING_GRANULARITY,
@@ -133,6 +146,11 @@ static_assert(
     "Should fit on a single cache line for optimal memory access performance "
     "on CPUs where the FALSE_SHARING_GRANULARITY upper bound is pessimistic"
 );
+static_assert(
+    sizeof(udipe_custom_payload_t) >= sizeof(udipe_network_payload_t),
+    "Custom payloads should be as large as network payloads, see "
+    "udipe_custom_payload_t"
+);
 static_assert(
     sizeof(udipe_result_t) <= CACHE_LINE_SIZE,
     "Should be true if above is because future is largely a superset of result"
@@ -183,15 +201,91 @@ UDIPE_NON_NULL_ARGS
 void future_notify_eager_outcome(udipe_future_t* future,
                                  future_status_t status);
 
-/// Check the status of a custom future which should not have completed, and
+/// Check the status of an eager future which should not have completed, and
 /// report whether it was canceled
 ///
 /// This function must be called within a logging scope.
 ///
-/// \param status is the status of the custom future of interest
+/// \param status is the status of the eager (custom or network) future of
+///               interest
 /// \returns whether the future was canceled (true) or not (false)
 UDIPE_NODISCARD
-bool future_custom_check_canceled(future_status_t status);
+bool future_eager_check_canceled(future_status_t status);
+
+/// Acknowledge the cancelation of an eager future
+///
+/// This is the backend of udipe_custom_acknowledge_cancel(), which is also
+/// used by worker threads to acknowledge the cancelation of network futures.
+///
+/// This function must be called within a logging scope.
+///
+/// \param future must be an eager future that has been canceled, but whose
+///               cancelation has not been acknowledged yet. It must not be
+///               used by the caller after calling this function.
+UDIPE_NON_NULL_ARGS
+void future_eager_acknowledge_cancel(udipe_future_t* future);
+
+/// Allocate the future of a network command
+///
+/// This is the network command counterpart of udipe_start_custom(), which
+/// client threads use to set up the future of a network command before
+/// submitting this command to a worker thread.
+///
+/// This function must be called within a logging scope.
+///
+/// \param context must be a valid udipe context.
+/// \param type must be a network future type, i.e. it must lie between \ref
+///             TYPE_NETWORK_START inclusive and \ref TYPE_NETWORK_END
+///             exclusive.
+///
+/// \returns a future in the \ref STATE_PROCESSING state, which the worker
+///          thread must complete with future_network_try_set_result() or
+///          future_eager_acknowledge_cancel().
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+udipe_future_t* future_network_allocate(udipe_context_t* context,
+                                        future_type_t type);
+
+/// Truth that a network future has been canceled
+///
+/// This is the network command counterpart of udipe_custom_canceled(), which
+/// worker threads use to poll for the cancelation of pending commands. If this
+/// returns true, the cancelation must be acknowledged with
+/// future_eager_acknowledge_cancel().
+///
+/// This function must be called within a logging scope.
+///
+/// \param future must be a network future whose result has not been set yet.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+bool future_network_canceled(udipe_future_t* future);
+
+/// Try to set the result of a network future
+///
+/// This is the network command counterpart of udipe_custom_try_set_result(),
+/// which worker threads use to publish the result of network commands. It has
+/// the same semantics: if the future was canceled, then the cancelation is
+/// acknowledged, `payload` is discarded and `false` is returned.
+///
+/// This function must be called within a logging scope.
+///
+/// \param future must be a network future whose result has not been set yet.
+///               It must not be used by the caller after calling this
+///               function.
+/// \param successful indicates whether the operation succeeded. If this is
+///                   false, the future's outcome will be \ref
+///                   OUTCOME_FAILURE_INTERNAL, but `payload` will still be
+///                   reported to the client, which can use it to find out
+///                   what went wrong.
+/// \param payload is the result of the network operation, whose variant must
+///                match the type of `future`.
+///
+/// \returns true if the result was set, false if the future was canceled.
+UDIPE_NON_NULL_ARGS
+bool future_network_try_set_result(udipe_future_t* future,
+                                   bool successful,
+                                   udipe_network_payload_t payload);
 
 /// \}
 
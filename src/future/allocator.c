@@ -222,6 +222,8 @@ void future_sync_initialize(udipe_future_t* future,
         case TYPE_NETWORK_DISCONNECT:
         case TYPE_NETWORK_SEND:
         case TYPE_NETWORK_RECV:
+        case TYPE_NETWORK_RECV_STREAM:
+        case TYPE_NETWORK_SEND_STREAM:
         case TYPE_CUSTOM:  // aliases TYPE_NETWORK_END
             debug("Obtaining the output event object...");
             future->status_sync.event = event_cache_allocate(&thread_cache->events);
@@ -323,9 +325,12 @@ void future_upstream_detach(udipe_future_t* future) {
         case TYPE_NETWORK_DISCONNECT:
         case TYPE_NETWORK_SEND:
         case TYPE_NETWORK_RECV:
-            // TODO: Implement once network futures are ready, beware that you
-            //       cannot break to the same code path as join/unordered
-            exit_with_error("Not implemented yet!");
+        case TYPE_NETWORK_RECV_STREAM:
+        case TYPE_NETWORK_SEND_STREAM:
+            // Network commands start as soon as they are submitted, since the
+            // udipe_start_xyz() functions do not let them wait for other
+            // futures, so network futures never have an upstream.
+            debug("No upstream to be detached for network futures.");
             break;
         case TYPE_JOIN:
             debug("Extracting collective upstream from join_state...");
@@ -384,6 +389,8 @@ void future_sync_finalize(udipe_future_t* future,
         case TYPE_NETWORK_DISCONNECT:
         case TYPE_NETWORK_SEND:
         case TYPE_NETWORK_RECV:
+        case TYPE_NETWORK_RECV_STREAM:
+        case TYPE_NETWORK_SEND_STREAM:
         case TYPE_CUSTOM:  // aliases TYPE_NETWORK_END
             debug("Recycling the output event object...");
             event_cache_liberate(&thread_cache->events,
@@ -204,6 +204,8 @@ void future_status_debug_check(future_status_t status,
             case TYPE_NETWORK_DISCONNECT:
             case TYPE_NETWORK_SEND:
             case TYPE_NETWORK_RECV:
+            case TYPE_NETWORK_RECV_STREAM:
+            case TYPE_NETWORK_SEND_STREAM:
                 // Network futures can be in all possible states: WAITING,
                 // PROCESSING, CANCELING and RESULT
                 result.state = (rand() % (NUM_STATES - 1)) + 1;
@@ -51,6 +51,14 @@ typedef enum future_type_e /* : _BitInt(4) */ {
     ///
     TYPE_NETWORK_RECV,
 
+    /// Datagram stream receive request, see udipe_start_recv_stream()
+    ///
+    TYPE_NETWORK_RECV_STREAM,
+
+    /// Datagram stream send request, see udipe_start_send_stream()
+    ///
+    TYPE_NETWORK_SEND_STREAM,
+
     /// First future type past the end of the list of network operations
     ///
     /// See also \ref TYPE_NETWORK_START.
@@ -107,6 +115,8 @@ bool future_type_has_dependencies(future_type_t type) {
         case TYPE_NETWORK_DISCONNECT:
         case TYPE_NETWORK_SEND:
         case TYPE_NETWORK_RECV:
+        case TYPE_NETWORK_RECV_STREAM:
+        case TYPE_NETWORK_SEND_STREAM:
         case TYPE_JOIN:
         case TYPE_UNORDERED:
             return true;
@@ -132,6 +142,8 @@ bool future_type_has_processing(future_type_t type) {
         case TYPE_NETWORK_DISCONNECT:
         case TYPE_NETWORK_SEND:
         case TYPE_NETWORK_RECV:
+        case TYPE_NETWORK_RECV_STREAM:
+        case TYPE_NETWORK_SEND_STREAM:
         case TYPE_CUSTOM:
         case TYPE_TIMER_ONCE:
         case TYPE_TIMER_REPEAT:
@@ -165,6 +177,8 @@ bool future_type_uses_lazy_lock(future_type_t type) {
         case TYPE_NETWORK_DISCONNECT:
         case TYPE_NETWORK_SEND:
         case TYPE_NETWORK_RECV:
+        case TYPE_NETWORK_RECV_STREAM:
+        case TYPE_NETWORK_SEND_STREAM:
         case TYPE_CUSTOM:  // Aliases TYPE_NETWORK_END
         case TYPE_TIMER_ONCE:
             return false;
@@ -219,6 +233,8 @@ bool future_type_uses_worker_thread(future_type_t type) {
         case TYPE_NETWORK_DISCONNECT:
         case TYPE_NETWORK_SEND:
         case TYPE_NETWORK_RECV:
+        case TYPE_NETWORK_RECV_STREAM:
+        case TYPE_NETWORK_SEND_STREAM:
         case TYPE_CUSTOM:  // Aliases TYPE_NETWORK_END
             return true;
         #ifdef __linux__
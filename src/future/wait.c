@@ -100,6 +100,8 @@ future_status_t future_wait(udipe_future_t* future,
         case TYPE_NETWORK_DISCONNECT:
         case TYPE_NETWORK_SEND:
         case TYPE_NETWORK_RECV:
+        case TYPE_NETWORK_RECV_STREAM:
+        case TYPE_NETWORK_SEND_STREAM:
         case TYPE_CUSTOM:
             // Eager futures that are driven by a dedicated thread enjoy
             // automatic status updates by said worker threads...
@@ -178,12 +178,20 @@
                            num_valid_identifiers);
                     ensure_le(num_valid_identifiers, num_identifiers);
                     for (size_t i = 0; i < num_valid_identifiers; ++i) {
-                        // We only subscribe to EPOLLIN and don't expect EPOLLERR or
-                        // EPOLLHUP for the kind of fds that we are monitoring.
-                        ensure_eq(events[i].events, EPOLLIN);
+                        // We only subscribe to EPOLLIN, but sockets also report
+                        // EPOLLERR when an error is pending. Reading from them
+                        // is how such errors are handled, so we treat this as
+                        // readability. We don't expect EPOLLHUP for the kind
+                        // of fds that we are monitoring.
+                        ensure_eq(events[i].events
+                                  & ~(uint32_t)(EPOLLIN | EPOLLERR),
+                                  (uint32_t)0);
                         identifiers[i] = events[i].data.u64;
                     }
                     return num_valid_identifiers;
+                } else if (result == 0) {
+                    debug("Reached timeout before inpoll became readable!");
+                    return (size_t)0;
                 }
                 assert(result == -1);
 
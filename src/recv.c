@@ -0,0 +1,2877 @@
+#ifdef __linux__
+    #define _GNU_SOURCE
+#endif
+
+#include "recv.h"
+
+#include <udipe/result.h>
+
+#include "buffer.h"
+#include "command.h"
+#include "connection.h"
+#include "error.h"
+#include "future.h"
+#include "inpoll.h"
+#include "log.h"
+#include "send.h"
+#include "uring.h"
+#include "visibility.h"
+#include "worker.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __linux__
+    #include <netinet/in.h>
+    #include <netinet/udp.h>
+    #include <poll.h>
+    #include <sys/socket.h>
+#endif
+
+
+UDIPE_NODISCARD
+recv_state_t recv_state_initialize() {
+    return (recv_state_t){ 0 };
+}
+
+UDIPE_NON_NULL_ARGS
+void recv_state_finalize(recv_state_t* state) {
+    LOGGED_FUNCTION_START("%p", state)
+        ensure_eq(state->backlog_len, (size_t)0);
+        ensure_eq(state->num_pending, (size_t)0);
+        ensure(!state->stream.callback);
+        ensure_eq(state->uring_operation, (uint64_t)0);
+    LOGGED_FUNCTION_END
+}
+
+/// Fill in the metadata of a freshly received datagram
+///
+/// This parses the control messages of the datagram, and takes care of GRO
+/// batches that did not fit in the reception buffer by dropping the trailing
+/// datagrams that only partially fit in.
+///
+/// This function must be called within a logging scope.
+///
+/// \param connection must be the connection that the datagram was received
+///                   from.
+/// \param datagram must point to a datagram whose `buffer` has just been
+///                 filled.
+/// \param header must be the message header that was used for reception.
+/// \param received must be the number of bytes that were received.
+UDIPE_NON_NULL_ARGS
+static void finish_datagram(udipe_connection_t* connection,
+                            recv_datagram_t* datagram,
+                            const struct msghdr* header,
+                            size_t received) {
+    LOGGED_FUNCTION_START("%p, %p, %p, %zu",
+                          connection, datagram, header, received)
+        datagram->size = received;
+        datagram->offset = 0;
+        datagram->segment_size = 0;
+        datagram->software_timestamp = 0;
+        datagram->hardware_timestamp = 0;
+        datagram->truncated = header->msg_flags & MSG_TRUNC;
+        if (header->msg_flags & MSG_CTRUNC) {
+            warn("Some control messages were truncated!");
+        }
+
+        trace("Parsing control messages...");
+        for (const struct cmsghdr* cmsg = CMSG_FIRSTHDR(header);
+             cmsg;
+             cmsg = CMSG_NXTHDR((struct msghdr*)header, (struct cmsghdr*)cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int segment_size;
+                memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(int));
+                assert(segment_size > 0);
+                tracef("Received a GRO batch of %d-byte datagrams.",
+                       segment_size);
+                datagram->segment_size = (size_t)segment_size;
+            } else if (cmsg->cmsg_level == SOL_SOCKET
+                       && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                // Entry 0 is the software timestamp, entry 2 the raw hardware
+                // timestamp, and entry 1 is deprecated
+                struct scm_timestamping timestamps;
+                memcpy(&timestamps,
+                       CMSG_DATA(cmsg),
+                       sizeof(struct scm_timestamping));
+                datagram->software_timestamp =
+                    (uint64_t)timestamps.ts[0].tv_sec * 1000000000
+                    + (uint64_t)timestamps.ts[0].tv_nsec;
+                datagram->hardware_timestamp =
+                    (uint64_t)timestamps.ts[2].tv_sec * 1000000000
+                    + (uint64_t)timestamps.ts[2].tv_nsec;
+                tracef("Datagram has timestamps %" PRIu64 " (software) and "
+                       "%" PRIu64 " (hardware).",
+                       datagram->software_timestamp,
+                       datagram->hardware_timestamp);
+            } else if (cmsg->cmsg_level == SOL_SOCKET
+                       && cmsg->cmsg_type == SO_RXQ_OVFL) {
+                // The kernel reports a wrapping 32-bit cumulative count, which
+                // we extend to 64 bits using the last value that we saw.
+                uint32_t kernel_dropped;
+                memcpy(&kernel_dropped, CMSG_DATA(cmsg), sizeof(uint32_t));
+                const uint64_t old_dropped =
+                    atomic_load_explicit(&connection->recv_dropped,
+                                         memory_order_relaxed);
+                const uint32_t new_drops =
+                    kernel_dropped - (uint32_t)old_dropped;
+                if (new_drops) {
+                    debugf("Kernel dropped %" PRIu32 " more datagram(s).",
+                           new_drops);
+                    atomic_store_explicit(&connection->recv_dropped,
+                                          old_dropped + new_drops,
+                                          memory_order_relaxed);
+                }
+            }
+        }
+
+        const size_t segment_size = datagram->segment_size;
+        if (datagram->truncated && segment_size && received >= segment_size) {
+            warnf("GRO batch did not fit in a %zu-byte buffer, dropping the "
+                  "last datagram(s). Consider using larger buffers.",
+                  received);
+            datagram->size = received - received % segment_size;
+            datagram->truncated = false;
+        }
+    LOGGED_FUNCTION_END
+}
+
+/// Start monitoring a connection's socket for incoming datagrams
+///
+/// This must be done when a connection gets its first pending receive command
+/// or a reception stream.
+///
+/// With the io_uring backend, this is done by recv_prepare() instead. Sockets
+/// of busy-polled connections are not monitored either, as recv_busy_poll()
+/// reads from them directly.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be a connection whose socket is not monitored yet.
+UDIPE_NON_NULL_ARGS
+static void monitor_socket(worker_t* worker, udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p, %p", worker, connection)
+        if (worker_uses_uring(worker) || connection->busy_poll) return;
+        switch (inpoll_attach(worker->sockets,
+                              connection->socket,
+                              (uint64_t)(uintptr_t)connection)) {
+        case INPOLL_ATTACH_SUCCESS:
+            break;
+        case INPOLL_ATTACH_TOO_NESTED:  // Sockets are not epoll fds
+        case INPOLL_ATTACH_REDUNDANT:  // Only attached when first needed
+            exit_with_error("This error is not expected to happen!");
+        }
+    LOGGED_FUNCTION_END
+}
+
+/// Stop monitoring a connection's socket for incoming datagrams
+///
+/// This must be done when a connection loses its last pending receive command
+/// or its reception stream.
+///
+/// With the io_uring backend, the operation that is in flight on the socket is
+/// left alone, and whatever it receives will land in the backlog.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be a connection whose socket was monitored by
+///                   monitor_socket().
+UDIPE_NON_NULL_ARGS
+static void unmonitor_socket(worker_t* worker, udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p, %p", worker, connection)
+        if (worker_uses_uring(worker) || connection->busy_poll) return;
+        switch (inpoll_detach(worker->sockets, connection->socket)) {
+        case INPOLL_DETACH_SUCCESS:
+            break;
+        case INPOLL_DETACH_NONEXISTENT:  // Attached by monitor_socket()
+            exit_with_error("This error is not expected to happen!");
+        }
+    LOGGED_FUNCTION_END
+}
+
+/// Complete a pending receive command and remove it from the pending list
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a valid worker.
+/// \param pending_idx must be the index of a valid entry of
+///                    `worker->pending_recvs`.
+/// \param result is the result of the receive command.
+UDIPE_NON_NULL_ARGS
+static void complete_pending(worker_t* worker,
+                             size_t pending_idx,
+                             udipe_recv_result_t result) {
+    LOGGED_FUNCTION_START("%p, %zu, { %zu, %d }",
+                          worker, pending_idx, result.size, result.error)
+        assert(pending_idx < worker->num_pending_recvs);
+        pending_recv_t* const pending = &worker->pending_recvs[pending_idx];
+        udipe_connection_t* const connection = pending->options.connection;
+
+        debug("Notifying the client...");
+        if (pending->future) {
+            (void)future_network_try_set_result(
+                pending->future,
+                result.error == 0,
+                (udipe_network_payload_t){ .recv = result }
+            );
+        } else {
+            debug("...which already acknowledged a cancelation.");
+        }
+
+        debug("Removing the command from the pending list...");
+        memmove(pending,
+                pending + 1,
+                (worker->num_pending_recvs - pending_idx - 1)
+                    * sizeof(pending_recv_t));
+        --(worker->num_pending_recvs);
+
+        assert(connection->recv.num_pending > 0);
+        if (--(connection->recv.num_pending) == 0) {
+            debug("Last pending command of this connection is gone, "
+                  "stop monitoring its socket...");
+            unmonitor_socket(worker, connection);
+        }
+    LOGGED_FUNCTION_END
+}
+
+/// Hand over datagrams from the backlog to a client
+///
+/// This copies the payload of the oldest datagram from a connection's backlog
+/// into a client buffer, then liberates the associated worker buffer.
+///
+/// If the oldest backlog entry is a GRO batch of several datagrams, as many
+/// whole datagrams as fit are copied instead, and the worker buffer is only
+/// liberated once all of them have been handed over.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be a connection with a nonempty backlog.
+/// \param buffer is the client's buffer.
+/// \param buffer_size is the size of the client's buffer.
+///
+/// \returns the result of the client's receive command.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_SPECIFIC_ARGS(1, 2)
+static udipe_recv_result_t pop_backlog(worker_t* worker,
+                                       udipe_connection_t* connection,
+                                       void* buffer,
+                                       size_t buffer_size) {
+    LOGGED_FUNCTION_START("%p, %p, %p, %zu",
+                          worker, connection, buffer, buffer_size)
+        recv_state_t* const state = &connection->recv;
+        assert(state->backlog_len > 0);
+        recv_datagram_t* const datagram = &state->backlog[state->backlog_start];
+        const size_t remaining = datagram->size - datagram->offset;
+        const size_t segment_size = datagram->segment_size;
+
+        udipe_recv_result_t result = {
+            .size = remaining,
+            .software_timestamp = datagram->software_timestamp,
+            .hardware_timestamp = datagram->hardware_timestamp,
+            .error = 0
+        };
+        size_t consumed = remaining;
+        if (datagram->truncated) {
+            debug("Datagram was truncated on reception.");
+            result.error = EMSGSIZE;
+        }
+        if (result.size > buffer_size) {
+            if (segment_size && buffer_size >= segment_size) {
+                result.size = buffer_size - buffer_size % segment_size;
+                debugf("Handing over %zu bytes of a %zu-byte GRO batch...",
+                       result.size, remaining);
+                consumed = result.size;
+            } else {
+                debugf("Truncating %zu-byte datagram to fit in %zu-byte buffer.",
+                       segment_size ? segment_size : result.size, buffer_size);
+                result.size = buffer_size;
+                result.error = EMSGSIZE;
+                if (segment_size && segment_size < remaining) {
+                    consumed = segment_size;
+                }
+            }
+        }
+        if (segment_size && result.size > segment_size) {
+            result.segment_size = segment_size;
+        }
+        tracef("Copying %zu bytes of payload to the client...", result.size);
+        memcpy(buffer, (char*)datagram->buffer + datagram->offset, result.size);
+
+        datagram->offset += consumed;
+        if (datagram->offset < datagram->size) {
+            debugf("Keeping the remaining %zu bytes in the backlog.",
+                   datagram->size - datagram->offset);
+            return result;
+        }
+        trace("Liberating the worker buffer...");
+        buffer_liberate(&worker->buffers, datagram->buffer);
+        *datagram = (recv_datagram_t){ 0 };
+        state->backlog_start = (state->backlog_start + 1) % UDIPE_MAX_BUFFERS;
+        --(state->backlog_len);
+        return result;
+    LOGGED_FUNCTION_END
+}
+
+/// Complete pending receive commands on a connection from its backlog
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be a valid connection.
+UDIPE_NON_NULL_ARGS
+static void serve_backlog(worker_t* worker, udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p, %p", worker, connection)
+        size_t pending_idx = 0;
+        while (connection->recv.backlog_len > 0
+               && connection->recv.num_pending > 0) {
+            assert(pending_idx < worker->num_pending_recvs);
+            pending_recv_t* const pending = &worker->pending_recvs[pending_idx];
+            if (pending->options.connection != connection) {
+                ++pending_idx;
+                continue;
+            }
+            if (future_network_canceled(pending->future)) {
+                debug("Skipping a pending command that was canceled...");
+                future_eager_acknowledge_cancel(pending->future);
+                pending->future = NULL;
+                complete_pending(worker,
+                                 pending_idx,
+                                 (udipe_recv_result_t){ 0 });
+                continue;
+            }
+            const udipe_recv_result_t result =
+                pop_backlog(worker,
+                            connection,
+                            pending->options.buffer,
+                            pending->options.buffer_size);
+            complete_pending(worker, pending_idx, result);
+        }
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void recv_start(worker_t* worker, const command_t* command) {
+    LOGGED_FUNCTION_START("%p, %p", worker, command)
+        const udipe_recv_options_t* const options = &command->options.recv;
+        udipe_connection_t* const connection = options->connection;
+        ensure(connection);
+        ensure(options->buffer || options->buffer_size == 0);
+
+        debug("Checking the connection's direction...");
+        if (connection->direction == UDIPE_OUT) {
+            warn("Attempted to receive from an output-only connection!");
+            (void)future_network_try_set_result(
+                command->future,
+                false,
+                (udipe_network_payload_t){
+                    .recv = (udipe_recv_result_t){ .error = EOPNOTSUPP }
+                }
+            );
+            return;
+        }
+
+        debug("Checking for reception streams...");
+        if (connection->recv.stream.callback) {
+            warn("Attempted to receive from a connection that has an active "
+                 "reception stream!");
+            (void)future_network_try_set_result(
+                command->future,
+                false,
+                (udipe_network_payload_t){
+                    .recv = (udipe_recv_result_t){ .error = EBUSY }
+                }
+            );
+            return;
+        }
+
+        if (connection->recv.backlog_len > 0
+            && connection->recv.num_pending == 0) {
+            debug("Serving the command from the connection's backlog...");
+            const udipe_recv_result_t result =
+                pop_backlog(worker,
+                            connection,
+                            options->buffer,
+                            options->buffer_size);
+            (void)future_network_try_set_result(
+                command->future,
+                result.error == 0,
+                (udipe_network_payload_t){ .recv = result }
+            );
+            return;
+        }
+
+        debug("Backlog is empty, recording the command as pending...");
+        ensure_lt(worker->num_pending_recvs, MAX_PENDING_RECVS);
+        udipe_duration_ns_t timeout = options->timeout;
+        if (timeout == UDIPE_DURATION_DEFAULT) {
+            timeout = connection->recv_timeout;
+        }
+        worker->pending_recvs[worker->num_pending_recvs++] = (pending_recv_t){
+            .options = *options,
+            .future = command->future,
+            .remaining_time = timeout
+        };
+        if ((connection->recv.num_pending)++ == 0) {
+            debug("First pending command on this connection, "
+                  "start monitoring its socket...");
+            monitor_socket(worker, connection);
+        }
+    LOGGED_FUNCTION_END
+}
+
+/// End the reception stream of a connection
+///
+/// The stream's future is notified of the final stream result, the connection
+/// is removed from the worker's list of reception streams, and its socket
+/// stops being monitored.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be a connection with an active reception stream.
+/// \param error is the error code that the stream should end with, or 0 if
+///              the stream was ended by its callback.
+/// \param canceled indicates that the stream was canceled, in which case
+///                 its future must be notified of the cancelation instead of
+///                 receiving a result.
+UDIPE_NON_NULL_ARGS
+static void end_stream(worker_t* worker,
+                       udipe_connection_t* connection,
+                       int error,
+                       bool canceled) {
+    LOGGED_FUNCTION_START("%p, %p, %d, %d",
+                          worker, connection, error, canceled)
+        recv_stream_t* const stream = &connection->recv.stream;
+        assert(stream->callback);
+
+        debug("Notifying the client...");
+        if (canceled) {
+            future_eager_acknowledge_cancel(stream->future);
+        } else {
+            stream->result.error = error;
+            (void)future_network_try_set_result(
+                stream->future,
+                error == 0,
+                (udipe_network_payload_t){ .recv_stream = stream->result }
+            );
+        }
+        *stream = (recv_stream_t){ 0 };
+
+        debug("Removing the connection from the list of streams...");
+        size_t stream_idx = 0;
+        while (worker->recv_streams[stream_idx] != connection) {
+            ++stream_idx;
+            assert(stream_idx < worker->num_recv_streams);
+        }
+        memmove(&worker->recv_streams[stream_idx],
+                &worker->recv_streams[stream_idx + 1],
+                (worker->num_recv_streams - stream_idx - 1)
+                    * sizeof(udipe_connection_t*));
+        --(worker->num_recv_streams);
+
+        debug("Stop monitoring the connection's socket...");
+        unmonitor_socket(worker, connection);
+    LOGGED_FUNCTION_END
+}
+
+/// Pass datagrams from the backlog to a connection's reception stream
+///
+/// Each datagram is passed to the stream's callback in place, then its worker
+/// buffer is liberated. This goes on until either the backlog is empty or the
+/// callback requests the end of the stream, in which case the remaining
+/// datagrams are left in the backlog for subsequent commands.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be a connection with an active reception stream.
+UDIPE_NON_NULL_ARGS
+static void serve_stream(worker_t* worker, udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p, %p", worker, connection)
+        recv_state_t* const state = &connection->recv;
+        recv_stream_t* const stream = &state->stream;
+        assert(stream->callback);
+        if (future_network_canceled(stream->future)) {
+            debug("Stream was canceled, acknowledging without serving it.");
+            end_stream(worker, connection, 0, true);
+            return;
+        }
+
+        while (state->backlog_len > 0) {
+            recv_datagram_t* const datagram =
+                &state->backlog[state->backlog_start];
+            const size_t size = datagram->size - datagram->offset;
+            const size_t segment_size = datagram->segment_size;
+            udipe_recv_result_t result = {
+                .size = size,
+                .software_timestamp = datagram->software_timestamp,
+                .hardware_timestamp = datagram->hardware_timestamp
+            };
+            if (datagram->truncated) {
+                debug("Datagram was truncated on reception.");
+                result.error = EMSGSIZE;
+            }
+            if (segment_size && size > segment_size) {
+                result.segment_size = segment_size;
+                stream->result.num_datagrams +=
+                    (size + segment_size - 1) / segment_size;
+            } else {
+                ++(stream->result.num_datagrams);
+            }
+            stream->result.num_bytes += size;
+
+            tracef("Passing %zu bytes of payload to the callback...", size);
+            const bool keep_going =
+                stream->callback(stream->context,
+                                 (const char*)datagram->buffer
+                                    + datagram->offset,
+                                 result);
+
+            trace("Liberating the worker buffer...");
+            buffer_liberate(&worker->buffers, datagram->buffer);
+            *datagram = (recv_datagram_t){ 0 };
+            state->backlog_start =
+                (state->backlog_start + 1) % UDIPE_MAX_BUFFERS;
+            --(state->backlog_len);
+
+            if (!keep_going) {
+                debug("Callback requested the end of the stream.");
+                end_stream(worker, connection, 0, false);
+                return;
+            }
+        }
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void recv_stream_start(worker_t* worker, const command_t* command) {
+    LOGGED_FUNCTION_START("%p, %p", worker, command)
+        const udipe_recv_stream_options_t* const options =
+            &command->options.recv_stream;
+        udipe_connection_t* const connection = options->connection;
+        ensure(connection);
+        ensure(options->callback);
+
+        debug("Checking that the stream can be set up...");
+        int error = 0;
+        if (connection->direction == UDIPE_OUT) {
+            warn("Attempted to receive from an output-only connection!");
+            error = EOPNOTSUPP;
+        } else if (connection->recv.stream.callback
+                   || connection->recv.num_pending > 0) {
+            warn("Attempted to start a reception stream on a connection that "
+                 "is already receiving datagrams!");
+            error = EBUSY;
+        } else if (worker->num_recv_streams == MAX_RECV_STREAMS) {
+            warn("Attempted to start more reception streams than the worker "
+                 "can handle!");
+            error = ENOBUFS;
+        }
+        if (error) {
+            (void)future_network_try_set_result(
+                command->future,
+                false,
+                (udipe_network_payload_t){
+                    .recv_stream = (udipe_recv_stream_result_t){
+                        .error = error
+                    }
+                }
+            );
+            return;
+        }
+
+        debug("Setting up the reception stream...");
+        connection->recv.stream = (recv_stream_t){
+            .callback = options->callback,
+            .context = options->context,
+            .future = command->future
+        };
+        worker->recv_streams[worker->num_recv_streams++] = connection;
+        monitor_socket(worker, connection);
+
+        debug("Passing backlog datagrams to the stream, if any...");
+        serve_stream(worker, connection);
+    LOGGED_FUNCTION_END
+}
+
+/// Handle a socket error that occured during datagram reception
+///
+/// Errors that can only be caused by a `libudipe` bug lead to program exit.
+/// Spurious errors are ignored. Other errors are reported to the oldest
+/// pending receive command of the connection, or to the callback of its
+/// reception stream.
+///
+/// On connections that can send datagrams, the socket's error queue is also
+/// drained with send_drain_error_queue(). This takes care of the errors that
+/// earlier datagrams triggered, which fail reception and make the socket look
+/// readable until they are read.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be a connection with pending receive commands or
+///                   an active reception stream.
+UDIPE_NON_NULL_ARGS
+static void handle_recv_error(worker_t* worker,
+                              udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p, %p", worker, connection)
+        const int error = errno;
+        errno = 0;
+        if (connection->direction != UDIPE_IN) {
+            send_drain_error_queue(worker, connection);
+        }
+        switch (error) {
+        case EAGAIN:  // No datagram available after all
+        #if EAGAIN != EWOULDBLOCK
+            case EWOULDBLOCK:
+        #endif
+        case EINTR:  // Interrupted by a signal before any datagram came in
+            debug("Spurious wakeup, will try again later.");
+            return;
+        case EBADF:  // Invalid socket
+        case EFAULT:  // Invalid buffer
+        case EINVAL:  // Invalid argument
+        case ENOTSOCK:  // Not a socket
+            exit_after_c_error("This error is not expected to happen!");
+        default:
+            warnf("Failed to receive a datagram: %s.", strerror(error));
+            recv_stream_t* const stream = &connection->recv.stream;
+            if (stream->callback) {
+                debug("Reporting the error to the stream callback...");
+                const bool keep_going =
+                    stream->callback(stream->context,
+                                     NULL,
+                                     (udipe_recv_result_t){ .error = error });
+                if (!keep_going) {
+                    debug("Callback requested the end of the stream.");
+                    end_stream(worker, connection, 0, false);
+                }
+                return;
+            }
+            for (size_t i = 0; i < worker->num_pending_recvs; ++i) {
+                if (worker->pending_recvs[i].options.connection == connection) {
+                    complete_pending(worker,
+                                     i,
+                                     (udipe_recv_result_t){ .error = error });
+                    return;
+                }
+            }
+            exit_with_error("Connection should have had a pending command!");
+        }
+    LOGGED_FUNCTION_END
+}
+
+/// Receive a datagram straight into the buffer of the oldest pending receive
+/// command on a connection
+///
+/// This is the slow path that is taken when the worker has run out of buffers,
+/// which can happen if other connections have accumulated a large backlog.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be a connection with pending receive commands and
+///                   an empty backlog.
+UDIPE_NON_NULL_ARGS
+static void recv_direct(worker_t* worker, udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p, %p", worker, connection)
+        size_t pending_idx = 0;
+        while (worker->pending_recvs[pending_idx].options.connection
+               != connection) {
+            ++pending_idx;
+            assert(pending_idx < worker->num_pending_recvs);
+        }
+        const udipe_recv_options_t* const options =
+            &worker->pending_recvs[pending_idx].options;
+
+        debug("Receiving into the client buffer...");
+        struct iovec iovec = {
+            .iov_base = options->buffer,
+            .iov_len = options->buffer_size
+        };
+        recv_control_t control;
+        struct msghdr header = {
+            .msg_iov = &iovec,
+            .msg_iovlen = 1,
+            .msg_control = control.bytes,
+            .msg_controllen = sizeof(control)
+        };
+        const ssize_t result = recvmsg(connection->socket,
+                                       &header,
+                                       MSG_DONTWAIT);
+        if (result < 0) {
+            handle_recv_error(worker, connection);
+            return;
+        }
+        recv_datagram_t datagram = { .buffer = options->buffer };
+        finish_datagram(connection, &datagram, &header, (size_t)result);
+
+        udipe_recv_result_t recv_result = {
+            .size = datagram.size,
+            .software_timestamp = datagram.software_timestamp,
+            .hardware_timestamp = datagram.hardware_timestamp
+        };
+        if (datagram.truncated) {
+            debugf("Truncated datagram to fit in %zu-byte buffer.",
+                   options->buffer_size);
+            recv_result.error = EMSGSIZE;
+        }
+        if (datagram.segment_size && datagram.size > datagram.segment_size) {
+            recv_result.segment_size = datagram.segment_size;
+        }
+        complete_pending(worker, pending_idx, recv_result);
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void recv_on_readable(worker_t* worker, udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p, %p", worker, connection)
+        recv_state_t* const state = &connection->recv;
+        if (state->num_pending == 0 && !state->stream.callback) {
+            debug("No pending receive command or stream, nothing to do.");
+            return;
+        }
+
+        debug("Allocating buffers for incoming datagrams...");
+        void* buffers[UDIPE_MAX_BUFFERS];
+        const size_t max_buffers = UDIPE_MAX_BUFFERS - state->backlog_len;
+        size_t num_buffers = 0;
+        while (num_buffers < max_buffers) {
+            void* const buffer = buffer_allocate(&worker->buffers);
+            if (!buffer) break;
+            buffers[num_buffers++] = buffer;
+        }
+        if (num_buffers == 0 && state->stream.callback) {
+            // Streams get no reserved worker buffers: datagrams simply wait in
+            // the socket's receive buffer, which is sized for such hiccups.
+            debug("Out of worker buffers, will retry once some are liberated.");
+            return;
+        }
+        if (num_buffers == 0) {
+            debug("Out of worker buffers, will receive directly into a client "
+                  "buffer instead...");
+            recv_direct(worker, connection);
+            return;
+        }
+
+        debugf("Draining the socket into %zu buffer(s)...", num_buffers);
+        const size_t buffer_size = worker->buffers.config.buffer_size;
+        struct iovec iovecs[UDIPE_MAX_BUFFERS];
+        recv_control_t controls[UDIPE_MAX_BUFFERS];
+        struct mmsghdr messages[UDIPE_MAX_BUFFERS];
+        for (size_t i = 0; i < num_buffers; ++i) {
+            iovecs[i] = (struct iovec){
+                .iov_base = buffers[i],
+                .iov_len = buffer_size
+            };
+            messages[i] = (struct mmsghdr){
+                .msg_hdr = (struct msghdr){
+                    .msg_iov = &iovecs[i],
+                    .msg_iovlen = 1,
+                    .msg_control = controls[i].bytes,
+                    .msg_controllen = sizeof(recv_control_t)
+                }
+            };
+        }
+        const int result = recvmmsg(connection->socket,
+                                    messages,
+                                    (unsigned)num_buffers,
+                                    MSG_DONTWAIT,
+                                    NULL);
+        const size_t num_received = (result > 0) ? (size_t)result : 0;
+        debugf("Received %zu datagram(s).", num_received);
+
+        trace("Appending received datagrams to the backlog...");
+        for (size_t i = 0; i < num_received; ++i) {
+            const size_t backlog_idx =
+                (state->backlog_start + state->backlog_len) % UDIPE_MAX_BUFFERS;
+            recv_datagram_t* const datagram = &state->backlog[backlog_idx];
+            datagram->buffer = buffers[i];
+            finish_datagram(connection,
+                            datagram,
+                            &messages[i].msg_hdr,
+                            messages[i].msg_len);
+            ++(state->backlog_len);
+        }
+
+        trace("Liberating unused buffers...");
+        for (size_t i = num_received; i < num_buffers; ++i) {
+            buffer_liberate(&worker->buffers, buffers[i]);
+        }
+
+        if (result < 0) {
+            handle_recv_error(worker, connection);
+        } else if (state->stream.callback) {
+            serve_stream(worker, connection);
+        } else {
+            serve_backlog(worker, connection);
+        }
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+bool recv_busy_poll(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        // Polling a connection may complete pending commands, which reorders
+        // worker->pending_recvs, so connections are collected beforehand.
+        udipe_connection_t* polled[MAX_PENDING_RECVS + MAX_RECV_STREAMS];
+        size_t num_polled = 0;
+        for (size_t i = 0; i < worker->num_pending_recvs; ++i) {
+            udipe_connection_t* const connection =
+                worker->pending_recvs[i].options.connection;
+            if (!connection->busy_poll) continue;
+            bool known = false;
+            for (size_t j = 0; j < num_polled && !known; ++j) {
+                known = (polled[j] == connection);
+            }
+            if (!known) polled[num_polled++] = connection;
+        }
+        for (size_t i = 0; i < worker->num_recv_streams; ++i) {
+            udipe_connection_t* const connection = worker->recv_streams[i];
+            if (connection->busy_poll) polled[num_polled++] = connection;
+        }
+        if (num_polled == 0) return false;
+
+        debugf("Busy-polling %zu connection(s)...", num_polled);
+        for (size_t i = 0; i < num_polled; ++i) {
+            recv_on_readable(worker, polled[i]);
+        }
+        return true;
+    LOGGED_FUNCTION_END
+}
+
+/// Ask the kernel to cancel the io_uring operation that is in flight on a
+/// connection's socket
+///
+/// The operation remains in flight until its final completion is processed by
+/// recv_on_completion().
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be a connection with an io_uring operation in
+///                   flight, whose cancelation was not requested yet.
+UDIPE_NON_NULL_ARGS
+static void cancel_operation(worker_t* worker,
+                             udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p, %p", worker, connection)
+        recv_state_t* const state = &connection->recv;
+        assert(state->uring_operation);
+        assert(!state->uring_canceling);
+        struct io_uring_sqe* const sqe = uring_get_sqe(&worker->ring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = state->uring_operation;
+        sqe->user_data = WORKER_URING_CANCEL;
+        state->uring_canceling = true;
+    LOGGED_FUNCTION_END
+}
+
+/// Prepare an io_uring operation that gets datagrams into a connection
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a worker that uses an io_uring backend.
+/// \param connection must be a connection owned by `worker` that has pending
+///                   receive commands or an active reception stream.
+UDIPE_NON_NULL_ARGS
+static void arm_connection(worker_t* worker, udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p, %p", worker, connection)
+        recv_state_t* const state = &connection->recv;
+        if (state->uring_operation) {
+            trace("An operation is already in flight on this connection.");
+            return;
+        }
+        if (connection->busy_poll) {
+            trace("Connection is busy-polled by recv_busy_poll() instead.");
+            return;
+        }
+        const uint64_t connection_bits = (uint64_t)(uintptr_t)connection;
+        assert((connection_bits & WORKER_URING_TAG_MASK) == 0);
+
+        struct io_uring_sqe* const sqe = uring_get_sqe(&worker->ring);
+        sqe->fd = connection->socket;
+        if (worker->recv_ring_len > 0
+            && worker->io_backend == UDIPE_IO_URING_MULTISHOT) {
+            debug("Preparing a multishot reception into provided buffers...");
+            // The kernel lays out each buffer as a struct io_uring_recvmsg_out
+            // followed by the control messages and the payload, so only the
+            // amount of space to be reserved for control messages matters.
+            state->uring_header = (struct msghdr){
+                .msg_controllen = sizeof(recv_control_t)
+            };
+            sqe->opcode = IORING_OP_RECVMSG;
+            sqe->addr = (uint64_t)(uintptr_t)&state->uring_header;
+            sqe->len = 1;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = worker->recv_ring.group;
+            state->uring_operation =
+                connection_bits | WORKER_URING_RECV_MULTISHOT;
+        } else if (worker->recv_ring_len > 0) {
+            debug("Preparing a reception into a provided buffer...");
+            // The kernel does not report control message lengths back to us
+            // in this mode, so we detect them by zeroing out the buffer.
+            memset(&state->uring_control, 0, sizeof(recv_control_t));
+            state->uring_iovec = (struct iovec){
+                .iov_base = NULL,
+                .iov_len = worker->buffers.config.buffer_size
+            };
+            state->uring_header = (struct msghdr){
+                .msg_iov = &state->uring_iovec,
+                .msg_iovlen = 1,
+                .msg_control = state->uring_control.bytes,
+                .msg_controllen = sizeof(recv_control_t)
+            };
+            sqe->opcode = IORING_OP_RECVMSG;
+            sqe->addr = (uint64_t)(uintptr_t)&state->uring_header;
+            sqe->len = 1;
+            // Message flags are not reported back either, so we ask for the
+            // full datagram length in order to detect truncation.
+            sqe->msg_flags = MSG_TRUNC;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = worker->recv_ring.group;
+            state->uring_operation = connection_bits | WORKER_URING_RECV;
+        } else {
+            // As with the epoll backend, datagrams wait in the socket's receive
+            // buffer until worker buffers are liberated.
+            debug("Out of worker buffers, will wait for readability instead.");
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = POLLIN;
+            state->uring_operation = connection_bits | WORKER_URING_POLL;
+        }
+        sqe->user_data = state->uring_operation;
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void recv_prepare(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        assert(worker_uses_uring(worker));
+
+        debug("Topping up the provided buffer ring...");
+        // Keep half of the worker buffers for emission and backlogs
+        size_t target_len = worker->buffers.config.buffer_count / 2;
+        if (target_len == 0) target_len = 1;
+        const size_t initial_len = worker->recv_ring_len;
+        while (worker->recv_ring_len < target_len) {
+            void* const buffer = buffer_allocate(&worker->buffers);
+            if (!buffer) break;
+            const size_t buffer_idx = buffer_index(&worker->buffers, buffer);
+            assert(!worker->recv_ring_buffers[buffer_idx]);
+            uring_buffer_ring_provide(&worker->recv_ring,
+                                      buffer,
+                                      worker->buffers.config.buffer_size,
+                                      (uint16_t)buffer_idx);
+            worker->recv_ring_buffers[buffer_idx] = true;
+            ++(worker->recv_ring_len);
+        }
+        if (worker->recv_ring_len != initial_len) {
+            tracef("Provided %zu buffer(s) to the kernel.",
+                   worker->recv_ring_len - initial_len);
+            uring_buffer_ring_publish(&worker->recv_ring);
+        }
+
+        debug("Preparing receptions for connections that need datagrams...");
+        for (size_t i = 0; i < worker->num_pending_recvs; ++i) {
+            arm_connection(worker, worker->pending_recvs[i].options.connection);
+        }
+        for (size_t i = 0; i < worker->num_recv_streams; ++i) {
+            arm_connection(worker, worker->recv_streams[i]);
+        }
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void recv_on_completion(worker_t* worker,
+                        udipe_connection_t* connection,
+                        const struct io_uring_cqe* completion) {
+    LOGGED_FUNCTION_START("%p, %p, %p", worker, connection, completion)
+        recv_state_t* const state = &connection->recv;
+        assert(completion->user_data == state->uring_operation);
+        const bool more = completion->flags & IORING_CQE_F_MORE;
+        if (!more) {
+            trace("This is the last completion of the operation.");
+            state->uring_operation = 0;
+            state->uring_canceling = false;
+        }
+        const bool needed = state->num_pending > 0 || state->stream.callback;
+
+        const uint64_t tag = completion->user_data & WORKER_URING_TAG_MASK;
+        if (tag == WORKER_URING_POLL) {
+            debug("Socket became readable, draining it...");
+            if (completion->res < 0 && completion->res != -ECANCELED) {
+                warnf("Failed to poll a socket: %s.",
+                      strerror(-completion->res));
+            }
+            recv_on_readable(worker, connection);
+            return;
+        }
+        assert(tag == WORKER_URING_RECV || tag == WORKER_URING_RECV_MULTISHOT);
+
+        const int32_t buffer_idx = uring_selected_buffer(completion);
+        if (completion->res < 0) {
+            assert(buffer_idx < 0);
+            if (tag == WORKER_URING_RECV_MULTISHOT
+                && completion->res == -EINVAL) {
+                if (worker->io_backend == UDIPE_IO_URING_MULTISHOT) {
+                    warn("Multishot reception is not supported by this "
+                         "kernel, falling back to one datagram per operation.");
+                    worker->io_backend = UDIPE_IO_URING;
+                }
+                return;
+            }
+            switch (-completion->res) {
+            case ECANCELED:  // Canceled by recv_abort()
+                debug("Reception was canceled.");
+                return;
+            case ENOBUFS:  // Provided buffer ring ran dry
+                debug("Out of provided buffers, will try again later.");
+                return;
+            default:
+                if (!needed) {
+                    warnf("Failed to receive a datagram: %s.",
+                          strerror(-completion->res));
+                    return;
+                }
+                errno = -completion->res;
+                handle_recv_error(worker, connection);
+                return;
+            }
+        }
+
+        void* buffer;
+        if (buffer_idx >= 0) {
+            assert(worker->recv_ring_buffers[buffer_idx]);
+            worker->recv_ring_buffers[buffer_idx] = false;
+            --(worker->recv_ring_len);
+            buffer = buffer_at(&worker->buffers, (size_t)buffer_idx);
+        } else {
+            // The kernel does not consume a provided buffer when receiving an
+            // empty datagram without a multishot header, but backlog entries
+            // need one.
+            ensure_eq(tag, (uint64_t)WORKER_URING_RECV);
+            ensure_eq(completion->res, 0);
+            debug("Received an empty datagram, allocating a buffer for it...");
+            buffer = buffer_allocate(&worker->buffers);
+            if (!buffer) {
+                warn("Out of worker buffers, dropping an empty datagram.");
+                return;
+            }
+        }
+
+        debug("Appending the received datagram to the backlog...");
+        const size_t buffer_size = worker->buffers.config.buffer_size;
+        struct msghdr header;
+        size_t payload_offset;
+        size_t received;
+        if (tag == WORKER_URING_RECV_MULTISHOT) {
+            const struct io_uring_recvmsg_out* const out = buffer;
+            const size_t control_offset = sizeof(struct io_uring_recvmsg_out)
+                                          + state->uring_header.msg_namelen;
+            payload_offset = control_offset
+                             + state->uring_header.msg_controllen;
+            assert(payload_offset <= (size_t)completion->res);
+            header = (struct msghdr){
+                .msg_control = (char*)buffer + control_offset,
+                .msg_controllen = out->controllen,
+                .msg_flags = (int)out->flags
+            };
+            received = (size_t)completion->res - payload_offset;
+        } else {
+            header = state->uring_header;
+            header.msg_controllen = sizeof(recv_control_t);
+            received = (size_t)completion->res;
+            header.msg_flags = (received > buffer_size) ? MSG_TRUNC : 0;
+            if (received > buffer_size) received = buffer_size;
+            payload_offset = 0;
+        }
+        assert(state->backlog_len < UDIPE_MAX_BUFFERS);
+        const size_t backlog_idx =
+            (state->backlog_start + state->backlog_len) % UDIPE_MAX_BUFFERS;
+        recv_datagram_t* const datagram = &state->backlog[backlog_idx];
+        datagram->buffer = buffer;
+        finish_datagram(connection, datagram, &header, received);
+        datagram->offset += payload_offset;
+        datagram->size += payload_offset;
+        ++(state->backlog_len);
+
+        if (state->stream.callback) {
+            serve_stream(worker, connection);
+        } else {
+            serve_backlog(worker, connection);
+        }
+
+        if (more
+            && !needed
+            && !state->uring_canceling
+            && state->backlog_len >= MAX_IDLE_BACKLOG) {
+            debug("Connection has no use for more datagrams, canceling its "
+                  "multishot reception...");
+            cancel_operation(worker, connection);
+        }
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+udipe_duration_ns_t recv_on_clock(worker_t* worker,
+                                  udipe_duration_ns_t elapsed) {
+    LOGGED_FUNCTION_START("%p, %zu", worker, (size_t)elapsed)
+        udipe_duration_ns_t next_timeout = UDIPE_DURATION_MAX;
+        size_t pending_idx = 0;
+        while (pending_idx < worker->num_pending_recvs) {
+            pending_recv_t* const pending = &worker->pending_recvs[pending_idx];
+            if (future_network_canceled(pending->future)) {
+                debug("Acknowledging the cancelation of a pending command...");
+                future_eager_acknowledge_cancel(pending->future);
+                pending->future = NULL;
+                complete_pending(worker,
+                                 pending_idx,
+                                 (udipe_recv_result_t){ 0 });
+                continue;
+            }
+            if (pending->remaining_time == UDIPE_DURATION_MAX) {
+                ++pending_idx;
+                continue;
+            }
+            if (pending->remaining_time <= elapsed) {
+                debug("A pending command has timed out.");
+                complete_pending(worker,
+                                 pending_idx,
+                                 (udipe_recv_result_t){ .error = ETIMEDOUT });
+                continue;
+            }
+            pending->remaining_time -= elapsed;
+            if (pending->remaining_time < next_timeout) {
+                next_timeout = pending->remaining_time;
+            }
+            ++pending_idx;
+        }
+
+        size_t stream_idx = 0;
+        while (stream_idx < worker->num_recv_streams) {
+            udipe_connection_t* const connection =
+                worker->recv_streams[stream_idx];
+            if (future_network_canceled(connection->recv.stream.future)) {
+                debug("Acknowledging the cancelation of a reception stream...");
+                end_stream(worker, connection, 0, true);
+                continue;
+            }
+            ++stream_idx;
+        }
+        return next_timeout;
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void recv_abort(worker_t* worker, udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p, %p", worker, connection)
+        if (connection->recv.uring_operation) {
+            debug("Canceling the io_uring operation on the socket...");
+            if (!connection->recv.uring_canceling) {
+                cancel_operation(worker, connection);
+            }
+            while (connection->recv.uring_operation) {
+                struct io_uring_cqe completions[16];
+                const size_t num_completions =
+                    uring_wait(&worker->ring,
+                               completions,
+                               sizeof(completions) / sizeof(completions[0]),
+                               UDIPE_DURATION_MAX);
+                for (size_t i = 0; i < num_completions; ++i) {
+                    worker_complete(worker, &completions[i]);
+                }
+            }
+        }
+
+        debug("Aborting pending receive commands...");
+        size_t pending_idx = 0;
+        while (connection->recv.num_pending > 0) {
+            assert(pending_idx < worker->num_pending_recvs);
+            if (worker->pending_recvs[pending_idx].options.connection
+                != connection) {
+                ++pending_idx;
+                continue;
+            }
+            complete_pending(worker,
+                             pending_idx,
+                             (udipe_recv_result_t){ .error = ECONNABORTED });
+        }
+        if (connection->recv.stream.callback) {
+            debug("Aborting the reception stream...");
+            end_stream(worker, connection, ECONNABORTED, false);
+        }
+
+        debugf("Dropping %zu backlog datagram(s)...",
+               connection->recv.backlog_len);
+        recv_state_t* const state = &connection->recv;
+        while (state->backlog_len > 0) {
+            recv_datagram_t* const datagram =
+                &state->backlog[state->backlog_start];
+            buffer_liberate(&worker->buffers, datagram->buffer);
+            *datagram = (recv_datagram_t){ 0 };
+            state->backlog_start =
+                (state->backlog_start + 1) % UDIPE_MAX_BUFFERS;
+            --(state->backlog_len);
+        }
+    LOGGED_FUNCTION_END
+}
+
+DEFINE_PUBLIC
+UDIPE_NODISCARD
+udipe_segment_iterator_t udipe_recv_segments(const void* buffer,
+                                             udipe_recv_result_t result) {
+    assert(buffer || result.size == 0);
+    return (udipe_segment_iterator_t){
+        .next = (const char*)buffer,
+        .remaining = result.size,
+        .segment_size = result.segment_size,
+        .done = false
+    };
+}
+
+DEFINE_PUBLIC
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+bool udipe_next_segment(udipe_segment_iterator_t* iterator,
+                        udipe_segment_t* segment) {
+    if (iterator->done) return false;
+    size_t size = iterator->remaining;
+    if (iterator->segment_size && size > iterator->segment_size) {
+        size = iterator->segment_size;
+    }
+    *segment = (udipe_segment_t){
+        .payload = iterator->next,
+        .size = size
+    };
+    iterator->next += size;
+    iterator->remaining -= size;
+    iterator->done = (iterator->remaining == 0);
+    return true;
+}
+
+
+#ifdef UDIPE_BUILD_TESTS
+
+    #include <udipe/command.h>
+    #include <udipe/context.h>
+
+    #include "context.h"
+    #include "unit_tests.h"
+    #include "worker_pool.h"
+
+    #include <arpa/inet.h>
+    #include <hwloc.h>
+    #include <sched.h>
+    #include <stdlib.h>
+    #include <threads.h>
+    #include <time.h>
+    #include <unistd.h>
+
+    /// Number of datagrams that are sent at once by the batching test
+    ///
+    #define NUM_BATCH_DATAGRAMS ((size_t)16)
+
+    /// Number of datagrams that are sent at once by the drop accounting test
+    ///
+    /// This is enough to overflow the default socket receive buffer.
+    #define NUM_FLOOD_DATAGRAMS ((size_t)2000)
+
+    /// Maximal size of the test datagrams
+    ///
+    #define MAX_TEST_DATAGRAM_SIZE ((size_t)1024)
+
+    /// Parameters of the delayed sender thread
+    ///
+    typedef struct delayed_send_s {
+        fd_t socket;  ///< Unconnected UDP socket to send from
+        ip_address_t destination;  ///< Destination address
+        struct timespec delay;  ///< Delay before sending
+        char payload[8];  ///< Datagram payload
+    } delayed_send_t;
+
+    /// Thread that sends a datagram after a delay
+    ///
+    /// This thread performs no logging, errors are reported via its result.
+    static int delayed_send_func(void* context) {
+        const delayed_send_t* params = (const delayed_send_t*)context;
+        if (thrd_sleep(&params->delay, NULL) != 0) return 1;
+        const ssize_t result = sendto(params->socket,
+                                      params->payload,
+                                      sizeof(params->payload),
+                                      0,
+                                      &params->destination.any,
+                                      sizeof(struct sockaddr_in));
+        return (result == sizeof(params->payload)) ? 0 : 2;
+    }
+
+    /// Fill a buffer with a pattern that depends on a seed
+    ///
+    static void fill_pattern(char* buffer, size_t size, size_t seed) {
+        for (size_t i = 0; i < size; ++i) {
+            buffer[i] = (char)((i * 7 + seed * 13) % 256);
+        }
+    }
+
+    /// Send a datagram from an unconnected socket to a udipe connection
+    ///
+    /// This function must be called within a logging scope.
+    UDIPE_NON_NULL_ARGS
+    static void send_raw(fd_t socket,
+                         const ip_address_t* destination,
+                         const char* payload,
+                         size_t size) {
+        LOGGED_FUNCTION_START("%d, %p, %p, %zu",
+                              socket, destination, payload, size)
+            const ssize_t result = sendto(socket,
+                                          payload,
+                                          size,
+                                          0,
+                                          &destination->any,
+                                          sizeof(struct sockaddr_in));
+            ensure_eq(result, (ssize_t)size);
+        LOGGED_FUNCTION_END
+    }
+
+    /// State of the reception stream test callback
+    ///
+    typedef struct stream_check_s {
+        const size_t* sizes;  ///< Expected datagram sizes, or NULL for any size
+        size_t max_calls;  ///< Number of calls after which the stream ends
+        size_t num_calls;  ///< Number of calls so far
+        size_t num_errors;  ///< Number of unexpected datagrams or errors
+        udipe_recv_result_t last_result;  ///< Last result that was observed
+    } stream_check_t;
+
+    /// Reception stream test callback
+    ///
+    /// This checks that the n-th datagram has size `sizes[n]` and was filled
+    /// with fill_pattern() using `n` as a seed. It performs no logging,
+    /// unexpected datagrams are reported via `num_errors`.
+    static bool stream_check_callback(void* context,
+                                      const void* payload,
+                                      udipe_recv_result_t result) {
+        stream_check_t* const check = (stream_check_t*)context;
+        const size_t idx = check->num_calls++;
+        check->last_result = result;
+        if (result.error || !payload) {
+            ++(check->num_errors);
+        } else if (check->sizes) {
+            char expected[MAX_TEST_DATAGRAM_SIZE];
+            fill_pattern(expected, check->sizes[idx], idx);
+            if (result.size != check->sizes[idx]
+                || memcmp(expected, payload, result.size) != 0) {
+                ++(check->num_errors);
+            }
+        }
+        return check->num_calls < check->max_calls;
+    }
+
+    /// Check that a segment iterator yields the expected datagrams
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param buffer is the buffer that is being iterated over.
+    /// \param result is the reception result that describes its contents.
+    /// \param expected_sizes is the expected size of each datagram.
+    /// \param num_expected is the number of datagrams that should be yielded.
+    UDIPE_NON_NULL_SPECIFIC_ARGS(3)
+    static void check_segments(const char* buffer,
+                               udipe_recv_result_t result,
+                               const size_t* expected_sizes,
+                               size_t num_expected) {
+        LOGGED_FUNCTION_START("%p, { %zu, %zu, %d }, %p, %zu",
+                              buffer, result.size, result.segment_size,
+                              result.error, expected_sizes, num_expected)
+            udipe_segment_iterator_t iterator =
+                udipe_recv_segments(buffer, result);
+            udipe_segment_t segment;
+            const char* expected_payload = buffer;
+            for (size_t i = 0; i < num_expected; ++i) {
+                ensure(udipe_next_segment(&iterator, &segment));
+                ensure_eq((const char*)segment.payload, expected_payload);
+                ensure_eq(segment.size, expected_sizes[i]);
+                expected_payload += expected_sizes[i];
+            }
+            ensure(!udipe_next_segment(&iterator, &segment));
+            ensure(!udipe_next_segment(&iterator, &segment));
+        LOGGED_FUNCTION_END
+    }
+
+    /// Unit tests for the GRO segment iterator
+    ///
+    /// This function must be called within a logging scope.
+    static void segment_iterator_unit_tests() {
+        LOGGED_FUNCTION_START_NO_PARAMS
+            char buffer[100];
+
+            debug("Checking iteration over a single datagram...");
+            check_segments(buffer,
+                           (udipe_recv_result_t){ .size = 42 },
+                           (size_t[]){ 42 },
+                           1);
+
+            debug("Checking iteration over an empty datagram...");
+            check_segments(buffer,
+                           (udipe_recv_result_t){ .size = 0 },
+                           (size_t[]){ 0 },
+                           1);
+
+            debug("Checking iteration over a GRO batch...");
+            check_segments(buffer,
+                           (udipe_recv_result_t){
+                               .size = 30,
+                               .segment_size = 10
+                           },
+                           (size_t[]){ 10, 10, 10 },
+                           3);
+
+            debug("Checking iteration over a GRO batch with a remainder...");
+            check_segments(buffer,
+                           (udipe_recv_result_t){
+                               .size = 25,
+                               .segment_size = 10
+                           },
+                           (size_t[]){ 10, 10, 5 },
+                           3);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Unit tests for GRO reception
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param context must be a valid udipe context.
+    UDIPE_NON_NULL_ARGS
+    static void gro_unit_tests(udipe_context_t* context) {
+        LOGGED_FUNCTION_START("%p", context)
+            debug("Checking that GRO is rejected on output connections...");
+            udipe_connect_options_t bad_options = {
+                .direction = UDIPE_OUT,
+                .enable_gro = true
+            };
+            bad_options.remote_address.v4 = (struct sockaddr_in){
+                .sin_family = AF_INET,
+                .sin_port = htons(9),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+            };
+            const udipe_connect_result_t bad_result =
+                udipe_connect(context, bad_options);
+            ensure_eq(bad_result.error, EINVAL);
+
+            debug("Setting up a GRO receiver...");
+            udipe_connect_options_t in_options = {
+                .direction = UDIPE_IN,
+                .enable_gro = true
+            };
+            in_options.local_address.v4 = (struct sockaddr_in){
+                .sin_family = AF_INET,
+                .sin_port = 0,
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+            };
+            const udipe_connect_result_t in_result =
+                udipe_connect(context, in_options);
+            ensure_eq(in_result.error, 0);
+            udipe_connection_t* const receiver = in_result.connection;
+
+            debug("Setting up a GSO sender...");
+            const size_t segment_size = 1000;
+            udipe_connect_options_t out_options = {
+                .direction = UDIPE_OUT,
+                .gso_segment_size = segment_size
+            };
+            out_options.remote_address = in_result.local_address;
+            const udipe_connect_result_t out_result =
+                udipe_connect(context, out_options);
+            ensure_eq(out_result.error, 0);
+            udipe_connection_t* const sender = out_result.connection;
+
+            const size_t buffer_size =
+                receiver->worker->buffers.config.buffer_size;
+            const size_t payload_size = 2 * buffer_size;
+            char* const payload = malloc(payload_size);
+            exit_on_null(payload, "Failed to allocate GSO payload");
+            char* const received = malloc(payload_size);
+            exit_on_null(received, "Failed to allocate reception buffer");
+            const size_t batch_size = 10 * segment_size + 500;
+            fill_pattern(payload, batch_size, 42);
+
+            debug("Checking reception of a whole GRO batch...");
+            udipe_send_result_t send_result =
+                udipe_send(context,
+                           (udipe_send_options_t){
+                               .connection = sender,
+                               .buffer = payload,
+                               .size = batch_size
+                           });
+            ensure_eq(send_result.error, 0);
+            udipe_recv_result_t result =
+                udipe_recv(context,
+                           (udipe_recv_options_t){
+                               .connection = receiver,
+                               .buffer = received,
+                               .buffer_size = payload_size
+                           });
+            ensure_eq(result.error, 0);
+            ensure_eq(result.size, batch_size);
+            ensure_eq(result.segment_size, segment_size);
+            ensure_eq(memcmp(payload, received, batch_size), 0);
+            size_t expected_sizes[12];
+            for (size_t i = 0; i < 10; ++i) expected_sizes[i] = segment_size;
+            expected_sizes[10] = 500;
+            check_segments(received, result, expected_sizes, 11);
+
+            debug("Checking piecewise reception of a GRO batch...");
+            send_result = udipe_send(context,
+                                     (udipe_send_options_t){
+                                         .connection = sender,
+                                         .buffer = payload,
+                                         .size = batch_size
+                                     });
+            ensure_eq(send_result.error, 0);
+            size_t offset = 0;
+            while (offset < batch_size) {
+                result = udipe_recv(context,
+                                    (udipe_recv_options_t){
+                                        .connection = receiver,
+                                        .buffer = received + offset,
+                                        .buffer_size = 4 * segment_size - 1
+                                    });
+                ensure_eq(result.error, 0);
+                size_t expected_size = batch_size - offset;
+                if (expected_size > 3 * segment_size) {
+                    expected_size = 3 * segment_size;
+                }
+                ensure_eq(result.size, expected_size);
+                offset += result.size;
+            }
+            ensure_eq(memcmp(payload, received, batch_size), 0);
+
+            debug("Checking reception of a GRO batch into a tiny buffer...");
+            send_result = udipe_send(context,
+                                     (udipe_send_options_t){
+                                         .connection = sender,
+                                         .buffer = payload,
+                                         .size = 2 * segment_size
+                                     });
+            ensure_eq(send_result.error, 0);
+            for (size_t i = 0; i < 2; ++i) {
+                result = udipe_recv(context,
+                                    (udipe_recv_options_t){
+                                        .connection = receiver,
+                                        .buffer = received,
+                                        .buffer_size = 10
+                                    });
+                ensure_eq(result.error, EMSGSIZE);
+                ensure_eq(result.size, (size_t)10);
+                ensure_eq(result.segment_size, (size_t)0);
+                ensure_eq(memcmp(payload + i * segment_size, received, 10), 0);
+            }
+
+            debug("Checking reception of a GRO batch that exceeds the worker "
+                  "buffer size...");
+            fill_pattern(payload, payload_size, 24);
+            const size_t oversized_batch =
+                (buffer_size / segment_size + 5) * segment_size;
+            send_result = udipe_send(context,
+                                     (udipe_send_options_t){
+                                         .connection = sender,
+                                         .buffer = payload,
+                                         .size = oversized_batch
+                                     });
+            ensure_eq(send_result.error, 0);
+            result = udipe_recv(context,
+                                (udipe_recv_options_t){
+                                    .connection = receiver,
+                                    .buffer = received,
+                                    .buffer_size = payload_size
+                                });
+            ensure_eq(result.error, 0);
+            ensure_eq(result.size, buffer_size - buffer_size % segment_size);
+            ensure_eq(result.segment_size, segment_size);
+            ensure_eq(memcmp(payload, received, result.size), 0);
+
+            debug("Checking stream reception of a GRO batch...");
+            send_result = udipe_send(context,
+                                     (udipe_send_options_t){
+                                         .connection = sender,
+                                         .buffer = payload,
+                                         .size = batch_size
+                                     });
+            ensure_eq(send_result.error, 0);
+            stream_check_t check = { .max_calls = 1 };
+            const udipe_recv_stream_result_t stream_result =
+                udipe_recv_stream(context,
+                                  (udipe_recv_stream_options_t){
+                                      .connection = receiver,
+                                      .callback = stream_check_callback,
+                                      .context = &check
+                                  });
+            ensure_eq(stream_result.error, 0);
+            ensure_eq(stream_result.num_datagrams, (size_t)11);
+            ensure_eq(stream_result.num_bytes, batch_size);
+            ensure_eq(check.num_calls, (size_t)1);
+            ensure_eq(check.num_errors, (size_t)0);
+            ensure_eq(check.last_result.size, batch_size);
+            ensure_eq(check.last_result.segment_size, segment_size);
+
+            debug("Cleaning up...");
+            free(received);
+            free(payload);
+            udipe_disconnect_result_t disconnect_result =
+                udipe_disconnect(context,
+                                 (udipe_disconnect_options_t){
+                                     .connection = sender
+                                 });
+            ensure_eq(disconnect_result.error, 0);
+            disconnect_result =
+                udipe_disconnect(context,
+                                 (udipe_disconnect_options_t){
+                                     .connection = receiver
+                                 });
+            ensure_eq(disconnect_result.error, 0);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Read the system clock that software reception timestamps are based on
+    ///
+    /// \returns the current time in nanoseconds since the Unix epoch.
+    static uint64_t realtime_ns() {
+        struct timespec now;
+        ensure_eq(timespec_get(&now, TIME_UTC), TIME_UTC);
+        return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+    }
+
+    /// Unit tests for reception timestamps
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param context must be a valid udipe context.
+    UDIPE_NON_NULL_ARGS
+    static void timestamp_unit_tests(udipe_context_t* context) {
+        LOGGED_FUNCTION_START("%p", context)
+            debug("Checking that timestamps are rejected on output "
+                  "connections...");
+            udipe_connect_options_t bad_options = {
+                .direction = UDIPE_OUT,
+                .enable_timestamps = true
+            };
+            bad_options.remote_address.v4 = (struct sockaddr_in){
+                .sin_family = AF_INET,
+                .sin_port = htons(9),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+            };
+            const udipe_connect_result_t bad_result =
+                udipe_connect(context, bad_options);
+            ensure_eq(bad_result.error, EINVAL);
+
+            debug("Setting up a timestamping receiver...");
+            udipe_connect_options_t options = {
+                .direction = UDIPE_IN,
+                .enable_timestamps = true
+            };
+            options.local_address.v4 = (struct sockaddr_in){
+                .sin_family = AF_INET,
+                .sin_port = 0,
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+            };
+            const udipe_connect_result_t connect_result =
+                udipe_connect(context, options);
+            ensure_eq(connect_result.error, 0);
+            udipe_connection_t* const connection = connect_result.connection;
+            fd_t sender = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            ensure_ge(sender, 0);
+
+            debug("Checking software timestamps on loopback...");
+            char payload[MAX_TEST_DATAGRAM_SIZE];
+            fill_pattern(payload, 100, 0);
+            char received[MAX_TEST_DATAGRAM_SIZE];
+            udipe_recv_result_t result;
+            uint64_t before, after_send;
+            // Linux turns on timestamping asynchronously when the first socket
+            // asks for it, so the first few datagrams may lack a timestamp
+            const struct timespec delay = { .tv_sec = 0, .tv_nsec = 1000*1000 };
+            size_t attempts = 0;
+            do {
+                if (attempts > 0) thrd_sleep(&delay, NULL);
+                ensure_lt(attempts, (size_t)1000);
+                ++attempts;
+                before = realtime_ns();
+                send_raw(sender, &connect_result.local_address, payload, 100);
+                after_send = realtime_ns();
+                result = udipe_recv(context,
+                                    (udipe_recv_options_t){
+                                        .connection = connection,
+                                        .buffer = received,
+                                        .buffer_size = sizeof(received)
+                                    });
+                ensure_eq(result.error, 0);
+                ensure_eq(result.size, (size_t)100);
+            } while (result.software_timestamp == 0);
+            // Loopback delivers datagrams synchronously within sendto()
+            ensure_ge(result.software_timestamp, before);
+            ensure_le(result.software_timestamp, after_send);
+            // The loopback interface has no hardware clock
+            ensure_eq(result.hardware_timestamp, (uint64_t)0);
+
+            debug("Cleaning up...");
+            close_virtual_fd(&sender);
+            const udipe_disconnect_result_t disconnect_result =
+                udipe_disconnect(context,
+                                 (udipe_disconnect_options_t){
+                                     .connection = connection
+                                 });
+            ensure_eq(disconnect_result.error, 0);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Unit tests for busy-polled connections
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param context must be a valid udipe context.
+    UDIPE_NON_NULL_ARGS
+    static void busy_poll_unit_tests(udipe_context_t* context) {
+        LOGGED_FUNCTION_START("%p", context)
+            debug("Checking that busy polling is rejected on output "
+                  "connections...");
+            udipe_connect_options_t bad_options = {
+                .direction = UDIPE_OUT,
+                .enable_busy_poll = true
+            };
+            bad_options.remote_address.v4 = (struct sockaddr_in){
+                .sin_family = AF_INET,
+                .sin_port = htons(9),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+            };
+            const udipe_connect_result_t bad_result =
+                udipe_connect(context, bad_options);
+            ensure_eq(bad_result.error, EINVAL);
+
+            debug("Setting up a busy-polled receiver...");
+            udipe_connect_options_t options = {
+                .direction = UDIPE_IN,
+                .enable_busy_poll = true
+            };
+            options.local_address.v4 = (struct sockaddr_in){
+                .sin_family = AF_INET,
+                .sin_port = 0,
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+            };
+            const udipe_connect_result_t connect_result =
+                udipe_connect(context, options);
+            ensure_eq(connect_result.error, 0);
+            udipe_connection_t* const connection = connect_result.connection;
+            const ip_address_t address = connect_result.local_address;
+            fd_t sender = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            ensure_ge(sender, 0);
+
+            debug("Checking reception of queued datagrams...");
+            char payload[MAX_TEST_DATAGRAM_SIZE];
+            char received[MAX_TEST_DATAGRAM_SIZE];
+            for (size_t i = 0; i < NUM_BATCH_DATAGRAMS; ++i) {
+                fill_pattern(payload, 100 + i, i);
+                send_raw(sender, &address, payload, 100 + i);
+            }
+            for (size_t i = 0; i < NUM_BATCH_DATAGRAMS; ++i) {
+                const udipe_recv_result_t result =
+                    udipe_recv(context,
+                               (udipe_recv_options_t){
+                                   .connection = connection,
+                                   .buffer = received,
+                                   .buffer_size = sizeof(received)
+                               });
+                ensure_eq(result.error, 0);
+                ensure_eq(result.size, 100 + i);
+                fill_pattern(payload, 100 + i, i);
+                ensure_eq(memcmp(payload, received, 100 + i), 0);
+            }
+
+            debug("Checking reception of a datagram that comes in later...");
+            delayed_send_t delayed_send = {
+                .socket = sender,
+                .destination = address,
+                .delay = { .tv_sec = 0, .tv_nsec = 10*1000*1000 },
+                .payload = "spin!!!"
+            };
+            thrd_t sender_thread;
+            exit_on_thread_error(thrd_create(&sender_thread,
+                                             delayed_send_func,
+                                             (void*)&delayed_send),
+                                 "Failed to spawn the sender thread");
+            udipe_recv_result_t result =
+                udipe_recv(context,
+                           (udipe_recv_options_t){
+                               .connection = connection,
+                               .buffer = received,
+                               .buffer_size = sizeof(received)
+                           });
+            ensure_eq(result.error, 0);
+            ensure_eq(result.size, sizeof(delayed_send.payload));
+            ensure_eq(memcmp(received,
+                             delayed_send.payload,
+                             sizeof(delayed_send.payload)),
+                      0);
+            int sender_result;
+            exit_on_thread_error(thrd_join(sender_thread, &sender_result),
+                                 "Failed to join the sender thread");
+            ensure_eq(sender_result, 0);
+
+            debug("Checking reception timeouts...");
+            result = udipe_recv(context,
+                                (udipe_recv_options_t){
+                                    .connection = connection,
+                                    .buffer = received,
+                                    .buffer_size = sizeof(received),
+                                    .timeout = UDIPE_MILLISECOND
+                                });
+            ensure_eq(result.error, ETIMEDOUT);
+
+            debug("Cleaning up...");
+            close_virtual_fd(&sender);
+            const udipe_disconnect_result_t disconnect_result =
+                udipe_disconnect(context,
+                                 (udipe_disconnect_options_t){
+                                     .connection = connection
+                                 });
+            ensure_eq(disconnect_result.error, 0);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Set up a loopback input connection with custom options, then return
+    /// its udipe_connect() result after disconnecting it
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param context must be a valid udipe context.
+    /// \param options are the connection options, whose `local_address` is
+    ///                overwritten to designate the loopback interface.
+    UDIPE_NON_NULL_ARGS
+    static udipe_connect_result_t connect_loopback(
+        udipe_context_t* context,
+        udipe_connect_options_t options
+    ) {
+        LOGGED_FUNCTION_START("%p", context)
+            options.local_address.v4 = (struct sockaddr_in){
+                .sin_family = AF_INET,
+                .sin_port = 0,
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+            };
+            const udipe_connect_result_t result =
+                udipe_connect(context, options);
+            if (result.connection) {
+                const udipe_disconnect_result_t disconnect_result =
+                    udipe_disconnect(context,
+                                     (udipe_disconnect_options_t){
+                                         .connection = result.connection
+                                     });
+                ensure_eq(disconnect_result.error, 0);
+            }
+            return result;
+        LOGGED_FUNCTION_END
+    }
+
+    /// Unit tests for socket buffer sizing
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param context must be a valid udipe context.
+    UDIPE_NON_NULL_ARGS
+    static void socket_buffer_unit_tests(udipe_context_t* context) {
+        LOGGED_FUNCTION_START("%p", context)
+            debug("Checking that invalid buffer options are rejected...");
+            udipe_connect_result_t result =
+                connect_loopback(context,
+                                 (udipe_connect_options_t){
+                                     .direction = UDIPE_IN,
+                                     .recv_buffer = 64
+                                 });
+            ensure_eq(result.error, EINVAL);
+            result = connect_loopback(context,
+                                      (udipe_connect_options_t){
+                                          .direction = UDIPE_IN,
+                                          .recv_buffer = 65536,
+                                          .recv_rate = 1000
+                                      });
+            ensure_eq(result.error, EINVAL);
+            udipe_connect_options_t out_options = {
+                .direction = UDIPE_OUT,
+                .recv_rate = 1000
+            };
+            out_options.remote_address.v4 = (struct sockaddr_in){
+                .sin_family = AF_INET,
+                .sin_port = htons(9),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+            };
+            result = connect_loopback(context, out_options);
+            ensure_eq(result.error, EINVAL);
+            ensure_eq(result.send_buffer, (uint32_t)0);
+            ensure_eq(result.recv_buffer, (uint32_t)0);
+
+            debug("Checking default buffer sizes...");
+            const udipe_connect_result_t default_result =
+                connect_loopback(context,
+                                 (udipe_connect_options_t){
+                                     .direction = UDIPE_IN
+                                 });
+            ensure_eq(default_result.error, 0);
+            ensure_gt(default_result.send_buffer, (uint32_t)0);
+            ensure_gt(default_result.recv_buffer, (uint32_t)0);
+
+            // Sizes below net.core.[rw]mem_max are granted as-is, but doubled
+            // by the Linux kernel to account for its bookkeeping overhead
+            debug("Checking explicit buffer sizes...");
+            udipe_connect_options_t inout_options = {
+                .direction = UDIPE_INOUT,
+                .send_buffer = 16384,
+                .recv_buffer = 32768
+            };
+            inout_options.remote_address = out_options.remote_address;
+            result = connect_loopback(context, inout_options);
+            ensure_eq(result.error, 0);
+            ensure_eq(result.send_buffer, (uint32_t)2 * 16384);
+            ensure_eq(result.recv_buffer, (uint32_t)2 * 32768);
+
+            debug("Checking oversized buffers, which may get clamped...");
+            result = connect_loopback(context,
+                                      (udipe_connect_options_t){
+                                          .direction = UDIPE_IN,
+                                          .recv_buffer = 64 * 1024 * 1024
+                                      });
+            ensure_eq(result.error, 0);
+            ensure_ge(result.recv_buffer, default_result.recv_buffer);
+
+            debug("Checking that slow connections keep the default size...");
+            result = connect_loopback(context,
+                                      (udipe_connect_options_t){
+                                          .direction = UDIPE_IN,
+                                          .recv_rate = 1000
+                                      });
+            ensure_eq(result.error, 0);
+            ensure_eq(result.recv_buffer, default_result.recv_buffer);
+
+            // Even unprivileged processes can get twice net.core.rmem_max,
+            // which is normally no smaller than net.core.rmem_default.
+            debug("Checking that fast connections get a larger buffer...");
+            result = connect_loopback(context,
+                                      (udipe_connect_options_t){
+                                          .direction = UDIPE_IN,
+                                          .recv_rate = 1000 * 1000 * 1000
+                                      });
+            ensure_eq(result.error, 0);
+            ensure_gt(result.recv_buffer, default_result.recv_buffer);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Unit tests for reception streams
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param context must be a valid udipe context.
+    UDIPE_NON_NULL_ARGS
+    static void recv_stream_unit_tests(udipe_context_t* context) {
+        LOGGED_FUNCTION_START("%p", context)
+            debug("Setting up a loopback input connection...");
+            udipe_connect_options_t options = { .direction = UDIPE_IN };
+            options.local_address.v4 = (struct sockaddr_in){
+                .sin_family = AF_INET,
+                .sin_port = 0,
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+            };
+            const udipe_connect_result_t connect_result =
+                udipe_connect(context, options);
+            ensure_eq(connect_result.error, 0);
+            udipe_connection_t* const connection = connect_result.connection;
+            const ip_address_t address = connect_result.local_address;
+
+            debug("Setting up a raw sender socket...");
+            fd_t sender = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            ensure_ge(sender, 0);
+
+            debug("Checking stream reception of queued datagrams...");
+            char payload[MAX_TEST_DATAGRAM_SIZE];
+            size_t sizes[NUM_BATCH_DATAGRAMS];
+            size_t total_size = 0;
+            const size_t num_streamed = NUM_BATCH_DATAGRAMS - 3;
+            for (size_t i = 0; i < NUM_BATCH_DATAGRAMS; ++i) {
+                sizes[i] = 1 + rand() % MAX_TEST_DATAGRAM_SIZE;
+                if (i < num_streamed) total_size += sizes[i];
+                fill_pattern(payload, sizes[i], i);
+                send_raw(sender, &address, payload, sizes[i]);
+            }
+            stream_check_t check = {
+                .sizes = sizes,
+                .max_calls = num_streamed
+            };
+            udipe_recv_stream_result_t stream_result =
+                udipe_recv_stream(context,
+                                  (udipe_recv_stream_options_t){
+                                      .connection = connection,
+                                      .callback = stream_check_callback,
+                                      .context = &check
+                                  });
+            ensure_eq(stream_result.error, 0);
+            ensure_eq(stream_result.num_datagrams, num_streamed);
+            ensure_eq(stream_result.num_bytes, total_size);
+            ensure_eq(check.num_calls, num_streamed);
+            ensure_eq(check.num_errors, (size_t)0);
+
+            debug("Checking that datagrams past the end of the stream are "
+                  "kept for subsequent commands...");
+            char received[MAX_TEST_DATAGRAM_SIZE];
+            for (size_t i = num_streamed; i < NUM_BATCH_DATAGRAMS; ++i) {
+                const udipe_recv_result_t result =
+                    udipe_recv(context,
+                               (udipe_recv_options_t){
+                                   .connection = connection,
+                                   .buffer = received,
+                                   .buffer_size = sizeof(received)
+                               });
+                ensure_eq(result.error, 0);
+                ensure_eq(result.size, sizes[i]);
+                fill_pattern(payload, sizes[i], i);
+                ensure_eq(memcmp(payload, received, sizes[i]), 0);
+            }
+
+            debug("Checking stream reception of datagrams that come in "
+                  "later...");
+            delayed_send_t delayed_send = {
+                .socket = sender,
+                .destination = address,
+                .delay = { .tv_sec = 0, .tv_nsec = 10*1000*1000 },
+                .payload = "udipe!!"
+            };
+            thrd_t sender_thread;
+            exit_on_thread_error(thrd_create(&sender_thread,
+                                             delayed_send_func,
+                                             (void*)&delayed_send),
+                                 "Failed to spawn the sender thread");
+            check = (stream_check_t){ .max_calls = 1 };
+            stream_result =
+                udipe_recv_stream(context,
+                                  (udipe_recv_stream_options_t){
+                                      .connection = connection,
+                                      .callback = stream_check_callback,
+                                      .context = &check
+                                  });
+            ensure_eq(stream_result.error, 0);
+            ensure_eq(stream_result.num_datagrams, (size_t)1);
+            ensure_eq(stream_result.num_bytes, sizeof(delayed_send.payload));
+            ensure_eq(check.num_errors, (size_t)0);
+            ensure_eq(check.last_result.size, sizeof(delayed_send.payload));
+            int sender_result;
+            exit_on_thread_error(thrd_join(sender_thread, &sender_result),
+                                 "Failed to join the sender thread");
+            ensure_eq(sender_result, 0);
+
+            debug("Checking that output connections cannot stream...");
+            udipe_connect_options_t out_options = { .direction = UDIPE_OUT };
+            out_options.remote_address = address;
+            const udipe_connect_result_t out_connect =
+                udipe_connect(context, out_options);
+            ensure_eq(out_connect.error, 0);
+            check = (stream_check_t){ .max_calls = 1 };
+            stream_result =
+                udipe_recv_stream(context,
+                                  (udipe_recv_stream_options_t){
+                                      .connection = out_connect.connection,
+                                      .callback = stream_check_callback,
+                                      .context = &check
+                                  });
+            ensure_eq(stream_result.error, EOPNOTSUPP);
+            ensure_eq(check.num_calls, (size_t)0);
+
+            debug("Cleaning up...");
+            close_virtual_fd(&sender);
+            udipe_disconnect_result_t disconnect_result =
+                udipe_disconnect(context,
+                                 (udipe_disconnect_options_t){
+                                     .connection = out_connect.connection
+                                 });
+            ensure_eq(disconnect_result.error, 0);
+            disconnect_result =
+                udipe_disconnect(context,
+                                 (udipe_disconnect_options_t){
+                                     .connection = connection
+                                 });
+            ensure_eq(disconnect_result.error, 0);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Number of shards of the sharded connection test
+    ///
+    #define NUM_TEST_SHARDS ((size_t)4)
+
+    /// Number of sender sockets used by the sharded connection test
+    ///
+    /// Each sender socket has a different source port, which gives the
+    /// operating system a chance to spread their datagrams across shards.
+    #define NUM_SHARD_SENDERS ((size_t)16)
+
+    /// Set up a sharded loopback input connection and check its shards
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param context must be a valid udipe context.
+    /// \param steer_by_cpu tells whether datagrams should be steered by CPU.
+    /// \param shards must point to an array of \ref NUM_TEST_SHARDS entries,
+    ///               which will be filled with the shards of the connection.
+    ///
+    /// \returns the local address of the connection.
+    UDIPE_NON_NULL_ARGS
+    static ip_address_t connect_shards(udipe_context_t* context,
+                                       bool steer_by_cpu,
+                                       udipe_connection_t* shards[]) {
+        LOGGED_FUNCTION_START("%p, %d, %p", context, steer_by_cpu, shards)
+            debug("Setting up a sharded loopback input connection...");
+            udipe_connect_options_t options = {
+                .direction = UDIPE_IN,
+                .num_shards = NUM_TEST_SHARDS,
+                .steer_by_cpu = steer_by_cpu
+            };
+            options.local_address.v4 = (struct sockaddr_in){
+                .sin_family = AF_INET,
+                .sin_port = 0,
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+            };
+            const udipe_connect_result_t connect_result =
+                udipe_connect(context, options);
+            ensure_eq(connect_result.error, 0);
+            udipe_connection_t* const connection = connect_result.connection;
+            ensure((bool)connection);
+            const ip_address_t address = connect_result.local_address;
+            ensure_ne(address.v4.sin_port, 0);
+
+            debug("Checking the shards...");
+            for (size_t i = 0; i < NUM_TEST_SHARDS; ++i) {
+                shards[i] = udipe_connection_shard(connection, i);
+                ensure((bool)shards[i]);
+                ensure((bool)shards[i]->worker);
+                for (size_t j = 0; j < i; ++j) ensure(shards[i] != shards[j]);
+                ensure(udipe_connection_shard(shards[i], 0) == connection);
+
+                ip_address_t shard_address;
+                socklen_t shard_address_size = sizeof(ip_address_t);
+                ensure_eq(getsockname(shards[i]->socket,
+                                      &shard_address.any,
+                                      &shard_address_size),
+                          0);
+                ensure_eq(shard_address.v4.sin_port, address.v4.sin_port);
+            }
+            ensure(shards[0] == connection);
+            ensure(!udipe_connection_shard(connection, NUM_TEST_SHARDS));
+            return address;
+        LOGGED_FUNCTION_END
+    }
+
+    /// Send one datagram from each of \ref NUM_SHARD_SENDERS source ports to a
+    /// sharded connection, then check that each landed on exactly one shard
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param context must be a valid udipe context.
+    /// \param shards must be the shards of a connection set up with
+    ///               connect_shards().
+    /// \param address must be the local address of this connection.
+    /// \param sender_cpus must point to an array of \ref NUM_SHARD_SENDERS
+    ///                    entries, which will be filled with the CPU that sent
+    ///                    each datagram, or -1 if that CPU is not known.
+    /// \param receiving_shards must point to an array of \ref
+    ///                         NUM_SHARD_SENDERS entries, which will be filled
+    ///                         with the index of the shard that received each
+    ///                         datagram.
+    UDIPE_NON_NULL_ARGS
+    static void exchange_with_shards(udipe_context_t* context,
+                                     udipe_connection_t* const shards[],
+                                     const ip_address_t* address,
+                                     int sender_cpus[],
+                                     size_t receiving_shards[]) {
+        LOGGED_FUNCTION_START("%p, %p, %p, %p, %p",
+                              context, shards, address,
+                              sender_cpus, receiving_shards)
+            debug("Sending datagrams from many source ports...");
+            char payload[MAX_TEST_DATAGRAM_SIZE];
+            for (size_t i = 0; i < NUM_SHARD_SENDERS; ++i) {
+                fd_t sender = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+                ensure_ge(sender, 0);
+                fill_pattern(payload, i + 1, i);
+                const int cpu_before = sched_getcpu();
+                send_raw(sender, address, payload, i + 1);
+                const int cpu_after = sched_getcpu();
+                sender_cpus[i] = (cpu_before == cpu_after) ? cpu_before : -1;
+                close_virtual_fd(&sender);
+            }
+
+            debug("Checking that each datagram landed on exactly one shard...");
+            // Receive commands may time out before the worker gets a chance to
+            // look at the socket, so we poll shards until we get everything.
+            char received[MAX_TEST_DATAGRAM_SIZE];
+            bool seen[NUM_SHARD_SENDERS] = { 0 };
+            size_t num_received = 0;
+            size_t attempts = 0;
+            while (num_received < NUM_SHARD_SENDERS) {
+                ensure_lt(attempts, (size_t)1000);
+                const size_t shard_idx = attempts % NUM_TEST_SHARDS;
+                ++attempts;
+                const udipe_recv_result_t result =
+                    udipe_recv(context,
+                               (udipe_recv_options_t){
+                                   .connection = shards[shard_idx],
+                                   .buffer = received,
+                                   .buffer_size = sizeof(received),
+                                   .timeout = UDIPE_MILLISECOND
+                               });
+                if (result.error == ETIMEDOUT) continue;
+                ensure_eq(result.error, 0);
+                ensure_ge(result.size, (size_t)1);
+                ensure_le(result.size, NUM_SHARD_SENDERS);
+                const size_t sender_idx = result.size - 1;
+                tracef("Shard #%zu received the datagram from sender #%zu.",
+                       shard_idx, sender_idx);
+                ensure(!seen[sender_idx]);
+                seen[sender_idx] = true;
+                receiving_shards[sender_idx] = shard_idx;
+                fill_pattern(payload, result.size, sender_idx);
+                ensure_eq(memcmp(payload, received, result.size), 0);
+                ++num_received;
+            }
+        LOGGED_FUNCTION_END
+    }
+
+    /// Disconnect all shards of a connection set up with connect_shards()
+    ///
+    /// This function must be called within a logging scope.
+    UDIPE_NON_NULL_ARGS
+    static void disconnect_shards(udipe_context_t* context,
+                                  udipe_connection_t* const shards[]) {
+        LOGGED_FUNCTION_START("%p, %p", context, shards)
+            for (size_t i = 0; i < NUM_TEST_SHARDS; ++i) {
+                const udipe_disconnect_result_t disconnect_result =
+                    udipe_disconnect(context,
+                                     (udipe_disconnect_options_t){
+                                         .connection = shards[i]
+                                     });
+                ensure_eq(disconnect_result.error, 0);
+            }
+        LOGGED_FUNCTION_END
+    }
+
+    /// Unit tests for sharded connections
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param context must be a valid udipe context.
+    UDIPE_NON_NULL_ARGS
+    static void shard_unit_tests(udipe_context_t* context) {
+        LOGGED_FUNCTION_START("%p", context)
+            debug("Checking that sharding is rejected on output connections...");
+            udipe_connect_options_t options = {
+                .direction = UDIPE_INOUT,
+                .num_shards = NUM_TEST_SHARDS
+            };
+            options.remote_address.v4 = (struct sockaddr_in){
+                .sin_family = AF_INET,
+                .sin_port = htons(9),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+            };
+            udipe_connect_result_t connect_result =
+                udipe_connect(context, options);
+            ensure_eq(connect_result.error, EINVAL);
+            ensure(!connect_result.connection);
+
+            debug("Checking that sharding is rejected on connected sockets...");
+            options.direction = UDIPE_IN;
+            connect_result = udipe_connect(context, options);
+            ensure_eq(connect_result.error, EINVAL);
+            ensure(!connect_result.connection);
+
+            debug("Checking that CPU steering requires sharding...");
+            connect_result =
+                udipe_connect(context,
+                              (udipe_connect_options_t){
+                                  .direction = UDIPE_IN,
+                                  .steer_by_cpu = true
+                              });
+            ensure_eq(connect_result.error, EINVAL);
+            ensure(!connect_result.connection);
+
+            debug("Checking source-based load balancing...");
+            udipe_connection_t* shards[NUM_TEST_SHARDS];
+            int sender_cpus[NUM_SHARD_SENDERS];
+            size_t receiving_shards[NUM_SHARD_SENDERS];
+            ip_address_t address = connect_shards(context, false, shards);
+            exchange_with_shards(context,
+                                 shards,
+                                 &address,
+                                 sender_cpus,
+                                 receiving_shards);
+            disconnect_shards(context, shards);
+
+            debug("Checking CPU-based steering...");
+            // Loopback datagrams are processed by the CPU that sent them
+            address = connect_shards(context, true, shards);
+            exchange_with_shards(context,
+                                 shards,
+                                 &address,
+                                 sender_cpus,
+                                 receiving_shards);
+            for (size_t i = 0; i < NUM_SHARD_SENDERS; ++i) {
+                if (sender_cpus[i] < 0) continue;
+                size_t expected_shard = NUM_TEST_SHARDS;
+                for (size_t j = 0; j < NUM_TEST_SHARDS; ++j) {
+                    hwloc_const_cpuset_t cpuset =
+                        worker_pool_cpuset(&context->workers,
+                                           shards[j]->worker);
+                    if (hwloc_bitmap_isset(cpuset, sender_cpus[i])) {
+                        expected_shard = j;
+                        break;
+                    }
+                }
+                tracef("Datagram #%zu was sent by CPU %d, expected on shard "
+                       "#%zu, received on shard #%zu.",
+                       i, sender_cpus[i], expected_shard, receiving_shards[i]);
+                if (expected_shard < NUM_TEST_SHARDS) {
+                    ensure_eq(receiving_shards[i], expected_shard);
+                }
+            }
+            disconnect_shards(context, shards);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Unit tests for the receive engine, using a certain I/O backend
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param io_backend is the I/O backend that workers should use.
+    static void recv_backend_unit_tests(udipe_io_backend_t io_backend) {
+        LOGGED_FUNCTION_START("%d", io_backend)
+            udipe_context_t* const context =
+                udipe_initialize((udipe_config_t){
+                    .workers = { .io_backend = io_backend }
+                });
+
+            debug("Checking that invalid connection options are rejected...");
+            udipe_connect_result_t bad_connect =
+                udipe_connect(context,
+                              (udipe_connect_options_t){
+                                  .direction = UDIPE_OUT
+                              });
+            ensure_eq(bad_connect.error, EINVAL);
+            ensure(!bad_connect.connection);
+
+            debug("Setting up a loopback input connection...");
+            udipe_connect_options_t options = { .direction = UDIPE_IN };
+            options.local_address.v4 = (struct sockaddr_in){
+                .sin_family = AF_INET,
+                .sin_port = 0,
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+            };
+            const udipe_connect_result_t connect_result =
+                udipe_connect(context, options);
+            ensure_eq(connect_result.error, 0);
+            ensure((bool)connect_result.connection);
+            ensure_eq(connect_result.local_address.any.sa_family,
+                      (sa_family_t)AF_INET);
+            ensure_ne(connect_result.local_address.v4.sin_port, 0);
+            udipe_connection_t* const connection = connect_result.connection;
+            const ip_address_t address = connect_result.local_address;
+
+            debug("Setting up a raw sender socket...");
+            fd_t sender = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            ensure_ge(sender, 0);
+
+            debug("Checking batched reception...");
+            char payload[MAX_TEST_DATAGRAM_SIZE];
+            char received[MAX_TEST_DATAGRAM_SIZE];
+            size_t sizes[NUM_BATCH_DATAGRAMS];
+            for (size_t i = 0; i < NUM_BATCH_DATAGRAMS; ++i) {
+                sizes[i] = 1 + rand() % MAX_TEST_DATAGRAM_SIZE;
+                fill_pattern(payload, sizes[i], i);
+                send_raw(sender, &address, payload, sizes[i]);
+            }
+            for (size_t i = 0; i < NUM_BATCH_DATAGRAMS; ++i) {
+                tracef("- Receiving datagram #%zu...", i);
+                const udipe_recv_result_t result =
+                    udipe_recv(context,
+                               (udipe_recv_options_t){
+                                   .connection = connection,
+                                   .buffer = received,
+                                   .buffer_size = sizeof(received)
+                               });
+                ensure_eq(result.error, 0);
+                ensure_eq(result.size, sizes[i]);
+                fill_pattern(payload, sizes[i], i);
+                ensure_eq(memcmp(payload, received, sizes[i]), 0);
+            }
+
+            debug("Checking reception timeouts...");
+            udipe_recv_result_t result =
+                udipe_recv(context,
+                           (udipe_recv_options_t){
+                               .connection = connection,
+                               .buffer = received,
+                               .buffer_size = sizeof(received),
+                               .timeout = UDIPE_MILLISECOND
+                           });
+            ensure_eq(result.error, ETIMEDOUT);
+            ensure_eq(result.size, (size_t)0);
+
+            debug("Checking kernel drop accounting...");
+            ensure_eq(udipe_connection_stats(connection).recv_dropped,
+                      (uint64_t)0);
+            fill_pattern(payload, MAX_TEST_DATAGRAM_SIZE, 0);
+            for (size_t i = 0; i < NUM_FLOOD_DATAGRAMS; ++i) {
+                send_raw(sender, &address, payload, MAX_TEST_DATAGRAM_SIZE);
+            }
+            size_t num_flood_received = 0;
+            do {
+                result = udipe_recv(context,
+                                    (udipe_recv_options_t){
+                                        .connection = connection,
+                                        .buffer = received,
+                                        .buffer_size = sizeof(received),
+                                        .timeout = 10 * UDIPE_MILLISECOND
+                                    });
+                if (result.error == 0) ++num_flood_received;
+            } while (result.error == 0);
+            ensure_eq(result.error, ETIMEDOUT);
+            // Drops are only reported alongside datagrams that arrive later.
+            // The worker may not have caught up with the flood yet if it got
+            // descheduled, so flood datagrams may still come before this one.
+            send_raw(sender, &address, payload, 1);
+            do {
+                result = udipe_recv(context,
+                                    (udipe_recv_options_t){
+                                        .connection = connection,
+                                        .buffer = received,
+                                        .buffer_size = sizeof(received)
+                                    });
+                ensure_eq(result.error, 0);
+                if (result.size == MAX_TEST_DATAGRAM_SIZE) {
+                    ++num_flood_received;
+                } else {
+                    ensure_eq(result.size, (size_t)1);
+                }
+            } while (result.size != 1);
+            const uint64_t num_dropped =
+                udipe_connection_stats(connection).recv_dropped;
+            debugf("Received %zu flood datagrams, kernel dropped %" PRIu64 ".",
+                   num_flood_received, num_dropped);
+            ensure_gt(num_dropped, (uint64_t)0);
+            ensure_eq(num_dropped + num_flood_received,
+                      (uint64_t)NUM_FLOOD_DATAGRAMS);
+
+            debug("Checking truncation...");
+            fill_pattern(payload, 100, 42);
+            send_raw(sender, &address, payload, 100);
+            result = udipe_recv(context,
+                                (udipe_recv_options_t){
+                                    .connection = connection,
+                                    .buffer = received,
+                                    .buffer_size = 10
+                                });
+            ensure_eq(result.error, EMSGSIZE);
+            ensure_eq(result.size, (size_t)10);
+            ensure_eq(memcmp(payload, received, 10), 0);
+
+            debug("Checking reception of a datagram that comes in later...");
+            delayed_send_t delayed_send = {
+                .socket = sender,
+                .destination = address,
+                .delay = { .tv_sec = 0, .tv_nsec = 10*1000*1000 },
+                .payload = "udipe!!"
+            };
+            thrd_t sender_thread;
+            exit_on_thread_error(thrd_create(&sender_thread,
+                                             delayed_send_func,
+                                             (void*)&delayed_send),
+                                 "Failed to spawn the sender thread");
+            udipe_future_t* const future =
+                udipe_start_recv(context,
+                                 (udipe_recv_options_t){
+                                     .connection = connection,
+                                     .buffer = received,
+                                     .buffer_size = sizeof(received)
+                                 });
+            const udipe_result_t async_result = udipe_finish(future);
+            ensure_eq(async_result.type, UDIPE_RECV);
+            ensure_eq(async_result.payload.network.recv.error, 0);
+            ensure_eq(async_result.payload.network.recv.size,
+                      sizeof(delayed_send.payload));
+            ensure_eq(memcmp(received,
+                             delayed_send.payload,
+                             sizeof(delayed_send.payload)),
+                      0);
+            int sender_result;
+            exit_on_thread_error(thrd_join(sender_thread, &sender_result),
+                                 "Failed to join the sender thread");
+            ensure_eq(sender_result, 0);
+
+            // No datagram and no timeout will ever wake up the worker here, so
+            // this hangs unless the cancelation signal reaches the worker.
+            debug("Checking cancelation of receptions that never complete...");
+            udipe_future_t* const pending =
+                udipe_start_recv(context,
+                                 (udipe_recv_options_t){
+                                     .connection = connection,
+                                     .buffer = received,
+                                     .buffer_size = sizeof(received)
+                                 });
+            debug("Giving the worker thread time to fall asleep...");
+            thrd_sleep(&delayed_send.delay, NULL);
+            ensure(udipe_cancel(pending, true));
+            udipe_future_t* canceled[NUM_BATCH_DATAGRAMS];
+            for (size_t i = 0; i < NUM_BATCH_DATAGRAMS; ++i) {
+                canceled[i] =
+                    udipe_start_recv(context,
+                                     (udipe_recv_options_t){
+                                         .connection = connection,
+                                         .buffer = received,
+                                         .buffer_size = sizeof(received)
+                                     });
+            }
+            for (size_t i = 0; i < NUM_BATCH_DATAGRAMS; ++i) {
+                ensure(udipe_cancel(canceled[i], false));
+            }
+            for (size_t i = 0; i < NUM_BATCH_DATAGRAMS; ++i) {
+                const udipe_result_t canceled_result =
+                    udipe_finish(canceled[i]);
+                ensure_eq(canceled_result.type, UDIPE_FAILURE_CANCELED);
+            }
+
+            debug("Checking that output connections cannot receive...");
+            udipe_connect_options_t out_options = { .direction = UDIPE_OUT };
+            out_options.remote_address = address;
+            const udipe_connect_result_t out_connect =
+                udipe_connect(context, out_options);
+            ensure_eq(out_connect.error, 0);
+            result = udipe_recv(context,
+                                (udipe_recv_options_t){
+                                    .connection = out_connect.connection,
+                                    .buffer = received,
+                                    .buffer_size = sizeof(received)
+                                });
+            ensure_eq(result.error, EOPNOTSUPP);
+            udipe_disconnect_result_t disconnect_result =
+                udipe_disconnect(context,
+                                 (udipe_disconnect_options_t){
+                                     .connection = out_connect.connection
+                                 });
+            ensure_eq(disconnect_result.error, 0);
+
+            debug("Checking disconnection with a nonempty backlog...");
+            for (size_t i = 0; i < 3; ++i) {
+                send_raw(sender, &address, payload, 100);
+            }
+            result = udipe_recv(context,
+                                (udipe_recv_options_t){
+                                    .connection = connection,
+                                    .buffer = received,
+                                    .buffer_size = sizeof(received)
+                                });
+            ensure_eq(result.error, 0);
+            disconnect_result =
+                udipe_disconnect(context,
+                                 (udipe_disconnect_options_t){
+                                     .connection = connection
+                                 });
+            ensure_eq(disconnect_result.error, 0);
+
+            debug("Checking reception streams...");
+            recv_stream_unit_tests(context);
+
+            debug("Checking the GRO segment iterator...");
+            segment_iterator_unit_tests();
+
+            debug("Checking GRO...");
+            gro_unit_tests(context);
+
+            debug("Checking reception timestamps...");
+            timestamp_unit_tests(context);
+
+            debug("Checking busy-polled connections...");
+            busy_poll_unit_tests(context);
+
+            debug("Checking socket buffer sizing...");
+            socket_buffer_unit_tests(context);
+
+            debug("Checking sharded connections...");
+            shard_unit_tests(context);
+
+            debug("Cleaning up...");
+            close_virtual_fd(&sender);
+            udipe_finalize(context);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Number of worker classes used by worker_class_unit_tests()
+    ///
+    #define NUM_TEST_WORKER_CLASSES ((size_t)3)
+
+    /// Find out which worker class a worker belongs to
+    ///
+    /// \param pool must be a valid worker pool.
+    /// \param worker must be a worker from `pool`.
+    ///
+    /// \returns the index of the worker class of `worker`.
+    UDIPE_NON_NULL_ARGS
+    static size_t worker_class_of(const worker_pool_t* pool,
+                                  const worker_t* worker) {
+        for (size_t i = 0; i < pool->num_workers; ++i) {
+            if (pool->threads[i].worker == worker) {
+                return pool->threads[i].worker_class;
+            }
+        }
+        exit_with_error("Worker does not belong to this pool!");
+    }
+
+    /// Unit tests for worker classes
+    ///
+    /// This function must be called within a logging scope.
+    static void worker_class_unit_tests() {
+        LOGGED_FUNCTION_START_NO_PARAMS
+            debug("Setting up a context with several worker classes...");
+            const udipe_worker_class_config_t worker_classes[] = {
+                {
+                    .workers = {
+                        .max_workers = 1,
+                        .io_backend = UDIPE_IO_EPOLL
+                    }
+                },
+                {
+                    .workers = {
+                        .max_workers = 1,
+                        .io_backend = UDIPE_IO_URING
+                    }
+                }
+            };
+            static_assert(sizeof(worker_classes) / sizeof(worker_classes[0])
+                              == NUM_TEST_WORKER_CLASSES - 1,
+                          "Worker class 0 is configured separately");
+            udipe_context_t* const context =
+                udipe_initialize((udipe_config_t){
+                    .worker_classes = worker_classes,
+                    .num_worker_classes = NUM_TEST_WORKER_CLASSES - 1
+                });
+            const worker_pool_t* const pool = &context->workers;
+            ensure_eq(pool->num_classes, NUM_TEST_WORKER_CLASSES);
+
+            debug("Checking that unknown worker classes are rejected...");
+            udipe_connect_options_t options = {
+                .direction = UDIPE_IN,
+                .worker_class = NUM_TEST_WORKER_CLASSES
+            };
+            options.local_address.v4 = (struct sockaddr_in){
+                .sin_family = AF_INET,
+                .sin_port = 0,
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+            };
+            udipe_connect_result_t connect_result =
+                udipe_connect(context, options);
+            ensure_eq(connect_result.error, EINVAL);
+            ensure(!connect_result.connection);
+
+            debug("Setting up one connection per worker class...");
+            udipe_connection_t* connections[NUM_TEST_WORKER_CLASSES];
+            ip_address_t addresses[NUM_TEST_WORKER_CLASSES];
+            for (size_t i = 0; i < NUM_TEST_WORKER_CLASSES; ++i) {
+                options.worker_class = (uint8_t)i;
+                connect_result = udipe_connect(context, options);
+                ensure_eq(connect_result.error, 0);
+                connections[i] = connect_result.connection;
+                addresses[i] = connect_result.local_address;
+                ensure_eq(worker_class_of(pool, connections[i]->worker), i);
+            }
+
+            debug("Checking that the shards of a connection stay in its "
+                  "worker class...");
+            options.worker_class = 1;
+            options.num_shards = 2;
+            connect_result = udipe_connect(context, options);
+            ensure_eq(connect_result.error, 0);
+            udipe_connection_t* shards[2];
+            for (size_t i = 0; i < 2; ++i) {
+                shards[i] = udipe_connection_shard(connect_result.connection,
+                                                   i);
+                ensure((bool)shards[i]);
+                ensure_eq(worker_class_of(pool, shards[i]->worker), (size_t)1);
+            }
+            for (size_t i = 0; i < 2; ++i) {
+                const udipe_disconnect_result_t disconnect_result =
+                    udipe_disconnect(context,
+                                     (udipe_disconnect_options_t){
+                                         .connection = shards[i]
+                                     });
+                ensure_eq(disconnect_result.error, 0);
+            }
+            options.num_shards = 0;
+
+            debug("Checking reception in every worker class...");
+            fd_t sender = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            ensure_ge(sender, 0);
+            char payload[MAX_TEST_DATAGRAM_SIZE];
+            char received[MAX_TEST_DATAGRAM_SIZE];
+            for (size_t i = 0; i < NUM_TEST_WORKER_CLASSES; ++i) {
+                fill_pattern(payload, 100, i);
+                send_raw(sender, &addresses[i], payload, 100);
+                const udipe_recv_result_t result =
+                    udipe_recv(context,
+                               (udipe_recv_options_t){
+                                   .connection = connections[i],
+                                   .buffer = received,
+                                   .buffer_size = sizeof(received)
+                               });
+                ensure_eq(result.error, 0);
+                ensure_eq(result.size, (size_t)100);
+                ensure_eq(memcmp(payload, received, 100), 0);
+            }
+
+            debug("Cleaning up...");
+            close_virtual_fd(&sender);
+            for (size_t i = 0; i < NUM_TEST_WORKER_CLASSES; ++i) {
+                const udipe_disconnect_result_t disconnect_result =
+                    udipe_disconnect(context,
+                                     (udipe_disconnect_options_t){
+                                         .connection = connections[i]
+                                     });
+                ensure_eq(disconnect_result.error, 0);
+            }
+            udipe_finalize(context);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Unit tests for idle worker thread spinning
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param io_backend is the I/O backend that worker threads should use.
+    static void idle_spin_unit_tests(udipe_io_backend_t io_backend) {
+        LOGGED_FUNCTION_START("%d", io_backend)
+            debug("Setting up a context with a spinning worker...");
+            const udipe_duration_ns_t idle_spin = UDIPE_MILLISECOND / 10;
+            udipe_context_t* const context =
+                udipe_initialize((udipe_config_t){
+                    .workers = {
+                        .max_workers = 1,
+                        .io_backend = io_backend,
+                        .idle_spin = idle_spin
+                    }
+                });
+            const worker_t* const worker = context->workers.threads[0].worker;
+            ensure_eq(worker->idle_spin, idle_spin);
+
+            debug("Setting up a loopback connection...");
+            udipe_connect_options_t options = { .direction = UDIPE_IN };
+            options.local_address.v4 = (struct sockaddr_in){
+                .sin_family = AF_INET,
+                .sin_port = 0,
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+            };
+            const udipe_connect_result_t connect_result =
+                udipe_connect(context, options);
+            ensure_eq(connect_result.error, 0);
+            udipe_connection_t* const connection = connect_result.connection;
+
+            debug("Checking reception under fast, then slow traffic...");
+            fd_t sender = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            ensure_ge(sender, 0);
+            char payload[MAX_TEST_DATAGRAM_SIZE];
+            char received[MAX_TEST_DATAGRAM_SIZE];
+            const struct timespec slow_delay = {
+                .tv_nsec = 2 * UDIPE_MILLISECOND
+            };
+            for (size_t i = 0; i < 40; ++i) {
+                if (i >= 30) thrd_sleep(&slow_delay, NULL);
+                fill_pattern(payload, 100, i);
+                send_raw(sender, &connect_result.local_address, payload, 100);
+                const udipe_recv_result_t result =
+                    udipe_recv(context,
+                               (udipe_recv_options_t){
+                                   .connection = connection,
+                                   .buffer = received,
+                                   .buffer_size = sizeof(received)
+                               });
+                ensure_eq(result.error, 0);
+                ensure_eq(result.size, (size_t)100);
+                ensure_eq(memcmp(payload, received, 100), 0);
+            }
+
+            debug("Checking that timeouts are honored while spinning...");
+            const udipe_recv_result_t result =
+                udipe_recv(context,
+                           (udipe_recv_options_t){
+                               .connection = connection,
+                               .buffer = received,
+                               .buffer_size = sizeof(received),
+                               .timeout = UDIPE_MILLISECOND / 20
+                           });
+            ensure_eq(result.error, ETIMEDOUT);
+
+            debug("Checking that an idle worker falls asleep...");
+            const struct timespec poll_delay = {
+                .tv_nsec = UDIPE_MILLISECOND
+            };
+            size_t num_polls = 0;
+            while (!atomic_load_explicit(&worker->sleeping,
+                                         memory_order_relaxed)) {
+                ensure_lt(num_polls, (size_t)1000);
+                thrd_sleep(&poll_delay, NULL);
+                ++num_polls;
+            }
+
+            debug("Checking that a sleeping worker is woken up by requests...");
+            fill_pattern(payload, 100, 40);
+            send_raw(sender, &connect_result.local_address, payload, 100);
+            const udipe_recv_result_t wakeup_result =
+                udipe_recv(context,
+                           (udipe_recv_options_t){
+                               .connection = connection,
+                               .buffer = received,
+                               .buffer_size = sizeof(received)
+                           });
+            ensure_eq(wakeup_result.error, 0);
+            ensure_eq(wakeup_result.size, (size_t)100);
+            ensure_eq(memcmp(payload, received, 100), 0);
+
+            debug("Cleaning up...");
+            close_virtual_fd(&sender);
+            const udipe_disconnect_result_t disconnect_result =
+                udipe_disconnect(context,
+                                 (udipe_disconnect_options_t){
+                                     .connection = connection
+                                 });
+            ensure_eq(disconnect_result.error, 0);
+            udipe_finalize(context);
+        LOGGED_FUNCTION_END
+    }
+
+    void recv_unit_tests() {
+        LOGGED_FUNCTION_START_NO_PARAMS
+            info("Running receive engine unit tests...");
+            configure_rand();
+
+            debug("Checking the epoll backend...");
+            recv_backend_unit_tests(UDIPE_IO_EPOLL);
+
+            debug("Checking the io_uring backend...");
+            recv_backend_unit_tests(UDIPE_IO_URING);
+
+            debug("Checking the multishot io_uring backend...");
+            recv_backend_unit_tests(UDIPE_IO_URING_MULTISHOT);
+
+            debug("Checking worker classes...");
+            worker_class_unit_tests();
+
+            debug("Checking idle worker thread spinning...");
+            idle_spin_unit_tests(UDIPE_IO_EPOLL);
+            idle_spin_unit_tests(UDIPE_IO_URING);
+        LOGGED_FUNCTION_END
+    }
+
+#endif  // UDIPE_BUILD_TESTS
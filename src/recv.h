@@ -0,0 +1,400 @@
+#pragma once
+
+//! \file
+//! \brief Datagram reception engine
+//!
+//! This code module implements the worker-side logic of the udipe_recv()
+//! command. Its design is driven by the observation that at high datagram
+//! rates, performing one system call per received datagram is the main
+//! performance bottleneck.
+//!
+//! Therefore, whenever a connection has pending receive commands and its
+//! socket becomes readable, the worker drains it with a single `recvmmsg()`
+//! call that fills as many buffers from its \ref buffer_allocator_t as are
+//! available. Datagrams that are not immediately claimed by a pending receive
+//! command are kept in a per-connection backlog, from which subsequent receive
+//! commands are served without any system call.
+//!
+//! When GRO is enabled, each backlog entry may hold several coalesced
+//! datagrams. These are handed over to clients as a whole if the client buffer
+//! is large enough, and otherwise split at datagram boundaries.
+//!
+//! The udipe_recv_stream() command uses the same reception machinery, but
+//! instead of copying datagrams into client buffers, it passes them to a
+//! client callback straight from the worker buffers, as soon as they have been
+//! received. This lets a single command process an unbounded amount of
+//! datagrams without any per-datagram inter-thread communication.
+//!
+//! With the io_uring backend, sockets are not drained upon readability.
+//! Instead, recv_prepare() keeps one `IORING_OP_RECVMSG` operation in flight
+//! on each connection that needs datagrams, letting the kernel pick a worker
+//! buffer from a provided buffer ring when a datagram comes in, and
+//! recv_on_completion() then appends the datagram to the backlog. The
+//! operations of all connections are submitted together, so a single system
+//! call covers all sockets of the worker.
+
+#include <udipe/buffer.h>
+#include <udipe/duration.h>
+#include <udipe/future.h>
+#include <udipe/nodiscard.h>
+#include <udipe/operation.h>
+#include <udipe/pointer.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __linux__
+    #include <linux/errqueue.h>
+    #include <sys/socket.h>
+    #include <sys/uio.h>
+#endif
+
+
+// Forward declarations to break header dependency cycles
+typedef struct command_s command_t;
+typedef struct worker_s worker_t;
+struct io_uring_cqe;
+
+/// Control message buffer for one received datagram
+///
+/// This is large enough to hold every control message that the receive engine
+/// may enable on a connection's socket, and suitably aligned for `cmsghdr`.
+typedef union recv_control_u {
+    /// Raw control message storage
+    ///
+    char bytes[CMSG_SPACE(sizeof(int))
+               + CMSG_SPACE(sizeof(uint32_t))
+               + CMSG_SPACE(sizeof(struct scm_timestamping))];
+
+    /// Alignment enforcer
+    ///
+    struct cmsghdr align;
+} recv_control_t;
+
+/// Datagram that was received ahead of demand
+///
+/// This is an entry of \ref recv_state_t::backlog.
+typedef struct recv_datagram_s {
+    /// Worker buffer that holds the datagram payload
+    ///
+    /// This buffer was allocated from the worker's \ref buffer_allocator_t and
+    /// must be liberated once the datagram has been handed over to a client.
+    void* buffer;
+
+    /// Position of the end of the datagram payload within `buffer`
+    ///
+    /// If GRO is enabled, the payload may consist of several coalesced
+    /// datagrams, see `segment_size`.
+    size_t size;
+
+    /// Position of the part of the payload that was not handed over to
+    /// clients yet within `buffer`
+    ///
+    /// This starts out nonzero for datagrams that were received by a
+    /// multishot io_uring operation, which puts a header in front of the
+    /// payload. It is then advanced as GRO batches are handed over to clients
+    /// piecewise, which happens when client buffers are too small to hold the
+    /// entire batch, without splitting any individual datagram.
+    size_t offset;
+
+    /// Size of the individual datagrams within `buffer`, or 0 if it holds a
+    /// single datagram
+    ///
+    /// This comes from the `UDP_GRO` control message.
+    size_t segment_size;
+
+    /// Software reception timestamp, see \ref
+    /// udipe_recv_result_t::software_timestamp
+    ///
+    /// This comes from the `SCM_TIMESTAMPING` control message.
+    uint64_t software_timestamp;
+
+    /// Hardware reception timestamp, see \ref
+    /// udipe_recv_result_t::hardware_timestamp
+    ///
+    /// This comes from the `SCM_TIMESTAMPING` control message.
+    uint64_t hardware_timestamp;
+
+    /// Truth that the datagram did not fit in `buffer` and was truncated
+    ///
+    bool truncated;
+} recv_datagram_t;
+
+/// Reception stream that is active on a connection
+///
+/// This is the \ref recv_state_t::stream of a connection.
+typedef struct recv_stream_s {
+    /// Callback that processes incoming datagrams
+    ///
+    /// This is `NULL` if no reception stream is active on the connection.
+    udipe_recv_callback_t callback;
+
+    /// Context that is passed to `callback`
+    ///
+    void* context;
+
+    /// Future that must be notified once the stream ends
+    ///
+    udipe_future_t* future;
+
+    /// Result that will be reported once the stream ends
+    ///
+    /// The datagram and byte counters are updated as datagrams are passed to
+    /// `callback`.
+    udipe_recv_stream_result_t result;
+} recv_stream_t;
+
+/// Per-connection state of the receive engine
+///
+/// This struct is embedded inside of each \ref udipe_connection_t. Unlike most
+/// other structs from `libudipe`, it must be initialized with
+/// recv_state_initialize() and finalized with recv_state_finalize().
+typedef struct recv_state_s {
+    /// Ring buffer of datagrams that were received ahead of demand
+    ///
+    /// Valid entries start at index `backlog_start` and wrap around at the end
+    /// of the array. There are `backlog_len` of them.
+    ///
+    /// As each entry holds a buffer from the worker's \ref buffer_allocator_t,
+    /// there cannot be more than \ref UDIPE_MAX_BUFFERS entries.
+    recv_datagram_t backlog[UDIPE_MAX_BUFFERS];
+
+    /// Index of the oldest datagram within `backlog`
+    ///
+    size_t backlog_start;
+
+    /// Number of datagrams within `backlog`
+    ///
+    size_t backlog_len;
+
+    /// Number of receive commands that are pending on this connection
+    ///
+    /// While this is nonzero, the connection's socket is attached to the
+    /// worker's \ref inpoll_t so that the worker is notified when datagrams
+    /// come in.
+    size_t num_pending;
+
+    /// Reception stream that is active on this connection, if any
+    ///
+    /// While a reception stream is active, the connection's socket is attached
+    /// to the worker's \ref inpoll_t. Receive commands and reception streams
+    /// are mutually exclusive, so `num_pending` is always zero in this case.
+    recv_stream_t stream;
+
+    /// `user_data` of the io_uring operation that is in flight on this
+    /// connection's socket, or 0 if there is none
+    ///
+    /// This is only used by the io_uring backends, see recv_prepare().
+    /// Multishot operations stay in flight across many completions.
+    uint64_t uring_operation;
+
+    /// Truth that the cancelation of the multishot operation from
+    /// `uring_operation` was already requested
+    ///
+    bool uring_canceling;
+
+    /// Message header of the in-flight `IORING_OP_RECVMSG` operation
+    ///
+    /// This must stay valid for as long as the operation is in flight.
+    struct msghdr uring_header;
+
+    /// I/O vector of `uring_header`
+    ///
+    /// Its base address is filled in by the kernel from the provided buffer
+    /// ring, so only its length matters.
+    struct iovec uring_iovec;
+
+    /// Control message buffer of `uring_header`
+    ///
+    recv_control_t uring_control;
+} recv_state_t;
+
+/// Receive command that could not be processed immediately
+///
+/// These are stored in \ref worker_t::pending_recvs in submission order.
+typedef struct pending_recv_s {
+    /// Receive command parameters
+    ///
+    udipe_recv_options_t options;
+
+    /// Future that must be notified once the command completes
+    ///
+    udipe_future_t* future;
+
+    /// Time left before this command times out
+    ///
+    /// This is \ref UDIPE_DURATION_MAX if the command never times out.
+    udipe_duration_ns_t remaining_time;
+} pending_recv_t;
+
+/// Maximal number of pending receive commands per worker
+///
+/// Once a worker has this many pending receive commands, it should stop
+/// accepting new commands until some of these have completed.
+#define MAX_PENDING_RECVS ((size_t)32)
+
+/// Maximal number of active reception streams per worker
+///
+/// Reception streams that would exceed this limit fail with `ENOBUFS`.
+#define MAX_RECV_STREAMS ((size_t)32)
+
+/// Number of datagrams that a multishot io_uring reception may accumulate in
+/// the backlog of a connection that has no use for them
+///
+/// Beyond this point, the reception gets canceled so that it does not take up
+/// the worker buffers that other connections need. It will be resumed by
+/// recv_prepare() once the connection needs datagrams again.
+#define MAX_IDLE_BACKLOG ((size_t)8)
+
+/// Set up the receive engine state of a newly created connection
+///
+UDIPE_NODISCARD
+recv_state_t recv_state_initialize();
+
+/// Check that the receive engine state of a connection is not in use anymore,
+/// before the connection is destroyed
+///
+/// This function must be called within a logging scope.
+///
+/// \param state must be a receive engine state that was initialized with
+///              recv_state_initialize() and emptied with recv_abort().
+UDIPE_NON_NULL_ARGS
+void recv_state_finalize(recv_state_t* state);
+
+/// Start processing a receive command
+///
+/// If the target connection has a datagram in its backlog, the command is
+/// completed immediately. Otherwise it is recorded as pending, and will be
+/// completed by subsequent calls to recv_on_readable(), recv_on_completion()
+/// or recv_on_clock().
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns the target connection, and it
+///               must have fewer than \ref MAX_PENDING_RECVS pending receive
+///               commands.
+/// \param command must be a receive command.
+UDIPE_NON_NULL_ARGS
+void recv_start(worker_t* worker, const command_t* command);
+
+/// Start processing a stream reception command
+///
+/// If the command is valid, a reception stream is set up on the target
+/// connection, and any datagram from the connection's backlog is immediately
+/// passed to the stream's callback. Subsequent datagrams will be passed to the
+/// callback by recv_on_readable() until the stream ends.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns the target connection.
+/// \param command must be a stream reception command.
+UDIPE_NON_NULL_ARGS
+void recv_stream_start(worker_t* worker, const command_t* command);
+
+/// Process a readability notification on a connection's socket
+///
+/// This drains the socket into the connection's backlog using as few system
+/// calls as possible, then serves pending receive commands or the active
+/// reception stream from the backlog.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be a connection with pending receive commands or an
+///                   active reception stream.
+UDIPE_NON_NULL_ARGS
+void recv_on_readable(worker_t* worker, udipe_connection_t* connection);
+
+/// Read from the sockets of busy-polled connections that need datagrams
+///
+/// This calls recv_on_readable() on every connection with \ref
+/// udipe_connect_options_t::enable_busy_poll that has pending receive
+/// commands or an active reception stream. The sockets of these connections
+/// are not monitored by the worker, so this must be done on every iteration of
+/// the worker loop, and the worker must not go to sleep while this function
+/// reports that some connections were polled.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a valid worker.
+///
+/// \returns the truth that some connections were busy-polled.
+UDIPE_NON_NULL_ARGS
+bool recv_busy_poll(worker_t* worker);
+
+/// Make sure that connections which need datagrams can get them via io_uring
+///
+/// This tops up the worker's provided buffer ring from its \ref
+/// buffer_allocator_t, then prepares an `IORING_OP_RECVMSG` operation for each
+/// connection that has pending receive commands or an active reception stream
+/// and no operation in flight. With \ref UDIPE_IO_URING_MULTISHOT, this
+/// operation keeps receiving datagrams until it runs out of provided buffers or
+/// the connection goes without demand for a while. If the worker has run out
+/// of buffers, a readability notification is requested instead, which will be
+/// processed by recv_on_readable().
+///
+/// The operations are submitted by the next uring_wait() or uring_submit().
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a worker that uses an io_uring backend.
+UDIPE_NON_NULL_ARGS
+void recv_prepare(worker_t* worker);
+
+/// Process the completion of an io_uring operation from recv_prepare()
+///
+/// Received datagrams are appended to the connection's backlog, which is then
+/// used to serve pending receive commands or the active reception stream.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be the connection that the operation targeted.
+/// \param completion must be the completion of the operation.
+UDIPE_NON_NULL_ARGS
+void recv_on_completion(worker_t* worker,
+                        udipe_connection_t* connection,
+                        const struct io_uring_cqe* completion);
+
+/// Account for the passage of time in pending receive commands
+///
+/// This makes pending receive commands whose timeout has elapsed fail with
+/// `ETIMEDOUT` and acknowledges the cancelation of pending receive commands
+/// and reception streams whose future has been canceled.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a valid worker.
+/// \param elapsed is the amount of time that elapsed since the last call.
+///
+/// \returns the time left until the next pending receive command times out,
+///          or \ref UDIPE_DURATION_MAX if no pending receive command can time
+///          out.
+UDIPE_NON_NULL_ARGS
+udipe_duration_ns_t recv_on_clock(worker_t* worker,
+                                  udipe_duration_ns_t elapsed);
+
+/// Release all receive engine resources associated with a connection
+///
+/// Pending receive commands and the active reception stream on this connection
+/// fail with `ECONNABORTED`, and backlog buffers are returned to the worker's
+/// \ref buffer_allocator_t. With the io_uring backend, the operation that is in
+/// flight on the connection's socket, if any, is canceled. This must be done
+/// before the connection is destroyed by connection_close().
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be a valid connection.
+UDIPE_NON_NULL_ARGS
+void recv_abort(worker_t* worker, udipe_connection_t* connection);
+
+
+#ifdef UDIPE_BUILD_TESTS
+    /// Unit tests for the receive engine
+    ///
+    /// This function runs the unit tests for the receive engine. It must be
+    /// called within a logging scope.
+    void recv_unit_tests();
+#endif
@@ -0,0 +1,2393 @@
+#ifdef __linux__
+    #define _GNU_SOURCE
+#endif
+
+#include "send.h"
+
+#include <udipe/result.h>
+
+#include "buffer.h"
+#include "command.h"
+#include "connection.h"
+#include "error.h"
+#include "future.h"
+#include "log.h"
+#include "uring.h"
+#include "worker.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+    #include <linux/errqueue.h>
+    #include <netinet/in.h>
+    #include <poll.h>
+    #include <sys/socket.h>
+#endif
+
+
+/// Maximal number of segments that Linux accepts in a single GSO send
+///
+/// This is `UDP_MAX_SEGMENTS` from the kernel's `include/linux/udp.h`, which
+/// is not exposed to user space. Newer kernels have raised this limit, but we
+/// stick with the historical value so that we work everywhere.
+#define GSO_MAX_SEGMENTS ((size_t)64)
+
+/// Maximal payload size of a single GSO send
+///
+/// GSO sends are built as a single oversized IP packet before segmentation, so
+/// their payload must leave room for an UDP header and the largest IPv4 header
+/// within the 64 KiB size limit of an IP packet.
+#define GSO_MAX_BYTES ((size_t)UINT16_MAX - 8 - 60)
+
+/// Maximal number of `sendmmsg()` messages that are built per system call
+///
+#define MAX_MESSAGES ((size_t)UDIPE_MAX_BUFFERS)
+
+/// Maximal number of entries that are read from a socket's error queue per
+/// `recvmmsg()` system call
+///
+/// The kernel coalesces the zero-copy completion notifications of consecutive
+/// sends, so a single entry often covers many sends.
+#define MAX_ERROR_QUEUE_ENTRIES ((size_t)16)
+
+/// Size of the control message buffer of a socket error queue entry
+///
+/// Entries other than zero-copy completion notifications carry the address of
+/// the node that reported the error after the `sock_extended_err`.
+#define ERROR_QUEUE_CONTROL_SIZE                                               \
+    CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))
+
+/// Number of times send_abort() polls a connection's socket for zero-copy
+/// completion notifications before giving up on the associated buffers
+///
+#define ZEROCOPY_ABORT_POLLS 10
+
+/// Duration of each of the polls from \ref ZEROCOPY_ABORT_POLLS in
+/// milliseconds
+///
+#define ZEROCOPY_ABORT_POLL_MS 10
+
+/// Maximal number of payload bytes that a single `sendmmsg()` message can carry
+/// on a given connection
+///
+/// \param connection must be a valid connection.
+///
+/// \returns `SIZE_MAX` if GSO is disabled, otherwise the largest multiple of
+///          the GSO segment size that stays within the kernel's limits.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static inline size_t max_message_size(const udipe_connection_t* connection) {
+    const size_t segment_size = connection->gso_segment_size;
+    if (segment_size == 0) return SIZE_MAX;
+    size_t num_segments = GSO_MAX_BYTES / segment_size;
+    if (num_segments > GSO_MAX_SEGMENTS) num_segments = GSO_MAX_SEGMENTS;
+    if (num_segments == 0) num_segments = 1;
+    return num_segments * segment_size;
+}
+
+/// Number of datagrams that a payload of a given size amounts to once sent
+///
+/// \param connection must be a valid connection.
+/// \param size is the payload size.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static inline size_t num_datagrams(const udipe_connection_t* connection,
+                                   size_t size) {
+    const size_t segment_size = connection->gso_segment_size;
+    if (segment_size == 0 || size == 0) return 1;
+    return (size + segment_size - 1) / segment_size;
+}
+
+/// Check if a connection belongs to a list of connections
+///
+/// \param connections is the list of connections.
+/// \param num_connections is the length of `connections`.
+/// \param connection is the connection to be looked up.
+UDIPE_NODISCARD
+static inline bool contains_connection(udipe_connection_t* const connections[],
+                                       size_t num_connections,
+                                       const udipe_connection_t* connection) {
+    for (size_t i = 0; i < num_connections; ++i) {
+        if (connections[i] == connection) return true;
+    }
+    return false;
+}
+
+/// Truth that a message of a queued datagram should be sent with
+/// `MSG_ZEROCOPY`
+///
+/// Only payloads that live in worker buffers qualify: client buffers are
+/// handed back to the client as soon as the send command completes, whereas
+/// the kernel may keep reading from a zero-copy payload after that.
+///
+/// \param pending must be a valid entry of \ref worker_t::pending_sends.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static inline bool use_zerocopy(const pending_send_t* pending) {
+    return pending->buffer && pending->connection->zerocopy;
+}
+
+/// Record that a message of a queued datagram was successfully sent with
+/// `MSG_ZEROCOPY`
+///
+/// \param pending must be a valid entry of \ref worker_t::pending_sends.
+UDIPE_NON_NULL_ARGS
+static inline void record_zerocopy_send(pending_send_t* pending) {
+    udipe_connection_t* const connection = pending->connection;
+    if (pending->zerocopy.count == 0) {
+        pending->zerocopy.first = connection->zerocopy_next;
+    }
+    ++(pending->zerocopy.count);
+    ++(connection->zerocopy_next);
+}
+
+/// Control message buffer of a paced `sendmmsg()` message
+///
+typedef union txtime_control_u {
+    /// Raw control message storage
+    ///
+    char bytes[CMSG_SPACE(sizeof(uint64_t))];
+
+    /// Alignment enforcer
+    ///
+    struct cmsghdr align;
+} txtime_control_t;
+
+/// Read the clock that paced departure times are based on
+///
+/// \returns the current `CLOCK_MONOTONIC` time in nanoseconds.
+UDIPE_NODISCARD
+static inline uint64_t monotonic_ns() {
+    struct timespec now;
+    exit_on_negative(clock_gettime(CLOCK_MONOTONIC, &now),
+                     "Failed to read the monotonic clock");
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/// Schedule the departure of a message on a paced connection
+///
+/// The message gets an `SCM_TXTIME` control message that tells the kernel
+/// when it should depart. Messages depart back to back at the connection's
+/// pacing rate, but never before `now`, so that an idle connection does not
+/// accumulate credit that it could later spend on a burst.
+///
+/// \param connection must be a connection with pacing enabled.
+/// \param header must be the header of a message with a single `iovec`. Its
+///               control message fields are overwritten.
+/// \param control is the control message buffer of `header`.
+/// \param earliest is the earliest time at which the message may depart, as
+///                 returned for the previous message of `connection`.
+/// \param now is the current `CLOCK_MONOTONIC` time in nanoseconds.
+///
+/// \returns the earliest time at which the next message of `connection` may
+///          depart.
+UDIPE_NON_NULL_ARGS
+static inline uint64_t schedule_departure(const udipe_connection_t* connection,
+                                          struct msghdr* header,
+                                          txtime_control_t* control,
+                                          uint64_t earliest,
+                                          uint64_t now) {
+    assert(connection->pacing_rate > 0);
+    const uint64_t departure = (earliest > now) ? earliest : now;
+    header->msg_control = control->bytes;
+    header->msg_controllen = sizeof(control->bytes);
+    struct cmsghdr* const cmsg = CMSG_FIRSTHDR(header);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_TXTIME;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+    memcpy(CMSG_DATA(cmsg), &departure, sizeof(uint64_t));
+    const uint64_t size = header->msg_iov[0].iov_len;
+    return departure + size * 1000000000 / connection->pacing_rate;
+}
+
+/// Find the emission stream of a connection
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be a valid connection.
+///
+/// \returns the emission stream of `connection`, or `NULL` if it has none.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static send_stream_t* find_stream(worker_t* worker,
+                                  const udipe_connection_t* connection) {
+    for (size_t i = 0; i < worker->num_send_streams; ++i) {
+        if (worker->send_streams[i].connection == connection) {
+            return &worker->send_streams[i];
+        }
+    }
+    return NULL;
+}
+
+/// Complete a queued send command and remove it from the queue
+///
+/// If the queued datagram was produced by an emission stream, its result is
+/// accounted for in the stream's result instead of being sent to a future.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a valid worker.
+/// \param pending_idx must be the index of a valid entry of
+///                    `worker->pending_sends`.
+/// \param result is the result of the send command.
+UDIPE_NON_NULL_ARGS
+static void complete_pending(worker_t* worker,
+                             size_t pending_idx,
+                             udipe_send_result_t result) {
+    LOGGED_FUNCTION_START("%p, %zu, { %zu, %d }",
+                          worker, pending_idx, result.size, result.error)
+        assert(pending_idx < worker->num_pending_sends);
+        pending_send_t* const pending = &worker->pending_sends[pending_idx];
+        udipe_connection_t* const connection = pending->connection;
+
+        if (pending->from_stream) {
+            debug("Accounting for the datagram in its emission stream...");
+            send_stream_t* const stream = find_stream(worker,
+                                                      pending->connection);
+            ensure(stream);
+            assert(stream->num_queued > 0);
+            --(stream->num_queued);
+            if (result.error == 0 || result.size > 0) {
+                stream->result.num_datagrams +=
+                    num_datagrams(pending->connection, result.size);
+                stream->result.num_bytes += result.size;
+            }
+            if (result.error) {
+                debug("Emission failed, ending the stream.");
+                if (!stream->result.error) stream->result.error = result.error;
+                stream->producing = false;
+            }
+        } else if (pending->future) {
+            debug("Notifying the client...");
+            (void)future_network_try_set_result(
+                pending->future,
+                result.error == 0,
+                (udipe_network_payload_t){ .send = result }
+            );
+        } else {
+            debug("Client already acknowledged a cancelation.");
+        }
+
+        if (pending->buffer
+            && pending->zerocopy.completed < pending->zerocopy.count) {
+            trace("Kernel may still read the worker buffer, keeping it until "
+                  "zero-copy emission completes...");
+            ensure_lt(worker->num_zerocopy_buffers, (size_t)UDIPE_MAX_BUFFERS);
+            worker->zerocopy_buffers[worker->num_zerocopy_buffers++] =
+                (zerocopy_buffer_t){
+                    .connection = pending->connection,
+                    .buffer = pending->buffer,
+                    .sends = pending->zerocopy
+                };
+        } else if (pending->buffer) {
+            trace("Liberating the worker buffer...");
+            buffer_liberate(&worker->buffers, pending->buffer);
+        }
+
+        debug("Removing the command from the queue...");
+        memmove(pending,
+                pending + 1,
+                (worker->num_pending_sends - pending_idx - 1)
+                    * sizeof(pending_send_t));
+        --(worker->num_pending_sends);
+
+        if (connection->worker != worker) {
+            debug("Command was stolen, releasing the connection...");
+            worker_release_connection(connection);
+        }
+    LOGGED_FUNCTION_END
+}
+
+/// Fail a send command that was not queued yet
+///
+/// This function must be called within a logging scope.
+///
+/// \param command must be a send command.
+/// \param error is the `errno` code that the command should fail with.
+UDIPE_NON_NULL_ARGS
+static void fail_immediately(const command_t* command, int error) {
+    LOGGED_FUNCTION_START("%p, %d", command, error)
+        (void)future_network_try_set_result(
+            command->future,
+            false,
+            (udipe_network_payload_t){
+                .send = (udipe_send_result_t){ .error = error }
+            }
+        );
+    LOGGED_FUNCTION_END
+}
+
+/// Account for a range of completed zero-copy sends
+///
+/// \param sends must be a set of zero-copy sends on the connection that
+///              reported the completions.
+/// \param first is the sequence number of the first completed send.
+/// \param last is the sequence number of the last completed send.
+UDIPE_NON_NULL_ARGS
+static void complete_zerocopy_sends(zerocopy_sends_t* sends,
+                                    uint32_t first,
+                                    uint32_t last) {
+    // Sequence numbers wrap around, hence the unsigned differences
+    for (uint32_t i = 0; i < sends->count; ++i) {
+        const uint32_t sequence = sends->first + i;
+        if ((uint32_t)(sequence - first) <= (uint32_t)(last - first)) {
+            ++(sends->completed);
+        }
+    }
+    assert(sends->completed <= sends->count);
+}
+
+/// Account for an error that was reported via a socket's error queue
+///
+/// The matching counter of \ref udipe_connection_stats_t is incremented. As an
+/// unreachable peer can easily trigger one error per datagram, errors are
+/// only logged when the counter reaches a power of two, so that error storms
+/// do not flood the logs.
+///
+/// This function must be called within a logging scope.
+///
+/// \param connection must be the connection whose socket reported the error.
+/// \param error is the error from the `IP_RECVERR` or `IPV6_RECVERR`
+///              control message.
+UDIPE_NON_NULL_ARGS
+static void count_socket_error(udipe_connection_t* connection,
+                               const struct sock_extended_err* error) {
+    LOGGED_FUNCTION_START("%p, %p", connection, error)
+        atomic_uint_least64_t* counter;
+        const char* source;
+        switch (error->ee_origin) {
+        case SO_EE_ORIGIN_ICMP:
+        case SO_EE_ORIGIN_ICMP6:
+            counter = &connection->icmp_errors;
+            source = "Remote host or router";
+            break;
+        case SO_EE_ORIGIN_LOCAL:
+            counter = &connection->local_errors;
+            source = "Local network stack";
+            break;
+        default:
+            warnf("Unexpected socket error queue entry from origin %u: %s.",
+                  (unsigned)error->ee_origin,
+                  strerror((int)error->ee_errno));
+            return;
+        }
+        // Workers that stole send commands may read the error queue too
+        const uint64_t count =
+            atomic_fetch_add_explicit(counter, 1, memory_order_relaxed) + 1;
+        if ((count & (count - 1)) == 0) {
+            warnf("%s reported an error: %s (%" PRIu64 " such error(s) "
+                  "so far).",
+                  source,
+                  strerror((int)error->ee_errno),
+                  count);
+        } else {
+            tracef("%s reported an error: %s.",
+                   source,
+                   strerror((int)error->ee_errno));
+        }
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void send_drain_error_queue(worker_t* worker,
+                            udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p, %p", worker, connection)
+        while (true) {
+            trace("Reading entries from the socket's error queue...");
+            char controls[MAX_ERROR_QUEUE_ENTRIES][ERROR_QUEUE_CONTROL_SIZE];
+            struct mmsghdr messages[MAX_ERROR_QUEUE_ENTRIES];
+            for (size_t i = 0; i < MAX_ERROR_QUEUE_ENTRIES; ++i) {
+                messages[i] = (struct mmsghdr){
+                    .msg_hdr = (struct msghdr){
+                        .msg_control = controls[i],
+                        .msg_controllen = ERROR_QUEUE_CONTROL_SIZE
+                    }
+                };
+            }
+            const int result = recvmmsg(connection->socket,
+                                        messages,
+                                        (unsigned)MAX_ERROR_QUEUE_ENTRIES,
+                                        MSG_ERRQUEUE | MSG_DONTWAIT,
+                                        NULL);
+            if (result < 0) {
+                const int error = errno;
+                errno = 0;
+                switch (error) {
+                case EAGAIN:  // Error queue is empty
+                #if EAGAIN != EWOULDBLOCK
+                    case EWOULDBLOCK:
+                #endif
+                    return;
+                case EINTR:  // Interrupted by a signal
+                    continue;
+                default:
+                    errno = error;
+                    exit_after_c_error("Failed to read the socket error queue!");
+                }
+            }
+
+            debugf("Processing %d error queue entries...", result);
+            for (size_t i = 0; i < (size_t)result; ++i) {
+                const struct msghdr* const header = &messages[i].msg_hdr;
+                for (const struct cmsghdr* cmsg = CMSG_FIRSTHDR(header);
+                     cmsg;
+                     cmsg = CMSG_NXTHDR((struct msghdr*)header,
+                                        (struct cmsghdr*)cmsg)) {
+                    if (!(cmsg->cmsg_level == SOL_IP
+                          && cmsg->cmsg_type == IP_RECVERR)
+                        && !(cmsg->cmsg_level == SOL_IPV6
+                             && cmsg->cmsg_type == IPV6_RECVERR)) {
+                        continue;
+                    }
+                    struct sock_extended_err error;
+                    memcpy(&error,
+                           CMSG_DATA(cmsg),
+                           sizeof(struct sock_extended_err));
+                    if (error.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                        count_socket_error(connection, &error);
+                        continue;
+                    }
+                    tracef("Zero-copy sends %u to %u have completed.",
+                           error.ee_info, error.ee_data);
+                    if ((error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                        && connection->zerocopy) {
+                        info("The kernel had to copy zero-copy datagrams "
+                             "anyway, which usually means that they went "
+                             "through the loopback interface. Turning off "
+                             "zero-copy emission on this connection.");
+                        connection->zerocopy = false;
+                    }
+                    for (size_t j = 0; j < worker->num_pending_sends; ++j) {
+                        pending_send_t* const pending =
+                            &worker->pending_sends[j];
+                        if (pending->connection != connection) continue;
+                        complete_zerocopy_sends(&pending->zerocopy,
+                                                error.ee_info,
+                                                error.ee_data);
+                    }
+                    size_t buffer_idx = 0;
+                    while (buffer_idx < worker->num_zerocopy_buffers) {
+                        zerocopy_buffer_t* const entry =
+                            &worker->zerocopy_buffers[buffer_idx];
+                        if (entry->connection != connection) {
+                            ++buffer_idx;
+                            continue;
+                        }
+                        complete_zerocopy_sends(&entry->sends,
+                                                error.ee_info,
+                                                error.ee_data);
+                        if (entry->sends.completed < entry->sends.count) {
+                            ++buffer_idx;
+                            continue;
+                        }
+                        trace("Liberating a worker buffer...");
+                        buffer_liberate(&worker->buffers, entry->buffer);
+                        *entry = worker->zerocopy_buffers[
+                            --(worker->num_zerocopy_buffers)
+                        ];
+                    }
+                }
+            }
+            if ((size_t)result < MAX_ERROR_QUEUE_ENTRIES) return;
+        }
+    LOGGED_FUNCTION_END
+}
+
+/// Truth that some worker buffers that were sent through a connection may
+/// still be read by the kernel due to zero-copy emission
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be a valid connection.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static bool has_zerocopy_buffers(const worker_t* worker,
+                                 const udipe_connection_t* connection) {
+    for (size_t i = 0; i < worker->num_zerocopy_buffers; ++i) {
+        if (worker->zerocopy_buffers[i].connection == connection) return true;
+    }
+    return false;
+}
+
+/// Take back the worker buffers whose zero-copy emission has completed
+///
+/// This processes the zero-copy completion notifications of every connection
+/// that has zero-copy sends in flight.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a valid worker.
+UDIPE_NON_NULL_ARGS
+static void reclaim_zerocopy_buffers(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        udipe_connection_t* connections[UDIPE_MAX_BUFFERS + MAX_PENDING_SENDS];
+        size_t num_connections = 0;
+        for (size_t i = 0; i < worker->num_zerocopy_buffers; ++i) {
+            udipe_connection_t* const connection =
+                worker->zerocopy_buffers[i].connection;
+            if (contains_connection(connections, num_connections, connection)) {
+                continue;
+            }
+            connections[num_connections++] = connection;
+        }
+        for (size_t i = 0; i < worker->num_pending_sends; ++i) {
+            const pending_send_t* const pending = &worker->pending_sends[i];
+            if (pending->zerocopy.completed == pending->zerocopy.count
+                || contains_connection(connections,
+                                       num_connections,
+                                       pending->connection)) {
+                continue;
+            }
+            connections[num_connections++] = pending->connection;
+        }
+
+        debugf("Collecting zero-copy notifications from %zu connection(s)...",
+               num_connections);
+        for (size_t i = 0; i < num_connections; ++i) {
+            send_drain_error_queue(worker, connections[i]);
+        }
+    LOGGED_FUNCTION_END
+}
+
+/// Hand over all queued datagrams to the operating system
+///
+/// This is send_flush() without the emission stream logic, for use by
+/// send_start() when it needs to make room in the send queue.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a valid worker.
+UDIPE_NON_NULL_ARGS
+static void flush_all(worker_t* worker);
+
+UDIPE_NON_NULL_ARGS
+void send_start(worker_t* worker, const command_t* command) {
+    LOGGED_FUNCTION_START("%p, %p", worker, command)
+        const udipe_send_options_t* const options = &command->options.send;
+        udipe_connection_t* const connection = options->connection;
+        ensure(connection);
+        ensure(options->buffer || options->size == 0);
+
+        debug("Checking the connection's direction...");
+        if (connection->direction == UDIPE_IN) {
+            warn("Attempted to send through an input-only connection!");
+            fail_immediately(command, EOPNOTSUPP);
+            return;
+        }
+
+        debug("Checking the datagram size...");
+        const size_t buffer_size = worker->buffers.config.buffer_size;
+        const bool fits_buffer = options->size <= buffer_size;
+        if (!fits_buffer && connection->gso_segment_size == 0) {
+            warnf("Attempted to send a %zu-byte datagram, which is larger "
+                  "than the %zu-byte worker buffers!",
+                  options->size, buffer_size);
+            fail_immediately(command, EMSGSIZE);
+            return;
+        }
+
+        if (worker->num_pending_sends == MAX_PENDING_SENDS) {
+            debug("Send queue is full, flushing it...");
+            flush_all(worker);
+        }
+        ensure_lt(worker->num_pending_sends, MAX_PENDING_SENDS);
+
+        void* buffer = NULL;
+        const void* payload = options->buffer;
+        if (fits_buffer) {
+            debug("Copying the payload into a worker buffer...");
+            buffer = buffer_allocate(&worker->buffers);
+            if (!buffer && worker->num_zerocopy_buffers > 0) {
+                debug("Out of worker buffers, checking if zero-copy emission "
+                      "is done with some...");
+                reclaim_zerocopy_buffers(worker);
+                buffer = buffer_allocate(&worker->buffers);
+            }
+            if (!buffer && worker->num_pending_sends > 0) {
+                debug("Out of worker buffers, flushing the send queue...");
+                flush_all(worker);
+                buffer = buffer_allocate(&worker->buffers);
+            }
+            if (buffer) {
+                // Empty datagrams may come with a NULL buffer
+                if (options->size > 0) {
+                    memcpy(buffer, options->buffer, options->size);
+                }
+                payload = buffer;
+            } else {
+                debug("Still out of worker buffers, will send straight from "
+                      "the client buffer instead.");
+            }
+        } else {
+            debug("GSO payload is larger than a worker buffer, will send "
+                  "straight from the client buffer.");
+        }
+
+        debug("Queuing the datagram for emission...");
+        udipe_duration_ns_t timeout = options->timeout;
+        if (timeout == UDIPE_DURATION_DEFAULT) {
+            timeout = connection->send_timeout;
+        }
+        worker->pending_sends[worker->num_pending_sends++] = (pending_send_t){
+            .connection = connection,
+            .payload = payload,
+            .buffer = buffer,
+            .size = options->size,
+            .sent = 0,
+            .future = command->future,
+            .from_stream = false,
+            .remaining_time = timeout
+        };
+        if (connection->worker != worker) {
+            debug("Command was stolen, keeping the connection open until it "
+                  "completes...");
+            connection_acquire(connection);
+        }
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void send_stream_start(worker_t* worker, const command_t* command) {
+    LOGGED_FUNCTION_START("%p, %p", worker, command)
+        const udipe_send_stream_options_t* const options =
+            &command->options.send_stream;
+        udipe_connection_t* const connection = options->connection;
+        ensure(connection);
+        ensure(options->callback);
+
+        debug("Checking that the stream can be set up...");
+        int error = 0;
+        if (connection->direction == UDIPE_IN) {
+            warn("Attempted to send through an input-only connection!");
+            error = EOPNOTSUPP;
+        } else if (find_stream(worker, connection)) {
+            warn("Attempted to start a second emission stream on a "
+                 "connection!");
+            error = EBUSY;
+        } else if (worker->num_send_streams == MAX_SEND_STREAMS) {
+            warn("Attempted to start more emission streams than the worker "
+                 "can handle!");
+            error = ENOBUFS;
+        }
+        if (error) {
+            (void)future_network_try_set_result(
+                command->future,
+                false,
+                (udipe_network_payload_t){
+                    .send_stream = (udipe_send_stream_result_t){
+                        .error = error
+                    }
+                }
+            );
+            return;
+        }
+
+        debug("Setting up the emission stream...");
+        worker->send_streams[worker->num_send_streams++] = (send_stream_t){
+            .connection = connection,
+            .callback = options->callback,
+            .context = options->context,
+            .future = command->future,
+            .producing = true
+        };
+    LOGGED_FUNCTION_END
+}
+
+/// Hand over all queued datagrams of a connection to the operating system
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be a valid connection.
+///
+/// \returns `true` if all queued datagrams were sent, `false` if some remain
+///          queued because the socket's send buffer is full.
+UDIPE_NON_NULL_ARGS
+static bool flush_connection(worker_t* worker,
+                             udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p, %p", worker, connection)
+        const size_t max_size = max_message_size(connection);
+        while (true) {
+            trace("Collecting queued datagrams...");
+            size_t indices[MAX_MESSAGES];
+            struct iovec iovecs[MAX_MESSAGES];
+            struct mmsghdr messages[MAX_MESSAGES];
+            size_t num_messages = 0;
+            bool zerocopy = false;
+            for (size_t i = 0;
+                 i < worker->num_pending_sends && num_messages < MAX_MESSAGES;
+                 ++i) {
+                const pending_send_t* const pending = &worker->pending_sends[i];
+                if (pending->connection != connection) continue;
+                // sendmmsg() flags apply to all messages, so zero-copy and
+                // copied payloads must be sent by separate system calls
+                if (num_messages == 0) {
+                    zerocopy = use_zerocopy(pending);
+                } else if (use_zerocopy(pending) != zerocopy) {
+                    break;
+                }
+                size_t offset = pending->sent;
+                do {
+                    size_t message_size = pending->size - offset;
+                    if (message_size > max_size) message_size = max_size;
+                    indices[num_messages] = i;
+                    iovecs[num_messages] = (struct iovec){
+                        .iov_base = (char*)pending->payload + offset,
+                        .iov_len = message_size
+                    };
+                    messages[num_messages] = (struct mmsghdr){
+                        .msg_hdr = (struct msghdr){
+                            .msg_iov = &iovecs[num_messages],
+                            .msg_iovlen = 1
+                        }
+                    };
+                    ++num_messages;
+                    offset += message_size;
+                } while (offset < pending->size && num_messages < MAX_MESSAGES);
+            }
+            if (num_messages == 0) return true;
+
+            txtime_control_t controls[MAX_MESSAGES];
+            uint64_t next_departures[MAX_MESSAGES];
+            if (connection->pacing_rate) {
+                trace("Scheduling message departures...");
+                const uint64_t now = monotonic_ns();
+                uint64_t earliest = connection->next_departure;
+                for (size_t i = 0; i < num_messages; ++i) {
+                    earliest = schedule_departure(connection,
+                                                  &messages[i].msg_hdr,
+                                                  &controls[i],
+                                                  earliest,
+                                                  now);
+                    next_departures[i] = earliest;
+                }
+            }
+
+            debugf("Sending %zu message(s)%s...",
+                   num_messages, zerocopy ? " without copying them" : "");
+            const int result = sendmmsg(connection->socket,
+                                        messages,
+                                        (unsigned)num_messages,
+                                        MSG_DONTWAIT
+                                        | (zerocopy ? MSG_ZEROCOPY : 0));
+            if (result > 0) {
+                debugf("Sent %d message(s).", result);
+                if (connection->pacing_rate) {
+                    connection->next_departure = next_departures[result - 1];
+                }
+                for (size_t i = 0; i < (size_t)result; ++i) {
+                    pending_send_t* const pending =
+                        &worker->pending_sends[indices[i]];
+                    pending->sent += iovecs[i].iov_len;
+                    if (zerocopy) record_zerocopy_send(pending);
+                }
+                // Going backwards keeps the lower indices valid, and messages
+                // from a given command are contiguous.
+                for (size_t i = (size_t)result; i > 0; --i) {
+                    const size_t pending_idx = indices[i - 1];
+                    if (i < (size_t)result && indices[i] == pending_idx) {
+                        continue;
+                    }
+                    const pending_send_t* const pending =
+                        &worker->pending_sends[pending_idx];
+                    if (pending->sent < pending->size) continue;
+                    complete_pending(
+                        worker,
+                        pending_idx,
+                        (udipe_send_result_t){ .size = pending->size }
+                    );
+                }
+                continue;
+            }
+            assert(result < 0);
+
+            const int error = errno;
+            errno = 0;
+            switch (error) {
+            case EAGAIN:  // Socket send buffer is full
+            #if EAGAIN != EWOULDBLOCK
+                case EWOULDBLOCK:
+            #endif
+            case ENOBUFS:  // Network interface output queue is full
+                debug("Socket is congested, will try again later.");
+                return false;
+            case EINTR:  // Interrupted by a signal before any datagram was sent
+                debug("Interrupted by a signal, trying again...");
+                continue;
+            case EBADF:  // Invalid socket
+            case EDESTADDRREQ:  // Socket is not connected
+            case EFAULT:  // Invalid buffer
+            case EISCONN:  // Destination specified for a connected socket
+            case ENOTSOCK:  // Not a socket
+                exit_after_c_error("This error is not expected to happen!");
+            default:
+                // EINVAL is not fatal here as the kernel uses it to reject GSO
+                // sends that its device cannot handle.
+                warnf("Failed to send a datagram: %s.", strerror(error));
+                // Other errors caused by earlier datagrams are waiting in the
+                // error queue, and would otherwise fail later sends one by one
+                send_drain_error_queue(worker, connection);
+                complete_pending(
+                    worker,
+                    indices[0],
+                    (udipe_send_result_t){
+                        .size = worker->pending_sends[indices[0]].sent,
+                        .error = error
+                    }
+                );
+                continue;
+            }
+        }
+    LOGGED_FUNCTION_END
+}
+
+/// Hand over all queued datagrams to the operating system via io_uring
+///
+/// This is the io_uring counterpart of calling flush_connection() on every
+/// connection with queued datagrams. The messages of all connections are
+/// submitted with a single system call. Those of a given connection are linked
+/// together, so that a congested socket cuts emission short on its own
+/// connection just like a partial `sendmmsg()` would, without affecting other
+/// connections.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a worker that uses an io_uring backend.
+UDIPE_NON_NULL_ARGS
+static void flush_all_uring(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        udipe_connection_t* congested[MAX_PENDING_SENDS];
+        size_t num_congested = 0;
+        while (true) {
+            trace("Collecting queued datagrams, grouped by connection...");
+            size_t indices[MAX_MESSAGES];
+            struct iovec iovecs[MAX_MESSAGES];
+            struct msghdr headers[MAX_MESSAGES];
+            bool zerocopy[MAX_MESSAGES];
+            size_t num_messages = 0;
+            udipe_connection_t* collected[MAX_PENDING_SENDS];
+            size_t num_collected = 0;
+            for (size_t first = 0;
+                 first < worker->num_pending_sends
+                 && num_messages < MAX_MESSAGES;
+                 ++first) {
+                udipe_connection_t* const connection =
+                    worker->pending_sends[first].connection;
+                if (contains_connection(congested, num_congested, connection)
+                    || contains_connection(collected,
+                                           num_collected,
+                                           connection)) {
+                    continue;
+                }
+                collected[num_collected++] = connection;
+                const size_t max_size = max_message_size(connection);
+                for (size_t i = first;
+                     i < worker->num_pending_sends
+                     && num_messages < MAX_MESSAGES;
+                     ++i) {
+                    const pending_send_t* const pending =
+                        &worker->pending_sends[i];
+                    if (pending->connection != connection) continue;
+                    size_t offset = pending->sent;
+                    do {
+                        size_t message_size = pending->size - offset;
+                        if (message_size > max_size) message_size = max_size;
+                        indices[num_messages] = i;
+                        iovecs[num_messages] = (struct iovec){
+                            .iov_base = (char*)pending->payload + offset,
+                            .iov_len = message_size
+                        };
+                        headers[num_messages] = (struct msghdr){
+                            .msg_iov = &iovecs[num_messages],
+                            .msg_iovlen = 1
+                        };
+                        zerocopy[num_messages] = use_zerocopy(pending);
+                        ++num_messages;
+                        offset += message_size;
+                    } while (offset < pending->size
+                             && num_messages < MAX_MESSAGES);
+                }
+            }
+            if (num_messages == 0) return;
+
+            debugf("Submitting %zu message(s) from %zu connection(s)...",
+                   num_messages, num_collected);
+            txtime_control_t controls[MAX_MESSAGES];
+            uint64_t next_departures[MAX_MESSAGES];
+            uint64_t now = 0;
+            uint64_t earliest = 0;
+            for (size_t i = 0; i < num_messages; ++i) {
+                const udipe_connection_t* const connection =
+                    worker->pending_sends[indices[i]].connection;
+                if (connection->pacing_rate) {
+                    if (now == 0) now = monotonic_ns();
+                    // Messages of a connection are contiguous
+                    if (i == 0
+                        || worker->pending_sends[indices[i - 1]].connection
+                           != connection) {
+                        earliest = connection->next_departure;
+                    }
+                    earliest = schedule_departure(connection,
+                                                  &headers[i],
+                                                  &controls[i],
+                                                  earliest,
+                                                  now);
+                    next_departures[i] = earliest;
+                }
+                struct io_uring_sqe* const sqe = uring_get_sqe(&worker->ring);
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->fd = connection->socket;
+                sqe->addr = (uint64_t)(uintptr_t)&headers[i];
+                sqe->len = 1;
+                // Report congestion instead of waiting for the socket
+                sqe->msg_flags = MSG_DONTWAIT
+                               | (zerocopy[i] ? MSG_ZEROCOPY : 0);
+                if (i + 1 < num_messages
+                    && worker->pending_sends[indices[i + 1]].connection
+                       == connection) {
+                    sqe->flags = IOSQE_IO_LINK;
+                }
+                sqe->user_data = ((uint64_t)i << WORKER_URING_TAG_BITS)
+                               | WORKER_URING_SEND;
+            }
+
+            debug("Waiting for emission results...");
+            int results[MAX_MESSAGES];
+            size_t num_results = 0;
+            while (num_results < num_messages) {
+                struct io_uring_cqe completions[MAX_MESSAGES];
+                const size_t num_completions = uring_wait(&worker->ring,
+                                                          completions,
+                                                          MAX_MESSAGES,
+                                                          UDIPE_DURATION_MAX);
+                for (size_t i = 0; i < num_completions; ++i) {
+                    const struct io_uring_cqe* const completion =
+                        &completions[i];
+                    if ((completion->user_data & WORKER_URING_TAG_MASK)
+                        != WORKER_URING_SEND) {
+                        worker_complete(worker, completion);
+                        continue;
+                    }
+                    const size_t message_idx =
+                        completion->user_data >> WORKER_URING_TAG_BITS;
+                    assert(message_idx < num_messages);
+                    results[message_idx] = completion->res;
+                    ++num_results;
+                }
+            }
+
+            trace("Accounting for emission results...");
+            bool touched[MAX_PENDING_SENDS] = { 0 };
+            int errors[MAX_PENDING_SENDS] = { 0 };
+            for (size_t i = 0; i < num_messages; ++i) {
+                const size_t pending_idx = indices[i];
+                pending_send_t* const pending =
+                    &worker->pending_sends[pending_idx];
+                if (results[i] >= 0) {
+                    pending->sent += iovecs[i].iov_len;
+                    if (zerocopy[i]) record_zerocopy_send(pending);
+                    if (pending->connection->pacing_rate) {
+                        pending->connection->next_departure =
+                            next_departures[i];
+                    }
+                    touched[pending_idx] = true;
+                    continue;
+                }
+                const int error = -results[i];
+                switch (error) {
+                case ECANCELED:  // An earlier message of the chain failed
+                    continue;
+                case EAGAIN:  // Socket send buffer is full
+                #if EAGAIN != EWOULDBLOCK
+                    case EWOULDBLOCK:
+                #endif
+                case ENOBUFS:  // Network interface output queue is full
+                    debug("Socket is congested, will try again later.");
+                    if (!contains_connection(congested,
+                                             num_congested,
+                                             pending->connection)) {
+                        congested[num_congested++] = pending->connection;
+                    }
+                    continue;
+                case EINTR:  // Interrupted before any datagram was sent
+                    debug("Interrupted by a signal, will try again...");
+                    continue;
+                case EBADF:  // Invalid socket
+                case EDESTADDRREQ:  // Socket is not connected
+                case EFAULT:  // Invalid buffer
+                case EISCONN:  // Destination specified for a connected socket
+                case ENOTSOCK:  // Not a socket
+                    errno = error;
+                    exit_after_c_error("This error is not expected to happen!");
+                default:
+                    // See flush_connection() for why EINVAL is not fatal
+                    warnf("Failed to send a datagram: %s.", strerror(error));
+                    // Messages of a connection are linked, so this happens at
+                    // most once per connection and submission
+                    send_drain_error_queue(worker, pending->connection);
+                    errors[pending_idx] = error;
+                    touched[pending_idx] = true;
+                    continue;
+                }
+            }
+
+            trace("Completing commands that are done...");
+            // Going backwards keeps the lower indices valid
+            for (size_t i = worker->num_pending_sends; i > 0; --i) {
+                const size_t pending_idx = i - 1;
+                if (!touched[pending_idx]) continue;
+                const pending_send_t* const pending =
+                    &worker->pending_sends[pending_idx];
+                if (errors[pending_idx]) {
+                    complete_pending(
+                        worker,
+                        pending_idx,
+                        (udipe_send_result_t){
+                            .size = pending->sent,
+                            .error = errors[pending_idx]
+                        }
+                    );
+                } else if (pending->sent >= pending->size) {
+                    complete_pending(
+                        worker,
+                        pending_idx,
+                        (udipe_send_result_t){ .size = pending->size }
+                    );
+                }
+            }
+        }
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+static void flush_all(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        if (worker_uses_uring(worker)) {
+            flush_all_uring(worker);
+            return;
+        }
+
+        udipe_connection_t* flushed[MAX_PENDING_SENDS];
+        size_t num_flushed = 0;
+        size_t pending_idx = 0;
+        while (pending_idx < worker->num_pending_sends) {
+            udipe_connection_t* const connection =
+                worker->pending_sends[pending_idx].connection;
+            bool already_flushed = false;
+            for (size_t i = 0; i < num_flushed; ++i) {
+                if (flushed[i] == connection) {
+                    already_flushed = true;
+                    break;
+                }
+            }
+            if (already_flushed) {
+                ++pending_idx;
+                continue;
+            }
+            (void)flush_connection(worker, connection);
+            flushed[num_flushed++] = connection;
+            // Flushing removes entries from the queue, so start over
+            pending_idx = 0;
+        }
+    LOGGED_FUNCTION_END
+}
+
+/// Have emission streams produce datagrams into worker buffers and queue them
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a valid worker.
+///
+/// \returns `true` if production was cut short because the worker ran out of
+///          buffers.
+UDIPE_NON_NULL_ARGS
+static bool produce_datagrams(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        const size_t buffer_size = worker->buffers.config.buffer_size;
+        for (size_t i = 0; i < worker->num_send_streams; ++i) {
+            send_stream_t* const stream = &worker->send_streams[i];
+            while (stream->producing
+                   && stream->num_queued < MAX_STREAM_QUEUED
+                   && worker->num_pending_sends < MAX_PENDING_SENDS) {
+                void* const buffer = buffer_allocate(&worker->buffers);
+                if (!buffer) {
+                    debug("Out of worker buffers, will produce more datagrams "
+                          "once some have been sent.");
+                    return true;
+                }
+
+                trace("Asking the callback for a datagram...");
+                size_t size = 0;
+                if (!stream->callback(stream->context,
+                                      buffer,
+                                      buffer_size,
+                                      &size)) {
+                    debug("Callback requested the end of the stream.");
+                    buffer_liberate(&worker->buffers, buffer);
+                    stream->producing = false;
+                    break;
+                }
+                ensure_le(size, buffer_size);
+
+                tracef("Queuing a %zu-byte datagram for emission...", size);
+                worker->pending_sends[worker->num_pending_sends++] =
+                    (pending_send_t){
+                        .connection = stream->connection,
+                        .payload = buffer,
+                        .buffer = buffer,
+                        .size = size,
+                        .sent = 0,
+                        .future = NULL,
+                        .from_stream = true,
+                        .remaining_time = stream->connection->send_timeout
+                    };
+                ++(stream->num_queued);
+            }
+        }
+        return false;
+    LOGGED_FUNCTION_END
+}
+
+/// Tear down the emission streams that are done producing datagrams and have
+/// no queued datagram left
+///
+/// The future of each such stream is notified of the stream's result, or of
+/// the acknowledgement of its cancelation.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a valid worker.
+UDIPE_NON_NULL_ARGS
+static void end_finished_streams(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        size_t stream_idx = 0;
+        while (stream_idx < worker->num_send_streams) {
+            send_stream_t* const stream = &worker->send_streams[stream_idx];
+            if (stream->producing || stream->num_queued > 0) {
+                ++stream_idx;
+                continue;
+            }
+
+            debug("Notifying the client that a stream has ended...");
+            if (stream->canceled) {
+                future_eager_acknowledge_cancel(stream->future);
+            } else {
+                (void)future_network_try_set_result(
+                    stream->future,
+                    stream->result.error == 0,
+                    (udipe_network_payload_t){ .send_stream = stream->result }
+                );
+            }
+
+            debug("Removing the stream from the stream list...");
+            memmove(stream,
+                    stream + 1,
+                    (worker->num_send_streams - stream_idx - 1)
+                        * sizeof(send_stream_t));
+            --(worker->num_send_streams);
+        }
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+bool send_flush(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        if (worker->num_zerocopy_buffers > 0) {
+            debug("Taking back worker buffers from zero-copy emission...");
+            reclaim_zerocopy_buffers(worker);
+        }
+
+        debug("Producing datagrams from emission streams...");
+        const bool starved = produce_datagrams(worker);
+
+        debug("Sending queued datagrams...");
+        flush_all(worker);
+
+        debug("Ending emission streams that are done...");
+        end_finished_streams(worker);
+
+        if (starved) return false;
+        for (size_t i = 0; i < worker->num_send_streams; ++i) {
+            const send_stream_t* const stream = &worker->send_streams[i];
+            if (stream->producing && stream->num_queued == 0) return true;
+        }
+        return false;
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+udipe_duration_ns_t send_on_clock(worker_t* worker,
+                                  udipe_duration_ns_t elapsed) {
+    LOGGED_FUNCTION_START("%p, %zu", worker, (size_t)elapsed)
+        udipe_duration_ns_t next_timeout = UDIPE_DURATION_MAX;
+        size_t pending_idx = 0;
+        while (pending_idx < worker->num_pending_sends) {
+            pending_send_t* const pending = &worker->pending_sends[pending_idx];
+            if (!pending->from_stream
+                && future_network_canceled(pending->future)) {
+                debug("Acknowledging the cancelation of a queued command...");
+                future_eager_acknowledge_cancel(pending->future);
+                pending->future = NULL;
+                complete_pending(worker,
+                                 pending_idx,
+                                 (udipe_send_result_t){ 0 });
+                continue;
+            }
+            if (pending->remaining_time == UDIPE_DURATION_MAX) {
+                ++pending_idx;
+                continue;
+            }
+            if (pending->remaining_time <= elapsed) {
+                debug("A queued command has timed out.");
+                complete_pending(worker,
+                                 pending_idx,
+                                 (udipe_send_result_t){
+                                     // Part of a GSO payload may be out
+                                     .size = pending->sent,
+                                     .error = ETIMEDOUT
+                                 });
+                continue;
+            }
+            pending->remaining_time -= elapsed;
+            if (pending->remaining_time < next_timeout) {
+                next_timeout = pending->remaining_time;
+            }
+            ++pending_idx;
+        }
+
+        for (size_t i = 0; i < worker->num_send_streams; ++i) {
+            send_stream_t* const stream = &worker->send_streams[i];
+            if (!stream->canceled && future_network_canceled(stream->future)) {
+                debug("An emission stream was canceled, stopping it...");
+                stream->canceled = true;
+                stream->producing = false;
+            }
+        }
+        end_finished_streams(worker);
+        return next_timeout;
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void send_abort(worker_t* worker, udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p, %p", worker, connection)
+        debug("Trying to send queued datagrams one last time...");
+        if (!flush_connection(worker, connection)) {
+            debug("Aborting remaining send commands...");
+            size_t pending_idx = 0;
+            while (pending_idx < worker->num_pending_sends) {
+                if (worker->pending_sends[pending_idx].connection
+                    != connection) {
+                    ++pending_idx;
+                    continue;
+                }
+                complete_pending(
+                    worker,
+                    pending_idx,
+                    (udipe_send_result_t){ .error = ECONNABORTED }
+                );
+            }
+        }
+
+        send_stream_t* const stream = find_stream(worker, connection);
+        if (stream) {
+            debug("Aborting the emission stream...");
+            if (stream->producing && !stream->result.error) {
+                stream->result.error = ECONNABORTED;
+            }
+            stream->producing = false;
+            end_finished_streams(worker);
+        }
+
+        for (size_t attempt = 0;
+             has_zerocopy_buffers(worker, connection);
+             ++attempt) {
+            if (attempt == ZEROCOPY_ABORT_POLLS) {
+                warn("Kernel did not report the completion of some zero-copy "
+                     "sends in time, liberating their buffers anyway. This "
+                     "may corrupt the last datagrams that were sent.");
+                size_t buffer_idx = 0;
+                while (buffer_idx < worker->num_zerocopy_buffers) {
+                    zerocopy_buffer_t* const entry =
+                        &worker->zerocopy_buffers[buffer_idx];
+                    if (entry->connection != connection) {
+                        ++buffer_idx;
+                        continue;
+                    }
+                    buffer_liberate(&worker->buffers, entry->buffer);
+                    *entry = worker->zerocopy_buffers[
+                        --(worker->num_zerocopy_buffers)
+                    ];
+                }
+                break;
+            }
+            if (attempt > 0) {
+                debug("Waiting for zero-copy completion notifications...");
+                // Error queue entries are reported as POLLERR, which is always
+                // monitored
+                struct pollfd pollfd = { .fd = connection->socket };
+                if (poll(&pollfd, 1, ZEROCOPY_ABORT_POLL_MS) < 0
+                    && errno != EINTR) {
+                    exit_after_c_error("Failed to poll a socket!");
+                }
+                errno = 0;
+            }
+            send_drain_error_queue(worker, connection);
+        }
+    LOGGED_FUNCTION_END
+}
+
+
+#ifdef UDIPE_BUILD_TESTS
+
+    #include <udipe/command.h>
+    #include <udipe/context.h>
+
+    #include "context.h"
+    #include "memory.h"
+    #include "unit_tests.h"
+
+    #include <arpa/inet.h>
+    #include <stdlib.h>
+    #include <sys/time.h>
+    #include <threads.h>
+    #include <time.h>
+
+    /// Number of datagrams that are sent by the round trip test
+    ///
+    #define NUM_TEST_DATAGRAMS ((size_t)16)
+
+    /// Maximal size of the test datagrams
+    ///
+    #define MAX_TEST_DATAGRAM_SIZE ((size_t)1024)
+
+    /// Number of datagrams that are sent by the emission stream test
+    ///
+    /// This is enough to require several rounds of datagram production, but
+    /// small enough for all datagrams to fit in the receiver's socket buffer.
+    #define NUM_STREAM_DATAGRAMS (3 * MAX_STREAM_QUEUED)
+
+    /// Fill a buffer with a pattern that depends on a seed
+    ///
+    static void fill_pattern(char* buffer, size_t size, size_t seed) {
+        for (size_t i = 0; i < size; ++i) {
+            buffer[i] = (char)((i * 11 + seed * 17) % 256);
+        }
+    }
+
+    /// State of the emission stream test callback
+    ///
+    typedef struct stream_source_s {
+        const size_t* sizes;  ///< Size of each datagram to be produced
+        size_t num_datagrams;  ///< Number of datagrams to be produced
+        size_t num_calls;  ///< Number of calls so far
+    } stream_source_t;
+
+    /// Emission stream test callback
+    ///
+    /// This produces datagrams of size `sizes[n]`, filled with fill_pattern()
+    /// using `n` as a seed, until `num_datagrams` datagrams have been
+    /// produced. It performs no logging.
+    static bool stream_source_callback(void* context,
+                                       void* buffer,
+                                       size_t buffer_size,
+                                       size_t* size) {
+        stream_source_t* const source = (stream_source_t*)context;
+        if (source->num_calls == source->num_datagrams) return false;
+        const size_t idx = source->num_calls++;
+        if (source->sizes[idx] > buffer_size) return false;
+        fill_pattern(buffer, source->sizes[idx], idx);
+        *size = source->sizes[idx];
+        return true;
+    }
+
+    /// Set up a pair of connections through which the emission engine can be
+    /// tested
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param context must be a valid udipe context.
+    /// \param receiver will receive an input connection bound to an ephemeral
+    ///                 loopback port.
+    /// \param sender will receive an output connection to `receiver`.
+    UDIPE_NON_NULL_ARGS
+    static void connect_pair(udipe_context_t* context,
+                             udipe_connection_t** receiver,
+                             udipe_connection_t** sender) {
+        LOGGED_FUNCTION_START("%p, %p, %p", context, receiver, sender)
+            debug("Setting up the receiving end...");
+            udipe_connect_options_t in_options = { .direction = UDIPE_IN };
+            in_options.local_address.v4 = (struct sockaddr_in){
+                .sin_family = AF_INET,
+                .sin_port = 0,
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+            };
+            const udipe_connect_result_t in_result =
+                udipe_connect(context, in_options);
+            ensure_eq(in_result.error, 0);
+            *receiver = in_result.connection;
+
+            debug("Setting up the sending end...");
+            udipe_connect_options_t out_options = { .direction = UDIPE_OUT };
+            out_options.remote_address = in_result.local_address;
+            const udipe_connect_result_t out_result =
+                udipe_connect(context, out_options);
+            ensure_eq(out_result.error, 0);
+            *sender = out_result.connection;
+        LOGGED_FUNCTION_END
+    }
+
+    /// Close a connection, checking that this works
+    ///
+    /// This function must be called within a logging scope.
+    UDIPE_NON_NULL_ARGS
+    static void disconnect(udipe_context_t* context,
+                           udipe_connection_t* connection) {
+        LOGGED_FUNCTION_START("%p, %p", context, connection)
+            const udipe_disconnect_result_t result =
+                udipe_disconnect(context,
+                                 (udipe_disconnect_options_t){
+                                     .connection = connection
+                                 });
+            ensure_eq(result.error, 0);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Set up a raw UDP socket that receives datagrams from the connections
+    /// under test
+    ///
+    /// The socket is bound to an ephemeral loopback port, has a receive
+    /// timeout, and has a receive buffer that is large enough for the largest
+    /// GSO sends of the tests.
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param address will receive the address of the socket.
+    ///
+    /// \returns a socket that must be closed with close_virtual_fd().
+    UDIPE_NON_NULL_ARGS
+    static fd_t open_raw_receiver(ip_address_t* address) {
+        LOGGED_FUNCTION_START("%p", address)
+            debug("Setting up a raw receiver socket...");
+            fd_t receiver = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            ensure_ge(receiver, 0);
+            const int rcvbuf = 4 << 20;
+            exit_on_negative(setsockopt(receiver,
+                                        SOL_SOCKET,
+                                        SO_RCVBUF,
+                                        &rcvbuf,
+                                        sizeof(int)),
+                             "Failed to enlarge the receive buffer");
+            const struct timeval rcvtimeo = { .tv_sec = 5, .tv_usec = 0 };
+            exit_on_negative(setsockopt(receiver,
+                                        SOL_SOCKET,
+                                        SO_RCVTIMEO,
+                                        &rcvtimeo,
+                                        sizeof(struct timeval)),
+                             "Failed to set the receive timeout");
+            *address = (ip_address_t){ 0 };
+            address->v4 = (struct sockaddr_in){
+                .sin_family = AF_INET,
+                .sin_port = 0,
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+            };
+            exit_on_negative(bind(receiver,
+                                  &address->any,
+                                  sizeof(struct sockaddr_in)),
+                             "Failed to bind the receiver socket");
+            socklen_t address_size = sizeof(struct sockaddr_in);
+            exit_on_negative(getsockname(receiver,
+                                         &address->any,
+                                         &address_size),
+                             "Failed to query the receiver address");
+            return receiver;
+        LOGGED_FUNCTION_END
+    }
+
+    /// Check that a GSO send through `sender` results in the expected
+    /// sequence of datagrams being received by `receiver`
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param context must be a valid udipe context.
+    /// \param sender must be an output connection with GSO enabled.
+    /// \param segment_size must be the GSO segment size of `sender`.
+    /// \param receiver must be a raw UDP socket that `sender` is connected to,
+    ///                 with a receive timeout and a receive buffer that is
+    ///                 large enough to hold all the resulting datagrams.
+    /// \param size is the total payload size to be sent.
+    UDIPE_NON_NULL_ARGS
+    static void check_gso_send(udipe_context_t* context,
+                               udipe_connection_t* sender,
+                               size_t segment_size,
+                               fd_t receiver,
+                               size_t size) {
+        LOGGED_FUNCTION_START("%p, %p, %zu, %d, %zu",
+                              context, sender, segment_size, receiver, size)
+            debug("Sending the GSO payload...");
+            char* const payload = malloc(size);
+            exit_on_null(payload, "Failed to allocate GSO payload");
+            fill_pattern(payload, size, size);
+            const udipe_send_result_t result =
+                udipe_send(context,
+                           (udipe_send_options_t){
+                               .connection = sender,
+                               .buffer = payload,
+                               .size = size
+                           });
+            ensure_eq(result.error, 0);
+            ensure_eq(result.size, size);
+
+            debug("Checking the resulting datagrams...");
+            char* const received = malloc(segment_size + 1);
+            exit_on_null(received, "Failed to allocate reception buffer");
+            size_t offset = 0;
+            while (offset < size) {
+                size_t expected_size = size - offset;
+                if (expected_size > segment_size) expected_size = segment_size;
+                const ssize_t received_size = recv(receiver,
+                                                   received,
+                                                   segment_size + 1,
+                                                   0);
+                ensure_eq(received_size, (ssize_t)expected_size);
+                ensure_eq(memcmp(payload + offset, received, expected_size),
+                          0);
+                offset += expected_size;
+            }
+            free(received);
+            free(payload);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Test the emission engine with GSO enabled
+    ///
+    /// This function must be called within a logging scope.
+    UDIPE_NON_NULL_ARGS
+    static void gso_unit_tests(udipe_context_t* context) {
+        LOGGED_FUNCTION_START("%p", context)
+            debug("Checking that GSO is rejected on input connections...");
+            const udipe_connect_result_t bad_result =
+                udipe_connect(context,
+                              (udipe_connect_options_t){
+                                  .direction = UDIPE_IN,
+                                  .gso_segment_size = 1000
+                              });
+            ensure_eq(bad_result.error, EINVAL);
+
+            ip_address_t address;
+            fd_t receiver = open_raw_receiver(&address);
+
+            const uint16_t segment_sizes[] = { 100, 1400 };
+            for (size_t i = 0; i < sizeof(segment_sizes)/sizeof(uint16_t); ++i) {
+                const size_t segment_size = segment_sizes[i];
+                debugf("Setting up a sender with %zu-byte segments...",
+                       segment_size);
+                udipe_connect_options_t options = {
+                    .direction = UDIPE_OUT,
+                    .gso_segment_size = segment_size
+                };
+                options.remote_address = address;
+                const udipe_connect_result_t connect_result =
+                    udipe_connect(context, options);
+                ensure_eq(connect_result.error, 0);
+                udipe_connection_t* const sender = connect_result.connection;
+                const size_t buffer_size =
+                    sender->worker->buffers.config.buffer_size;
+
+                debug("Checking a single-datagram send...");
+                check_gso_send(context, sender, segment_size, receiver,
+                               segment_size / 2);
+
+                debug("Checking a send that exceeds the segment limit...");
+                check_gso_send(context, sender, segment_size, receiver,
+                               (GSO_MAX_SEGMENTS * 2 + 22) * segment_size + 37);
+
+                debug("Checking a send that exceeds the worker buffer size...");
+                check_gso_send(context, sender, segment_size, receiver,
+                               buffer_size + segment_size + 1);
+
+                debug("Checking a GSO emission stream...");
+                const size_t stream_size = 3 * segment_size + 7;
+                stream_source_t source = {
+                    .sizes = &stream_size,
+                    .num_datagrams = 1
+                };
+                const udipe_send_stream_result_t stream_result =
+                    udipe_send_stream(context,
+                                      (udipe_send_stream_options_t){
+                                          .connection = sender,
+                                          .callback = stream_source_callback,
+                                          .context = &source
+                                      });
+                ensure_eq(stream_result.error, 0);
+                ensure_eq(stream_result.num_datagrams, (size_t)4);
+                ensure_eq(stream_result.num_bytes, stream_size);
+                char* const expected = malloc(stream_size);
+                exit_on_null(expected, "Failed to allocate expected payload");
+                char* const received = malloc(segment_size + 1);
+                exit_on_null(received, "Failed to allocate reception buffer");
+                fill_pattern(expected, stream_size, 0);
+                for (size_t j = 0; j < 4; ++j) {
+                    const size_t expected_size = (j < 3) ? segment_size : 7;
+                    const ssize_t received_size = recv(receiver,
+                                                       received,
+                                                       segment_size + 1,
+                                                       0);
+                    ensure_eq(received_size, (ssize_t)expected_size);
+                    ensure_eq(memcmp(expected + j * segment_size,
+                                     received,
+                                     expected_size),
+                              0);
+                }
+                free(received);
+                free(expected);
+
+                const udipe_disconnect_result_t disconnect_result =
+                    udipe_disconnect(context,
+                                     (udipe_disconnect_options_t){
+                                         .connection = sender
+                                     });
+                ensure_eq(disconnect_result.error, 0);
+            }
+            close_virtual_fd(&receiver);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Test the emission engine with zero-copy emission enabled
+    ///
+    /// This function must be called within a logging scope.
+    UDIPE_NON_NULL_ARGS
+    static void zerocopy_unit_tests(udipe_context_t* context) {
+        LOGGED_FUNCTION_START("%p", context)
+            debug("Checking that zero-copy is rejected on input connections...");
+            const udipe_connect_result_t bad_result =
+                udipe_connect(context,
+                              (udipe_connect_options_t){
+                                  .direction = UDIPE_IN,
+                                  .enable_zerocopy = true
+                              });
+            ensure_eq(bad_result.error, EINVAL);
+
+            ip_address_t address;
+            fd_t receiver = open_raw_receiver(&address);
+
+            debug("Setting up a zero-copy GSO sender...");
+            const size_t segment_size = 1400;
+            udipe_connect_options_t options = {
+                .direction = UDIPE_OUT,
+                .gso_segment_size = segment_size,
+                .enable_zerocopy = true
+            };
+            options.remote_address = address;
+            const udipe_connect_result_t connect_result =
+                udipe_connect(context, options);
+            ensure_eq(connect_result.error, 0);
+            udipe_connection_t* const sender = connect_result.connection;
+            const size_t buffer_size =
+                sender->worker->buffers.config.buffer_size;
+
+            // Over loopback, the kernel turns zero-copy sends into copies and
+            // zero-copy emission gets turned off after the first completion
+            // notification, so this mostly checks the transition.
+            debug("Checking a few zero-copy sends...");
+            for (size_t i = 1; i <= NUM_TEST_DATAGRAMS; ++i) {
+                size_t size = i * segment_size + i;
+                if (size > buffer_size) size = buffer_size;
+                check_gso_send(context, sender, segment_size, receiver, size);
+            }
+
+            debug("Checking a zero-copy emission stream...");
+            const size_t stream_size = 2 * segment_size + 3;
+            stream_source_t source = {
+                .sizes = &stream_size,
+                .num_datagrams = 1
+            };
+            const udipe_send_stream_result_t stream_result =
+                udipe_send_stream(context,
+                                  (udipe_send_stream_options_t){
+                                      .connection = sender,
+                                      .callback = stream_source_callback,
+                                      .context = &source
+                                  });
+            ensure_eq(stream_result.error, 0);
+            ensure_eq(stream_result.num_datagrams, (size_t)3);
+            ensure_eq(stream_result.num_bytes, stream_size);
+            char expected[2 * 1400 + 3];
+            char received[1400 + 1];
+            fill_pattern(expected, stream_size, 0);
+            for (size_t j = 0; j < 3; ++j) {
+                const size_t expected_size = (j < 2) ? segment_size : 3;
+                const ssize_t received_size = recv(receiver,
+                                                   received,
+                                                   segment_size + 1,
+                                                   0);
+                ensure_eq(received_size, (ssize_t)expected_size);
+                ensure_eq(memcmp(expected + j * segment_size,
+                                 received,
+                                 expected_size),
+                          0);
+            }
+
+            debug("Checking that disconnection waits for zero-copy buffers...");
+            disconnect(context, sender);
+            close_virtual_fd(&receiver);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Test the emission engine with pacing enabled
+    ///
+    /// This function must be called within a logging scope.
+    UDIPE_NON_NULL_ARGS
+    static void pacing_unit_tests(udipe_context_t* context) {
+        LOGGED_FUNCTION_START("%p", context)
+            debug("Checking that pacing is rejected on input connections...");
+            const udipe_connect_result_t bad_result =
+                udipe_connect(context,
+                              (udipe_connect_options_t){
+                                  .direction = UDIPE_IN,
+                                  .pacing_rate = 1000
+                              });
+            ensure_eq(bad_result.error, EINVAL);
+
+            ip_address_t address;
+            fd_t receiver = open_raw_receiver(&address);
+
+            debug("Setting up a paced GSO sender...");
+            const size_t segment_size = 1000;
+            const uint64_t pacing_rate = 1000 * 1000;
+            udipe_connect_options_t options = {
+                .direction = UDIPE_OUT,
+                .gso_segment_size = segment_size,
+                .pacing_rate = pacing_rate
+            };
+            options.remote_address = address;
+            const udipe_connect_result_t connect_result =
+                udipe_connect(context, options);
+            ensure_eq(connect_result.error, 0);
+            udipe_connection_t* const sender = connect_result.connection;
+            const size_t buffer_size =
+                sender->worker->buffers.config.buffer_size;
+
+            // The loopback interface does not use the fq qdisc, so datagrams
+            // are not actually delayed, but departure times should still be
+            // scheduled back to back at the pacing rate.
+            debug("Checking a few paced sends...");
+            const uint64_t start = monotonic_ns();
+            size_t total_size = 0;
+            for (size_t i = 1; i <= NUM_TEST_DATAGRAMS; ++i) {
+                size_t size = i * segment_size + i;
+                if (size > buffer_size) size = buffer_size;
+                check_gso_send(context, sender, segment_size, receiver, size);
+                total_size += size;
+            }
+            ensure_ge(sender->next_departure,
+                      start + total_size * 1000000000 / pacing_rate);
+
+            debug("Cleaning up...");
+            disconnect(context, sender);
+            close_virtual_fd(&receiver);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Number of client threads that concurrently back up a worker in the
+    /// send stealing test
+    ///
+    #define NUM_STEALING_CLIENTS ((size_t)4)
+
+    /// Number of sends that each client thread submits in one batch in the
+    /// send stealing test
+    ///
+    /// This is more than half of the command queue capacity, which is the
+    /// point where sibling workers start stealing sends.
+    #define STEALING_BATCH_LEN ((size_t)COMMAND_QUEUE_LEN)
+
+    /// Maximal size of the datagrams of the send stealing test
+    ///
+    /// Every datagram of a round of this test has a different size, which
+    /// identifies it on the receiver side.
+    #define MAX_STOLEN_SEND_SIZE (NUM_STEALING_CLIENTS * STEALING_BATCH_LEN)
+
+    /// State of a client thread in the send stealing test
+    typedef struct stealing_client_s {
+        udipe_context_t* context;
+        udipe_connection_t* sender;
+        logger_parent_state_t logger;
+        size_t id;
+        /// Futures of the sends that this client submitted, which are awaited
+        /// by the main test thread
+        udipe_future_t* futures[STEALING_BATCH_LEN];
+        /// Payloads of these sends, which must outlive them
+        char payloads[STEALING_BATCH_LEN][MAX_STOLEN_SEND_SIZE];
+    } stealing_client_t;
+
+    /// Size of the `i`-th datagram sent by a client of the send stealing test
+    static size_t stolen_send_size(const stealing_client_t* client, size_t i) {
+        return 1 + client->id * STEALING_BATCH_LEN + i;
+    }
+
+    /// Client thread of the send stealing test
+    ///
+    /// It submits all of its sends in a single batch and exits without
+    /// awaiting them.
+    static int stealing_client_func(void* context) {
+        stealing_client_t* const client = (stealing_client_t*)context;
+        logger_init_child(&client->logger);
+        LOGGED_FUNCTION_START("%p", context)
+            udipe_command_t batch[STEALING_BATCH_LEN];
+            for (size_t i = 0; i < STEALING_BATCH_LEN; ++i) {
+                const size_t size = stolen_send_size(client, i);
+                fill_pattern(client->payloads[i], size, size);
+                batch[i] = (udipe_command_t){
+                    .type = UDIPE_SEND,
+                    .options.send = {
+                        .connection = client->sender,
+                        .buffer = client->payloads[i],
+                        .size = size
+                    }
+                };
+            }
+            udipe_start_batch(client->context,
+                              batch,
+                              STEALING_BATCH_LEN,
+                              client->futures);
+            return 0;
+        LOGGED_FUNCTION_END
+    }
+
+    /// Back up the worker of a sender by submitting batches of sends from
+    /// several client threads at once
+    ///
+    /// This function must be called within a logging scope. It returns once
+    /// all sends have been submitted, and the futures of the sends must then
+    /// be awaited with finish_stolen_sends().
+    UDIPE_NON_NULL_ARGS
+    static void start_stealing_clients(udipe_context_t* context,
+                                       udipe_connection_t* sender,
+                                       stealing_client_t clients[]) {
+        LOGGED_FUNCTION_START("%p, %p, %p", context, sender, clients)
+            thrd_t threads[NUM_STEALING_CLIENTS];
+            for (size_t id = 0; id < NUM_STEALING_CLIENTS; ++id) {
+                clients[id].context = context;
+                clients[id].sender = sender;
+                clients[id].logger = logger_save_parent();
+                clients[id].id = id;
+                exit_on_thread_error(thrd_create(&threads[id],
+                                                 stealing_client_func,
+                                                 &clients[id]),
+                                     "Failed to spawn a client thread");
+            }
+            for (size_t id = 0; id < NUM_STEALING_CLIENTS; ++id) {
+                int result;
+                exit_on_thread_error(thrd_join(threads[id], &result),
+                                     "Failed to join a client thread");
+                ensure_eq(result, 0);
+            }
+        LOGGED_FUNCTION_END
+    }
+
+    /// Await the sends submitted by start_stealing_clients(), then check that
+    /// each of them came out exactly once at `receiver`
+    ///
+    /// This function must be called within a logging scope.
+    UDIPE_NON_NULL_ARGS
+    static void finish_stolen_sends(stealing_client_t clients[],
+                                    fd_t receiver) {
+        LOGGED_FUNCTION_START("%p, %d", clients, receiver)
+            debug("Checking the results of the sends...");
+            for (size_t id = 0; id < NUM_STEALING_CLIENTS; ++id) {
+                for (size_t i = 0; i < STEALING_BATCH_LEN; ++i) {
+                    const udipe_result_t result =
+                        udipe_finish(clients[id].futures[i]);
+                    ensure_eq(result.type, UDIPE_SEND);
+                    ensure_eq(result.payload.network.send.error, 0);
+                    ensure_eq(result.payload.network.send.size,
+                              stolen_send_size(&clients[id], i));
+                }
+            }
+
+            debug("Checking the datagrams, which may come out of order...");
+            bool received_sizes[MAX_STOLEN_SEND_SIZE + 1] = { false };
+            char received[MAX_STOLEN_SEND_SIZE + 1];
+            char expected[MAX_STOLEN_SEND_SIZE];
+            for (size_t n = 0; n < MAX_STOLEN_SEND_SIZE; ++n) {
+                const ssize_t result = recv(receiver,
+                                            received,
+                                            sizeof(received),
+                                            0);
+                ensure_gt(result, (ssize_t)0);
+                ensure_le(result, (ssize_t)MAX_STOLEN_SEND_SIZE);
+                const size_t size = (size_t)result;
+                ensure(!received_sizes[size]);
+                received_sizes[size] = true;
+                fill_pattern(expected, size, size);
+                ensure_eq(memcmp(expected, received, size), 0);
+            }
+        LOGGED_FUNCTION_END
+    }
+
+    /// Test the emission engine with send stealing enabled
+    ///
+    /// This function must be called within a logging scope.
+    UDIPE_NON_NULL_ARGS
+    static void stealing_unit_tests(udipe_context_t* context) {
+        LOGGED_FUNCTION_START("%p", context)
+            debug("Checking that send stealing is rejected where invalid...");
+            const udipe_connect_options_t bad_options[] = {
+                {
+                    .direction = UDIPE_IN,
+                    .enable_send_stealing = true
+                },
+                {
+                    .direction = UDIPE_OUT,
+                    .enable_send_stealing = true,
+                    .enable_zerocopy = true
+                },
+                {
+                    .direction = UDIPE_OUT,
+                    .enable_send_stealing = true,
+                    .pacing_rate = 1000
+                }
+            };
+            ip_address_t address;
+            fd_t receiver = open_raw_receiver(&address);
+            for (size_t i = 0;
+                 i < sizeof(bad_options)/sizeof(udipe_connect_options_t);
+                 ++i) {
+                udipe_connect_options_t options = bad_options[i];
+                if (options.direction == UDIPE_OUT) {
+                    options.remote_address = address;
+                }
+                const udipe_connect_result_t bad_result =
+                    udipe_connect(context, options);
+                ensure_eq(bad_result.error, EINVAL);
+            }
+
+            debug("Setting up a sender whose sends may be stolen...");
+            udipe_connect_options_t options = {
+                .direction = UDIPE_OUT,
+                .enable_send_stealing = true
+            };
+            options.remote_address = address;
+            const udipe_connect_result_t connect_result =
+                udipe_connect(context, options);
+            ensure_eq(connect_result.error, 0);
+            udipe_connection_t* const sender = connect_result.connection;
+            ensure(sender->steal_sends);
+
+            debug("Checking a few sends...");
+            char payload[MAX_TEST_DATAGRAM_SIZE];
+            char received[MAX_TEST_DATAGRAM_SIZE];
+            for (size_t i = 1; i <= NUM_TEST_DATAGRAMS; ++i) {
+                const size_t size = i * MAX_TEST_DATAGRAM_SIZE
+                                    / NUM_TEST_DATAGRAMS;
+                fill_pattern(payload, size, i);
+                const udipe_send_result_t send_result =
+                    udipe_send(context,
+                               (udipe_send_options_t){
+                                   .connection = sender,
+                                   .buffer = payload,
+                                   .size = size
+                               });
+                ensure_eq(send_result.error, 0);
+                ensure_eq(recv(receiver, received, sizeof(received), 0),
+                          (ssize_t)size);
+                ensure_eq(memcmp(payload, received, size), 0);
+            }
+
+            // Sibling workers can only steal on hosts with several CPU cores
+            // that share a cache, elsewhere this only checks the owner's side.
+            debug("Checking sends from clients that back up the worker...");
+            stealing_client_t* const clients =
+                realtime_allocate(NUM_STEALING_CLIENTS
+                                  * sizeof(stealing_client_t));
+            start_stealing_clients(context, sender, clients);
+            finish_stolen_sends(clients, receiver);
+            ensure_eq(atomic_load(&sender->num_refs), (size_t)1);
+
+            debug("Checking a disconnection that races with stolen sends...");
+            start_stealing_clients(context, sender, clients);
+            disconnect(context, sender);
+            finish_stolen_sends(clients, receiver);
+
+            debug("Cleaning up...");
+            realtime_liberate(clients,
+                              NUM_STEALING_CLIENTS * sizeof(stealing_client_t));
+            close_virtual_fd(&receiver);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Test the emission engine with traffic prioritization enabled
+    ///
+    /// This function must be called within a logging scope.
+    UDIPE_NON_NULL_ARGS
+    static void priority_unit_tests(udipe_context_t* context) {
+        LOGGED_FUNCTION_START("%p", context)
+            debug("Checking that DSCP is rejected on input connections...");
+            const udipe_connect_result_t bad_result =
+                udipe_connect(context,
+                              (udipe_connect_options_t){
+                                  .direction = UDIPE_IN,
+                                  .dscp = 46
+                              });
+            ensure_eq(bad_result.error, EINVAL);
+
+            debug("Setting up a receiver that reports the TOS field...");
+            ip_address_t address;
+            fd_t receiver = open_raw_receiver(&address);
+            const int enable = 1;
+            exit_on_negative(setsockopt(receiver,
+                                        SOL_IP,
+                                        IP_RECVTOS,
+                                        &enable,
+                                        sizeof(int)),
+                             "Failed to enable TOS reporting");
+
+            debug("Setting up a prioritized sender...");
+            const unsigned priority = 5;
+            const unsigned dscp = 46;
+            udipe_connect_options_t options = {
+                .direction = UDIPE_OUT,
+                .priority = priority,
+                .dscp = dscp
+            };
+            options.remote_address = address;
+            const udipe_connect_result_t connect_result =
+                udipe_connect(context, options);
+            ensure_eq(connect_result.error, 0);
+            udipe_connection_t* const sender = connect_result.connection;
+
+            debug("Reading back the socket options...");
+            int value;
+            socklen_t value_len = sizeof(int);
+            exit_on_negative(getsockopt(sender->socket,
+                                        SOL_SOCKET,
+                                        SO_PRIORITY,
+                                        &value,
+                                        &value_len),
+                             "Failed to query the socket priority");
+            ensure_eq(value, (int)priority);
+            value_len = sizeof(int);
+            exit_on_negative(getsockopt(sender->socket,
+                                        SOL_IP,
+                                        IP_TOS,
+                                        &value,
+                                        &value_len),
+                             "Failed to query the TOS field");
+            ensure_eq(value, (int)(dscp << 2));
+
+            debug("Checking the TOS field of a sent datagram...");
+            char payload[MAX_TEST_DATAGRAM_SIZE];
+            fill_pattern(payload, 100, 0);
+            const udipe_send_result_t send_result =
+                udipe_send(context,
+                           (udipe_send_options_t){
+                               .connection = sender,
+                               .buffer = payload,
+                               .size = 100
+                           });
+            ensure_eq(send_result.error, 0);
+            char received[MAX_TEST_DATAGRAM_SIZE];
+            struct iovec iovec = {
+                .iov_base = received,
+                .iov_len = sizeof(received)
+            };
+            union {
+                char bytes[CMSG_SPACE(sizeof(int))];
+                struct cmsghdr align;
+            } control;
+            struct msghdr header = {
+                .msg_iov = &iovec,
+                .msg_iovlen = 1,
+                .msg_control = control.bytes,
+                .msg_controllen = sizeof(control)
+            };
+            ensure_eq(recvmsg(receiver, &header, 0), (ssize_t)100);
+            ensure_eq(memcmp(payload, received, 100), 0);
+            bool found_tos = false;
+            for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+                 cmsg;
+                 cmsg = CMSG_NXTHDR(&header, cmsg)) {
+                if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_TOS) {
+                    continue;
+                }
+                const uint8_t tos = *(const uint8_t*)CMSG_DATA(cmsg);
+                ensure_eq(tos, (uint8_t)(dscp << 2));
+                found_tos = true;
+            }
+            ensure(found_tos);
+
+            debug("Cleaning up...");
+            disconnect(context, sender);
+            close_virtual_fd(&receiver);
+        LOGGED_FUNCTION_END
+    }
+
+    /// Unit tests for the emission engine, using a certain I/O backend
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param io_backend is the I/O backend that workers should use.
+    static void send_backend_unit_tests(udipe_io_backend_t io_backend) {
+        LOGGED_FUNCTION_START("%d", io_backend)
+            udipe_context_t* const context =
+                udipe_initialize((udipe_config_t){
+                    .workers = { .io_backend = io_backend }
+                });
+            udipe_connection_t* receiver;
+            udipe_connection_t* sender;
+            connect_pair(context, &receiver, &sender);
+
+            debug("Checking synchronous emission...");
+            char payload[MAX_TEST_DATAGRAM_SIZE];
+            char received[MAX_TEST_DATAGRAM_SIZE];
+            size_t sizes[NUM_TEST_DATAGRAMS];
+            for (size_t i = 0; i < NUM_TEST_DATAGRAMS; ++i) {
+                sizes[i] = rand() % MAX_TEST_DATAGRAM_SIZE;
+                fill_pattern(payload, sizes[i], i);
+                tracef("- Sending datagram #%zu...", i);
+                const udipe_send_result_t result =
+                    udipe_send(context,
+                               (udipe_send_options_t){
+                                   .connection = sender,
+                                   .buffer = payload,
+                                   .size = sizes[i]
+                               });
+                ensure_eq(result.error, 0);
+                ensure_eq(result.size, sizes[i]);
+            }
+            for (size_t i = 0; i < NUM_TEST_DATAGRAMS; ++i) {
+                tracef("- Receiving datagram #%zu...", i);
+                const udipe_recv_result_t result =
+                    udipe_recv(context,
+                               (udipe_recv_options_t){
+                                   .connection = receiver,
+                                   .buffer = received,
+                                   .buffer_size = sizeof(received)
+                               });
+                ensure_eq(result.error, 0);
+                ensure_eq(result.size, sizes[i]);
+                fill_pattern(payload, sizes[i], i);
+                ensure_eq(memcmp(payload, received, sizes[i]), 0);
+            }
+
+            debug("Checking asynchronous emission...");
+            char payloads[NUM_TEST_DATAGRAMS][MAX_TEST_DATAGRAM_SIZE];
+            udipe_future_t* futures[NUM_TEST_DATAGRAMS];
+            for (size_t i = 0; i < NUM_TEST_DATAGRAMS; ++i) {
+                sizes[i] = 1 + rand() % (MAX_TEST_DATAGRAM_SIZE - 1);
+                fill_pattern(payloads[i], sizes[i], i + NUM_TEST_DATAGRAMS);
+                futures[i] = udipe_start_send(context,
+                                              (udipe_send_options_t){
+                                                  .connection = sender,
+                                                  .buffer = payloads[i],
+                                                  .size = sizes[i]
+                                              });
+            }
+            for (size_t i = 0; i < NUM_TEST_DATAGRAMS; ++i) {
+                const udipe_result_t result = udipe_finish(futures[i]);
+                ensure_eq(result.type, UDIPE_SEND);
+                ensure_eq(result.payload.network.send.error, 0);
+                ensure_eq(result.payload.network.send.size, sizes[i]);
+            }
+            for (size_t i = 0; i < NUM_TEST_DATAGRAMS; ++i) {
+                const udipe_recv_result_t result =
+                    udipe_recv(context,
+                               (udipe_recv_options_t){
+                                   .connection = receiver,
+                                   .buffer = received,
+                                   .buffer_size = sizeof(received)
+                               });
+                ensure_eq(result.error, 0);
+                ensure_eq(result.size, sizes[i]);
+                ensure_eq(memcmp(payloads[i], received, sizes[i]), 0);
+            }
+
+            debug("Checking batched emission...");
+            udipe_command_t batch[NUM_TEST_DATAGRAMS];
+            for (size_t i = 0; i < NUM_TEST_DATAGRAMS; ++i) {
+                sizes[i] = 1 + rand() % (MAX_TEST_DATAGRAM_SIZE - 1);
+                fill_pattern(payloads[i], sizes[i], i + 2*NUM_TEST_DATAGRAMS);
+                batch[i] = (udipe_command_t){
+                    .type = UDIPE_SEND,
+                    .options.send = {
+                        .connection = sender,
+                        .buffer = payloads[i],
+                        .size = sizes[i]
+                    }
+                };
+            }
+            udipe_start_batch(context, batch, NUM_TEST_DATAGRAMS, futures);
+            for (size_t i = 0; i < NUM_TEST_DATAGRAMS; ++i) {
+                const udipe_result_t result = udipe_finish(futures[i]);
+                ensure_eq(result.type, UDIPE_SEND);
+                ensure_eq(result.payload.network.send.error, 0);
+                ensure_eq(result.payload.network.send.size, sizes[i]);
+            }
+            for (size_t i = 0; i < NUM_TEST_DATAGRAMS; ++i) {
+                const udipe_recv_result_t result =
+                    udipe_recv(context,
+                               (udipe_recv_options_t){
+                                   .connection = receiver,
+                                   .buffer = received,
+                                   .buffer_size = sizeof(received)
+                               });
+                ensure_eq(result.error, 0);
+                ensure_eq(result.size, sizes[i]);
+                ensure_eq(memcmp(payloads[i], received, sizes[i]), 0);
+            }
+
+            debug("Checking emission streams...");
+            size_t stream_sizes[NUM_STREAM_DATAGRAMS];
+            size_t total_size = 0;
+            for (size_t i = 0; i < NUM_STREAM_DATAGRAMS; ++i) {
+                stream_sizes[i] = rand() % MAX_TEST_DATAGRAM_SIZE;
+                total_size += stream_sizes[i];
+            }
+            stream_source_t source = {
+                .sizes = stream_sizes,
+                .num_datagrams = NUM_STREAM_DATAGRAMS
+            };
+            udipe_send_stream_result_t stream_result =
+                udipe_send_stream(context,
+                                  (udipe_send_stream_options_t){
+                                      .connection = sender,
+                                      .callback = stream_source_callback,
+                                      .context = &source
+                                  });
+            ensure_eq(stream_result.error, 0);
+            ensure_eq(stream_result.num_datagrams, NUM_STREAM_DATAGRAMS);
+            ensure_eq(stream_result.num_bytes, total_size);
+            ensure_eq(source.num_calls, NUM_STREAM_DATAGRAMS);
+            for (size_t i = 0; i < NUM_STREAM_DATAGRAMS; ++i) {
+                const udipe_recv_result_t result =
+                    udipe_recv(context,
+                               (udipe_recv_options_t){
+                                   .connection = receiver,
+                                   .buffer = received,
+                                   .buffer_size = sizeof(received)
+                               });
+                ensure_eq(result.error, 0);
+                ensure_eq(result.size, stream_sizes[i]);
+                fill_pattern(payload, stream_sizes[i], i);
+                ensure_eq(memcmp(payload, received, stream_sizes[i]), 0);
+            }
+
+            debug("Checking empty emission streams...");
+            source = (stream_source_t){ .sizes = stream_sizes };
+            stream_result =
+                udipe_send_stream(context,
+                                  (udipe_send_stream_options_t){
+                                      .connection = sender,
+                                      .callback = stream_source_callback,
+                                      .context = &source
+                                  });
+            ensure_eq(stream_result.error, 0);
+            ensure_eq(stream_result.num_datagrams, (size_t)0);
+
+            debug("Checking that input connections cannot stream...");
+            source = (stream_source_t){
+                .sizes = stream_sizes,
+                .num_datagrams = 1
+            };
+            stream_result =
+                udipe_send_stream(context,
+                                  (udipe_send_stream_options_t){
+                                      .connection = receiver,
+                                      .callback = stream_source_callback,
+                                      .context = &source
+                                  });
+            ensure_eq(stream_result.error, EOPNOTSUPP);
+            ensure_eq(source.num_calls, (size_t)0);
+
+            debug("Checking that input connections cannot send...");
+            udipe_send_result_t result =
+                udipe_send(context,
+                           (udipe_send_options_t){
+                               .connection = receiver,
+                               .buffer = payload,
+                               .size = 1
+                           });
+            ensure_eq(result.error, EOPNOTSUPP);
+            ensure_eq(result.size, (size_t)0);
+
+            debug("Checking that oversized datagrams are rejected...");
+            const size_t buffer_size =
+                sender->worker->buffers.config.buffer_size;
+            char* const oversized = calloc(buffer_size + 1, 1);
+            exit_on_null(oversized, "Failed to allocate oversized datagram");
+            result = udipe_send(context,
+                                (udipe_send_options_t){
+                                    .connection = sender,
+                                    .buffer = oversized,
+                                    .size = buffer_size + 1
+                                });
+            ensure_eq(result.error, EMSGSIZE);
+            free(oversized);
+
+            debug("Checking GSO...");
+            gso_unit_tests(context);
+
+            debug("Checking zero-copy emission...");
+            zerocopy_unit_tests(context);
+
+            debug("Checking pacing...");
+            pacing_unit_tests(context);
+
+            debug("Checking traffic prioritization...");
+            priority_unit_tests(context);
+
+            debug("Checking send stealing...");
+            stealing_unit_tests(context);
+
+            debug("Checking that ICMP errors are reported...");
+            disconnect(context, receiver);
+            const struct timespec delay = {
+                .tv_sec = 0,
+                .tv_nsec = 1000*1000
+            };
+            size_t attempts = 0;
+            do {
+                ensure_lt(attempts, (size_t)1000);
+                ++attempts;
+                result = udipe_send(context,
+                                    (udipe_send_options_t){
+                                        .connection = sender,
+                                        .buffer = payload,
+                                        .size = 1
+                                    });
+                if (result.error == 0) thrd_sleep(&delay, NULL);
+            } while (result.error == 0);
+            ensure_eq(result.error, ECONNREFUSED);
+            const udipe_connection_stats_t stats =
+                udipe_connection_stats(sender);
+            ensure_ge(stats.icmp_errors, (uint64_t)1);
+            ensure_eq(stats.local_errors, (uint64_t)0);
+
+            debug("Cleaning up...");
+            disconnect(context, sender);
+            udipe_finalize(context);
+        LOGGED_FUNCTION_END
+    }
+
+    void send_unit_tests() {
+        LOGGED_FUNCTION_START_NO_PARAMS
+            info("Running emission engine unit tests...");
+            configure_rand();
+
+            debug("Checking the epoll backend...");
+            send_backend_unit_tests(UDIPE_IO_EPOLL);
+
+            debug("Checking the io_uring backend...");
+            send_backend_unit_tests(UDIPE_IO_URING);
+
+            debug("Checking the multishot io_uring backend...");
+            send_backend_unit_tests(UDIPE_IO_URING_MULTISHOT);
+        LOGGED_FUNCTION_END
+    }
+
+#endif  // UDIPE_BUILD_TESTS
@@ -0,0 +1,315 @@
+#pragma once
+
+//! \file
+//! \brief Datagram emission engine
+//!
+//! This code module implements the worker-side logic of the udipe_send()
+//! command. Like \ref recv.h, its design is driven by the observation that at
+//! high datagram rates, performing one system call per sent datagram is the
+//! main performance bottleneck.
+//!
+//! Therefore, send commands are not processed immediately. Instead, the
+//! payload of each datagram is copied into a buffer from the worker's \ref
+//! buffer_allocator_t and queued. Once the worker is done processing incoming
+//! commands, send_flush() hands over all queued datagrams of each connection
+//! to the operating system with a single `sendmmsg()` call.
+//!
+//! When GSO is enabled on a connection, each send command may carry many
+//! datagrams' worth of payload, which the kernel splits into segments. The
+//! payload is then cut into as many `sendmmsg()` messages as needed to stay
+//! within the kernel's limits on the size of a single GSO send.
+//!
+//! The udipe_send_stream() command uses the same queue, but instead of copying
+//! client payloads, it has a client callback fill worker buffers directly
+//! right before each send_flush(). This lets a single command send an
+//! unbounded amount of datagrams without any per-datagram inter-thread
+//! communication.
+
+#include <udipe/buffer.h>
+#include <udipe/duration.h>
+#include <udipe/future.h>
+#include <udipe/operation.h>
+#include <udipe/pointer.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Forward declarations to break header dependency cycles
+typedef struct command_s command_t;
+typedef struct worker_s worker_t;
+
+/// `MSG_ZEROCOPY` sends of a worker buffer
+///
+/// The kernel may keep reading from the buffer until it has reported the
+/// completion of all of these sends.
+typedef struct zerocopy_sends_s {
+    /// Sequence number of the first send, see \ref
+    /// udipe_connection_t::zerocopy_next
+    ///
+    /// Sends of a given buffer are numbered consecutively.
+    uint32_t first;
+
+    /// Number of sends
+    ///
+    uint32_t count;
+
+    /// Number of sends whose completion was reported by the kernel
+    ///
+    uint32_t completed;
+} zerocopy_sends_t;
+
+/// Worker buffer that the kernel may still be reading from
+///
+/// These are stored in \ref worker_t::zerocopy_buffers once the associated
+/// send command has completed, and liberated once the kernel reports that it
+/// is done with them.
+typedef struct zerocopy_buffer_s {
+    /// Connection through which the buffer was sent
+    ///
+    udipe_connection_t* connection;
+
+    /// Worker buffer
+    ///
+    void* buffer;
+
+    /// `MSG_ZEROCOPY` sends of `buffer`
+    ///
+    zerocopy_sends_t sends;
+} zerocopy_buffer_t;
+
+/// Send command that has been queued for emission
+///
+/// These are stored in \ref worker_t::pending_sends in submission order.
+typedef struct pending_send_s {
+    /// Connection through which the datagram should be sent
+    ///
+    udipe_connection_t* connection;
+
+    /// Payload of the datagram
+    ///
+    /// This normally points to `buffer`, but if the worker ran out of buffers
+    /// when the command was queued, it points to the client's buffer instead.
+    const void* payload;
+
+    /// Worker buffer that holds a copy of the payload, if any
+    ///
+    /// If this is not `NULL`, it must be liberated once the datagram has been
+    /// sent or the command has failed.
+    void* buffer;
+
+    /// Size of the datagram payload
+    ///
+    /// When GSO is enabled, this may span multiple datagrams, see \ref
+    /// udipe_connect_options_t::gso_segment_size.
+    size_t size;
+
+    /// Number of payload bytes that were already handed over to the kernel
+    ///
+    /// This can only be nonzero when GSO is enabled and the payload had to be
+    /// split across multiple `sendmmsg()` messages, some of which have been
+    /// sent while others could not be sent yet.
+    size_t sent;
+
+    /// `MSG_ZEROCOPY` sends of `buffer` so far
+    ///
+    /// If some of these have not completed by the time the command completes,
+    /// `buffer` is moved to \ref worker_t::zerocopy_buffers instead of being
+    /// liberated.
+    zerocopy_sends_t zerocopy;
+
+    /// Future that must be notified once the command completes
+    ///
+    /// This is `NULL` if the command's cancelation has been acknowledged, or
+    /// if the datagram was produced by an emission stream.
+    udipe_future_t* future;
+
+    /// Truth that this datagram was produced by the emission stream of
+    /// `connection`, rather than by a send command
+    ///
+    /// The completion of such datagrams is accounted for in the associated
+    /// \ref send_stream_t instead of being reported to a future.
+    bool from_stream;
+
+    /// Time left before this command times out
+    ///
+    /// This is \ref UDIPE_DURATION_MAX if the command never times out.
+    udipe_duration_ns_t remaining_time;
+} pending_send_t;
+
+/// Emission stream that is active on a connection
+///
+/// These are stored in \ref worker_t::send_streams in submission order.
+typedef struct send_stream_s {
+    /// Connection through which datagrams are sent
+    ///
+    udipe_connection_t* connection;
+
+    /// Callback that produces outgoing datagrams
+    ///
+    udipe_send_callback_t callback;
+
+    /// Context that is passed to `callback`
+    ///
+    void* context;
+
+    /// Future that must be notified once the stream ends
+    ///
+    udipe_future_t* future;
+
+    /// Result that will be reported once the stream ends
+    ///
+    /// The datagram and byte counters are updated as produced datagrams are
+    /// handed over to the operating system.
+    udipe_send_stream_result_t result;
+
+    /// Number of datagrams from this stream that are queued in \ref
+    /// worker_t::pending_sends
+    ///
+    size_t num_queued;
+
+    /// Truth that `callback` should be called to produce more datagrams
+    ///
+    /// This becomes `false` once the callback has ended the stream, an
+    /// emission error has occured, or the stream has been canceled. The stream
+    /// is then torn down once its queued datagrams are gone.
+    bool producing;
+
+    /// Truth that the stream's future was canceled
+    ///
+    bool canceled;
+} send_stream_t;
+
+/// Maximal number of active emission streams per worker
+///
+/// Emission streams that would exceed this limit fail with `ENOBUFS`.
+#define MAX_SEND_STREAMS ((size_t)32)
+
+/// Maximal number of datagrams that each emission stream may have queued in
+/// \ref worker_t::pending_sends at any given time
+///
+/// This ensures that a single stream cannot monopolize the worker buffers and
+/// send queue, while still letting it fill a full `sendmmsg()` batch.
+#define MAX_STREAM_QUEUED ((size_t)UDIPE_MAX_BUFFERS/4)
+
+/// Maximal number of queued send commands per worker
+///
+/// This matches the number of worker buffers, since in normal operation each
+/// queued send command holds one of them.
+#define MAX_PENDING_SENDS ((size_t)UDIPE_MAX_BUFFERS)
+
+/// Delay after which the emission of datagrams is retried when a socket's send
+/// buffer is full
+///
+/// TODO: Wait for sockets to become writable instead, which requires \ref
+///       inpoll_t to support `EPOLLOUT`.
+#define SEND_RETRY_DELAY (UDIPE_MILLISECOND/20)
+
+/// Start processing a send command
+///
+/// Invalid commands fail immediately. Others are queued for emission by the
+/// next call to send_flush().
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns the target connection.
+/// \param command must be a send command.
+UDIPE_NON_NULL_ARGS
+void send_start(worker_t* worker, const command_t* command);
+
+/// Start processing a stream emission command
+///
+/// Invalid commands fail immediately. Others set up an emission stream, whose
+/// callback will be called by the next call to send_flush().
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns the target connection.
+/// \param command must be a stream emission command.
+UDIPE_NON_NULL_ARGS
+void send_stream_start(worker_t* worker, const command_t* command);
+
+/// Produce datagrams from emission streams, then hand over queued datagrams to
+/// the operating system
+///
+/// Before that, worker buffers whose zero-copy emission has completed are
+/// taken back, see \ref udipe_connect_options_t::enable_zerocopy.
+///
+/// All datagrams that are queued for a given connection are sent with a single
+/// `sendmmsg()` system call. Datagrams that cannot be sent because a socket's
+/// send buffer is full remain queued, and the caller should retry after \ref
+/// SEND_RETRY_DELAY.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a valid worker.
+///
+/// \returns `true` if some emission streams can produce more datagrams right
+///          away, in which case the caller should call this function again
+///          without waiting for network activity.
+UDIPE_NON_NULL_ARGS
+bool send_flush(worker_t* worker);
+
+/// Account for the passage of time in queued send commands
+///
+/// This makes queued send commands whose timeout has elapsed fail with
+/// `ETIMEDOUT` and acknowledges the cancelation of queued send commands and
+/// emission streams whose future has been canceled.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a valid worker.
+/// \param elapsed is the amount of time that elapsed since the last call.
+///
+/// \returns the time left until the next queued send command times out, or
+///          \ref UDIPE_DURATION_MAX if no queued send command can time out.
+UDIPE_NON_NULL_ARGS
+udipe_duration_ns_t send_on_clock(worker_t* worker,
+                                  udipe_duration_ns_t elapsed);
+
+/// Process the entries of a connection's socket error queue
+///
+/// Entries are read in batches of up to \ref MAX_ERROR_QUEUE_ENTRIES until the
+/// queue is empty. Zero-copy completion notifications liberate the worker
+/// buffers from \ref worker_t::zerocopy_buffers whose zero-copy sends have all
+/// completed. Errors reported by remote nodes via ICMP or by the local network
+/// stack are accounted for in \ref udipe_connection_stats_t and logged in a
+/// rate-limited fashion.
+///
+/// Reading the error queue also clears the pending socket error that the
+/// kernel derives from its entries, so that a burst of ICMP errors fails at
+/// most one send or receive command instead of one command per error.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be a valid connection.
+UDIPE_NON_NULL_ARGS
+void send_drain_error_queue(worker_t* worker,
+                            udipe_connection_t* connection);
+
+/// Release all emission engine resources associated with a connection
+///
+/// Queued datagrams are given one last chance to be sent, then any send
+/// command that is still queued and the connection's emission stream, if any,
+/// fail with `ECONNABORTED`. Worker buffers that the kernel may still be
+/// reading from due to zero-copy emission are then waited for, within a time
+/// limit. This must be done before the connection is destroyed by
+/// connection_close().
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that owns `connection`.
+/// \param connection must be a valid connection.
+UDIPE_NON_NULL_ARGS
+void send_abort(worker_t* worker, udipe_connection_t* connection);
+
+
+#ifdef UDIPE_BUILD_TESTS
+    /// Unit tests for the emission engine
+    ///
+    /// This function runs the unit tests for the emission engine. It must be
+    /// called within a logging scope.
+    void send_unit_tests();
+#endif
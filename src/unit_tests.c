@@ -16,9 +16,12 @@
     #include "log.h"
     #include "memory.h"
     #include "name_filter.h"
+    #include "recv.h"
     #include "scope.h"
+    #include "send.h"
     #include "thread_name.h"
     #include "visibility.h"
+    #include "worker.h"
 
     #include <string.h>
 
@@ -64,10 +67,14 @@
             NAME_FILTERED_CALL(filter, memory_unit_tests);
             NAME_FILTERED_CALL(filter, bit_array_unit_tests);
             NAME_FILTERED_CALL(filter, buffer_unit_tests);
+            NAME_FILTERED_CALL(filter, command_unit_tests);
             NAME_FILTERED_CALL(filter, numeric_unit_tests);
             NAME_FILTERED_CALL(filter, distribution_unit_tests);
             NAME_FILTERED_CALL(filter, future_status_unit_tests);
             NAME_FILTERED_CALL(filter, future_custom_unit_tests);
+            NAME_FILTERED_CALL(filter, worker_unit_tests);
+            NAME_FILTERED_CALL(filter, recv_unit_tests);
+            NAME_FILTERED_CALL(filter, send_unit_tests);
 
             name_filter_finalize(&filter);
             info("All executed tests completed successfully!");
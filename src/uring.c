@@ -0,0 +1,417 @@
+#ifdef __linux__
+
+    #include "uring.h"
+
+    #include "error.h"
+    #include "fd.h"
+    #include "log.h"
+
+    #include <assert.h>
+    #include <errno.h>
+    #include <signal.h>
+    #include <string.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+
+
+    /// Wrapper for the `io_uring_setup()` system call
+    ///
+    /// glibc does not provide one, and we do not want to depend on `liburing`.
+    static inline int sys_io_uring_setup(unsigned entries,
+                                         struct io_uring_params* params) {
+        return (int)syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    /// Wrapper for the `io_uring_enter()` system call
+    ///
+    static inline int sys_io_uring_enter(int fd,
+                                         unsigned to_submit,
+                                         unsigned min_complete,
+                                         unsigned flags,
+                                         const void* arg,
+                                         size_t arg_size) {
+        return (int)syscall(__NR_io_uring_enter,
+                            fd,
+                            to_submit,
+                            min_complete,
+                            flags,
+                            arg,
+                            arg_size);
+    }
+
+    /// Wrapper for the `io_uring_register()` system call
+    ///
+    static inline int sys_io_uring_register(int fd,
+                                            unsigned opcode,
+                                            const void* arg,
+                                            unsigned num_args) {
+        return (int)syscall(__NR_io_uring_register,
+                            fd,
+                            opcode,
+                            arg,
+                            num_args);
+    }
+
+    /// Map one of the shared memory regions of an io_uring
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param fd must be an io_uring file descriptor.
+    /// \param size is the size of the region.
+    /// \param offset is the `IORING_OFF_` offset that designates the region.
+    ///
+    /// \returns the address of the mapping.
+    UDIPE_NODISCARD
+    UDIPE_NON_NULL_RESULT
+    static void* map_ring(fd_t fd, size_t size, off_t offset) {
+        LOGGED_FUNCTION_START("%d, %zu, %#zx", fd, size, (size_t)offset)
+            void* const result = mmap(NULL,
+                                      size,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_POPULATE,
+                                      fd,
+                                      offset);
+            if (result == MAP_FAILED) {
+                exit_after_c_error("Failed to map io_uring memory!");
+            }
+            return result;
+        LOGGED_FUNCTION_END
+    }
+
+    UDIPE_NODISCARD
+    UDIPE_NON_NULL_ARGS
+    bool uring_initialize(uring_t* ring, unsigned num_entries) {
+        LOGGED_FUNCTION_START("%p, %u", ring, num_entries)
+            assert(num_entries > 0 && (num_entries & (num_entries - 1)) == 0);
+
+            debug("Setting up the io_uring...");
+            // Each worker owns its io_uring, and only ever submits from its
+            // own thread. Older kernels reject these flags, in which case we
+            // try again without them.
+            struct io_uring_params params = {
+                .flags = IORING_SETUP_SUBMIT_ALL
+                       | IORING_SETUP_COOP_TASKRUN
+                       | IORING_SETUP_SINGLE_ISSUER
+            };
+            int fd = sys_io_uring_setup(num_entries, &params);
+            if (fd < 0 && errno == EINVAL) {
+                debug("Kernel rejected setup flags, trying again without...");
+                errno = 0;
+                params = (struct io_uring_params){ 0 };
+                fd = sys_io_uring_setup(num_entries, &params);
+            }
+            if (fd < 0) {
+                switch (errno) {
+                case ENOSYS:  // Kernel was built without io_uring
+                case EPERM:  // io_uring disabled by sysctl or seccomp
+                case EINVAL:  // Kernel is too old for our parameters
+                    warnf("io_uring is not available: %s.", strerror(errno));
+                    errno = 0;
+                    return false;
+                case EMFILE:  // Reached process fd limit
+                case ENFILE:  // Reached system fd limit
+                case ENOMEM:  // Not enough locked memory for the rings
+                case EFAULT:  // Invalid params pointer
+                default:
+                    exit_after_c_error("Failed to set up an io_uring!");
+                }
+            }
+            ring->fd = fd;
+
+            debug("Checking kernel features...");
+            // EXT_ARG (Linux 5.11) is needed for timeouts in uring_wait().
+            if (!(params.features & IORING_FEAT_EXT_ARG)) {
+                warn("io_uring is too old (no IORING_FEAT_EXT_ARG).");
+                close_virtual_fd(&ring->fd);
+                return false;
+            }
+
+            debug("Mapping the submission and completion queues...");
+            ring->sq_ring_size = params.sq_off.array
+                               + params.sq_entries * sizeof(unsigned);
+            ring->cq_ring_size = params.cq_off.cqes
+                               + params.cq_entries
+                                 * sizeof(struct io_uring_cqe);
+            if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring->cq_ring_size > ring->sq_ring_size) {
+                    ring->sq_ring_size = ring->cq_ring_size;
+                }
+                ring->cq_ring_size = ring->sq_ring_size;
+            }
+            ring->sq_ring = map_ring(fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+            if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                ring->cq_ring = ring->sq_ring;
+            } else {
+                ring->cq_ring = map_ring(fd,
+                                         ring->cq_ring_size,
+                                         IORING_OFF_CQ_RING);
+            }
+            ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+            ring->sqes = map_ring(fd, ring->sqes_size, IORING_OFF_SQES);
+
+            debug("Locating queue pointers...");
+            char* const sq_ring = (char*)ring->sq_ring;
+            ring->sq_head = (unsigned*)(sq_ring + params.sq_off.head);
+            ring->sq_tail = (unsigned*)(sq_ring + params.sq_off.tail);
+            ring->sq_array = (unsigned*)(sq_ring + params.sq_off.array);
+            ring->sq_mask = *(unsigned*)(sq_ring + params.sq_off.ring_mask);
+            ring->sq_entries = params.sq_entries;
+            ring->sq_local_tail = *ring->sq_tail;
+            char* const cq_ring = (char*)ring->cq_ring;
+            ring->cq_head = (unsigned*)(cq_ring + params.cq_off.head);
+            ring->cq_tail = (unsigned*)(cq_ring + params.cq_off.tail);
+            ring->cqes = (struct io_uring_cqe*)(cq_ring + params.cq_off.cqes);
+            ring->cq_mask = *(unsigned*)(cq_ring + params.cq_off.ring_mask);
+
+            // Submission queue entry N always lives in sqes[N]
+            for (unsigned i = 0; i < ring->sq_entries; ++i) {
+                ring->sq_array[i] = i;
+            }
+            debugf("Set up io_uring %d with %u SQ and %u CQ entries.",
+                   fd, params.sq_entries, params.cq_entries);
+            return true;
+        LOGGED_FUNCTION_END
+    }
+
+    /// Make prepared submission queue entries visible to the kernel
+    ///
+    /// \param ring must be a valid io_uring instance.
+    ///
+    /// \returns the number of entries that the kernel has not consumed yet.
+    UDIPE_NODISCARD
+    UDIPE_NON_NULL_ARGS
+    static inline unsigned publish_sqes(uring_t* ring) {
+        __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+        return ring->sq_local_tail
+               - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    UDIPE_NODISCARD
+    UDIPE_NON_NULL_ARGS
+    UDIPE_NON_NULL_RESULT
+    struct io_uring_sqe* uring_get_sqe(uring_t* ring) {
+        LOGGED_FUNCTION_START("%p", ring)
+            while (ring->sq_local_tail
+                   - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+                   >= ring->sq_entries) {
+                debug("Submission queue is full, submitting it...");
+                uring_submit(ring);
+            }
+            struct io_uring_sqe* const sqe =
+                &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            ++(ring->sq_local_tail);
+            return sqe;
+        LOGGED_FUNCTION_END
+    }
+
+    UDIPE_NON_NULL_ARGS
+    void uring_submit(uring_t* ring) {
+        LOGGED_FUNCTION_START("%p", ring)
+            const unsigned to_submit = publish_sqes(ring);
+            if (to_submit == 0) return;
+            debugf("Submitting %u entries to io_uring %d...",
+                   to_submit, ring->fd);
+            const int result = sys_io_uring_enter(ring->fd,
+                                                  to_submit,
+                                                  0,
+                                                  0,
+                                                  NULL,
+                                                  0);
+            if (result >= 0) return;
+            switch (errno) {
+            case EINTR:  // Interrupted by a signal
+            case EAGAIN:  // Kernel ran out of resources
+            case EBUSY:  // Completion queue overflowed
+                // Entries remain in the submission queue, and will be
+                // submitted again by the next call.
+                debugf("Submission did not go through (%s), will try again "
+                       "later.", strerror(errno));
+                errno = 0;
+                return;
+            default:
+                exit_after_c_error("Failed to submit io_uring entries!");
+            }
+        LOGGED_FUNCTION_END
+    }
+
+    UDIPE_NODISCARD
+    UDIPE_NON_NULL_ARGS
+    size_t uring_wait(uring_t* ring,
+                      struct io_uring_cqe completions[],
+                      size_t max_completions,
+                      udipe_duration_ns_t timeout) {
+        LOGGED_FUNCTION_START("%p, %p, %zu, %zu",
+                              ring,
+                              completions,
+                              max_completions,
+                              timeout)
+            assert(timeout != UDIPE_DURATION_DEFAULT);
+            const unsigned to_submit = publish_sqes(ring);
+            unsigned head = *ring->cq_head;
+            const bool ready =
+                __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) != head;
+            const bool must_wait = !ready && timeout != UDIPE_DURATION_MIN;
+            if (to_submit > 0 || must_wait) {
+                unsigned flags = must_wait ? IORING_ENTER_GETEVENTS : 0;
+                struct io_uring_getevents_arg arg = {
+                    .sigmask = 0,
+                    .sigmask_sz = _NSIG / 8
+                };
+                struct __kernel_timespec delay;
+                if (must_wait && timeout != UDIPE_DURATION_MAX) {
+                    debugf("Setting up an io_uring timeout of %zu.%06zu ms...",
+                           (size_t)(timeout / UDIPE_MILLISECOND),
+                           (size_t)(timeout % UDIPE_MILLISECOND));
+                    delay = (struct __kernel_timespec){
+                        .tv_sec = timeout / UDIPE_SECOND,
+                        .tv_nsec = timeout % UDIPE_SECOND
+                    };
+                    arg.ts = (uint64_t)(uintptr_t)&delay;
+                    flags |= IORING_ENTER_EXT_ARG;
+                }
+
+                debugf("Submitting %u entries to io_uring %d%s...",
+                       to_submit, ring->fd,
+                       must_wait ? " and waiting for completions" : "");
+                const int result = sys_io_uring_enter(
+                    ring->fd,
+                    to_submit,
+                    must_wait ? 1 : 0,
+                    flags,
+                    (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL,
+                    (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0
+                );
+                if (result < 0) {
+                    switch (errno) {
+                    case ETIME:  // Reached timeout
+                        debug("Reached timeout before any completion!");
+                        break;
+                    case EINTR:  // Interrupted by a signal
+                    case EAGAIN:  // Kernel ran out of resources
+                    case EBUSY:  // Completion queue overflowed
+                        // Reaping completions below should make room
+                        debugf("Wait did not go through (%s).",
+                               strerror(errno));
+                        break;
+                    default:
+                        exit_after_c_error("Failed to wait for io_uring!");
+                    }
+                    errno = 0;
+                }
+            }
+
+            trace("Collecting completions...");
+            const unsigned tail = __atomic_load_n(ring->cq_tail,
+                                                  __ATOMIC_ACQUIRE);
+            size_t num_completions = 0;
+            while (head != tail && num_completions < max_completions) {
+                completions[num_completions++] = ring->cqes[head & ring->cq_mask];
+                ++head;
+            }
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+            debugf("Collected %zu completion(s).", num_completions);
+            return num_completions;
+        LOGGED_FUNCTION_END
+    }
+
+    UDIPE_NON_NULL_ARGS
+    void uring_finalize(uring_t* ring) {
+        LOGGED_FUNCTION_START("%p", ring)
+            debug("Unmapping the submission and completion queues...");
+            exit_on_negative(munmap(ring->sqes, ring->sqes_size),
+                             "Failed to unmap io_uring SQEs!");
+            if (ring->cq_ring != ring->sq_ring) {
+                exit_on_negative(munmap(ring->cq_ring, ring->cq_ring_size),
+                                 "Failed to unmap io_uring CQ ring!");
+            }
+            exit_on_negative(munmap(ring->sq_ring, ring->sq_ring_size),
+                             "Failed to unmap io_uring SQ ring!");
+            *ring = (uring_t){ .fd = ring->fd };
+
+            debug("Closing the io_uring...");
+            close_virtual_fd(&ring->fd);
+        LOGGED_FUNCTION_END
+    }
+
+    UDIPE_NODISCARD
+    UDIPE_NON_NULL_ARGS
+    bool uring_buffer_ring_initialize(uring_t* ring,
+                                      uring_buffer_ring_t* buffers,
+                                      unsigned num_entries,
+                                      uint16_t group) {
+        LOGGED_FUNCTION_START("%p, %p, %u, %u",
+                              ring, buffers, num_entries, group)
+            assert(num_entries > 0 && (num_entries & (num_entries - 1)) == 0);
+            assert(num_entries <= (1u << 15));
+
+            debug("Allocating the buffer ring...");
+            const size_t size = num_entries * sizeof(struct io_uring_buf);
+            void* const entries = mmap(NULL,
+                                       size,
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS,
+                                       -1,
+                                       0);
+            if (entries == MAP_FAILED) {
+                exit_after_c_error("Failed to allocate an io_uring buffer ring!");
+            }
+
+            debug("Registering the buffer ring...");
+            const struct io_uring_buf_reg registration = {
+                .ring_addr = (uint64_t)(uintptr_t)entries,
+                .ring_entries = num_entries,
+                .bgid = group
+            };
+            const int result = sys_io_uring_register(ring->fd,
+                                                     IORING_REGISTER_PBUF_RING,
+                                                     &registration,
+                                                     1);
+            if (result < 0) {
+                switch (errno) {
+                case EINVAL:  // Kernel is too old for provided buffer rings
+                    warnf("io_uring provided buffer rings are not available: "
+                          "%s.", strerror(errno));
+                    errno = 0;
+                    exit_on_negative(munmap(entries, size),
+                                     "Failed to liberate the buffer ring!");
+                    return false;
+                default:
+                    exit_after_c_error("Failed to register a buffer ring!");
+                }
+            }
+            *buffers = (uring_buffer_ring_t){
+                .entries = (struct io_uring_buf_ring*)entries,
+                .num_entries = num_entries,
+                .local_tail = 0,
+                .group = group
+            };
+            return true;
+        LOGGED_FUNCTION_END
+    }
+
+    UDIPE_NON_NULL_ARGS
+    void uring_buffer_ring_finalize(uring_t* ring,
+                                    uring_buffer_ring_t* buffers) {
+        LOGGED_FUNCTION_START("%p, %p", ring, buffers)
+            debug("Unregistering the buffer ring...");
+            const struct io_uring_buf_reg registration = {
+                .bgid = buffers->group
+            };
+            exit_on_negative(sys_io_uring_register(ring->fd,
+                                                   IORING_UNREGISTER_PBUF_RING,
+                                                   &registration,
+                                                   1),
+                             "Failed to unregister a buffer ring!");
+
+            debug("Liberating the buffer ring...");
+            exit_on_negative(munmap(buffers->entries,
+                                    buffers->num_entries
+                                    * sizeof(struct io_uring_buf)),
+                             "Failed to liberate the buffer ring!");
+            *buffers = (uring_buffer_ring_t){ 0 };
+        LOGGED_FUNCTION_END
+    }
+
+#endif  // __linux__
@@ -0,0 +1,349 @@
+#pragma once
+
+//! \file
+//! \brief io_uring instance (Linux-only)
+//!
+//! This code module implements \ref uring_t, a thin wrapper over the
+//! `io_uring` Linux system call family, which is used by the io_uring backend
+//! of workers (see \ref UDIPE_IO_URING). It talks to the kernel through raw
+//! system calls, so that `libudipe` does not need to depend on `liburing`.
+//!
+//! Only the features that workers actually need are exposed: submission queue
+//! entries are prepared by the caller in place, submitted in batches, and
+//! completions are then collected in a fashion similar to inpoll_wait().
+//! Provided buffer rings, which let the kernel pick reception buffers at the
+//! time where datagrams come in, are also supported via \ref
+//! uring_buffer_ring_t.
+
+#ifdef __linux__
+
+    #include <udipe/duration.h>
+    #include <udipe/nodiscard.h>
+    #include <udipe/pointer.h>
+
+    #include "fd.h"
+
+    #include <linux/io_uring.h>
+    #include <stdbool.h>
+    #include <stddef.h>
+    #include <stdint.h>
+
+
+    /// io_uring instance
+    ///
+    /// This struct holds an io_uring file descriptor along with the memory
+    /// mappings of its submission and completion queues. It must be set up
+    /// with uring_initialize() and destroyed with uring_finalize().
+    ///
+    /// An io_uring instance must only be used by a single thread.
+    typedef struct uring_s {
+        /// io_uring file descriptor
+        ///
+        fd_t fd;
+
+        /// Head of the submission queue, which is advanced by the kernel
+        ///
+        unsigned* sq_head;
+
+        /// Tail of the submission queue, which is advanced by us
+        ///
+        unsigned* sq_tail;
+
+        /// Indirection array of the submission queue
+        ///
+        /// We always fill it so that entry N designates `sqes[N]`.
+        unsigned* sq_array;
+
+        /// Submission queue entries
+        ///
+        struct io_uring_sqe* sqes;
+
+        /// Mask to be applied to submission queue indices
+        ///
+        unsigned sq_mask;
+
+        /// Number of entries within the submission queue
+        ///
+        unsigned sq_entries;
+
+        /// Submission queue tail including entries that were prepared with
+        /// uring_get_sqe() but not submitted yet
+        ///
+        unsigned sq_local_tail;
+
+        /// Head of the completion queue, which is advanced by us
+        ///
+        unsigned* cq_head;
+
+        /// Tail of the completion queue, which is advanced by the kernel
+        ///
+        unsigned* cq_tail;
+
+        /// Completion queue entries
+        ///
+        struct io_uring_cqe* cqes;
+
+        /// Mask to be applied to completion queue indices
+        ///
+        unsigned cq_mask;
+
+        /// Memory mapping of the submission queue ring
+        ///
+        void* sq_ring;
+
+        /// Size of `sq_ring` in bytes
+        ///
+        size_t sq_ring_size;
+
+        /// Memory mapping of the completion queue ring
+        ///
+        /// This may alias `sq_ring` if the kernel supports a single mapping.
+        void* cq_ring;
+
+        /// Size of `cq_ring` in bytes
+        ///
+        size_t cq_ring_size;
+
+        /// Size of the `sqes` mapping in bytes
+        ///
+        size_t sqes_size;
+    } uring_t;
+
+    /// Set up an io_uring instance
+    ///
+    /// io_uring may be unavailable because the kernel is too old, because it
+    /// was disabled by the system administrator (e.g. via the
+    /// `kernel.io_uring_disabled` sysctl) or because a sandbox filters out the
+    /// associated system calls. These conditions are reported by returning
+    /// `false`, so that the caller may fall back to another I/O strategy. Other
+    /// errors are considered fatal and lead to program exit.
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param ring must point to uninitialized storage for an io_uring
+    ///             instance.
+    /// \param num_entries is the desired number of submission queue entries.
+    ///                    It must be a power of two.
+    ///
+    /// \returns the truth that io_uring is available. If this is `true`, the
+    ///          instance must later be destroyed with uring_finalize().
+    ///          Otherwise `ring` is left in an unspecified state.
+    UDIPE_NODISCARD
+    UDIPE_NON_NULL_ARGS
+    bool uring_initialize(uring_t* ring, unsigned num_entries);
+
+    /// Prepare a new submission queue entry
+    ///
+    /// The resulting entry is zero-initialized. It will be handed over to the
+    /// kernel by the next call to uring_submit() or uring_wait(). If the
+    /// submission queue is full, previously prepared entries are submitted
+    /// first.
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param ring must be an io_uring instance that was set up with
+    ///             uring_initialize() and hasn't been destroyed with
+    ///             uring_finalize() yet.
+    ///
+    /// \returns a submission queue entry that must be filled in by the caller
+    ///          before the next call to another `uring_` function.
+    UDIPE_NODISCARD
+    UDIPE_NON_NULL_ARGS
+    UDIPE_NON_NULL_RESULT
+    struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+
+    /// Hand over all prepared submission queue entries to the kernel
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param ring must be an io_uring instance that was set up with
+    ///             uring_initialize() and hasn't been destroyed with
+    ///             uring_finalize() yet.
+    UDIPE_NON_NULL_ARGS
+    void uring_submit(uring_t* ring);
+
+    /// Submit prepared entries, then wait for at least one completion and
+    /// report a bounded list of completions
+    ///
+    /// Submission and waiting are performed using a single system call.
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param ring must be an io_uring instance that was set up with
+    ///             uring_initialize() and hasn't been destroyed with
+    ///             uring_finalize() yet.
+    /// \param completions is a user-provided array that will be filled up
+    ///                    with completion queue entries.
+    /// \param max_completions is the capacity of `completions`, which should
+    ///                        be at least 1. Completions beyond this amount
+    ///                        are left in the completion queue for the next
+    ///                        call to this function.
+    /// \param timeout indicates after how much time this function should stop
+    ///                waiting and report zero completions. It must not be
+    ///                \ref UDIPE_DURATION_DEFAULT.
+    ///
+    /// \returns the number of completions that were written to `completions`.
+    ///          If `timeout` is \ref UDIPE_DURATION_MAX, this is normally at
+    ///          least one, but signals may cause spurious early returns.
+    UDIPE_NODISCARD
+    UDIPE_NON_NULL_ARGS
+    size_t uring_wait(uring_t* ring,
+                      struct io_uring_cqe completions[],
+                      size_t max_completions,
+                      udipe_duration_ns_t timeout);
+
+    /// Truth that an io_uring has completions waiting to be collected
+    ///
+    /// Unlike uring_wait(), this never makes system calls, so it can be called
+    /// in a busy loop. But it does not submit pending operations either.
+    ///
+    /// \param ring must be an io_uring instance that was set up with
+    ///             uring_initialize() and hasn't been destroyed with
+    ///             uring_finalize() yet.
+    UDIPE_NODISCARD
+    UDIPE_NON_NULL_ARGS
+    static inline bool uring_completions_ready(const uring_t* ring) {
+        return __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)
+               != *ring->cq_head;
+    }
+
+    /// Destroy an io_uring instance
+    ///
+    /// Any operation that is still in flight gets canceled by the kernel.
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param ring must be an io_uring instance that was set up with
+    ///             uring_initialize() and hasn't been destroyed with
+    ///             uring_finalize() yet. It cannot be used after calling this
+    ///             function.
+    UDIPE_NON_NULL_ARGS
+    void uring_finalize(uring_t* ring);
+
+    /// Ring of buffers that are provided to the kernel for reception
+    ///
+    /// Operations that are submitted with the `IOSQE_BUFFER_SELECT` flag and
+    /// the buffer group of this ring get a buffer from it at the time where
+    /// data comes in. The identifier of the selected buffer is reported in the
+    /// `flags` of the completion queue entry, see uring_selected_buffer().
+    ///
+    /// This must be set up with uring_buffer_ring_initialize() and destroyed
+    /// with uring_buffer_ring_finalize().
+    typedef struct uring_buffer_ring_s {
+        /// Ring storage, which is shared with the kernel
+        ///
+        struct io_uring_buf_ring* entries;
+
+        /// Number of entries within the ring
+        ///
+        /// This is a power of two.
+        unsigned num_entries;
+
+        /// Ring tail including buffers that were provided with
+        /// uring_buffer_ring_provide() but not published yet
+        ///
+        uint16_t local_tail;
+
+        /// Buffer group identifier of this ring
+        ///
+        uint16_t group;
+    } uring_buffer_ring_t;
+
+    /// Set up a provided buffer ring and register it with an io_uring
+    ///
+    /// Provided buffer rings were introduced in Linux 5.19. Like
+    /// uring_initialize(), this function reports their unavailability by
+    /// returning `false` and exits on other errors.
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param ring must be an io_uring instance that was set up with
+    ///             uring_initialize() and hasn't been destroyed with
+    ///             uring_finalize() yet.
+    /// \param buffers must point to uninitialized storage for a buffer ring.
+    /// \param num_entries is the number of buffers that the ring can hold. It
+    ///                    must be a power of two.
+    /// \param group is the buffer group identifier that submission queue
+    ///              entries will use to designate this ring.
+    ///
+    /// \returns the truth that the buffer ring was set up. If this is `true`,
+    ///          it must later be destroyed with uring_buffer_ring_finalize().
+    UDIPE_NODISCARD
+    UDIPE_NON_NULL_ARGS
+    bool uring_buffer_ring_initialize(uring_t* ring,
+                                      uring_buffer_ring_t* buffers,
+                                      unsigned num_entries,
+                                      uint16_t group);
+
+    /// Add a buffer to a provided buffer ring
+    ///
+    /// The buffer only becomes visible to the kernel once
+    /// uring_buffer_ring_publish() is called. The caller is responsible for
+    /// never providing more buffers than the ring can hold.
+    ///
+    /// \param buffers must be a buffer ring that was set up with
+    ///                uring_buffer_ring_initialize().
+    /// \param buffer is the buffer to be provided.
+    /// \param size is the size of `buffer` in bytes.
+    /// \param id is the identifier that will designate this buffer in
+    ///           completion queue entries.
+    UDIPE_NON_NULL_ARGS
+    static inline
+    void uring_buffer_ring_provide(uring_buffer_ring_t* buffers,
+                                   void* buffer,
+                                   size_t size,
+                                   uint16_t id) {
+        struct io_uring_buf* const entry =
+            &buffers->entries->bufs[buffers->local_tail
+                                    & (buffers->num_entries - 1)];
+        entry->addr = (uint64_t)(uintptr_t)buffer;
+        entry->len = (uint32_t)size;
+        entry->bid = id;
+        ++(buffers->local_tail);
+    }
+
+    /// Make buffers from uring_buffer_ring_provide() visible to the kernel
+    ///
+    /// \param buffers must be a buffer ring that was set up with
+    ///                uring_buffer_ring_initialize().
+    UDIPE_NON_NULL_ARGS
+    static inline
+    void uring_buffer_ring_publish(uring_buffer_ring_t* buffers) {
+        __atomic_store_n(&buffers->entries->tail,
+                         buffers->local_tail,
+                         __ATOMIC_RELEASE);
+    }
+
+    /// Destroy a provided buffer ring
+    ///
+    /// Buffers that were still provided to the kernel are not liberated, this
+    /// is the responsibility of the caller.
+    ///
+    /// This function must be called within a logging scope.
+    ///
+    /// \param ring must be the io_uring instance that `buffers` was registered
+    ///             with.
+    /// \param buffers must be a buffer ring that was set up with
+    ///                uring_buffer_ring_initialize(). It cannot be used after
+    ///                calling this function.
+    UDIPE_NON_NULL_ARGS
+    void uring_buffer_ring_finalize(uring_t* ring,
+                                    uring_buffer_ring_t* buffers);
+
+    /// Query which provided buffer a completion used, if any
+    ///
+    /// \param completion must be a completion queue entry.
+    ///
+    /// \returns the identifier of the buffer that was selected by the kernel,
+    ///          or -1 if no buffer was selected.
+    UDIPE_NODISCARD
+    UDIPE_NON_NULL_ARGS
+    static inline
+    int32_t uring_selected_buffer(const struct io_uring_cqe* completion) {
+        if (!(completion->flags & IORING_CQE_F_BUFFER)) return -1;
+        return (int32_t)(completion->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+
+#else
+    #error "This header is currently only implemented on Linux."
+#endif  // __linux__
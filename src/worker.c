@@ -0,0 +1,1138 @@
+#include "worker.h"
+
+#include <udipe/result.h>
+
+#include "connect.h"
+#include "connection.h"
+#include "context.h"
+#include "event.h"
+#include "error.h"
+#include "future.h"
+#include "future/status_ops.h"
+#include "log.h"
+#include "recv.h"
+#include "send.h"
+#include "uring.h"
+#include "worker_pool.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <hwloc.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <threads.h>
+
+
+/// Maximal number of readable sockets processed per worker_poll() call
+///
+#define MAX_READABLE_SOCKETS ((size_t)16)
+
+/// Maximal number of io_uring completions processed per worker_poll() call
+///
+#define MAX_COMPLETIONS ((size_t)64)
+
+/// Number of spin_loop_hint() calls between two checks for new work while an
+/// idle worker thread is spinning
+///
+#define IDLE_SPIN_HINTS ((size_t)32)
+
+/// Number of checks for new work between two polls of the I/O backend while
+/// an idle worker thread is spinning
+///
+/// Polling the I/O backend may require system calls, so in between, only
+/// userspace checks are performed.
+#define IDLE_BACKEND_POLL_INTERVAL ((size_t)16)
+
+/// Inverse of the weight of the latest measurement in \ref
+/// worker_t::idle_period
+///
+#define IDLE_PERIOD_SMOOTHING ((udipe_duration_ns_t)8)
+
+/// Number of queued commands from which a worker is considered to be backed up
+///
+/// Sibling workers steal commands from backed up workers, see \ref
+/// udipe_connect_options_t::enable_send_stealing.
+#define STEAL_THRESHOLD ((size_t)(COMMAND_QUEUE_LEN / 2))
+
+/// Maximal number of commands that steal_commands() steals in one go
+///
+/// This keeps a worker that steals commands reactive to its own traffic.
+#define MAX_STOLEN_COMMANDS ((size_t)8)
+
+/// Set up the io_uring of a worker, along with its provided buffer ring
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a worker whose buffer allocator is set up.
+///
+/// \returns the truth that io_uring is usable. If this is `false`, the worker
+///          must fall back to another I/O backend.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static bool setup_uring(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        if (!uring_initialize(&worker->ring, WORKER_URING_ENTRIES)) {
+            return false;
+        }
+        static_assert((UDIPE_MAX_BUFFERS & (UDIPE_MAX_BUFFERS - 1)) == 0,
+                      "Provided buffer rings must have a power-of-two size");
+        if (!uring_buffer_ring_initialize(&worker->ring,
+                                          &worker->recv_ring,
+                                          UDIPE_MAX_BUFFERS,
+                                          WORKER_RECV_BUFFER_GROUP)) {
+            uring_finalize(&worker->ring);
+            return false;
+        }
+        for (size_t i = 0; i < UDIPE_MAX_BUFFERS; ++i) {
+            worker->recv_ring_buffers[i] = false;
+        }
+        worker->recv_ring_len = 0;
+        return true;
+    LOGGED_FUNCTION_END
+}
+
+/// Ask a worker's io_uring to report the next signal of its wakeup event
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a worker that uses an io_uring backend.
+UDIPE_NON_NULL_ARGS
+static void monitor_wakeup(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        // Multishot polling would save a few submissions, but it reports every
+        // signal, which would make us reset the event more often than needed.
+        struct io_uring_sqe* const sqe = uring_get_sqe(&worker->ring);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = worker->wakeup;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = WORKER_WAKEUP_ID;
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_SPECIFIC_ARGS(1, 2)
+void worker_initialize(worker_t* worker,
+                       udipe_context_t* context,
+                       udipe_buffer_configurator_t buffer_configurator,
+                       udipe_io_backend_t io_backend,
+                       udipe_duration_ns_t idle_spin,
+                       hwloc_topology_t topology) {
+    LOGGED_FUNCTION_START("%p, %p, { %p, %p }, %d, %zu, %p",
+                          worker,
+                          context,
+                          buffer_configurator.callback,
+                          buffer_configurator.context,
+                          io_backend,
+                          (size_t)idle_spin,
+                          topology)
+        assert(io_backend != UDIPE_IO_DEFAULT);
+        worker->context = context;
+
+        debug("Setting up the command queue...");
+        command_queue_initialize(&worker->commands);
+        atomic_init(&worker->control, 0);
+        atomic_init(&worker->sleeping, false);
+        atomic_init(&worker->stealing, false);
+        worker->num_steal_victims = 0;
+        worker->steal_victims_known = false;
+
+        debug("Setting up the buffer allocator...");
+        worker->buffers = buffer_allocator_initialize(buffer_configurator,
+                                                      topology);
+
+        debug("Setting up the I/O backend...");
+        worker->io_backend = io_backend;
+        if (io_backend != UDIPE_IO_EPOLL && !setup_uring(worker)) {
+            warn("Falling back to the epoll I/O backend.");
+            worker->io_backend = UDIPE_IO_EPOLL;
+        }
+        worker->sockets = FD_INVALID;
+        if (worker->io_backend == UDIPE_IO_EPOLL) {
+            debug("Setting up socket readiness polling...");
+            worker->sockets = inpoll_initialize();
+        }
+
+        debug("Setting up the wakeup event...");
+        worker->wakeup = event_initialize(false);
+        if (worker_uses_uring(worker)) {
+            monitor_wakeup(worker);
+        } else {
+            switch (inpoll_attach(worker->sockets,
+                                  worker->wakeup,
+                                  WORKER_WAKEUP_ID)) {
+            case INPOLL_ATTACH_SUCCESS:
+                break;
+            case INPOLL_ATTACH_TOO_NESTED:  // Events are not epoll fds
+            case INPOLL_ATTACH_REDUNDANT:  // inpoll was just created
+                exit_with_error("This error is not expected to happen!");
+            }
+        }
+
+        debug("Setting up the command timeout clock...");
+        worker->clock = stopwatch_initialize();
+        worker->max_latency = 0;
+        worker->idle_spin = idle_spin;
+        // Start by spinning for as long as allowed
+        worker->idle_period = idle_spin / 2;
+        worker->num_pending_recvs = 0;
+        worker->num_recv_streams = 0;
+        worker->num_pending_sends = 0;
+        worker->num_zerocopy_buffers = 0;
+        worker->num_send_streams = 0;
+    LOGGED_FUNCTION_END
+}
+
+/// Steer the incoming traffic of a sharded connection based on its CPU
+///
+/// Each CPU that a worker thread is pinned to is mapped to the first shard
+/// that this worker owns, see \ref udipe_connect_options_t::steer_by_cpu.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be the worker that processed the udipe_connect() command.
+/// \param connection must be the first shard of a sharded connection whose
+///                   shards have all been assigned to a worker.
+UDIPE_NON_NULL_ARGS
+static void steer_by_cpu(worker_t* worker, udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p, %p", worker, connection)
+        worker_pool_t* const pool = &worker->context->workers;
+
+        debug("Determining the number of CPUs to be mapped...");
+        size_t num_cpus = 0;
+        udipe_connection_t* shard;
+        for (size_t i = 0;
+             (shard = udipe_connection_shard(connection, i));
+             ++i) {
+            const int last_cpu =
+                hwloc_bitmap_last(worker_pool_cpuset(pool, shard->worker));
+            ensure_ge(last_cpu, 0);
+            if ((size_t)last_cpu >= num_cpus) num_cpus = last_cpu + 1;
+        }
+
+        debug("Mapping each worker CPU to the first shard of its worker...");
+        uint32_t* const cpu_shards = malloc(num_cpus * sizeof(uint32_t));
+        exit_on_null(cpu_shards, "Failed to allocate CPU to shard mapping!");
+        for (size_t cpu = 0; cpu < num_cpus; ++cpu) cpu_shards[cpu] = UINT32_MAX;
+        for (size_t i = 0;
+             (shard = udipe_connection_shard(connection, i));
+             ++i) {
+            unsigned cpu;
+            hwloc_bitmap_foreach_begin(cpu,
+                                       worker_pool_cpuset(pool, shard->worker))
+                if (cpu_shards[cpu] == UINT32_MAX) cpu_shards[cpu] = i;
+            hwloc_bitmap_foreach_end();
+        }
+
+        debug("Attaching the steering program...");
+        const int error = connection_steer_by_cpu(connection,
+                                                  cpu_shards,
+                                                  num_cpus);
+        if (error) warnf("Failed to steer datagrams by CPU (errno %d), will "
+                         "spread them across shards by source instead.",
+                         error);
+        free(cpu_shards);
+    LOGGED_FUNCTION_END
+}
+
+/// Process a connection command
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a valid worker.
+/// \param command must be a connection command.
+UDIPE_NON_NULL_ARGS
+static void execute_connect(worker_t* worker, const command_t* command) {
+    LOGGED_FUNCTION_START("%p, %p", worker, command)
+        udipe_connect_options_t* const options = command->options.connect;
+
+        udipe_connect_result_t result = { 0 };
+        if (options->worker_class >= worker->context->workers.num_classes) {
+            warnf("There is no worker class %u!",
+                  (unsigned)options->worker_class);
+            result.error = EINVAL;
+        } else {
+            debug("Setting up the connection...");
+            result = connection_open(options, worker->max_latency);
+        }
+        if (result.connection) {
+            debug("Assigning the connection's shard(s) to workers...");
+            udipe_connection_t* shard;
+            for (size_t i = 0;
+                 (shard = udipe_connection_shard(result.connection, i));
+                 ++i) {
+                shard->worker = worker_pool_neighbor(&worker->context->workers,
+                                                     worker,
+                                                     i);
+            }
+            if (options->steer_by_cpu) steer_by_cpu(worker, result.connection);
+        }
+
+        debug("Releasing the connection options...");
+        connect_options_liberate(&worker->context->connect_options, options);
+
+        debug("Notifying the client...");
+        const bool notified = future_network_try_set_result(
+            command->future,
+            result.error == 0,
+            (udipe_network_payload_t){ .connect = result }
+        );
+        if (!notified && result.connection) {
+            debug("Connection was canceled, tearing it back down...");
+            const int error = connection_close_shards(result.connection);
+            if (error) warnf("Failed to close canceled connection (errno %d).",
+                             error);
+        }
+    LOGGED_FUNCTION_END
+}
+
+/// Process a disconnection command
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a valid worker.
+/// \param command must be a disconnection command.
+UDIPE_NON_NULL_ARGS
+static void execute_disconnect(worker_t* worker, const command_t* command) {
+    LOGGED_FUNCTION_START("%p, %p", worker, command)
+        udipe_connection_t* const connection =
+            command->options.disconnect.connection;
+        ensure(connection);
+
+        debug("Releasing emission engine resources...");
+        send_abort(worker, connection);
+
+        debug("Releasing receive engine resources...");
+        recv_abort(worker, connection);
+
+        // A thief may have taken a send command targeting this connection out
+        // of our queue, without having acquired the connection yet.
+        debug("Waiting for steals in flight...");
+        while (atomic_load_explicit(&worker->stealing, memory_order_acquire)) {
+            spin_loop_hint();
+        }
+
+        debug("Dropping the owner's reference to the connection...");
+        connection->disconnect_future = command->future;
+        worker_release_connection(connection);
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void worker_release_connection(udipe_connection_t* connection) {
+    LOGGED_FUNCTION_START("%p", connection)
+        if (!connection_release(connection)) {
+            debug("Stolen send commands are still in flight, the last of them "
+                  "will close the connection.");
+            return;
+        }
+        udipe_future_t* const future = connection->disconnect_future;
+        ensure((bool)future);
+
+        debug("Closing the connection...");
+        const udipe_disconnect_result_t result = {
+            .error = connection_close(connection)
+        };
+
+        debug("Notifying the client...");
+        // Connection is gone either way, so cancelation does not matter here
+        (void)future_network_try_set_result(
+            future,
+            result.error == 0,
+            (udipe_network_payload_t){ .disconnect = result }
+        );
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void worker_execute(worker_t* worker, const command_t* command) {
+    LOGGED_FUNCTION_START("%p, %p", worker, command)
+        udipe_future_t* const future = command->future;
+        if (!future) {
+            debug("Command was canceled while queued, ignoring it.");
+            return;
+        }
+
+        debug("Determining the command type...");
+        const future_type_t type = future_status_load(
+            future,
+            // Synchronize with the client thread that submitted the command
+            memory_order_acquire
+        ).type;
+
+        debug("Handling commands that were canceled before processing...");
+        if (type != TYPE_NETWORK_DISCONNECT && future_network_canceled(future)) {
+            debug("Command was canceled, acknowledging without processing it.");
+            if (type == TYPE_NETWORK_CONNECT) {
+                connect_options_liberate(&worker->context->connect_options,
+                                         command->options.connect);
+            }
+            future_eager_acknowledge_cancel(future);
+            return;
+        }
+
+        debugf("Processing a command of type %d...", type);
+        switch (type) {
+        case TYPE_NETWORK_CONNECT:
+            execute_connect(worker, command);
+            break;
+        case TYPE_NETWORK_DISCONNECT:
+            execute_disconnect(worker, command);
+            break;
+        case TYPE_NETWORK_RECV:
+            recv_start(worker, command);
+            break;
+        case TYPE_NETWORK_RECV_STREAM:
+            recv_stream_start(worker, command);
+            break;
+        case TYPE_NETWORK_SEND:
+            send_start(worker, command);
+            break;
+        case TYPE_NETWORK_SEND_STREAM:
+            send_stream_start(worker, command);
+            break;
+        default:
+            exit_with_error("Received a command with an invalid type!");
+        }
+    LOGGED_FUNCTION_END
+}
+
+/// Account for the time elapsed since the last call in pending commands
+///
+/// Any time elapsed beyond `expected` is also accounted for in \ref
+/// worker_t::max_latency.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a valid worker.
+/// \param expected is how much time was expected to elapse since the last
+///                 call, or \ref UDIPE_DURATION_MAX if any amount of elapsed
+///                 time is fine.
+///
+/// \returns the time left until the next pending command times out, or \ref
+///          UDIPE_DURATION_MAX if no pending command can time out.
+UDIPE_NON_NULL_ARGS
+static udipe_duration_ns_t update_timeouts(worker_t* worker,
+                                           udipe_duration_ns_t expected) {
+    LOGGED_FUNCTION_START("%p, %zu", worker, (size_t)expected)
+        const udipe_duration_ns_t elapsed = stopwatch_measure(&worker->clock);
+        if (expected != UDIPE_DURATION_MAX
+            && elapsed > expected
+            && elapsed - expected > worker->max_latency) {
+            worker->max_latency = elapsed - expected;
+            debugf("Worker loop latency reached a new high of %zu ns.",
+                   (size_t)worker->max_latency);
+        }
+        const udipe_duration_ns_t recv_wait = recv_on_clock(worker, elapsed);
+        const udipe_duration_ns_t send_wait = send_on_clock(worker, elapsed);
+        return (recv_wait < send_wait) ? recv_wait : send_wait;
+    LOGGED_FUNCTION_END
+}
+
+/// Wait for socket readiness with the epoll backend, then process it
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a worker that uses the \ref UDIPE_IO_EPOLL backend.
+/// \param wait is the maximal amount of time to wait.
+///
+/// \returns the number of readiness notifications that were processed.
+UDIPE_NON_NULL_ARGS
+static size_t wait_epoll(worker_t* worker, udipe_duration_ns_t wait) {
+    LOGGED_FUNCTION_START("%p, %zu", worker, (size_t)wait)
+        uint64_t readable[MAX_READABLE_SOCKETS];
+        const size_t num_readable = inpoll_wait(worker->sockets,
+                                                readable,
+                                                MAX_READABLE_SOCKETS,
+                                                wait);
+
+        debugf("Processing %zu readable socket(s)...", num_readable);
+        for (size_t i = 0; i < num_readable; ++i) {
+            if (readable[i] == WORKER_WAKEUP_ID) {
+                debug("Woken up by a client, resetting the wakeup event...");
+                event_reset(worker->wakeup);
+                continue;
+            }
+            udipe_connection_t* const connection =
+                (udipe_connection_t*)(uintptr_t)readable[i];
+            recv_on_readable(worker, connection);
+        }
+        return num_readable;
+    LOGGED_FUNCTION_END
+}
+
+/// Submit I/O operations with the io_uring backend, wait for completions, then
+/// process them
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a worker that uses an io_uring backend.
+/// \param wait is the maximal amount of time to wait.
+///
+/// \returns the number of completions that were processed.
+UDIPE_NON_NULL_ARGS
+static size_t wait_uring(worker_t* worker, udipe_duration_ns_t wait) {
+    LOGGED_FUNCTION_START("%p, %zu", worker, (size_t)wait)
+        debug("Preparing receptions...");
+        recv_prepare(worker);
+
+        struct io_uring_cqe completions[MAX_COMPLETIONS];
+        const size_t num_completions = uring_wait(&worker->ring,
+                                                  completions,
+                                                  MAX_COMPLETIONS,
+                                                  wait);
+
+        debugf("Processing %zu completion(s)...", num_completions);
+        for (size_t i = 0; i < num_completions; ++i) {
+            worker_complete(worker, &completions[i]);
+        }
+        return num_completions;
+    LOGGED_FUNCTION_END
+}
+
+/// Truth that a worker thread has new commands or control signals to process
+///
+/// This function must be called by the worker thread.
+///
+/// \param worker must be a valid worker.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static inline bool has_client_work(worker_t* worker) {
+    // worker_run() loads the control word again with the right memory ordering
+    return !command_queue_empty(&worker->commands)
+           || atomic_load_explicit(&worker->control, memory_order_relaxed) != 0;
+}
+
+/// Wait for network activity or new commands with the worker's I/O backend,
+/// then process network activity
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a valid worker.
+/// \param wait is the maximal amount of time to wait. If this is not \ref
+///             UDIPE_DURATION_MIN, the worker thread advertises that it may be
+///             sleeping so that client threads wake it up.
+///
+/// \returns the number of network events that were processed, including
+///          wakeups from client threads.
+UDIPE_NON_NULL_ARGS
+static size_t wait_backend(worker_t* worker, udipe_duration_ns_t wait) {
+    LOGGED_FUNCTION_START("%p, %zu", worker, (size_t)wait)
+        if (wait != UDIPE_DURATION_MIN) {
+            debug("Advertising that the worker thread may sleep...");
+            atomic_store_explicit(&worker->sleeping,
+                                  true,
+                                  memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (has_client_work(worker)) {
+                debug("Commands came in meanwhile, so don't wait.");
+                wait = UDIPE_DURATION_MIN;
+            }
+        }
+
+        const size_t num_events = worker_uses_uring(worker)
+                                  ? wait_uring(worker, wait)
+                                  : wait_epoll(worker, wait);
+        atomic_store_explicit(&worker->sleeping, false, memory_order_relaxed);
+        return num_events;
+    LOGGED_FUNCTION_END
+}
+
+/// Truth that a worker thread's io_uring has completions to process
+///
+/// This is a cheap check that does not require system calls, which the epoll
+/// backend has no equivalent of.
+///
+/// \param worker must be a valid worker.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static inline bool has_uring_completions(const worker_t* worker) {
+    return worker_uses_uring(worker)
+           && uring_completions_ready(&worker->ring);
+}
+
+/// Decide for how long an idle worker thread should spin, then yield, before
+/// blocking
+///
+/// Spinning is pointless if new work usually takes longer to come in than \ref
+/// worker_t::idle_spin, so this is 0 if \ref worker_t::idle_period says so.
+///
+/// \param worker must be a worker whose \ref worker_t::idle_spin is nonzero.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static udipe_duration_ns_t idle_spin_duration(const worker_t* worker) {
+    if (worker->idle_period > worker->idle_spin) return 0;
+    const udipe_duration_ns_t spin = 2 * worker->idle_period;
+    return (spin > worker->idle_spin) ? worker->idle_spin : spin;
+}
+
+/// Account for the duration of an idle period in \ref worker_t::idle_period
+///
+/// \param worker must be a worker whose \ref worker_t::idle_spin is nonzero.
+/// \param elapsed is the time that the worker thread spent waiting for work.
+UDIPE_NON_NULL_ARGS
+static void record_idle_period(worker_t* worker, udipe_duration_ns_t elapsed) {
+    // Clamped so that one long idle period does not disable spinning for
+    // many subsequent short ones.
+    if (elapsed > 2 * worker->idle_spin) elapsed = 2 * worker->idle_spin;
+    worker->idle_period = worker->idle_period
+                          - worker->idle_period / IDLE_PERIOD_SMOOTHING
+                          + elapsed / IDLE_PERIOD_SMOOTHING;
+}
+
+/// Spin, then yield, then block until network activity or new commands come
+/// in, and update \ref worker_t::idle_period accordingly
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a worker whose \ref worker_t::idle_spin is nonzero.
+/// \param wait is the maximal amount of time to wait. It must not be \ref
+///             UDIPE_DURATION_MIN.
+UDIPE_NON_NULL_ARGS
+static void idle_wait(worker_t* worker, udipe_duration_ns_t wait) {
+    LOGGED_FUNCTION_START("%p, %zu", worker, (size_t)wait)
+        assert(worker->idle_spin > 0);
+        assert(wait != UDIPE_DURATION_MIN);
+        stopwatch_t clock = stopwatch_initialize();
+        udipe_duration_ns_t elapsed = 0;
+
+        debug("Deciding how long to spin...");
+        const udipe_duration_ns_t spin = idle_spin_duration(worker);
+
+        debugf("Spinning, then yielding, for up to %zu ns each...",
+               (size_t)spin);
+        bool active = false;
+        bool spinning = true;
+        for (size_t iteration = 0;
+             elapsed < 2 * spin && elapsed < wait;
+             ++iteration) {
+            // The first poll submits pending io_uring operations. Later ones
+            // occur periodically, when io_uring completions are ready, and
+            // when switching from spinning to yielding.
+            bool poll_backend = (iteration % IDLE_BACKEND_POLL_INTERVAL == 0);
+            if (spinning && elapsed >= spin) {
+                spinning = false;
+                poll_backend = true;
+            }
+            if (has_uring_completions(worker)) poll_backend = true;
+            if (has_client_work(worker)
+                || (poll_backend
+                    && wait_backend(worker, UDIPE_DURATION_MIN) > 0)) {
+                active = true;
+                break;
+            }
+            if (spinning) {
+                for (size_t i = 0; i < IDLE_SPIN_HINTS; ++i) spin_loop_hint();
+            } else {
+                thrd_yield();
+            }
+            elapsed += stopwatch_measure(&clock);
+        }
+
+        if (!active) {
+            debug("Nothing happened, blocking...");
+            udipe_duration_ns_t remaining = UDIPE_DURATION_MIN;
+            if (wait == UDIPE_DURATION_MAX) {
+                remaining = UDIPE_DURATION_MAX;
+            } else if (elapsed < wait) {
+                remaining = wait - elapsed;
+            }
+            (void)wait_backend(worker, remaining);
+        }
+        elapsed += stopwatch_measure(&clock);
+
+        debug("Updating the idle period estimate...");
+        record_idle_period(worker, elapsed);
+        tracef("Idle period estimate is now %zu ns.",
+               (size_t)worker->idle_period);
+    LOGGED_FUNCTION_END
+}
+
+/// Wake up a worker thread if it may be sleeping
+///
+/// This must be called by client threads after submitting commands or raising
+/// control signals, within a logging scope.
+///
+/// \param worker must be a worker whose thread is running worker_run().
+UDIPE_NON_NULL_ARGS
+static void wake_up(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        // Order our update before the check, see worker_t::sleeping
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&worker->sleeping, memory_order_relaxed)) {
+            debug("Worker thread may be sleeping, waking it up...");
+            event_signal(worker->wakeup);
+        }
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void worker_complete(worker_t* worker, const struct io_uring_cqe* completion) {
+    LOGGED_FUNCTION_START("%p, %p", worker, completion)
+        const uint64_t user_data = completion->user_data;
+        udipe_connection_t* const connection =
+            (udipe_connection_t*)(uintptr_t)(user_data
+                                             & ~WORKER_URING_TAG_MASK);
+        switch ((worker_uring_tag_t)(user_data & WORKER_URING_TAG_MASK)) {
+        case WORKER_URING_WAKEUP:
+            assert(user_data == WORKER_WAKEUP_ID);
+            debug("Woken up by a client, resetting the wakeup event...");
+            if (completion->res < 0) {
+                errno = -completion->res;
+                exit_after_c_error("Failed to poll the wakeup event!");
+            }
+            event_reset(worker->wakeup);
+            monitor_wakeup(worker);
+            break;
+        case WORKER_URING_RECV:
+        case WORKER_URING_POLL:
+        case WORKER_URING_RECV_MULTISHOT:
+            ensure(connection);
+            recv_on_completion(worker, connection, completion);
+            break;
+        case WORKER_URING_CANCEL:
+            trace("Cancelation request went through.");
+            break;
+        case WORKER_URING_SEND:  // Collected by send_flush()
+        default:
+            exit_with_error("Unexpected io_uring completion!");
+        }
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void worker_poll(worker_t* worker, udipe_duration_ns_t max_wait) {
+    LOGGED_FUNCTION_START("%p, %zu", worker, (size_t)max_wait)
+        assert(max_wait != UDIPE_DURATION_DEFAULT);
+
+        debug("Sending queued datagrams...");
+        const bool streaming = send_flush(worker);
+
+        debug("Busy-polling sockets that need datagrams...");
+        const bool busy_polling = recv_busy_poll(worker);
+
+        // Network activity is not processed until the wait below, so all the
+        // time spent since the last wait counts as latency
+        debug("Updating pending command timeouts...");
+        udipe_duration_ns_t wait = update_timeouts(worker, 0);
+        if (max_wait < wait) wait = max_wait;
+        if (streaming) {
+            debug("Emission streams have more to send, so don't wait.");
+            wait = UDIPE_DURATION_MIN;
+        } else if (busy_polling) {
+            debug("Some sockets are busy-polled, so don't wait.");
+            wait = UDIPE_DURATION_MIN;
+        } else if ((worker->num_pending_sends > 0
+                    || worker->num_send_streams > 0
+                    || worker->num_zerocopy_buffers > 0)
+                   && SEND_RETRY_DELAY < wait) {
+            debug("Some sockets or worker buffers are congested, will retry "
+                  "sending soon.");
+            wait = SEND_RETRY_DELAY;
+        }
+        if (wait == UDIPE_DURATION_DEFAULT) wait = UDIPE_DURATION_MIN;
+
+        debug("Waiting for network activity or new commands...");
+        if (worker->idle_spin > 0 && wait != UDIPE_DURATION_MIN) {
+            idle_wait(worker, wait);
+        } else {
+            (void)wait_backend(worker, wait);
+        }
+
+        debug("Accounting for the time spent waiting...");
+        (void)update_timeouts(worker, wait);
+    LOGGED_FUNCTION_END
+}
+
+/// Make sure that a worker knows its sibling workers
+///
+/// This function must be called by the worker thread, within a logging scope.
+///
+/// \param worker must be a valid worker.
+///
+/// \returns the truth that \ref worker_t::steal_victims is valid.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static bool know_siblings(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        if (!worker->steal_victims_known) {
+            debug("Looking for sibling workers...");
+            worker->steal_victims_known =
+                worker_pool_cache_siblings(&worker->context->workers,
+                                           worker,
+                                           worker->steal_victims,
+                                           MAX_STEAL_VICTIMS,
+                                           &worker->num_steal_victims);
+        }
+        return worker->steal_victims_known;
+    LOGGED_FUNCTION_END
+}
+
+/// Wake up a sibling worker if this worker is backed up with commands that
+/// siblings could steal
+///
+/// This function must be called by the worker thread, within a logging scope.
+///
+/// \param worker must be a valid worker.
+UDIPE_NON_NULL_ARGS
+static void call_for_help(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        if (command_queue_len(&worker->commands) < STEAL_THRESHOLD
+            || !command_queue_next_stealable(&worker->commands)
+            || !know_siblings(worker)) {
+            return;
+        }
+
+        debug("Backed up with stealable commands, waking up a sibling...");
+        for (size_t i = 0; i < worker->num_steal_victims; ++i) {
+            worker_t* const sibling = worker->steal_victims[i];
+            if (atomic_load_explicit(&sibling->sleeping,
+                                     memory_order_relaxed)) {
+                event_signal(sibling->wakeup);
+                return;
+            }
+        }
+        trace("No sibling is sleeping.");
+    LOGGED_FUNCTION_END
+}
+
+/// Steal send commands from the most loaded sibling worker, if it is backed up
+///
+/// This function must be called by the worker thread once it has processed
+/// all of its own commands, within a logging scope.
+///
+/// \param worker must be a valid worker.
+///
+/// \returns the truth that some commands were stolen.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static bool steal_commands(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        if (!know_siblings(worker)) return false;
+
+        debug("Looking for the most loaded sibling worker...");
+        worker_t* victim = NULL;
+        size_t max_queued = STEAL_THRESHOLD - 1;
+        for (size_t i = 0; i < worker->num_steal_victims; ++i) {
+            worker_t* const sibling = worker->steal_victims[i];
+            const size_t num_queued = command_queue_len(&sibling->commands);
+            if (num_queued > max_queued) {
+                victim = sibling;
+                max_queued = num_queued;
+            }
+        }
+        if (!victim) {
+            trace("No sibling worker is backed up.");
+            return false;
+        }
+
+        debugf("Stealing commands from worker %p...", victim);
+        size_t num_stolen = 0;
+        while (num_stolen < MAX_STOLEN_COMMANDS
+               && worker->num_pending_sends < MAX_PENDING_SENDS / 2) {
+            if (atomic_exchange_explicit(&victim->stealing,
+                                         true,
+                                         memory_order_acquire)) {
+                debug("Another worker is already stealing from it.");
+                break;
+            }
+            command_t command;
+            const bool stolen = command_queue_try_steal(&victim->commands,
+                                                        &command);
+            // Canceled commands are turned into no-ops, see
+            // process_cancelations(), which need not be executed
+            const bool noop = stolen && !command.future;
+            if (stolen && !noop) {
+                connection_acquire(command.options.send.connection);
+            }
+            atomic_store_explicit(&victim->stealing,
+                                  false,
+                                  // Let the owner see our connection reference
+                                  memory_order_release);
+            if (!stolen) break;
+            if (noop) continue;
+
+            worker_execute(worker, &command);
+            worker_release_connection(command.options.send.connection);
+            ++num_stolen;
+        }
+        debugf("Stole %zu command(s).", num_stolen);
+        return num_stolen > 0;
+    LOGGED_FUNCTION_END
+}
+
+/// Acknowledge the cancelation of commands after \ref WORKER_CONTROL_CANCEL
+/// has been raised
+///
+/// Canceled commands that are still queued are acknowledged right away and
+/// turned into no-ops, instead of waiting for their turn in the command queue.
+/// Canceled commands that are already being processed are acknowledged by
+/// update_timeouts().
+///
+/// This function must be called by the worker thread, within a logging scope.
+///
+/// \param worker must be a valid worker.
+UDIPE_NON_NULL_ARGS
+static void process_cancelations(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        debug("Keeping other workers from stealing queued commands...");
+        while (atomic_exchange_explicit(&worker->stealing,
+                                        true,
+                                        memory_order_acquire)) {
+            spin_loop_hint();
+        }
+
+        debug("Acknowledging queued commands that were canceled...");
+        size_t num_canceled = 0;
+        command_t* command;
+        for (size_t pos = 0;
+             (command = command_queue_peek(&worker->commands, pos));
+             ++pos) {
+            udipe_future_t* const future = command->future;
+            if (!future) continue;
+            const future_type_t type = future_status_load(
+                future,
+                // Synchronize with the client thread that submitted the command
+                memory_order_acquire
+            ).type;
+            if (type == TYPE_NETWORK_DISCONNECT
+                || !future_network_canceled(future)) {
+                continue;
+            }
+            worker_execute(worker, command);
+            command->future = NULL;
+            ++num_canceled;
+        }
+        atomic_store_explicit(&worker->stealing, false, memory_order_release);
+        debugf("Acknowledged %zu queued command(s).", num_canceled);
+
+        debug("Acknowledging canceled commands that are being processed...");
+        (void)update_timeouts(worker, 0);
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void worker_submit(worker_t* worker, const command_t* command) {
+    LOGGED_FUNCTION_START("%p, %p", worker, command)
+        debug("Recording which worker processes the command...");
+        command->future->worker = worker;
+
+        debug("Enqueuing the command...");
+        command_queue_push(&worker->commands, command);
+
+        debug("Waking up the worker thread...");
+        wake_up(worker);
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void worker_submit_batch(worker_t* worker,
+                         const command_t commands[],
+                         size_t num_commands) {
+    LOGGED_FUNCTION_START("%p, %p, %zu", worker, commands, num_commands)
+        debug("Recording which worker processes the commands...");
+        for (size_t i = 0; i < num_commands; ++i) {
+            commands[i].future->worker = worker;
+        }
+
+        while (num_commands > 0) {
+            debugf("Enqueuing up to %zu commands...", num_commands);
+            const size_t num_pushed = command_queue_push_batch(&worker->commands,
+                                                               commands,
+                                                               num_commands);
+            commands += num_pushed;
+            num_commands -= num_pushed;
+
+            // Must be done before pushing more commands, otherwise we could
+            // wait for a sleeping worker to free up queue slots forever.
+            debug("Waking up the worker thread...");
+            wake_up(worker);
+        }
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void worker_run(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        debug("Resetting the timeout clock...");
+        (void)update_timeouts(worker, UDIPE_DURATION_MAX);
+
+        while (true) {
+            debug("Checking for control signals...");
+            const unsigned control = atomic_fetch_and_explicit(
+                &worker->control,
+                ~(unsigned)WORKER_CONTROL_CANCEL,
+                // Synchronize with the client thread that raised the signals
+                memory_order_acquire
+            );
+            if (control & WORKER_CONTROL_CANCEL) process_cancelations(worker);
+            if (control & WORKER_CONTROL_STOP) break;
+
+            debug("Checking if sibling workers could help...");
+            call_for_help(worker);
+
+            debug("Processing a batch of queued commands...");
+            size_t num_commands = 0;
+            command_t command;
+            while (num_commands < WORKER_COMMAND_BATCH
+                   && command_queue_try_pop(&worker->commands, &command)) {
+                worker_execute(worker, &command);
+                ++num_commands;
+            }
+            // More commands may be queued, but check control signals first
+            if (num_commands == WORKER_COMMAND_BATCH) continue;
+
+            // Come back quickly after stealing, as the victim likely has more
+            debug("Helping backed up sibling workers...");
+            const bool stole = steal_commands(worker);
+            worker_poll(worker, stole ? UDIPE_DURATION_MIN
+                                      : UDIPE_DURATION_MAX);
+        }
+
+        debug("Asked to stop, acknowledging canceled commands...");
+        process_cancelations(worker);
+        command_t command;
+        while (command_queue_try_pop(&worker->commands, &command)) {
+            // udipe_finalize() may only be called once all futures are finished
+            ensure(!command.future);
+        }
+        debug("Exiting the worker loop.");
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void worker_cancel(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        debug("Raising the cancelation signal...");
+        atomic_fetch_or_explicit(&worker->control,
+                                 WORKER_CONTROL_CANCEL,
+                                 // Publish the canceled future status
+                                 memory_order_release);
+
+        debug("Waking up the worker thread...");
+        wake_up(worker);
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void worker_stop(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        debug("Raising the stop signal...");
+        atomic_fetch_or_explicit(&worker->control,
+                                 WORKER_CONTROL_STOP,
+                                 memory_order_release);
+
+        debug("Waking up the worker thread...");
+        wake_up(worker);
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void worker_finalize(worker_t* worker) {
+    LOGGED_FUNCTION_START("%p", worker)
+        debug("Checking that no command is pending...");
+        ensure_eq(worker->num_pending_recvs, (size_t)0);
+        ensure_eq(worker->num_recv_streams, (size_t)0);
+        ensure_eq(worker->num_pending_sends, (size_t)0);
+        ensure_eq(worker->num_zerocopy_buffers, (size_t)0);
+        ensure_eq(worker->num_send_streams, (size_t)0);
+
+        if (worker_uses_uring(worker)) {
+            debug("Tearing down the io_uring...");
+            uring_buffer_ring_finalize(&worker->ring, &worker->recv_ring);
+            uring_finalize(&worker->ring);
+
+            debugf("Taking back %zu provided buffer(s)...",
+                   worker->recv_ring_len);
+            for (size_t i = 0; i < UDIPE_MAX_BUFFERS; ++i) {
+                if (!worker->recv_ring_buffers[i]) continue;
+                buffer_liberate(&worker->buffers,
+                                buffer_at(&worker->buffers, i));
+                worker->recv_ring_buffers[i] = false;
+            }
+            worker->recv_ring_len = 0;
+
+            debug("Tearing down the wakeup event...");
+            event_finalize(&worker->wakeup);
+        } else {
+            debug("Tearing down the wakeup event...");
+            switch (inpoll_detach(worker->sockets, worker->wakeup)) {
+            case INPOLL_DETACH_SUCCESS:
+                break;
+            case INPOLL_DETACH_NONEXISTENT:  // Attached by worker_initialize()
+                exit_with_error("This error is not expected to happen!");
+            }
+            event_finalize(&worker->wakeup);
+
+            debug("Tearing down socket readiness polling...");
+            inpoll_finalize(&worker->sockets);
+        }
+
+        debug("Tearing down the buffer allocator...");
+        buffer_allocator_finalize(&worker->buffers);
+
+        debug("Tearing down the command queue...");
+        command_queue_finalize(&worker->commands);
+
+        worker->context = NULL;
+    LOGGED_FUNCTION_END
+}
+
+
+#ifdef UDIPE_BUILD_TESTS
+    #include "memory.h"
+
+    void worker_unit_tests() {
+        LOGGED_FUNCTION_START_NO_PARAMS
+            info("Running worker unit tests...");
+
+            debug("Setting up a worker that only tracks idle periods...");
+            const udipe_duration_ns_t idle_spin = UDIPE_MILLISECOND / 100;
+            worker_t* const worker = realtime_allocate(sizeof(worker_t));
+            worker->idle_spin = idle_spin;
+            // Like worker_initialize()
+            worker->idle_period = idle_spin / 2;
+            ensure_eq(idle_spin_duration(worker), idle_spin);
+
+            debug("Checking that short idle periods keep spinning on...");
+            const udipe_duration_ns_t short_gap = idle_spin / 100;
+            for (size_t i = 0; i < 4 * IDLE_PERIOD_SMOOTHING; ++i) {
+                record_idle_period(worker, short_gap);
+                ensure_gt(idle_spin_duration(worker), (udipe_duration_ns_t)0);
+            }
+            ensure_lt(idle_spin_duration(worker), idle_spin);
+
+            debug("Checking that one long idle period keeps spinning on...");
+            const udipe_duration_ns_t long_gap = 1000 * idle_spin;
+            record_idle_period(worker, long_gap);
+            ensure_gt(idle_spin_duration(worker), (udipe_duration_ns_t)0);
+
+            debug("Checking that repeated long idle periods stop spinning...");
+            size_t num_long_gaps = 1;
+            while (idle_spin_duration(worker) > 0) {
+                ensure_lt(num_long_gaps, (size_t)(2 * IDLE_PERIOD_SMOOTHING));
+                record_idle_period(worker, long_gap);
+                ++num_long_gaps;
+            }
+            for (size_t i = 0; i < 4 * IDLE_PERIOD_SMOOTHING; ++i) {
+                record_idle_period(worker, long_gap);
+                ensure_eq(idle_spin_duration(worker), (udipe_duration_ns_t)0);
+            }
+
+            debug("Checking that short idle periods bring spinning back...");
+            size_t num_short_gaps = 0;
+            while (idle_spin_duration(worker) == 0) {
+                ensure_lt(num_short_gaps, (size_t)(2 * IDLE_PERIOD_SMOOTHING));
+                record_idle_period(worker, short_gap);
+                ++num_short_gaps;
+            }
+            for (size_t i = 0; i < 4 * IDLE_PERIOD_SMOOTHING; ++i) {
+                record_idle_period(worker, short_gap);
+                ensure_gt(idle_spin_duration(worker), (udipe_duration_ns_t)0);
+            }
+
+            realtime_liberate(worker, sizeof(worker_t));
+        LOGGED_FUNCTION_END
+    }
+#endif  // UDIPE_BUILD_TESTS
@@ -0,0 +1,545 @@
+#pragma once
+
+//! \file
+//! \brief Worker state
+//!
+//! This code module defines \ref worker_t, the state of a `libudipe` worker,
+//! which processes commands from client threads and drives the network
+//! engines that perform the actual UDP communication.
+//!
+//! Each worker runs on its own worker thread, which is managed by the \ref
+//! worker_pool_t of the \ref udipe_context_t. Client threads submit commands
+//! to a worker using worker_submit(), and the worker thread processes them
+//! inside of worker_run().
+//!
+//! Depending on \ref udipe_worker_config_t::io_backend, workers either wait for
+//! socket readiness with an \ref inpoll_t and then perform synchronous I/O
+//! system calls, or submit I/O operations to a \ref uring_t and wait for their
+//! completion.
+
+#include <udipe/buffer.h>
+#include <udipe/context.h>
+#include <udipe/duration.h>
+#include <udipe/future.h>
+#include <udipe/nodiscard.h>
+#include <udipe/pointer.h>
+#include <udipe/worker.h>
+
+#include "buffer.h"
+#include "command.h"
+#include "event.h"
+#include "inpoll.h"
+#include "recv.h"
+#include "send.h"
+#include "stopwatch.h"
+#include "uring.h"
+
+#include <hwloc.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/// Identifier of \ref worker_t::wakeup within \ref worker_t::sockets, or
+/// `user_data` of the operation that monitors it within \ref worker_t::ring
+///
+/// This cannot be mistaken for a connection, since connection sockets are
+/// attached with a non-`NULL` connection pointer as an identifier.
+#define WORKER_WAKEUP_ID ((uint64_t)0)
+
+/// Kind of io_uring operation that a completion queue entry is about
+///
+/// When the io_uring backend is used, the `user_data` of each operation is
+/// the bitwise OR of one of these tags and of a pointer to the associated
+/// connection (or, for emission, of a shifted message index). Connections are
+/// sufficiently aligned for the low-order bits of their address to be free.
+typedef enum worker_uring_tag_e {
+    /// Readability of \ref worker_t::wakeup
+    ///
+    /// The `user_data` of this operation is \ref WORKER_WAKEUP_ID.
+    WORKER_URING_WAKEUP = 0,
+
+    /// Reception of a datagram into a buffer from \ref worker_t::recv_ring
+    ///
+    WORKER_URING_RECV,
+
+    /// Readability of a connection's socket
+    ///
+    /// This is used instead of \ref WORKER_URING_RECV when the worker has run
+    /// out of buffers, see recv_prepare().
+    WORKER_URING_POLL,
+
+    /// Emission of a message, see send_flush()
+    ///
+    WORKER_URING_SEND,
+
+    /// Cancelation of another operation
+    ///
+    WORKER_URING_CANCEL,
+
+    /// Reception of any number of datagrams into buffers from \ref
+    /// worker_t::recv_ring
+    ///
+    /// This is used instead of \ref WORKER_URING_RECV by the \ref
+    /// UDIPE_IO_URING_MULTISHOT backend.
+    WORKER_URING_RECV_MULTISHOT,
+} worker_uring_tag_t;
+
+/// Mask that extracts the \ref worker_uring_tag_t from an io_uring `user_data`
+///
+#define WORKER_URING_TAG_MASK ((uint64_t)7)
+
+/// Number of bits that the emission message index is shifted by in the
+/// `user_data` of \ref WORKER_URING_SEND operations
+///
+#define WORKER_URING_TAG_BITS 3
+
+/// Number of submission queue entries of a worker's io_uring
+///
+#define WORKER_URING_ENTRIES 256u
+
+/// Buffer group identifier of \ref worker_t::recv_ring
+///
+#define WORKER_RECV_BUFFER_GROUP ((uint16_t)0)
+
+/// Out-of-band signal from \ref worker_t::control
+///
+/// Unlike commands, which are processed in FIFO order, these signals are
+/// noticed by the worker thread between two batches of commands, see \ref
+/// WORKER_COMMAND_BATCH. Several signals may be raised at once by OR-ing them.
+typedef enum worker_control_e {
+    /// The worker thread should exit worker_run(), see worker_stop()
+    ///
+    /// This signal is never cleared.
+    WORKER_CONTROL_STOP = 1 << 0,
+
+    /// Some commands processed by the worker thread were canceled, see
+    /// worker_cancel()
+    ///
+    /// This signal is cleared by the worker thread as it checks for canceled
+    /// commands.
+    WORKER_CONTROL_CANCEL = 1 << 1,
+} worker_control_t;
+
+/// Maximal number of commands that worker_run() processes before it checks
+/// \ref worker_t::control
+///
+/// This bounds how long \ref worker_control_t signals wait behind a full
+/// command queue.
+#define WORKER_COMMAND_BATCH ((size_t)8)
+
+/// Maximal number of sibling workers that a worker may steal commands from
+///
+/// See \ref udipe_connect_options_t::enable_send_stealing.
+#define MAX_STEAL_VICTIMS ((size_t)64)
+
+/// Worker state
+///
+/// This struct holds all the state that a worker needs in order to process
+/// commands from client threads. Unlike most other structs from `libudipe`, it
+/// must be initialized with worker_initialize().
+///
+/// It is allocated by the worker thread with realtime_allocate(), so that it
+/// lives in locked memory on the worker's NUMA node. Client threads only
+/// access `commands`, `wakeup`, `control` and `sleeping`. Other workers only
+/// access `commands` and `stealing` when they steal commands, and `sleeping`
+/// and `wakeup` when a backed-up worker wakes them up so that they can help
+/// it.
+///
+/// Which of `sockets` and `ring` is used to wait for network activity depends
+/// on `io_backend`.
+typedef struct worker_s {
+    /// Commands submitted by client threads
+    ///
+    /// This comes first so that it sits on its own memory page, away from the
+    /// worker-private state below.
+    command_queue_t commands;
+
+    /// Event that is signaled when the worker thread should look at its
+    /// command queue or `control` word, or at the command queues of sibling
+    /// workers that are backed up
+    ///
+    /// This event is attached to `sockets` (or monitored by `ring`) with the
+    /// \ref WORKER_WAKEUP_ID identifier, so that worker_poll() returns when it
+    /// is signaled.
+    event_t wakeup;
+
+    /// Out-of-band signals to the worker thread
+    ///
+    /// This is a bitwise OR of \ref worker_control_t flags.
+    atomic_uint control;
+
+    /// Truth that the worker thread may be blocked waiting for network
+    /// activity or `wakeup`
+    ///
+    /// Client threads only need to signal `wakeup` when this is set, which
+    /// saves them a system call when the worker thread is busy or spinning.
+    /// Setting this flag and checking `commands` and `control` on the worker
+    /// side, like updating these and checking this flag on the client side,
+    /// must be separated by a sequentially consistent fence so that either the
+    /// worker thread notices the client's update or the client wakes it up.
+    ///
+    /// Backed-up sibling workers also check this flag to find a worker that
+    /// could help them. They do not need such a fence, as a missed wakeup only
+    /// means that they get no help this time.
+    atomic_bool sleeping;
+
+    /// Truth that another worker is stealing a command from `commands`
+    ///
+    /// Thieves raise this flag before taking a command out of the queue, and
+    /// clear it once they hold a reference to the target connection, see \ref
+    /// udipe_connection_t::num_refs. This lets the owner of a connection make
+    /// sure that no steal is in flight before it drops its own reference to a
+    /// connection. It also ensures that there is only one thief at a time.
+    atomic_bool stealing;
+
+    /// udipe context that this worker belongs to
+    ///
+    udipe_context_t* context;
+
+    /// Allocator of datagram buffers
+    ///
+    /// All datagrams that are received or sent by this worker transit through
+    /// buffers from this allocator, which is configured for optimal cache
+    /// locality on the CPU core that the worker runs on.
+    buffer_allocator_t buffers;
+
+    /// Readability notifications from connection sockets
+    ///
+    /// Connection sockets are attached to this \ref inpoll_t, with the
+    /// connection pointer as an identifier, while they have pending receive
+    /// commands or an active reception stream. `wakeup` is permanently
+    /// attached too.
+    ///
+    /// This is only used by the \ref UDIPE_IO_EPOLL backend.
+    inpoll_t sockets;
+
+    /// I/O backend that this worker uses
+    ///
+    /// This is never \ref UDIPE_IO_DEFAULT. Use worker_uses_uring() to tell
+    /// whether `ring` is valid.
+    udipe_io_backend_t io_backend;
+
+    /// io_uring that I/O operations are submitted to
+    ///
+    /// Readability of `wakeup` is monitored with a poll operation tagged with
+    /// \ref WORKER_URING_WAKEUP, and the other operations are tagged as
+    /// described in \ref worker_uring_tag_t.
+    ///
+    /// This is only valid if worker_uses_uring() is true.
+    uring_t ring;
+
+    /// Worker buffers that are provided to the kernel for io_uring reception
+    ///
+    /// The identifier of each buffer is its index within the memory pool of
+    /// `buffers`. recv_prepare() keeps this ring topped up.
+    ///
+    /// This is only valid if worker_uses_uring() is true.
+    uring_buffer_ring_t recv_ring;
+
+    /// Truth that each buffer from `buffers` is currently in `recv_ring`
+    ///
+    /// Buffers are designated by their index within the memory pool.
+    bool recv_ring_buffers[UDIPE_MAX_BUFFERS];
+
+    /// Number of buffers that are currently in `recv_ring`
+    ///
+    size_t recv_ring_len;
+
+    /// Stopwatch used to update the timeout of pending commands
+    ///
+    stopwatch_t clock;
+
+    /// Longest time during which the worker loop was unable to react to
+    /// network activity so far
+    ///
+    /// This is the maximum of the time spent processing between two waits for
+    /// network activity, and of the extra time that a wait took beyond its
+    /// requested timeout because the worker thread was not scheduled in time.
+    /// It is measured by worker_poll() and used to size receive buffers, see
+    /// \ref udipe_connect_options_t::recv_rate.
+    udipe_duration_ns_t max_latency;
+
+    /// Maximal idle spinning time
+    ///
+    /// This is \ref udipe_worker_config_t::idle_spin, or 0 if the worker
+    /// thread should block as soon as it runs out of work.
+    udipe_duration_ns_t idle_spin;
+
+    /// Sibling workers that this worker may steal commands from
+    ///
+    /// These workers belong to the same worker class and run on CPU cores that
+    /// share a cache with this worker's. This list is only valid once
+    /// `steal_victims_known` is set.
+    worker_t* steal_victims[MAX_STEAL_VICTIMS];
+
+    /// Number of valid entries at the start of `steal_victims`
+    ///
+    size_t num_steal_victims;
+
+    /// Truth that `steal_victims` has been queried from the worker pool
+    ///
+    /// This cannot be done until all worker threads have started.
+    bool steal_victims_known;
+
+    /// Moving average of the time that the worker thread stays idle
+    ///
+    /// This is measured by worker_poll() whenever it has to wait for network
+    /// activity or new commands, and used to decide how long it should spin
+    /// before blocking. It is only tracked if `idle_spin` is nonzero.
+    udipe_duration_ns_t idle_period;
+
+    /// Receive commands that could not be completed immediately
+    ///
+    /// Entries are ordered by submission time, so that receive commands
+    /// targeting a particular connection are completed in order.
+    pending_recv_t pending_recvs[MAX_PENDING_RECVS];
+
+    /// Number of valid entries at the start of `pending_recvs`
+    ///
+    size_t num_pending_recvs;
+
+    /// Connections with an active reception stream
+    ///
+    /// This list is used to periodically check whether reception streams have
+    /// been canceled, which must be done even if no datagram comes in.
+    udipe_connection_t* recv_streams[MAX_RECV_STREAMS];
+
+    /// Number of valid entries at the start of `recv_streams`
+    ///
+    size_t num_recv_streams;
+
+    /// Send commands that are queued for emission by send_flush()
+    ///
+    /// Entries are ordered by submission time, so that datagrams targeting a
+    /// particular connection are sent in order.
+    pending_send_t pending_sends[MAX_PENDING_SENDS];
+
+    /// Number of valid entries at the start of `pending_sends`
+    ///
+    size_t num_pending_sends;
+
+    /// Worker buffers from completed send commands that the kernel may still
+    /// be reading from due to zero-copy emission
+    ///
+    /// These are liberated by send_flush() once the kernel reports that it
+    /// is done with them. As each entry holds a worker buffer, there cannot be
+    /// more than \ref UDIPE_MAX_BUFFERS of them.
+    zerocopy_buffer_t zerocopy_buffers[UDIPE_MAX_BUFFERS];
+
+    /// Number of valid entries at the start of `zerocopy_buffers`
+    ///
+    size_t num_zerocopy_buffers;
+
+    /// Emission streams that are active on this worker's connections
+    ///
+    send_stream_t send_streams[MAX_SEND_STREAMS];
+
+    /// Number of valid entries at the start of `send_streams`
+    ///
+    size_t num_send_streams;
+} worker_t;
+
+/// Truth that a worker uses one of the io_uring backends
+///
+/// \param worker must be a worker that was set up with worker_initialize().
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static inline bool worker_uses_uring(const worker_t* worker) {
+    return worker->io_backend == UDIPE_IO_URING
+           || worker->io_backend == UDIPE_IO_URING_MULTISHOT;
+}
+
+/// Set up a worker
+///
+/// This function must be called by the worker thread, after it has been pinned
+/// to its CPU core(s), since the buffer allocator is tuned for the CPU cores
+/// that the calling thread may run on. It must be called within a logging
+/// scope.
+///
+/// \param worker must point to uninitialized storage for a worker.
+/// \param context must be the udipe context that this worker belongs to.
+/// \param buffer_configurator configures the worker's buffer allocator, see
+///                            \ref udipe_buffer_configurator_t.
+/// \param io_backend is the I/O backend that the worker should use. It must
+///                   not be \ref UDIPE_IO_DEFAULT.
+/// \param idle_spin is the maximal time that the worker should spend spinning
+///                  when it runs out of work, see \ref
+///                  udipe_worker_config_t::idle_spin.
+/// \param topology is the hwloc topology of the host system.
+UDIPE_NON_NULL_SPECIFIC_ARGS(1, 2)
+void worker_initialize(worker_t* worker,
+                       udipe_context_t* context,
+                       udipe_buffer_configurator_t buffer_configurator,
+                       udipe_io_backend_t io_backend,
+                       udipe_duration_ns_t idle_spin,
+                       hwloc_topology_t topology);
+
+/// Process a command
+///
+/// Commands that can be processed right away will be completed before this
+/// function returns. Others will be completed by subsequent calls to
+/// worker_poll().
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a worker that was set up with worker_initialize()
+///               and has not been finalized with worker_finalize() yet.
+/// \param command must be a command whose future has been allocated with
+///                future_network_allocate(), or whose future is `NULL` because
+///                its cancelation was acknowledged while it was queued, see
+///                worker_cancel() and process_cancelations(). The latter
+///                commands are ignored.
+UDIPE_NON_NULL_ARGS
+void worker_execute(worker_t* worker, const command_t* command);
+
+/// Wait for network activity and process it
+///
+/// This starts by handing over queued datagrams to the operating system. It
+/// then waits until either a connection with pending commands is ready for
+/// I/O, a pending command times out, a command is submitted, or `max_wait`
+/// elapses. It then processes whatever happened, which may result in some
+/// pending commands completing.
+///
+/// Depending on \ref worker_t::idle_spin, the worker thread may spin for a
+/// while before it blocks, see \ref udipe_worker_config_t::idle_spin.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a worker that was set up with worker_initialize()
+///               and has not been finalized with worker_finalize() yet.
+/// \param max_wait is the maximal amount of time to wait for network activity.
+///                 It must not be \ref UDIPE_DURATION_DEFAULT.
+UDIPE_NON_NULL_ARGS
+void worker_poll(worker_t* worker, udipe_duration_ns_t max_wait);
+
+/// Process an io_uring completion
+///
+/// This is called by worker_poll() for every completion that it collects, but
+/// also by the reception and emission engines when they need to wait for the
+/// completion of specific operations, in which case they must forward the
+/// completions that are not theirs to this function.
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a worker that uses an io_uring backend.
+/// \param completion must be a completion from `worker->ring` that is not
+///                   tagged with \ref WORKER_URING_SEND.
+UDIPE_NON_NULL_ARGS
+void worker_complete(worker_t* worker, const struct io_uring_cqe* completion);
+
+/// Drop a reference to a connection, closing it if this was the last one
+///
+/// See \ref udipe_connection_t::num_refs. If the connection is closed, the
+/// client that requested it is notified via \ref
+/// udipe_connection_t::disconnect_future.
+///
+/// This function must be called within a logging scope.
+///
+/// \param connection must be a connection that the caller holds a reference
+///                   to. It must not be used after calling this function.
+UDIPE_NON_NULL_ARGS
+void worker_release_connection(udipe_connection_t* connection);
+
+/// Submit a command to a worker
+///
+/// This enqueues the command into the worker's command queue, then wakes up
+/// the worker thread if it is sleeping. The command will be processed
+/// asynchronously by worker_run(). If the command queue is full, this blocks
+/// until the worker thread has caught up.
+///
+/// This function may be called by any thread, within a logging scope.
+///
+/// \param worker must be a worker whose thread is running worker_run().
+/// \param command must be a command whose future has been allocated with
+///                future_network_allocate().
+UDIPE_NON_NULL_ARGS
+void worker_submit(worker_t* worker, const command_t* command);
+
+/// Submit several commands to a worker
+///
+/// This is a batched version of worker_submit(), which enqueues commands into
+/// the worker's command queue with as few lock acquisitions and worker thread
+/// wakeups as possible, i.e. at most one per call if the command queue has room
+/// for all commands. If the command queue fills up, the worker thread is woken
+/// up if needed and this function blocks until it has caught up.
+///
+/// This function may be called by any thread, within a logging scope.
+///
+/// \param worker must be a worker whose thread is running worker_run().
+/// \param commands is an array of `num_commands` commands that should be
+///                 processed in order. Their futures must have been allocated
+///                 with future_network_allocate().
+/// \param num_commands is the number of commands within `commands`.
+UDIPE_NON_NULL_ARGS
+void worker_submit_batch(worker_t* worker,
+                         const command_t commands[],
+                         size_t num_commands);
+
+/// Process commands and network activity until worker_stop() is called
+///
+/// This is the main loop of a worker thread. It alternates between processing
+/// all queued commands with worker_execute() and waiting for network activity
+/// or new commands with worker_poll(). When it runs out of commands, it may
+/// also steal send commands from sibling workers, see \ref
+/// udipe_connect_options_t::enable_send_stealing.
+///
+/// Queued commands are processed in batches of \ref WORKER_COMMAND_BATCH, and
+/// \ref worker_t::control is checked before each batch.
+///
+/// This function must be called by the worker thread, within a logging scope.
+///
+/// \param worker must be a worker that was set up with worker_initialize()
+///               and has not been finalized with worker_finalize() yet.
+UDIPE_NON_NULL_ARGS
+void worker_run(worker_t* worker);
+
+/// Tell a worker thread that some of its commands were canceled
+///
+/// This raises \ref WORKER_CONTROL_CANCEL, which the worker thread notices
+/// within one batch of commands even if its command queue is full. It then
+/// acknowledges canceled commands that are still queued, along with canceled
+/// commands that it started processing.
+///
+/// This function may be called by any thread, within a logging scope.
+///
+/// \param worker must be a worker whose thread is running worker_run().
+UDIPE_NON_NULL_ARGS
+void worker_cancel(worker_t* worker);
+
+/// Ask a worker thread to exit worker_run()
+///
+/// This raises \ref WORKER_CONTROL_STOP, which the worker thread notices
+/// within one batch of commands, without processing the rest of its command
+/// queue. Since udipe_finalize() may only be called once all futures have
+/// been finished, the only commands that may still be queued at this point are
+/// canceled commands, which the worker thread acknowledges before exiting. No
+/// command should be submitted after calling this function.
+///
+/// This function may be called by any thread, within a logging scope.
+///
+/// \param worker must be a worker whose thread is running worker_run().
+UDIPE_NON_NULL_ARGS
+void worker_stop(worker_t* worker);
+
+/// Destroy a worker
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker must be a worker that was set up with worker_initialize(),
+///               has not been finalized with worker_finalize() yet, and has no
+///               pending commands. It cannot be used after calling this
+///               function.
+UDIPE_NON_NULL_ARGS
+void worker_finalize(worker_t* worker);
+
+
+#ifdef UDIPE_BUILD_TESTS
+    /// Unit tests for workers
+    ///
+    /// This function runs the unit tests for the parts of workers that can be
+    /// tested without a worker thread, such as the adaptive idle spinning
+    /// heuristic. It must be called within a logging scope.
+    void worker_unit_tests();
+#endif
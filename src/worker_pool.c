@@ -0,0 +1,552 @@
+#include "worker_pool.h"
+
+#include "command.h"
+#include "context.h"
+#include "error.h"
+#include "log.h"
+#include "memory.h"
+#include "thread_name.h"
+#include "worker.h"
+
+#include <assert.h>
+#include <hwloc.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+
+
+/// Determine which CPUs worker threads may run on
+///
+/// This function must be called within a logging scope.
+///
+/// \param topology is the hwloc topology of the host system.
+/// \param config is the user's worker thread configuration.
+///
+/// \returns a non-empty cpuset that must be liberated with hwloc_bitmap_free().
+UDIPE_NODISCARD
+UDIPE_NON_NULL_RESULT
+static hwloc_cpuset_t selected_cpus(hwloc_topology_t topology,
+                                    udipe_worker_config_t config) {
+    LOGGED_FUNCTION_START("%p, { \"%s\", %zu }",
+                          topology,
+                          config.cpus ? config.cpus : "(null)",
+                          config.max_workers)
+        debug("Querying the CPUs that the process may run on...");
+        hwloc_cpuset_t selection = hwloc_bitmap_alloc();
+        exit_on_null(selection, "Failed to allocate worker cpuset!");
+        exit_on_negative(hwloc_get_cpubind(topology,
+                                           selection,
+                                           HWLOC_CPUBIND_PROCESS),
+                         "Failed to query process CPU binding!");
+        exit_on_negative(
+            hwloc_bitmap_and(selection,
+                             selection,
+                             hwloc_topology_get_allowed_cpuset(topology)),
+            "Failed to restrict process CPU binding to allowed CPUs!"
+        );
+
+        if (config.cpus) {
+            debugf("Restricting them to user-selected CPUs %s...", config.cpus);
+            hwloc_cpuset_t requested = hwloc_bitmap_alloc();
+            exit_on_null(requested, "Failed to allocate requested cpuset!");
+            if (hwloc_bitmap_list_sscanf(requested, config.cpus) < 0) {
+                exit_with_error("Failed to parse udipe_worker_config_t::cpus!");
+            }
+            exit_on_negative(hwloc_bitmap_and(selection, selection, requested),
+                             "Failed to apply user CPU selection!");
+            hwloc_bitmap_free(requested);
+        }
+
+        if (hwloc_bitmap_iszero(selection)) {
+            exit_with_error("No usable CPU was selected for worker threads!");
+        }
+        if (log_enabled(UDIPE_DEBUG)) {
+            char* cpuset_str;
+            exit_on_negative(hwloc_bitmap_list_asprintf(&cpuset_str, selection),
+                             "Failed to display worker CPU selection!");
+            debugf("Worker threads may run on CPU(s) %s.", cpuset_str);
+            free(cpuset_str);
+        }
+        return selection;
+    LOGGED_FUNCTION_END
+}
+
+/// Query the configuration of a worker class
+///
+/// \param config is the configuration that was passed to udipe_initialize().
+/// \param class_idx is the index of a worker class, which must be smaller than
+///                  `config->num_worker_classes + 1`.
+///
+/// \returns the configuration of the worker class at index `class_idx`.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static udipe_worker_class_config_t class_config(const udipe_config_t* config,
+                                                size_t class_idx) {
+    if (class_idx == 0) {
+        return (udipe_worker_class_config_t){
+            .buffer = config->buffer,
+            .workers = config->workers
+        };
+    }
+    assert(class_idx <= config->num_worker_classes);
+    return config->worker_classes[class_idx - 1];
+}
+
+/// Kind of hwloc object that worker threads are spawned on
+///
+/// \param topology is the hwloc topology of the host system.
+///
+/// \returns `HWLOC_OBJ_CORE` if hwloc knows about CPU cores, otherwise
+///          `HWLOC_OBJ_PU`.
+UDIPE_NODISCARD
+static hwloc_obj_type_t core_type(hwloc_topology_t topology) {
+    // hwloc may not know about CPU cores on some exotic systems, in which
+    // case we have no choice but to treat every hardware thread as a core.
+    return (hwloc_get_nbobjs_by_type(topology, HWLOC_OBJ_CORE) > 0)
+               ? HWLOC_OBJ_CORE
+               : HWLOC_OBJ_PU;
+}
+
+/// Worker thread entry point
+///
+/// \param arg must point to the \ref worker_thread_t of this thread.
+///
+/// \returns 0 once worker_stop() has been called and the worker is torn down.
+static int worker_thread_main(void* arg) {
+    worker_thread_t* const thread = (worker_thread_t*)arg;
+    worker_pool_t* const pool = thread->pool;
+    udipe_context_t* const context = pool->context;
+    LOGGER_START(&context->logger)
+        debug("Naming the worker thread...");
+        char name[MAX_THREAD_NAME_LEN + 1];
+        snprintf(name, sizeof(name), "udipe_wk_%zu", thread->index);
+        set_thread_name(name);
+
+        debug("Pinning the worker thread...");
+        exit_on_negative(hwloc_set_cpubind(context->topology,
+                                           thread->cpuset,
+                                           HWLOC_CPUBIND_THREAD
+                                           | HWLOC_CPUBIND_STRICT),
+                         "Failed to pin a worker thread");
+
+        debug("Setting up the worker in NUMA-local locked memory...");
+        const worker_class_t* const worker_class =
+            &pool->classes[thread->worker_class];
+        worker_t* const worker = realtime_allocate(sizeof(worker_t));
+        worker_initialize(worker,
+                          context,
+                          worker_class->buffer_configurator,
+                          worker_class->io_backend,
+                          worker_class->idle_spin,
+                          context->topology);
+
+        debug("Announcing that the worker is ready...");
+        exit_on_thread_error(mtx_lock(&pool->startup_mutex),
+                             "Failed to lock the startup mutex");
+        thread->worker = worker;
+        ++(pool->num_ready);
+        exit_on_thread_error(cnd_signal(&pool->startup_condition),
+                             "Failed to signal the startup condition");
+        exit_on_thread_error(mtx_unlock(&pool->startup_mutex),
+                             "Failed to unlock the startup mutex");
+
+        debug("Processing commands...");
+        worker_run(worker);
+
+        debug("Waiting for sibling workers to stop stealing commands...");
+        exit_on_thread_error(mtx_lock(&pool->startup_mutex),
+                             "Failed to lock the startup mutex");
+        ++(pool->num_stopped);
+        exit_on_thread_error(cnd_broadcast(&pool->shutdown_condition),
+                             "Failed to signal the shutdown condition");
+        while (pool->num_stopped < pool->num_workers) {
+            exit_on_thread_error(cnd_wait(&pool->shutdown_condition,
+                                          &pool->startup_mutex),
+                                 "Failed to wait for sibling workers");
+        }
+        exit_on_thread_error(mtx_unlock(&pool->startup_mutex),
+                             "Failed to unlock the startup mutex");
+
+        debug("Tearing down the worker...");
+        worker_finalize(worker);
+        realtime_liberate(worker, sizeof(worker_t));
+    LOGGER_END
+    return 0;
+}
+
+/// Set up a worker class and count its worker threads
+///
+/// The worker threads of the class are not set up yet, see
+/// setup_class_threads().
+///
+/// This function must be called within a logging scope.
+///
+/// \param worker_class must point to uninitialized storage for a worker
+///                     class.
+/// \param topology is the hwloc topology of the host system.
+/// \param config is the configuration of this worker class.
+/// \param first_thread is the index that the first worker thread of this
+///                     class will have within \ref worker_pool_t::threads.
+///
+/// \returns the CPUs that the worker threads of this class may run on, which
+///          must be liberated with hwloc_bitmap_free().
+UDIPE_NODISCARD
+UDIPE_NON_NULL_SPECIFIC_ARGS(1)
+UDIPE_NON_NULL_RESULT
+static hwloc_cpuset_t initialize_class(worker_class_t* worker_class,
+                                       hwloc_topology_t topology,
+                                       udipe_worker_class_config_t config,
+                                       size_t first_thread) {
+    LOGGED_FUNCTION_START("%p, %p, { { %p, %p }, { \"%s\", %zu, %d, %zu } }, "
+                          "%zu",
+                          worker_class,
+                          topology,
+                          config.buffer.callback,
+                          config.buffer.context,
+                          config.workers.cpus ? config.workers.cpus : "(null)",
+                          config.workers.max_workers,
+                          config.workers.io_backend,
+                          (size_t)config.workers.idle_spin,
+                          first_thread)
+        worker_class->buffer_configurator = config.buffer;
+        switch (config.workers.io_backend) {
+        case UDIPE_IO_DEFAULT:
+            worker_class->io_backend = UDIPE_IO_EPOLL;
+            break;
+        case UDIPE_IO_EPOLL:
+        case UDIPE_IO_URING:
+        case UDIPE_IO_URING_MULTISHOT:
+            worker_class->io_backend = config.workers.io_backend;
+            break;
+        default:
+            exit_with_error("Invalid udipe_worker_config_t::io_backend!");
+        }
+        if (config.workers.idle_spin > UDIPE_SECOND) {
+            exit_with_error("udipe_worker_config_t::idle_spin should not be "
+                            "longer than one second!");
+        }
+        worker_class->idle_spin = config.workers.idle_spin;
+        worker_class->first_thread = first_thread;
+        atomic_init(&worker_class->next_worker, 0);
+
+        debug("Selecting CPUs...");
+        hwloc_cpuset_t selection = selected_cpus(topology, config.workers);
+
+        debug("Counting the CPU cores that contain selected CPUs...");
+        const hwloc_obj_type_t type = core_type(topology);
+        size_t num_cores = 0;
+        for (hwloc_obj_t core = hwloc_get_next_obj_by_type(topology,
+                                                           type,
+                                                           NULL);
+             core;
+             core = hwloc_get_next_obj_by_type(topology, type, core)) {
+            if (hwloc_bitmap_intersects(core->cpuset, selection)) ++num_cores;
+        }
+        ensure_gt(num_cores, (size_t)0);
+        worker_class->num_workers = num_cores;
+        if (config.workers.max_workers != 0
+            && config.workers.max_workers < num_cores) {
+            worker_class->num_workers = config.workers.max_workers;
+        }
+        return selection;
+    LOGGED_FUNCTION_END
+}
+
+/// Find the outermost CPU cache of a CPU core
+///
+/// \param core is a CPU core, or a hardware thread if hwloc does not know
+///             about CPU cores.
+///
+/// \returns the outermost cache object above `core`, or `NULL` if hwloc does
+///          not know about CPU caches.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static hwloc_obj_t outermost_cache(hwloc_obj_t core) {
+    hwloc_obj_t cache = NULL;
+    for (hwloc_obj_t obj = core->parent; obj; obj = obj->parent) {
+        if (hwloc_obj_type_is_cache(obj->type)) cache = obj;
+    }
+    return cache;
+}
+
+/// Set up the descriptors of the worker threads of a worker class
+///
+/// This function must be called within a logging scope.
+///
+/// \param pool must be a worker pool whose `threads` have been allocated.
+/// \param class_idx is the index of a worker class from `pool`, which must
+///                  have been set up with initialize_class().
+/// \param selection is the cpuset that initialize_class() returned for this
+///                  worker class.
+UDIPE_NON_NULL_ARGS
+static void setup_class_threads(worker_pool_t* pool,
+                                size_t class_idx,
+                                hwloc_const_cpuset_t selection) {
+    LOGGED_FUNCTION_START("%p, %zu, %p", pool, class_idx, selection)
+        hwloc_topology_t topology = pool->context->topology;
+        const worker_class_t* const worker_class = &pool->classes[class_idx];
+        const hwloc_obj_type_t type = core_type(topology);
+        const size_t end_idx =
+            worker_class->first_thread + worker_class->num_workers;
+        size_t thread_idx = worker_class->first_thread;
+        for (hwloc_obj_t core = hwloc_get_next_obj_by_type(topology,
+                                                           type,
+                                                           NULL);
+             core && thread_idx < end_idx;
+             core = hwloc_get_next_obj_by_type(topology, type, core)) {
+            if (!hwloc_bitmap_intersects(core->cpuset, selection)) continue;
+            worker_thread_t* const thread = &pool->threads[thread_idx];
+            thread->cpuset = hwloc_bitmap_alloc();
+            exit_on_null(thread->cpuset, "Failed to allocate worker cpuset!");
+            exit_on_negative(hwloc_bitmap_and(thread->cpuset,
+                                              core->cpuset,
+                                              selection),
+                             "Failed to compute worker cpuset!");
+            thread->cache = outermost_cache(core);
+            thread->worker = NULL;
+            thread->index = thread_idx;
+            thread->worker_class = class_idx;
+            thread->pool = pool;
+            ++thread_idx;
+        }
+        ensure_eq(thread_idx, end_idx);
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void worker_pool_initialize(worker_pool_t* pool,
+                            udipe_context_t* context,
+                            const udipe_config_t* config) {
+    LOGGED_FUNCTION_START("%p, %p, %p", pool, context, config)
+        pool->context = context;
+        if (config->num_worker_classes >= UDIPE_MAX_WORKER_CLASSES) {
+            exit_with_error("Too many worker classes in "
+                            "udipe_config_t::worker_classes!");
+        }
+        if (config->num_worker_classes > 0 && !config->worker_classes) {
+            exit_with_error("udipe_config_t::worker_classes should not be NULL "
+                            "when num_worker_classes is nonzero!");
+        }
+        pool->num_classes = config->num_worker_classes + 1;
+
+        debugf("Setting up %zu worker class(es)...", pool->num_classes);
+        pool->classes = calloc(pool->num_classes, sizeof(worker_class_t));
+        exit_on_null(pool->classes, "Failed to allocate worker classes!");
+        hwloc_cpuset_t* const selections =
+            calloc(pool->num_classes, sizeof(hwloc_cpuset_t));
+        exit_on_null(selections, "Failed to allocate worker class cpusets!");
+        pool->num_workers = 0;
+        for (size_t i = 0; i < pool->num_classes; ++i) {
+            selections[i] = initialize_class(&pool->classes[i],
+                                             context->topology,
+                                             class_config(config, i),
+                                             pool->num_workers);
+            pool->num_workers += pool->classes[i].num_workers;
+            infof("Will spawn %zu worker thread(s) for worker class %zu.",
+                  pool->classes[i].num_workers, i);
+        }
+
+        debug("Allocating worker thread descriptors...");
+        pool->threads = calloc(pool->num_workers, sizeof(worker_thread_t));
+        exit_on_null(pool->threads, "Failed to allocate worker threads!");
+        for (size_t i = 0; i < pool->num_classes; ++i) {
+            setup_class_threads(pool, i, selections[i]);
+            hwloc_bitmap_free(selections[i]);
+        }
+        free(selections);
+
+        debug("Spawning worker threads...");
+        pool->num_ready = 0;
+        pool->num_stopped = 0;
+        exit_on_thread_error(mtx_init(&pool->startup_mutex, mtx_plain),
+                             "Failed to initialize the startup mutex");
+        exit_on_thread_error(cnd_init(&pool->startup_condition),
+                             "Failed to initialize the startup condition");
+        exit_on_thread_error(cnd_init(&pool->shutdown_condition),
+                             "Failed to initialize the shutdown condition");
+        for (size_t i = 0; i < pool->num_workers; ++i) {
+            exit_on_thread_error(thrd_create(&pool->threads[i].thread,
+                                             worker_thread_main,
+                                             &pool->threads[i]),
+                                 "Failed to spawn a worker thread");
+        }
+
+        debug("Waiting for worker threads to be ready...");
+        exit_on_thread_error(mtx_lock(&pool->startup_mutex),
+                             "Failed to lock the startup mutex");
+        while (pool->num_ready < pool->num_workers) {
+            exit_on_thread_error(cnd_wait(&pool->startup_condition,
+                                          &pool->startup_mutex),
+                                 "Failed to wait for worker threads");
+        }
+        exit_on_thread_error(mtx_unlock(&pool->startup_mutex),
+                             "Failed to unlock the startup mutex");
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+worker_t* worker_pool_select(worker_pool_t* pool, size_t worker_class) {
+    LOGGED_FUNCTION_START("%p, %zu", pool, worker_class)
+        if (worker_class >= pool->num_classes) {
+            debugf("There is no worker class %zu, will use worker class 0 "
+                   "so that the command gets rejected.", worker_class);
+            worker_class = 0;
+        }
+        worker_class_t* const selected_class = &pool->classes[worker_class];
+        const size_t counter =
+            atomic_fetch_add_explicit(&selected_class->next_worker,
+                                      1,
+                                      memory_order_relaxed);
+
+        // Starting from the round-robin position breaks ties fairly
+        debug("Looking for the least loaded worker...");
+        size_t worker_idx = SIZE_MAX;
+        size_t min_queued = SIZE_MAX;
+        for (size_t i = 0; i < selected_class->num_workers; ++i) {
+            const size_t idx = selected_class->first_thread
+                             + (counter + i) % selected_class->num_workers;
+            const size_t num_queued =
+                command_queue_len(&pool->threads[idx].worker->commands);
+            if (num_queued < min_queued) {
+                worker_idx = idx;
+                min_queued = num_queued;
+                if (num_queued == 0) break;
+            }
+        }
+        tracef("Selected worker #%zu with %zu queued command(s).",
+               worker_idx, min_queued);
+        return pool->threads[worker_idx].worker;
+    LOGGED_FUNCTION_END
+}
+
+/// Find the position of a worker within a worker pool
+///
+/// This function must be called within a logging scope.
+///
+/// \param pool must be a worker pool that was set up with
+///             worker_pool_initialize() and hasn't been destroyed with
+///             worker_pool_finalize() yet.
+/// \param worker must be a worker from `pool`.
+///
+/// \returns the index of the \ref worker_thread_t of `worker` within
+///          `pool->threads`.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+static size_t worker_index(worker_pool_t* pool, worker_t* worker) {
+    LOGGED_FUNCTION_START("%p, %p", pool, worker)
+        for (size_t i = 0; i < pool->num_workers; ++i) {
+            if (pool->threads[i].worker == worker) return i;
+        }
+        exit_with_error("Worker does not belong to this pool!");
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+worker_t* worker_pool_neighbor(worker_pool_t* pool,
+                               worker_t* worker,
+                               size_t offset) {
+    LOGGED_FUNCTION_START("%p, %p, %zu", pool, worker, offset)
+        const size_t worker_idx = worker_index(pool, worker);
+        const worker_class_t* const worker_class =
+            &pool->classes[pool->threads[worker_idx].worker_class];
+        const size_t neighbor_idx =
+            worker_class->first_thread
+            + (worker_idx - worker_class->first_thread + offset)
+              % worker_class->num_workers;
+        tracef("Worker #%zu is %zu position(s) after worker #%zu.",
+               neighbor_idx, offset, worker_idx);
+        return pool->threads[neighbor_idx].worker;
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+bool worker_pool_cache_siblings(worker_pool_t* pool,
+                                worker_t* worker,
+                                worker_t* siblings[],
+                                size_t max_siblings,
+                                size_t* num_siblings) {
+    LOGGED_FUNCTION_START("%p, %p, %p, %zu, %p",
+                          pool, worker, siblings, max_siblings, num_siblings)
+        debug("Checking that all worker threads have started...");
+        exit_on_thread_error(mtx_lock(&pool->startup_mutex),
+                             "Failed to lock the startup mutex");
+        const bool ready = pool->num_ready == pool->num_workers;
+        exit_on_thread_error(mtx_unlock(&pool->startup_mutex),
+                             "Failed to unlock the startup mutex");
+        if (!ready) {
+            debug("Some worker threads are still starting up.");
+            return false;
+        }
+
+        debug("Collecting workers of the same class that share a cache...");
+        const size_t worker_idx = worker_index(pool, worker);
+        const worker_thread_t* const thread = &pool->threads[worker_idx];
+        const worker_class_t* const worker_class =
+            &pool->classes[thread->worker_class];
+        *num_siblings = 0;
+        for (size_t i = worker_class->first_thread;
+             thread->cache
+             && i < worker_class->first_thread + worker_class->num_workers
+             && *num_siblings < max_siblings;
+             ++i) {
+            if (i == worker_idx || pool->threads[i].cache != thread->cache) {
+                continue;
+            }
+            siblings[(*num_siblings)++] = pool->threads[i].worker;
+        }
+        debugf("Found %zu sibling worker(s).", *num_siblings);
+        return true;
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+hwloc_const_cpuset_t worker_pool_cpuset(worker_pool_t* pool,
+                                        worker_t* worker) {
+    LOGGED_FUNCTION_START("%p, %p", pool, worker)
+        return pool->threads[worker_index(pool, worker)].cpuset;
+    LOGGED_FUNCTION_END
+}
+
+UDIPE_NON_NULL_ARGS
+void worker_pool_finalize(worker_pool_t* pool) {
+    LOGGED_FUNCTION_START("%p", pool)
+        debug("Asking worker threads to stop...");
+        for (size_t i = 0; i < pool->num_workers; ++i) {
+            worker_stop(pool->threads[i].worker);
+        }
+
+        debug("Waiting for worker threads to exit...");
+        for (size_t i = 0; i < pool->num_workers; ++i) {
+            worker_thread_t* const thread = &pool->threads[i];
+            int result;
+            exit_on_thread_error(thrd_join(thread->thread, &result),
+                                 "Failed to join a worker thread");
+            ensure_eq(result, 0);
+            thread->worker = NULL;
+            hwloc_bitmap_free(thread->cpuset);
+            thread->cpuset = NULL;
+        }
+
+        debug("Liberating worker thread descriptors...");
+        cnd_destroy(&pool->shutdown_condition);
+        cnd_destroy(&pool->startup_condition);
+        mtx_destroy(&pool->startup_mutex);
+        free(pool->threads);
+        pool->threads = NULL;
+        pool->num_workers = 0;
+        free(pool->classes);
+        pool->classes = NULL;
+        pool->num_classes = 0;
+        pool->context = NULL;
+    LOGGED_FUNCTION_END
+}
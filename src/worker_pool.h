@@ -0,0 +1,297 @@
+#pragma once
+
+//! \file
+//! \brief Worker thread pool
+//!
+//! This code module implements \ref worker_pool_t, the set of worker threads
+//! that a \ref udipe_context_t uses to process network commands.
+//!
+//! Worker threads are grouped into worker classes, see \ref
+//! udipe_worker_class_config_t. Within each class, one worker thread is spawned
+//! per selected CPU core, as configured by \ref udipe_worker_config_t, and
+//! pinned to this core. Each worker thread then allocates its \ref worker_t,
+//! which includes its \ref command_queue_t and \ref buffer_allocator_t, in
+//! locked memory that is local to its NUMA node.
+//!
+//! Connection commands are spread across the workers of the requested class by
+//! worker_pool_select(). All other commands are processed by the worker that
+//! owns the target connection, see \ref udipe_connection_t::worker.
+
+#include <udipe/buffer.h>
+#include <udipe/context.h>
+#include <udipe/duration.h>
+#include <udipe/nodiscard.h>
+#include <udipe/pointer.h>
+#include <udipe/worker.h>
+
+#include "worker.h"
+
+#include <hwloc.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <threads.h>
+
+
+// Forward declaration to break header dependency cycles
+typedef struct worker_pool_s worker_pool_t;
+
+/// Worker thread from a \ref worker_pool_t
+///
+typedef struct worker_thread_s {
+    /// Thread handle
+    ///
+    thrd_t thread;
+
+    /// CPUs that this thread is pinned to
+    ///
+    /// These all belong to the same CPU core.
+    hwloc_cpuset_t cpuset;
+
+    /// Outermost CPU cache of this thread's CPU core
+    ///
+    /// Worker threads of the same class whose CPU cores share this cache may
+    /// steal commands from each other, see worker_pool_cache_siblings(). This
+    /// is `NULL` if hwloc does not know about CPU caches.
+    hwloc_obj_t cache;
+
+    /// Worker state
+    ///
+    /// This is allocated by the worker thread on startup and liberated by the
+    /// worker thread before it exits. It is `NULL` while the worker thread is
+    /// starting up, and worker_pool_initialize() does not return before it is
+    /// set.
+    worker_t* worker;
+
+    /// Index of this thread within \ref worker_pool_t::threads
+    ///
+    size_t index;
+
+    /// Index of the class of this thread within \ref worker_pool_t::classes
+    ///
+    size_t worker_class;
+
+    /// Pool that this thread belongs to
+    ///
+    worker_pool_t* pool;
+} worker_thread_t;
+
+/// Class of worker threads from a \ref worker_pool_t
+///
+/// This is the internal counterpart of \ref udipe_worker_class_config_t.
+typedef struct worker_class_s {
+    /// Buffering configuration that worker threads apply on startup
+    ///
+    udipe_buffer_configurator_t buffer_configurator;
+
+    /// I/O backend that worker threads use
+    ///
+    /// This is never \ref UDIPE_IO_DEFAULT, which is resolved into an actual
+    /// backend by worker_pool_initialize(). Individual workers may still fall
+    /// back to \ref UDIPE_IO_EPOLL if their preferred backend is unavailable,
+    /// see \ref worker_t::io_backend.
+    udipe_io_backend_t io_backend;
+
+    /// Maximal idle spinning time of worker threads
+    ///
+    /// This is \ref udipe_worker_config_t::idle_spin, or 0 if idle worker
+    /// threads should block right away.
+    udipe_duration_ns_t idle_spin;
+
+    /// Index of the first worker thread of this class within \ref
+    /// worker_pool_t::threads
+    ///
+    /// The worker threads of a class are stored contiguously.
+    size_t first_thread;
+
+    /// Number of worker threads within this class
+    ///
+    /// This is at least 1.
+    size_t num_workers;
+
+    /// Round-robin counter used by worker_pool_select()
+    ///
+    atomic_size_t next_worker;
+} worker_class_t;
+
+/// Worker thread pool
+///
+/// This struct holds the worker threads of a \ref udipe_context_t. Unlike most
+/// other structs from `libudipe`, it must be initialized in place with
+/// worker_pool_initialize() because it contains synchronization primitives.
+struct worker_pool_s {
+    /// udipe context that this pool belongs to
+    ///
+    udipe_context_t* context;
+
+    /// Worker classes
+    ///
+    /// This array has `num_classes` entries, the first of which is the default
+    /// worker class 0.
+    worker_class_t* classes;
+
+    /// Number of worker classes
+    ///
+    /// This is at least 1 and at most \ref UDIPE_MAX_WORKER_CLASSES.
+    size_t num_classes;
+
+    /// Worker threads of all classes
+    ///
+    /// This array has `num_workers` entries.
+    worker_thread_t* threads;
+
+    /// Total number of worker threads
+    ///
+    /// This is at least `num_classes`.
+    size_t num_workers;
+
+    /// Mutex that protects `num_ready`
+    ///
+    mtx_t startup_mutex;
+
+    /// Condition variable that is signaled as worker threads become ready
+    ///
+    cnd_t startup_condition;
+
+    /// Number of worker threads that have published their \ref
+    /// worker_thread_t::worker
+    ///
+    size_t num_ready;
+
+    /// Condition variable that is signaled as worker threads exit worker_run()
+    ///
+    /// Worker threads wait for all of their siblings to exit worker_run()
+    /// before they liberate their \ref worker_t, since siblings may otherwise
+    /// still try to steal commands from it. This is also protected by
+    /// `startup_mutex`.
+    cnd_t shutdown_condition;
+
+    /// Number of worker threads that have exited worker_run()
+    ///
+    size_t num_stopped;
+};
+
+/// Spawn the worker threads of a udipe context
+///
+/// This function returns once all worker threads are ready to accept commands.
+/// Configuration errors are handled by exiting the program, like other
+/// udipe_initialize() errors.
+///
+/// This function must be called within a logging scope.
+///
+/// \param pool must point to uninitialized storage for a worker pool, which
+///             must not move until worker_pool_finalize() is called.
+/// \param context must be the udipe context that this pool belongs to. Its
+///                hwloc topology and logger must already be set up.
+/// \param config is the configuration that was passed to udipe_initialize(),
+///               whose `buffer`, `workers` and `worker_classes` configure the
+///               worker classes.
+UDIPE_NON_NULL_ARGS
+void worker_pool_initialize(worker_pool_t* pool,
+                            udipe_context_t* context,
+                            const udipe_config_t* config);
+
+/// Select the worker that should own a new connection
+///
+/// Connections are assigned to the worker of their class that has the fewest
+/// queued commands, and spread across workers in a round-robin fashion when
+/// several workers are equally loaded.
+///
+/// This function may be called by any thread, within a logging scope.
+///
+/// \param pool must be a worker pool that was set up with
+///             worker_pool_initialize() and hasn't been destroyed with
+///             worker_pool_finalize() yet.
+/// \param worker_class is the requested \ref
+///                     udipe_connect_options_t::worker_class. If it does not
+///                     designate a worker class of `pool`, a worker from
+///                     class 0 is selected, and this worker will then reject
+///                     the udipe_connect() command.
+///
+/// \returns the worker that should process the udipe_connect() command.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+worker_t* worker_pool_select(worker_pool_t* pool, size_t worker_class);
+
+/// Find the worker that comes a certain number of positions after another
+/// within its worker class
+///
+/// This is used to spread the shards of a sharded connection across workers in
+/// a round-robin fashion, see \ref udipe_connect_options_t::num_shards.
+///
+/// This function may be called by any thread, within a logging scope.
+///
+/// \param pool must be a worker pool that was set up with
+///             worker_pool_initialize() and hasn't been destroyed with
+///             worker_pool_finalize() yet.
+/// \param worker must be a worker from `pool`.
+/// \param offset is the number of positions to move forward by, wrapping
+///               around at the end of the worker class of `worker`.
+///
+/// \returns the worker at position `offset` after `worker` within its class.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+worker_t* worker_pool_neighbor(worker_pool_t* pool,
+                               worker_t* worker,
+                               size_t offset);
+
+/// Find the workers that a worker may steal commands from
+///
+/// These are the other workers of the same class, whose CPU cores share the
+/// outermost CPU cache of this worker's CPU core. See \ref
+/// udipe_connect_options_t::enable_send_stealing.
+///
+/// This function must be called by a worker thread, within a logging scope.
+///
+/// \param pool must be a worker pool that was set up with
+///             worker_pool_initialize() and hasn't been destroyed with
+///             worker_pool_finalize() yet.
+/// \param worker must be a worker from `pool`.
+/// \param siblings is an array of `max_siblings` entries that will be filled
+///                 with sibling workers.
+/// \param max_siblings is the capacity of `siblings`. Extra siblings are
+///                     ignored.
+/// \param num_siblings will be set to the number of entries of `siblings`
+///                     that were filled.
+///
+/// \returns `false` if some worker threads are still starting up, in which
+///          case the query should be retried later.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+bool worker_pool_cache_siblings(worker_pool_t* pool,
+                                worker_t* worker,
+                                worker_t* siblings[],
+                                size_t max_siblings,
+                                size_t* num_siblings);
+
+/// Query the CPUs that a worker's thread is pinned to
+///
+/// This function may be called by any thread, within a logging scope.
+///
+/// \param pool must be a worker pool that was set up with
+///             worker_pool_initialize() and hasn't been destroyed with
+///             worker_pool_finalize() yet.
+/// \param worker must be a worker from `pool`.
+///
+/// \returns the cpuset of the thread of `worker`, which remains valid until
+///          worker_pool_finalize() is called.
+UDIPE_NODISCARD
+UDIPE_NON_NULL_ARGS
+UDIPE_NON_NULL_RESULT
+hwloc_const_cpuset_t worker_pool_cpuset(worker_pool_t* pool,
+                                        worker_t* worker);
+
+/// Stop and join all worker threads
+///
+/// All commands must have completed before this function is called.
+///
+/// This function must be called within a logging scope.
+///
+/// \param pool must be a worker pool that was set up with
+///             worker_pool_initialize() and hasn't been destroyed with
+///             worker_pool_finalize() yet. It cannot be used after calling
+///             this function.
+UDIPE_NON_NULL_ARGS
+void worker_pool_finalize(worker_pool_t* pool);